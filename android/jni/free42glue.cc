@@ -424,6 +424,21 @@ bool shell_write_saved_state(const void *buf, int4 bufsize) {
     return ret;
 }
 
+void *shell_map_saved_state(int4 offset, int4 nbytes) {
+    Tracer T("shell_map_saved_state");
+    // Not supported; the core will read the data instead
+    return NULL;
+}
+
+void shell_unmap_saved_state(void *addr, int4 nbytes) {
+    Tracer T("shell_unmap_saved_state");
+}
+
+int4 shell_saved_state_position() {
+    Tracer T("shell_saved_state_position");
+    return 0;
+}
+
 unsigned int shell_get_mem() {
     Tracer T("shell_get_mem");
     JNIEnv *env = getJniEnv();
@@ -0,0 +1,698 @@
+/*****************************************************************************
+ * Free42 -- an HP-42S calculator simulator
+ * Copyright (C) 2004-2016  Thomas Okken
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see http://www.gnu.org/licenses/.
+ *****************************************************************************/
+
+/* Benchmark runner for the Free42 core. Like the cli shell, this has no user
+ * interface; it runs a fixed set of programs and core operations, starting
+ * from Memory Clear, and writes the timings to standard output in JSON.
+ * The programs are built in memory, and the state is saved to and loaded
+ * from memory, so no files are involved. See bench/README for usage.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "shell.h"
+#include "core_main.h"
+#include "core_globals.h"
+#include "core_helpers.h"
+#include "core_variables.h"
+
+
+#define MAX_RUNS 100
+
+typedef struct {
+    const char *name;
+    int size;
+    int4 ops;
+    void (*setup)(int size);
+    void (*run)(int size);
+} bench_spec;
+
+
+/* Private globals */
+
+static int runs = 5;
+static const char *only = NULL;
+static int max_size = 300;
+static bool first_result = true;
+
+static unsigned char *prgm_text = NULL;
+static int4 prgm_size = 0;
+static int4 prgm_capacity = 0;
+
+static char *state_buf = NULL;
+static int4 state_size = 0;
+static int4 state_capacity = 0;
+static int4 state_pos = 0;
+static bool state_open = false;
+
+static uint4 data_seed;
+static vartype *matrix_a = NULL;
+static vartype *matrix_b = NULL;
+
+static phloat *format_data = NULL;
+static int4 format_count = 1000;
+
+static bool timeout3_pending = false;
+
+
+/* Private functions */
+
+static void usage();
+static double now();
+static void run_bench(const bench_spec *spec);
+static void op(int cmd);
+static void op_num(int cmd, int4 num);
+static void op_str(int cmd, const char *name);
+static void op_number(const char *text);
+static void end_program();
+static void build_programs();
+static void run_program(const char *name);
+static double next_random();
+static vartype *random_matrix(int4 rows, int4 columns);
+static void set_stack(vartype *y, vartype *x);
+static void loop_run(int size);
+static void solve_run(int size);
+static void integ_run(int size);
+static void sigma_run(int size);
+static void matrix_setup(int size);
+static void mul_run(int size);
+static void div_run(int size);
+static void invrt_run(int size);
+static void format_setup(int size);
+static void format_run(int size);
+static void state_setup(int size);
+static void save_run(int size);
+static void load_run(int size);
+static bool write_header();
+static bool read_header(int4 *version);
+
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-runs") == 0)
+            runs = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-only") == 0)
+            only = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-maxsize") == 0)
+            max_size = atoi(argv[++i]);
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (runs < 1 || runs > MAX_RUNS || max_size < 1) {
+        usage();
+        return 1;
+    }
+
+    core_init(0, 0);
+    build_programs();
+
+    static const int sizes[] = { 10, 30, 100, 300 };
+    static const bench_spec fixed[] = {
+        { "rcl_sto_isg_loop", 0, 99900, NULL, loop_run },
+        { "solve",            0, 100,   NULL, solve_run },
+        { "integ",            0, 10,    NULL, integ_run },
+        { "sigma_add",        0, 10000, NULL, sigma_run },
+        { "phloat2string",    0, 0,     format_setup, format_run }
+    };
+
+    printf("{\n");
+    printf("  \"version\": \"%s\",\n", VERSION);
+#ifdef BCD_MATH
+    printf("  \"math\": \"decimal\",\n");
+#else
+    printf("  \"math\": \"binary\",\n");
+#endif
+    printf("  \"runs\": %d,\n", runs);
+    printf("  \"unit\": \"us\",\n");
+    printf("  \"results\": [");
+
+    for (int i = 0; i < (int) (sizeof(fixed) / sizeof(bench_spec)); i++) {
+        bench_spec spec = fixed[i];
+        if (spec.run == format_run)
+            spec.ops = format_count * 4;
+        run_bench(&spec);
+    }
+    for (int i = 0; i < (int) (sizeof(sizes) / sizeof(int)); i++) {
+        int n = sizes[i];
+        if (n > max_size)
+            break;
+        bench_spec mul = { "matrix_mul", n, 1, matrix_setup, mul_run };
+        bench_spec div = { "matrix_div", n, 1, matrix_setup, div_run };
+        bench_spec inv = { "matrix_invrt", n, 1, matrix_setup, invrt_run };
+        run_bench(&mul);
+        run_bench(&div);
+        run_bench(&inv);
+    }
+    bench_spec save = { "state_save", max_size, 1, state_setup, save_run };
+    bench_spec load = { "state_load", max_size, 1, state_setup, load_run };
+    run_bench(&save);
+    run_bench(&load);
+
+    printf("\n  ]\n}\n");
+
+    free_vartype(matrix_a);
+    free_vartype(matrix_b);
+    state_open = false;
+    core_quit();
+    free(prgm_text);
+    free(state_buf);
+    free(format_data);
+    return 0;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: free42bench [options]\n"
+        "  -runs <n>        time each benchmark n times (default 5, max %d)\n"
+        "  -only <name>     only run the benchmarks whose names start with\n"
+        "                   <name>\n"
+        "  -maxsize <n>     largest matrix size to use (default 300)\n",
+        MAX_RUNS);
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void run_bench(const bench_spec *spec) {
+    /* The setup is not timed; it is repeated before every run, with the
+     * same random data, so every run does exactly the same work.
+     */
+    if (only != NULL && strncmp(spec->name, only, strlen(only)) != 0)
+        return;
+    double times[MAX_RUNS];
+    for (int r = 0; r < runs; r++) {
+        data_seed = 12345;
+        if (spec->setup != NULL)
+            spec->setup(spec->size);
+        double start = now();
+        spec->run(spec->size);
+        times[r] = now() - start;
+    }
+    qsort(times, runs, sizeof(double), compare_doubles);
+    printf(first_result ? "\n" : ",\n");
+    first_result = false;
+    printf("    { \"name\": \"%s\", ", spec->name);
+    if (spec->size != 0)
+        printf("\"size\": %d, ", spec->size);
+    printf("\"ops\": %d, \"min\": %.0f, \"median\": %.0f, \"max\": %.0f }",
+           spec->ops, times[0], times[runs / 2], times[runs - 1]);
+    fflush(stdout);
+}
+
+
+/* The benchmark programs. They are encoded the same way imported programs
+ * are, and appended to program memory one at a time.
+ */
+
+static void op_arg(int cmd, arg_struct *arg) {
+    if (prgm_size + MAX_COMMAND_LENGTH > prgm_capacity) {
+        prgm_capacity = prgm_capacity == 0 ? 1024 : prgm_capacity * 2;
+        prgm_text = (unsigned char *) realloc(prgm_text, prgm_capacity);
+        if (prgm_text == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    prgm_size += encode_command(cmd, arg, prgm_text + prgm_size);
+}
+
+static void op(int cmd) {
+    arg_struct arg;
+    arg.type = ARGTYPE_NONE;
+    op_arg(cmd, &arg);
+}
+
+static void op_num(int cmd, int4 num) {
+    arg_struct arg;
+    arg.type = ARGTYPE_NUM;
+    arg.val.num = num;
+    op_arg(cmd, &arg);
+}
+
+static void op_str(int cmd, const char *name) {
+    arg_struct arg;
+    arg.type = ARGTYPE_STR;
+    arg.length = strlen(name);
+    memcpy(arg.val.text, name, arg.length);
+    op_arg(cmd, &arg);
+}
+
+static void op_number(const char *text) {
+    /* Numbers are parsed rather than converted from double, so that the
+     * binary and decimal versions run exactly the same programs. The text
+     * is in HP-42S format, with char(24) for the exponent.
+     */
+    arg_struct arg;
+    arg.type = ARGTYPE_DOUBLE;
+    string2phloat(text, strlen(text), &arg.val_d);
+    op_arg(CMD_NUMBER, &arg);
+}
+
+static void end_program() {
+    if (!append_program(prgm_text, prgm_size)) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    prgm_size = 0;
+}
+
+static void build_programs() {
+    /* 100 x 999 passes through an RCL/+/STO/ISG loop */
+    op_str(CMD_LBL, "LOOP");
+    op_number("100");
+    op_num(CMD_STO, 2);
+    op_number("0");
+    op_num(CMD_STO, 1);
+    op_num(CMD_LBL, 1);
+    op_number("1.999");
+    op_num(CMD_STO, 0);
+    op_num(CMD_LBL, 2);
+    op_num(CMD_RCL, 1);
+    op_number("1");
+    op(CMD_ADD);
+    op_num(CMD_STO, 1);
+    op_num(CMD_ISG, 0);
+    op_num(CMD_GTO, 2);
+    op_num(CMD_DSE, 2);
+    op_num(CMD_GTO, 1);
+    end_program();
+
+    /* x^3 - 2x - 5 = 0, solved 100 times */
+    op_str(CMD_LBL, "FS");
+    op_str(CMD_MVAR, "X");
+    op_str(CMD_RCL, "X");
+    op_number("3");
+    op(CMD_Y_POW_X);
+    op_str(CMD_RCL, "X");
+    op_number("2");
+    op(CMD_MUL);
+    op(CMD_SUB);
+    op_number("5");
+    op(CMD_SUB);
+    end_program();
+    op_str(CMD_LBL, "SOLV");
+    op_number("100");
+    op_num(CMD_STO, 0);
+    op_num(CMD_LBL, 1);
+    op_str(CMD_PGMSLV, "FS");
+    op_number("2");
+    op_str(CMD_STO, "X");
+    op_number("3");
+    op_str(CMD_SOLVE, "X");
+    op_num(CMD_DSE, 0);
+    op_num(CMD_GTO, 1);
+    end_program();
+
+    /* Integral of sin(x) from 0 to 3, in radians, 10 times */
+    op_str(CMD_LBL, "FI");
+    op_str(CMD_MVAR, "X");
+    op_str(CMD_RCL, "X");
+    op(CMD_SIN);
+    end_program();
+    op_str(CMD_LBL, "INTG");
+    op(CMD_RAD);
+    op_number("10");
+    op_num(CMD_STO, 0);
+    op_num(CMD_LBL, 1);
+    op_str(CMD_PGMINT, "FI");
+    op_number("0");
+    op_str(CMD_STO, "LLIM");
+    op_number("3");
+    op_str(CMD_STO, "ULIM");
+    op_number("1\030-8");
+    op_str(CMD_STO, "ACC");
+    op_str(CMD_INTEG, "X");
+    op_num(CMD_DSE, 0);
+    op_num(CMD_GTO, 1);
+    end_program();
+
+    /* 10000 x Sigma+ */
+    op_str(CMD_LBL, "SIGM");
+    op(CMD_CLSIGMA);
+    op_number("10000");
+    op_num(CMD_STO, 0);
+    op_num(CMD_LBL, 1);
+    op_num(CMD_RCL, 0);
+    op(CMD_SQRT);
+    op_num(CMD_RCL, 0);
+    op(CMD_SIGMAADD);
+    op_num(CMD_DSE, 0);
+    op_num(CMD_GTO, 1);
+    end_program();
+
+    /* Matrix operations on X and Y, as set up by matrix_setup() */
+    op_str(CMD_LBL, "MMUL");
+    op(CMD_MUL);
+    end_program();
+    op_str(CMD_LBL, "MDIV");
+    op(CMD_DIV);
+    end_program();
+    op_str(CMD_LBL, "MINV");
+    op(CMD_INVRT);
+    end_program();
+
+    rebuild_label_table();
+}
+
+static void run_program(const char *name) {
+    int keep_running = core_xeq(name, strlen(name));
+    while (true) {
+        int enqueued, repeat;
+        if (!keep_running) {
+            if (!timeout3_pending)
+                break;
+            timeout3_pending = false;
+            if (!core_timeout3(1))
+                break;
+        }
+        keep_running = core_keydown(0, &enqueued, &repeat);
+    }
+}
+
+static void loop_run(int size) {
+    run_program("LOOP");
+}
+
+static void solve_run(int size) {
+    run_program("SOLV");
+}
+
+static void integ_run(int size) {
+    run_program("INTG");
+}
+
+static void sigma_run(int size) {
+    run_program("SIGM");
+}
+
+
+/* Matrix benchmarks. The matrices are random, with a dominant diagonal, so
+ * that they are well-conditioned; the random numbers come from a simple LCG,
+ * so that every build and every platform uses the same data.
+ */
+
+static double next_random() {
+    data_seed = data_seed * 1103515245 + 12345;
+    return (data_seed >> 8) / 16777216.0 - 0.5;
+}
+
+static vartype *random_matrix(int4 rows, int4 columns) {
+    vartype *v = new_realmatrix(rows, columns);
+    if (v == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    phloat *data = ((vartype_realmatrix *) v)->array->data;
+    for (int4 r = 0; r < rows; r++)
+        for (int4 c = 0; c < columns; c++)
+            data[r * columns + c] = next_random() + (r == c ? rows : 0);
+    return v;
+}
+
+static void set_stack(vartype *y, vartype *x) {
+    free_vartype(reg_x);
+    free_vartype(reg_y);
+    reg_x = dup_vartype(x);
+    reg_y = dup_vartype(y);
+}
+
+static void matrix_setup(int size) {
+    free_vartype(matrix_a);
+    free_vartype(matrix_b);
+    matrix_a = random_matrix(size, size);
+    matrix_b = random_matrix(size, size);
+}
+
+static void mul_run(int size) {
+    set_stack(matrix_b, matrix_a);
+    run_program("MMUL");
+}
+
+static void div_run(int size) {
+    /* This is what SIMQ does, with B in Y and A in X */
+    set_stack(matrix_b, matrix_a);
+    run_program("MDIV");
+}
+
+static void invrt_run(int size) {
+    set_stack(matrix_b, matrix_a);
+    run_program("MINV");
+}
+
+
+/* phloat2string() in FIX 4, SCI 4, ENG 4, and ALL mode, with numbers
+ * ranging from 1e-30 to 1e30 in magnitude.
+ */
+
+static void format_setup(int size) {
+    if (format_data != NULL)
+        return;
+    format_data = (phloat *) malloc(format_count * sizeof(phloat));
+    if (format_data == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for (int4 i = 0; i < format_count; i++) {
+        char buf[50];
+        snprintf(buf, 50, "%.11f\030%d", next_random() * 2,
+                 (int) (i % 61) - 30);
+        string2phloat(buf, strlen(buf), format_data + i);
+    }
+}
+
+static void format_run(int size) {
+    char buf[50];
+    for (int4 i = 0; i < format_count; i++)
+        for (int mode = 0; mode < 4; mode++)
+            phloat2string(format_data[i], buf, 50, 0, 4, mode, 1);
+}
+
+
+/* State save and load. The state consists of everything the other
+ * benchmarks left behind, plus a size x size matrix and 1000 real variables.
+ */
+
+static void state_setup(int size) {
+    if (recall_var("BIG", 3) == NULL) {
+        store_var("BIG", 3, random_matrix(size, size));
+        for (int i = 0; i < 1000; i++) {
+            char name[8];
+            snprintf(name, 8, "V%d", i);
+            store_var(name, strlen(name), new_real(next_random()));
+        }
+    }
+    state_size = 0;
+    state_pos = 0;
+    state_open = true;
+    if (!write_header() || !core_save_state()) {
+        fprintf(stderr, "Could not save state.\n");
+        exit(1);
+    }
+    state_open = false;
+}
+
+static void save_run(int size) {
+    state_size = 0;
+    state_open = true;
+    if (!write_header() || !core_save_state()) {
+        fprintf(stderr, "Could not save state.\n");
+        exit(1);
+    }
+    state_open = false;
+}
+
+static void load_run(int size) {
+    /* core_quit() tries to save the state, but with the state closed,
+     * that fails right away.
+     */
+    int4 version;
+    int count = vars_count;
+    core_quit();
+    state_pos = 0;
+    state_open = true;
+    if (!read_header(&version)) {
+        fprintf(stderr, "Could not load state.\n");
+        exit(1);
+    }
+    core_init(1, version);
+    state_open = false;
+    if (vars_count != count) {
+        fprintf(stderr, "Could not load state.\n");
+        exit(1);
+    }
+}
+
+static bool write_header() {
+    /* The same header the cli and GTK shells write, with an empty shell
+     * state, so the saved state is a valid state file.
+     */
+    int4 header[4];
+    header[0] = FREE42_MAGIC;
+    header[1] = FREE42_VERSION;
+    header[2] = 0;
+    header[3] = 0;
+    return shell_write_saved_state(header, sizeof(header));
+}
+
+static bool read_header(int4 *version) {
+    int4 header[4];
+    if (shell_read_saved_state(header, sizeof(header)) != sizeof(header))
+        return false;
+    if (header[0] != FREE42_MAGIC || header[1] != FREE42_VERSION
+            || header[2] != 0)
+        return false;
+    *version = header[1];
+    return true;
+}
+
+
+/* Callbacks */
+
+void shell_blitter(const char *bits, int bytesperline, int x, int y,
+                                     int width, int height) {
+    // Nothing to do
+}
+
+void shell_beeper(int frequency, int duration) {
+    // Nothing to do
+}
+
+void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
+    // Nothing to do
+}
+
+int shell_wants_cpu() {
+    return 0;
+}
+
+void shell_delay(int duration) {
+    // Not timing the delays
+}
+
+void shell_request_timeout3(int delay) {
+    timeout3_pending = true;
+}
+
+int4 shell_read_saved_state(void *buf, int4 bufsize) {
+    if (!state_open)
+        return -1;
+    int4 n = state_size - state_pos;
+    if (n > bufsize)
+        n = bufsize;
+    memcpy(buf, state_buf + state_pos, n);
+    state_pos += n;
+    return n;
+}
+
+bool shell_write_saved_state(const void *buf, int4 nbytes) {
+    if (!state_open)
+        return false;
+    if (state_size + nbytes > state_capacity) {
+        int4 newcapacity = state_capacity == 0 ? 65536 : state_capacity;
+        while (newcapacity < state_size + nbytes)
+            newcapacity *= 2;
+        char *newbuf = (char *) realloc(state_buf, newcapacity);
+        if (newbuf == NULL)
+            return false;
+        state_buf = newbuf;
+        state_capacity = newcapacity;
+    }
+    memcpy(state_buf + state_size, buf, nbytes);
+    state_size += nbytes;
+    return true;
+}
+
+void *shell_map_saved_state(int4 offset, int4 nbytes) {
+    return NULL;
+}
+
+void shell_unmap_saved_state(void *addr, int4 nbytes) {
+    // Nothing to do
+}
+
+int4 shell_saved_state_position() {
+    return 0;
+}
+
+uint4 shell_get_mem() {
+    return 0;
+}
+
+int shell_low_battery() {
+    return 0;
+}
+
+void shell_powerdown() {
+    // Nothing to do
+}
+
+double shell_random_seed() {
+    /* Fixed, so that runs are reproducible */
+    return 0.5;
+}
+
+uint4 shell_milliseconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint4) (tv.tv_sec * 1000L + tv.tv_usec / 1000);
+}
+
+int shell_decimal_point() {
+    return 1;
+}
+
+void shell_print(const char *text, int length,
+                 const char *bits, int bytesperline,
+                 int x, int y, int width, int height) {
+    // Nothing to do
+}
+
+void shell_log(const char *message) {
+    fprintf(stderr, "%s\n", message);
+}
+
+int shell_write(const char *buf, int4 buflen) {
+    return 0;
+}
+
+int4 shell_read(char *buf, int4 buflen) {
+    return -1;
+}
+
+void shell_get_time_date(uint4 *time, uint4 *date, int *weekday) {
+    if (time != NULL)
+        *time = 12000000;
+    if (date != NULL)
+        *date = 20160101;
+    if (weekday != NULL)
+        *weekday = 5;
+}
@@ -0,0 +1,779 @@
+/*****************************************************************************
+ * Free42 -- an HP-42S calculator simulator
+ * Copyright (C) 2004-2016  Thomas Okken
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see http://www.gnu.org/licenses/.
+ *****************************************************************************/
+
+/* Headless Free42 shell, for running programs unattended in batch jobs.
+ * There is no event loop, no skin, and no X server; the shell_*() callbacks
+ * are stubs, except for the ones that deal with the state file, importing
+ * programs, and printing. See cli/README for usage.
+ */
+
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shell.h"
+#include "shell_spool.h"
+#include "core_main.h"
+#include "core_display.h"
+#include "core_globals.h"
+#include "core_helpers.h"
+#include "core_variables.h"
+
+
+#define ACTION_IMPORT 0
+#define ACTION_PUSH 1
+#define ACTION_XEQ 2
+#define ACTION_EXPORT 3
+
+typedef struct {
+    int type;
+    const char *arg;
+} action_spec;
+
+
+/* Private globals */
+
+static FILE *statefile = NULL;
+static FILE *import_file = NULL;
+static FILE *print_file = NULL;
+static print_sink *printer = NULL;
+static bool print_flush_pending = false;
+static FILE *profile_file = NULL;
+
+static char *shell_state = NULL;
+static int4 shell_state_size = 0;
+static int4 shell_state_version = 0;
+
+static const char *display_bits = NULL;
+static int display_bpl = 0;
+
+static bool quit_flag = false;
+static bool timeout3_pending = false;
+static uint4 time_limit = 0;
+static uint4 deadline;
+static bool deadline_passed;
+
+
+/* Private functions */
+
+static void usage();
+static int read_shell_state(int4 *version);
+static int write_shell_state();
+static bool import_programs(const char *filename);
+static bool export_programs(const char *filename);
+static bool run_program(const char *name);
+static void dump_display();
+static void dump_vartype(const char *name, int namelen, const vartype *v);
+static int real2buf(phloat x, char *buf, int buflen);
+static uint4 profile_clock();
+static void profile_writer(const char *text);
+static int print_format(const char *filename);
+static int print_writer(void *context, const char *buf, int4 length);
+static int print_seeker(void *context, int4 pos);
+static void print_request_flush(void *context);
+
+
+int main(int argc, char *argv[]) {
+    const char *state_in = NULL;
+    const char *state_out = NULL;
+    bool quiet = false;
+    bool show_display = false;
+    bool fast_matrix = false;
+    int repeat = 1;
+    action_spec *actions = (action_spec *) malloc(argc * sizeof(action_spec));
+    int nactions = 0;
+    int ret = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-state") == 0)
+            state_in = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-save") == 0)
+            state_out = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-import") == 0) {
+            actions[nactions].type = ACTION_IMPORT;
+            actions[nactions++].arg = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-export") == 0) {
+            actions[nactions].type = ACTION_EXPORT;
+            actions[nactions++].arg = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-x") == 0) {
+            actions[nactions].type = ACTION_PUSH;
+            actions[nactions++].arg = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-xeq") == 0) {
+            actions[nactions].type = ACTION_XEQ;
+            actions[nactions++].arg = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-repeat") == 0)
+            repeat = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-timeout") == 0)
+            time_limit = (uint4) atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-print") == 0) {
+            i++;
+            int format = print_format(argv[i]);
+            if (printer != NULL) {
+                print_sink_close(printer);
+                if (print_file != stdout)
+                    fclose(print_file);
+                printer = NULL;
+            }
+            if (format == PRINT_SINK_TEXT && strcmp(argv[i], "-") == 0)
+                print_file = stdout;
+            else if ((print_file = fopen(argv[i],
+                        format == PRINT_SINK_TEXT ? "a" : "wb")) == NULL) {
+                fprintf(stderr, "Can't open \"%s\" for output.\n", argv[i]);
+                return 1;
+            }
+            printer = print_sink_open(format, 143, print_writer,
+                                      print_seeker, print_file,
+                                      print_request_flush);
+            if (printer == NULL) {
+                fprintf(stderr, "Insufficient memory.\n");
+                return 1;
+            }
+        } else if (i + 1 < argc && strcmp(argv[i], "-profile") == 0) {
+            i++;
+            if (strcmp(argv[i], "-") == 0)
+                profile_file = stdout;
+            else if ((profile_file = fopen(argv[i], "w")) == NULL) {
+                fprintf(stderr, "Can't open \"%s\" for output.\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-display") == 0)
+            show_display = true;
+        else if (strcmp(argv[i], "-quiet") == 0)
+            quiet = true;
+        else if (strcmp(argv[i], "-fastmatrix") == 0)
+            fast_matrix = true;
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    setlocale(LC_ALL, "");
+
+    int4 version = 0;
+    int init_mode = 0;
+    if (state_in != NULL) {
+        statefile = fopen(state_in, "r");
+        if (statefile == NULL) {
+            fprintf(stderr, "Can't open \"%s\" for input.\n", state_in);
+            return 1;
+        }
+        init_mode = read_shell_state(&version) ? 1 : 2;
+    }
+    core_init(init_mode, version);
+    if (statefile != NULL) {
+        fclose(statefile);
+        statefile = NULL;
+    }
+    if (init_mode == 2) {
+        fprintf(stderr, "State file \"%s\" is corrupt.\n", state_in);
+        ret = 1;
+    }
+    if (fast_matrix)
+        core_settings.matrix_fastbinary = true;
+    if (profile_file != NULL && !core_profile_start(profile_clock)) {
+        fprintf(stderr, "Not enough memory for profiling.\n");
+        ret = 1;
+    }
+
+    for (int r = 0; r < repeat && !quit_flag; r++) {
+        for (int i = 0; i < nactions && !quit_flag; i++) {
+            const char *arg = actions[i].arg;
+            switch (actions[i].type) {
+                case ACTION_IMPORT:
+                    if (!import_programs(arg))
+                        ret = 1;
+                    break;
+                case ACTION_EXPORT:
+                    if (!export_programs(arg))
+                        ret = 1;
+                    break;
+                case ACTION_PUSH:
+                    core_paste(arg);
+                    break;
+                case ACTION_XEQ:
+                    if (!run_program(arg))
+                        ret = 1;
+                    break;
+            }
+        }
+    }
+
+    if (profile_file != NULL) {
+        core_profile_stop();
+        core_profile_report(profile_writer, 50);
+        if (profile_file != stdout)
+            fclose(profile_file);
+    }
+
+    if (show_display)
+        dump_display();
+
+    if (!quiet) {
+        char buf[50];
+        int len;
+        dump_vartype("X", 1, reg_x);
+        dump_vartype("Y", 1, reg_y);
+        dump_vartype("Z", 1, reg_z);
+        dump_vartype("T", 1, reg_t);
+        dump_vartype("LASTX", 5, reg_lastx);
+        len = hp2ascii(buf, reg_alpha, reg_alpha_length);
+        printf("ALPHA=\"%.*s\"\n", len, buf);
+        for (int i = 0; i < vars_count; i++)
+            dump_vartype(vars[i].name, vars[i].length, vars[i].value);
+    }
+
+    // The state is written to a new file, which then replaces the old one,
+    // since the core may still have parts of the old one mapped into memory.
+    char *state_temp = NULL;
+    if (state_out != NULL) {
+        state_temp = (char *) malloc(strlen(state_out) + 5);
+        if (state_temp != NULL) {
+            strcpy(state_temp, state_out);
+            strcat(state_temp, ".new");
+            statefile = fopen(state_temp, "w");
+        }
+        if (statefile == NULL) {
+            fprintf(stderr, "Can't open \"%s\" for output.\n", state_out);
+            ret = 1;
+        } else
+            write_shell_state();
+    }
+    core_quit();
+    if (statefile != NULL) {
+        bool ok = fflush(statefile) == 0 && fsync(fileno(statefile)) == 0;
+        if (fclose(statefile) != 0 || !ok
+                || rename(state_temp, state_out) != 0) {
+            fprintf(stderr, "Error while writing the state file.\n");
+            remove(state_temp);
+            ret = 1;
+        }
+    } else if (state_temp != NULL) {
+        remove(state_temp);
+        ret = 1;
+    }
+    free(state_temp);
+
+    if (printer != NULL) {
+        bool ok = print_sink_close(printer) != 0;
+        if (print_file != stdout && fclose(print_file) != 0)
+            ok = false;
+        if (!ok) {
+            fprintf(stderr, "Error while writing the printer output.\n");
+            ret = 1;
+        }
+    }
+    free(shell_state);
+    free(actions);
+    return ret;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: free42cli [options]\n"
+        "  -state <file>    load calculator state from <file>\n"
+        "  -save <file>     write calculator state to <file> when done\n"
+        "  -import <file>   import programs from HP-42S raw file <file>\n"
+        "  -export <file>   export all programs to HP-42S raw file <file>\n"
+        "  -x <value>       put <value> on the stack, like Paste\n"
+        "  -xeq <label>     run the program at global label <label>\n"
+        "  -repeat <n>      perform the -import, -export, -x, and -xeq actions\n"
+        "                   n times\n"
+        "  -timeout <ms>    stop programs that run longer than <ms>\n"
+        "  -print <file>    append printer output to <file> ('-' = stdout);\n"
+        "                   write an image if it ends in .gif, .png, or .raw\n"
+        "  -profile <file>  write an execution profile of the programs run to\n"
+        "                   <file> ('-' = stdout)\n"
+        "  -display         show the display contents when done\n"
+        "  -quiet           don't show the stack and variables when done\n"
+        "  -fastmatrix      use binary arithmetic for real matrix operations\n"
+        "                   (decimal version only)\n");
+}
+
+/* The shell state is stored in the state file by the GTK shell, between the
+ * version number and the core state. We don't use it here, but we keep a
+ * copy, so that state files we write can still be used with the GTK version.
+ */
+static int read_shell_state(int4 *ver) {
+    int4 magic;
+    int4 version;
+
+    if (shell_read_saved_state(&magic, sizeof(int4)) != sizeof(int4))
+        return 0;
+    if (magic != FREE42_MAGIC)
+        return 0;
+    if (shell_read_saved_state(&version, sizeof(int4)) != sizeof(int4))
+        return 0;
+    if (version == 0) {
+        *ver = version;
+        return 1;
+    } else if (version > FREE42_VERSION)
+        return 0;
+
+    if (shell_read_saved_state(&shell_state_size, sizeof(int4))
+            != sizeof(int4))
+        return 0;
+    if (shell_read_saved_state(&shell_state_version, sizeof(int4))
+            != sizeof(int4))
+        return 0;
+    if (shell_state_size < 0)
+        return 0;
+    shell_state = (char *) malloc(shell_state_size);
+    if (shell_state == NULL && shell_state_size != 0)
+        return 0;
+    if (shell_read_saved_state(shell_state, shell_state_size)
+            != shell_state_size)
+        return 0;
+
+    *ver = version;
+    return 1;
+}
+
+static int write_shell_state() {
+    int4 magic = FREE42_MAGIC;
+    int4 version = FREE42_VERSION;
+
+    if (shell_state == NULL) {
+        /* Shell state version 0 makes the GTK shell use its defaults */
+        shell_state_size = 0;
+        shell_state_version = 0;
+    }
+    if (!shell_write_saved_state(&magic, sizeof(int4)))
+        return 0;
+    if (!shell_write_saved_state(&version, sizeof(int4)))
+        return 0;
+    if (!shell_write_saved_state(&shell_state_size, sizeof(int4)))
+        return 0;
+    if (!shell_write_saved_state(&shell_state_version, sizeof(int4)))
+        return 0;
+    if (!shell_write_saved_state(shell_state, shell_state_size))
+        return 0;
+    return 1;
+}
+
+static bool import_programs(const char *filename) {
+    import_file = fopen(filename, "r");
+    if (import_file == NULL) {
+        fprintf(stderr, "Can't open \"%s\" for input.\n", filename);
+        return false;
+    }
+    core_import_programs(NULL);
+    bool ok = import_file != NULL;
+    if (ok) {
+        fclose(import_file);
+        import_file = NULL;
+    }
+    return ok;
+}
+
+static bool export_programs(const char *filename) {
+    int *indexes = (int *) malloc(prgms_count * sizeof(int));
+    char *buf = NULL;
+    int4 length;
+    if (indexes != NULL) {
+        for (int i = 0; i < prgms_count; i++)
+            indexes[i] = i;
+        buf = core_export_programs_to_memory(prgms_count, indexes, &length);
+        free(indexes);
+    }
+    if (buf == NULL) {
+        fprintf(stderr, "Not enough memory to export programs.\n");
+        return false;
+    }
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Can't open \"%s\" for output.\n", filename);
+        free(buf);
+        return false;
+    }
+    bool ok = fwrite(buf, 1, length, f) == (size_t) length;
+    if (fclose(f) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "Error while writing \"%s\".\n", filename);
+    free(buf);
+    return ok;
+}
+
+static bool run_program(const char *name) {
+    arg_struct arg;
+    int prgm;
+    int4 pc;
+    int len = strlen(name);
+    if (len > 7)
+        len = 7;
+    arg.type = ARGTYPE_STR;
+    arg.length = len;
+    memcpy(arg.val.text, name, len);
+    if (!find_global_label(&arg, &prgm, &pc)) {
+        fprintf(stderr, "Label \"%s\" not found.\n", name);
+        return false;
+    }
+
+    if (time_limit != 0) {
+        deadline = shell_milliseconds() + time_limit;
+        deadline_passed = false;
+    }
+    int keep_running = core_xeq(name, len);
+    while (!quit_flag) {
+        int enqueued, repeat;
+        if (!keep_running) {
+            /* A PSE leaves the program suspended until core_timeout3() is
+             * called; we don't wait for it.
+             */
+            if (!timeout3_pending)
+                break;
+            timeout3_pending = false;
+            if (!core_timeout3(1))
+                break;
+        }
+        if (deadline_passed) {
+            core_keydown(KEY_EXIT, &enqueued, &repeat);
+            core_keyup();
+            fprintf(stderr, "Program \"%s\" timed out.\n", name);
+            return false;
+        }
+        keep_running = core_keydown(0, &enqueued, &repeat);
+        if (print_flush_pending) {
+            print_flush_pending = false;
+            print_sink_flush(printer);
+        }
+    }
+    return true;
+}
+
+static uint4 profile_clock() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint4) (tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+static void profile_writer(const char *text) {
+    fprintf(profile_file, "%s\n", text);
+}
+
+static void dump_display() {
+    if (display_bits == NULL)
+        return;
+    for (int y = 0; y < 16; y++) {
+        char line[132];
+        for (int x = 0; x < 131; x++)
+            line[x] = (display_bits[y * display_bpl + (x >> 3)]
+                            & (1 << (x & 7))) != 0 ? '#' : ' ';
+        int n = 131;
+        while (n > 0 && line[n - 1] == ' ')
+            n--;
+        printf("|%.*s\n", n, line);
+    }
+}
+
+static int real2buf(phloat x, char *buf, int buflen) {
+    /* ALL mode, so we don't lose any digits */
+    return phloat2string(x, buf, buflen, 0, 0, 3, 0);
+}
+
+static void dump_vartype(const char *name, int namelen, const vartype *v) {
+    char n[50], buf[100];
+    int nlen = hp2ascii(n, name, namelen);
+    printf("%.*s=", nlen, n);
+    if (v == NULL) {
+        printf("\n");
+        return;
+    }
+    switch (v->type) {
+        case TYPE_REAL: {
+            int len = real2buf(((vartype_real *) v)->x, buf, 50);
+            printf("%.*s\n", hp2ascii(buf + 50, buf, len), buf + 50);
+            break;
+        }
+        case TYPE_COMPLEX: {
+            vartype_complex *c = (vartype_complex *) v;
+            int len = real2buf(c->re, buf, 25);
+            buf[len++] = ' ';
+            buf[len++] = 'i';
+            len += real2buf(c->im, buf + len, 25);
+            printf("%.*s\n", hp2ascii(buf + 50, buf, len), buf + 50);
+            break;
+        }
+        case TYPE_STRING: {
+            vartype_string *s = (vartype_string *) v;
+            printf("\"%.*s\"\n", hp2ascii(buf, s->text, s->length), buf);
+            break;
+        }
+        case TYPE_REALMATRIX: {
+            vartype_realmatrix *rm = (vartype_realmatrix *) v;
+            printf("[ %dx%d Matrix ]\n", rm->rows, rm->columns);
+            int4 i = 0;
+            for (int4 r = 0; r < rm->rows; r++) {
+                for (int4 c = 0; c < rm->columns; c++, i++) {
+                    int len;
+                    if (rm->array->is_string[i]) {
+                        char *text = (char *) &rm->array->data[i];
+                        buf[0] = '"';
+                        len = hp2ascii(buf + 1, text + 1, text[0]) + 1;
+                        buf[len++] = '"';
+                        printf(" %.*s", len, buf);
+                    } else {
+                        len = real2buf(rm->array->data[i], buf, 50);
+                        printf(" %.*s", hp2ascii(buf + 50, buf, len), buf + 50);
+                    }
+                }
+                printf("\n");
+            }
+            break;
+        }
+        case TYPE_COMPLEXMATRIX: {
+            vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
+            printf("[ %dx%d Cpx Matrix ]\n", cm->rows, cm->columns);
+            int4 i = 0;
+            for (int4 r = 0; r < cm->rows; r++) {
+                for (int4 c = 0; c < cm->columns; c++, i += 2) {
+                    int len = real2buf(cm->array->data[i], buf, 25);
+                    buf[len++] = ' ';
+                    buf[len++] = 'i';
+                    len += real2buf(cm->array->data[i + 1], buf + len, 25);
+                    printf(" %.*s", hp2ascii(buf + 50, buf, len), buf + 50);
+                }
+                printf("\n");
+            }
+            break;
+        }
+    }
+}
+
+void shell_blitter(const char *bits, int bytesperline, int x, int y,
+                                     int width, int height) {
+    /* The core always passes us its own display buffer, so all we need to
+     * do is remember where it is, in case we're asked to show it later.
+     */
+    display_bits = bits;
+    display_bpl = bytesperline;
+}
+
+void shell_beeper(int frequency, int duration) {
+    // Nothing to do
+}
+
+void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
+    // Nothing to do
+}
+
+int shell_wants_cpu() {
+    /* There are no events to handle, so the only reason to ask for the CPU
+     * back is to enforce the time limit.
+     */
+    if (time_limit == 0)
+        return 0;
+    if ((int4) (shell_milliseconds() - deadline) < 0)
+        return 0;
+    deadline_passed = true;
+    return 1;
+}
+
+void shell_delay(int duration) {
+    // No point in waiting when nobody is watching
+}
+
+void shell_request_timeout3(int delay) {
+    timeout3_pending = true;
+}
+
+int4 shell_read_saved_state(void *buf, int4 bufsize) {
+    if (statefile == NULL)
+        return -1;
+    else {
+        int4 n = fread(buf, 1, bufsize, statefile);
+        if (n != bufsize && ferror(statefile)) {
+            fclose(statefile);
+            statefile = NULL;
+            return -1;
+        } else
+            return n;
+    }
+}
+
+bool shell_write_saved_state(const void *buf, int4 nbytes) {
+    if (statefile == NULL)
+        return false;
+    else {
+        int4 n = fwrite(buf, 1, nbytes, statefile);
+        if (n != nbytes) {
+            fprintf(stderr, "Error while writing the state file.\n");
+            fclose(statefile);
+            statefile = NULL;
+            return false;
+        } else
+            return true;
+    }
+}
+
+void *shell_map_saved_state(int4 offset, int4 nbytes) {
+    if (statefile == NULL)
+        return NULL;
+    long pos = ftell(statefile);
+    if (pos == -1)
+        return NULL;
+    // mmap() wants a page-aligned file offset, so map from the start of the
+    // page containing the data
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t start = pos + offset;
+    off_t page = start - start % pagesize;
+    size_t skew = start - page;
+    // Accessing a mapping beyond the end of the file raises SIGBUS, so make
+    // sure the file is long enough
+    struct stat st;
+    if (fstat(fileno(statefile), &st) != 0 || st.st_size < start + nbytes)
+        return NULL;
+    void *addr = mmap(NULL, nbytes + skew, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fileno(statefile), page);
+    if (addr == MAP_FAILED)
+        return NULL;
+    return (char *) addr + skew;
+}
+
+void shell_unmap_saved_state(void *addr, int4 nbytes) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t skew = (size_t) addr % pagesize;
+    munmap((char *) addr - skew, nbytes + skew);
+}
+
+int4 shell_saved_state_position() {
+    if (statefile == NULL)
+        return 0;
+    long pos = ftell(statefile);
+    return pos == -1 ? 0 : (int4) pos;
+}
+
+uint4 shell_get_mem() {
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    char line[1024];
+    uint4 bytes = 0;
+    if (meminfo == NULL)
+        return 0;
+    while (fgets(line, 1024, meminfo) != NULL) {
+        if (strncmp(line, "MemFree:", 8) == 0) {
+            unsigned int kbytes;
+            if (sscanf(line + 8, "%u", &kbytes) == 1)
+                bytes = 1024 * kbytes;
+            break;
+        }
+    }
+    fclose(meminfo);
+    return bytes;
+}
+
+int shell_low_battery() {
+    return 0;
+}
+
+void shell_powerdown() {
+    quit_flag = true;
+}
+
+double shell_random_seed() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((tv.tv_sec * 1000000L + tv.tv_usec) & 0xffffffffL) / 4294967296.0;
+}
+
+uint4 shell_milliseconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint4) (tv.tv_sec * 1000L + tv.tv_usec / 1000);
+}
+
+int shell_decimal_point() {
+    struct lconv *loc = localeconv();
+    return strcmp(loc->decimal_point, ",") == 0 ? 0 : 1;
+}
+
+static int print_format(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    if (ext == NULL)
+        return PRINT_SINK_TEXT;
+    else if (strcasecmp(ext, ".gif") == 0)
+        return PRINT_SINK_GIF;
+    else if (strcasecmp(ext, ".png") == 0)
+        return PRINT_SINK_PNG;
+    else if (strcasecmp(ext, ".raw") == 0)
+        return PRINT_SINK_RAW;
+    else
+        return PRINT_SINK_TEXT;
+}
+
+static int print_writer(void *context, const char *buf, int4 length) {
+    return fwrite(buf, 1, length, (FILE *) context) == (size_t) length;
+}
+
+static int print_seeker(void *context, int4 pos) {
+    return fseek((FILE *) context, pos, SEEK_SET) == 0;
+}
+
+static void print_request_flush(void *context) {
+    /* The buffer is flushed by run_program(), between instructions */
+    print_flush_pending = true;
+}
+
+void shell_print(const char *text, int length,
+                 const char *bits, int bytesperline,
+                 int x, int y, int width, int height) {
+    if (printer != NULL)
+        print_sink_print(printer, text, length,
+                         bits, bytesperline, x, y, width, height);
+}
+
+void shell_log(const char *message) {
+    fprintf(stderr, "%s\n", message);
+}
+
+int shell_write(const char *buf, int4 buflen) {
+    return 0;
+}
+
+int shell_read(char *buf, int4 buflen) {
+    int4 nread;
+    if (import_file == NULL)
+        return -1;
+    nread = fread(buf, 1, buflen, import_file);
+    if (nread != buflen && ferror(import_file)) {
+        fclose(import_file);
+        import_file = NULL;
+        fprintf(stderr, "An error occurred; import was terminated prematurely.\n");
+        return -1;
+    } else
+        return nread;
+}
+
+void shell_get_time_date(uint4 *time, uint4 *date, int *weekday) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct tm tms;
+    localtime_r(&tv.tv_sec, &tms);
+    if (time != NULL)
+        *time = ((tms.tm_hour * 100 + tms.tm_min) * 100 + tms.tm_sec) * 100 + tv.tv_usec / 10000;
+    if (date != NULL)
+        *date = ((tms.tm_year + 1900) * 100 + tms.tm_mon + 1) * 100 + tms.tm_mday;
+    if (weekday != NULL)
+        *weekday = tms.tm_wday;
+}
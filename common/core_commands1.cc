@@ -40,10 +40,9 @@ int docmd_clx(arg_struct *arg) {
 }
 
 int docmd_enter(arg_struct *arg) {
-    vartype *v = dup_vartype(reg_x);
+    vartype *v = recycle_vartype(reg_t, reg_x);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
-    free_vartype(reg_t);
     reg_t = reg_z;
     reg_z = reg_y;
     reg_y = v;
@@ -121,6 +120,14 @@ static void docmd_div_completion(int error, vartype *res) {
 }
 
 int docmd_div(arg_struct *arg) {
+    if (reg_x->type == TYPE_REAL && reg_y->type == TYPE_REAL) {
+        phloat r;
+        int error = div_rr(((vartype_real *) reg_x)->x,
+                           ((vartype_real *) reg_y)->x, &r);
+        if (error != ERR_NONE)
+            return error;
+        return binary_real_result(r);
+    }
     return generic_div(reg_x, reg_y, docmd_div_completion);
 }
 
@@ -130,10 +137,26 @@ static void docmd_mul_completion(int error, vartype *res) {
 }
 
 int docmd_mul(arg_struct *arg) {
+    if (reg_x->type == TYPE_REAL && reg_y->type == TYPE_REAL) {
+        phloat r;
+        int error = mul_rr(((vartype_real *) reg_x)->x,
+                           ((vartype_real *) reg_y)->x, &r);
+        if (error != ERR_NONE)
+            return error;
+        return binary_real_result(r);
+    }
     return generic_mul(reg_x, reg_y, docmd_mul_completion);
 }
 
 int docmd_sub(arg_struct *arg) {
+    if (reg_x->type == TYPE_REAL && reg_y->type == TYPE_REAL) {
+        phloat r;
+        int error = sub_rr(((vartype_real *) reg_x)->x,
+                           ((vartype_real *) reg_y)->x, &r);
+        if (error != ERR_NONE)
+            return error;
+        return binary_real_result(r);
+    }
     vartype *res;
     int error = generic_sub(reg_x, reg_y, &res);
     if (error == ERR_NONE)
@@ -142,6 +165,14 @@ int docmd_sub(arg_struct *arg) {
 }
 
 int docmd_add(arg_struct *arg) {
+    if (reg_x->type == TYPE_REAL && reg_y->type == TYPE_REAL) {
+        phloat r;
+        int error = add_rr(((vartype_real *) reg_x)->x,
+                           ((vartype_real *) reg_y)->x, &r);
+        if (error != ERR_NONE)
+            return error;
+        return binary_real_result(r);
+    }
     vartype *res;
     int error = generic_add(reg_x, reg_y, &res);
     if (error == ERR_NONE)
@@ -179,9 +210,11 @@ int docmd_complex(arg_struct *arg) {
             free_vartype(reg_lastx);
             reg_lastx = reg_x;
             reg_x = v;
-            free_vartype(reg_y);
+            vartype *old_y = reg_y;
             reg_y = reg_z;
-            reg_z = dup_vartype(reg_t);
+            reg_z = recycle_vartype(old_y, reg_t);
+            if (reg_z == NULL)
+                free_vartype(old_y);
             break;
         }
         case TYPE_COMPLEX: {
@@ -655,6 +688,7 @@ int docmd_clsigma(arg_struct *arg) {
     size = r->rows * r->columns;
     if (last > size)
         return ERR_SIZE_ERROR;
+    matrix_data_modified(r->array->data);
     for (i = first; i < last; i++) {
         r->array->is_string[i] = 0;
         r->array->data[i] = 0;
@@ -858,11 +892,7 @@ static int mappable_to_deg(phloat x, phloat *y) {
 
 int docmd_to_deg(arg_struct *arg) {
     if (reg_x->type == TYPE_REAL || reg_x->type == TYPE_REALMATRIX) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_to_deg, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_to_deg, NULL);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -876,11 +906,7 @@ static int mappable_to_rad(phloat x, phloat *y) {
 
 int docmd_to_rad(arg_struct *arg) {
     if (reg_x->type == TYPE_REAL || reg_x->type == TYPE_REALMATRIX) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_to_rad, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_to_rad, NULL);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -932,11 +958,7 @@ static int mappable_to_hr(phloat x, phloat *y) {
 
 int docmd_to_hr(arg_struct *arg) {
     if (reg_x->type == TYPE_REAL || reg_x->type == TYPE_REALMATRIX) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_to_hr, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_to_hr, NULL);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -964,11 +986,7 @@ static int mappable_to_hms(phloat x, phloat *y) {
 
 int docmd_to_hms(arg_struct *arg) {
     if (reg_x->type == TYPE_REAL || reg_x->type == TYPE_REALMATRIX) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_to_hms, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_to_hms, NULL);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -1024,13 +1042,8 @@ int docmd_to_rec(arg_struct *arg) {
     } else if (reg_x->type == TYPE_COMPLEX) {
         vartype_complex *c = (vartype_complex *) reg_x;
         phloat x, y;
-        vartype *v;
         generic_p2r(c->re, c->im, &x, &y);
-        v = new_complex(x, y);
-        if (v == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        unary_result(v);
-        return ERR_NONE;
+        return unary_complex_result(x, y);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -1092,7 +1105,6 @@ int docmd_to_pol(arg_struct *arg) {
     } else if (reg_x->type == TYPE_COMPLEX) {
         vartype_complex *c = (vartype_complex *) reg_x;
         phloat r, phi;
-        vartype *v;
         generic_r2p(c->re, c->im, &r, &phi);
         if (p_isinf(r)) {
             if (flags.f.range_error_ignore)
@@ -1100,11 +1112,7 @@ int docmd_to_pol(arg_struct *arg) {
             else
                 return ERR_OUT_OF_RANGE;
         }
-        v = new_complex(r, phi);
-        if (v == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        unary_result(v);
-        return ERR_NONE;
+        return unary_complex_result(r, phi);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -1121,11 +1129,7 @@ static int mappable_ip(phloat x, phloat *y) {
 
 int docmd_ip(arg_struct *arg) {
     if (reg_x->type == TYPE_REAL || reg_x->type == TYPE_REALMATRIX) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_ip, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_ip, NULL);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -1142,11 +1146,7 @@ static int mappable_fp(phloat x, phloat *y) {
 
 int docmd_fp(arg_struct *arg) {
     if (reg_x->type == TYPE_REAL || reg_x->type == TYPE_REALMATRIX) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_fp, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_fp, NULL);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -1218,18 +1218,13 @@ int docmd_rnd(arg_struct *arg) {
     if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else {
-        vartype *v;
-        int err;
         int digits = 0;
         if (flags.f.digits_bit3) digits += 8;
         if (flags.f.digits_bit2) digits += 4;
         if (flags.f.digits_bit1) digits += 2;
         if (flags.f.digits_bit0) digits += 1;
         rnd_multiplier = pow(10.0, digits);
-        err = map_unary(reg_x, &v, mappable_rnd_r, mappable_rnd_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_rnd_r, mappable_rnd_c);
     }
 }
 
@@ -1371,7 +1366,6 @@ int docmd_mod(arg_struct *arg) {
         phloat x = ((vartype_real *) reg_x)->x;
         phloat y = ((vartype_real *) reg_y)->x;
         phloat res;
-        vartype *v;
         if (x == 0)
             res = y;
         else if (y == 0)
@@ -1381,11 +1375,7 @@ int docmd_mod(arg_struct *arg) {
             if (res != 0 && ((x > 0 && y < 0) || (x < 0 && y > 0)))
                 res += x;
         }
-        v = new_real(res);
-        if (v == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        binary_result(v);
-        return ERR_NONE;
+        return binary_real_result(res);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else if (reg_x->type != TYPE_REAL)
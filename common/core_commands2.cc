@@ -151,7 +151,6 @@ int docmd_comb(arg_struct *arg) {
         phloat y = ((vartype_real *) reg_y)->x;
         phloat x = ((vartype_real *) reg_x)->x;
         phloat r = 1, q = 1;
-        vartype *v;
         if (x < 0 || x != floor(x) || x == x - 1 || y < 0 || y != floor(y))
             return ERR_INVALID_DATA;
         if (y < x)
@@ -169,11 +168,7 @@ int docmd_comb(arg_struct *arg) {
             }
             r /= q++;
         }
-        v = new_real(r);
-        if (v == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        binary_result(v);
-        return ERR_NONE;
+        return binary_real_result(r);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else if (reg_x->type != TYPE_REAL)
@@ -189,7 +184,6 @@ int docmd_perm(arg_struct *arg) {
         phloat y = ((vartype_real *) reg_y)->x;
         phloat x = ((vartype_real *) reg_x)->x;
         phloat r = 1;
-        vartype *v;
         if (x < 0 || x != floor(x) || x == x - 1 || y < 0 || y != floor(y))
             return ERR_INVALID_DATA;
         if (y < x)
@@ -205,11 +199,7 @@ int docmd_perm(arg_struct *arg) {
             }
             x--;
         }
-        v = new_real(r);
-        if (v == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        binary_result(v);
-        return ERR_NONE;
+        return binary_real_result(r);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else if (reg_x->type != TYPE_REAL)
@@ -240,11 +230,7 @@ static int mappable_fact(phloat x, phloat *y) {
 
 int docmd_fact(arg_struct *arg) {
     if (reg_x->type == TYPE_REAL || reg_x->type == TYPE_REALMATRIX) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_fact, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_fact, NULL);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -257,11 +243,7 @@ int docmd_gamma(arg_struct *arg) {
     else if (reg_x->type == TYPE_COMPLEX || reg_x->type == TYPE_COMPLEXMATRIX)
         return ERR_INVALID_TYPE;
     else {
-        vartype *v;
-        int err = map_unary(reg_x, &v, math_gamma, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(math_gamma, NULL);
     }
 }
 
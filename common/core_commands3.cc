@@ -151,11 +151,7 @@ int docmd_asinh(arg_struct *arg) {
     if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_asinh_r, mappable_asinh_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_asinh_r, mappable_asinh_c);
     }
 }
 
@@ -197,10 +193,7 @@ int docmd_atanh(arg_struct *arg) {
         unary_result(v);
         return ERR_NONE;
     } else {
-        err = map_unary(reg_x, &v, mappable_atanh_r, math_atanh);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_atanh_r, math_atanh);
     }
 }
 
@@ -259,11 +252,7 @@ static int mappable_cosh_c(phloat xre, phloat xim, phloat *yre, phloat *yim) {
 
 int docmd_cosh(arg_struct *arg) {
     if (reg_x->type != TYPE_STRING) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_cosh_r, mappable_cosh_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_cosh_r, mappable_cosh_c);
     } else
         return ERR_ALPHA_DATA_IS_INVALID;
 }
@@ -277,7 +266,6 @@ int docmd_cross(arg_struct *arg) {
     else if (reg_x->type == TYPE_COMPLEX && reg_y->type == TYPE_COMPLEX) {
         vartype_complex *left = (vartype_complex *) reg_y;
         vartype_complex *right = (vartype_complex *) reg_x;
-        vartype *v;
         phloat d = left->re * right->im - left->im * right->re;
         int inf;
         if ((inf = p_isinf(d)) != 0) {
@@ -286,11 +274,7 @@ int docmd_cross(arg_struct *arg) {
             else
                 return ERR_OUT_OF_RANGE;
         }
-        v = new_real(d);
-        if (v == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        binary_result(v);
-        return ERR_NONE;
+        return binary_real_result(d);
     } else if (reg_x->type == TYPE_REALMATRIX
                         && reg_y->type == TYPE_REALMATRIX) {
         vartype_realmatrix *left = (vartype_realmatrix *) reg_y;
@@ -445,6 +429,8 @@ int docmd_delr(arg_struct *arg) {
          * still have all the data so we can roll everything back. And best
          * of all, no temporary memory allocations needed!
          */
+        matrix_data_modified(m->type == TYPE_REALMATRIX ? rm->array->data
+                                                        : cm->array->data);
         if (m->type == TYPE_REALMATRIX) {
             for (j = 0; j < columns; j++) {
                 phloat tempd = rm->array->data[matedit_i * columns + j];
@@ -507,28 +493,12 @@ int docmd_delr(arg_struct *arg) {
          * does not deal with resizing. */
         int4 newsize = (rows - 1) * columns;
         if (m->type == TYPE_REALMATRIX) {
-            realmatrix_data *array = (realmatrix_data *)
-                                malloc(sizeof(realmatrix_data));
+            realmatrix_data *array = new_realmatrix_data(newsize);
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            array->data = (phloat *) malloc(newsize * sizeof(phloat));
-            if (array->data == NULL) {
-                if (interactive)
-                    free_vartype(newx);
-                free(array);
-                return ERR_INSUFFICIENT_MEMORY;
-            }
-            array->is_string = (char *) malloc(newsize);
-            if (array->is_string == NULL) {
-                if (interactive)
-                    free_vartype(newx);
-                free(array->data);
-                free(array);
-                return ERR_INSUFFICIENT_MEMORY;
-            }
             for (i = 0; i < matedit_i * columns; i++) {
                 array->is_string[i] = rm->array->is_string[i];
                 array->data[i] = rm->array->data[i];
@@ -537,30 +507,21 @@ int docmd_delr(arg_struct *arg) {
                 array->is_string[i] = rm->array->is_string[i + columns];
                 array->data[i] = rm->array->data[i + columns];
             }
-            array->refcount = 1;
+            array->no_strings = rm->array->no_strings;
             rm->array->refcount--;
             rm->array = array;
             rm->rows--;
         } else {
-            complexmatrix_data *array = (complexmatrix_data *)
-                                malloc(sizeof(complexmatrix_data));
+            complexmatrix_data *array = new_complexmatrix_data(newsize);
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            array->data = (phloat *) malloc(2 * newsize * sizeof(phloat));
-            if (array->data == NULL) {
-                if (interactive)
-                    free_vartype(newx);
-                free(array);
-                return ERR_INSUFFICIENT_MEMORY;
-            }
             for (i = 0; i < 2 * matedit_i * columns; i++)
                 array->data[i] = cm->array->data[i];
             for (i = 2 * matedit_i * columns; i < 2 * newsize; i++)
                 array->data[i] = cm->array->data[i + 2 * columns];
-            array->refcount = 1;
             cm->array->refcount--;
             cm->array = array;
             cm->rows--;
@@ -970,11 +931,7 @@ static int mappable_e_pow_x_1(phloat x, phloat *y) {
 
 int docmd_e_pow_x_1(arg_struct *arg) {
     if (reg_x->type == TYPE_REAL || reg_x->type == TYPE_REALMATRIX) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_e_pow_x_1, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_e_pow_x_1, NULL);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -1031,15 +988,10 @@ static int fnrm(vartype *m, phloat *norm) {
 
 int docmd_fnrm(arg_struct *arg) {
     phloat norm;
-    vartype *v;
     int err = fnrm(reg_x, &norm);
     if (err != ERR_NONE)
         return err;
-    v = new_real(norm);
-    if (v == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    unary_result(v);
-    return ERR_NONE;
+    return unary_real_result(norm);
 }
 
 int docmd_getm(arg_struct *arg) {
@@ -1112,6 +1064,7 @@ int docmd_getm(arg_struct *arg) {
                 dst->array->is_string[n2] = src->array->is_string[n1];
                 dst->array->data[n2] = src->array->data[n1];
             }
+        dst->array->no_strings = src->array->no_strings;
         binary_result((vartype *) dst);
         return ERR_NONE;
     } else /* m->type == TYPE_COMPLEXMATRIX */ {
@@ -1279,11 +1232,7 @@ static int hms_add_or_sub(bool add) {
             return ERR_OUT_OF_RANGE;
     }
 
-    vartype *v = new_real(r);
-    if (v == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    binary_result(v);
-    return ERR_NONE;
+    return binary_real_result(r);
 }
 
 int docmd_hmsadd(arg_struct *arg) {
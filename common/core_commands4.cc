@@ -121,28 +121,12 @@ int docmd_insr(arg_struct *arg) {
          * does not deal with resizing. */
         int4 newsize = (rows + 1) * columns;
         if (m->type == TYPE_REALMATRIX) {
-            realmatrix_data *array = (realmatrix_data *)
-                                malloc(sizeof(realmatrix_data));
+            realmatrix_data *array = new_realmatrix_data(newsize);
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            array->data = (phloat *) malloc(newsize * sizeof(phloat));
-            if (array->data == NULL) {
-                if (interactive)
-                    free_vartype(newx);
-                free(array);
-                return ERR_INSUFFICIENT_MEMORY;
-            }
-            array->is_string = (char *) malloc(newsize);
-            if (array->is_string == NULL) {
-                if (interactive)
-                    free_vartype(newx);
-                free(array->data);
-                free(array);
-                return ERR_INSUFFICIENT_MEMORY;
-            }
             for (i = 0; i < matedit_i * columns; i++) {
                 array->is_string[i] = rm->array->is_string[i];
                 array->data[i] = rm->array->data[i];
@@ -155,25 +139,17 @@ int docmd_insr(arg_struct *arg) {
                 array->is_string[i] = rm->array->is_string[i - columns];
                 array->data[i] = rm->array->data[i - columns];
             }
-            array->refcount = 1;
+            array->no_strings = rm->array->no_strings;
             rm->array->refcount--;
             rm->array = array;
             rm->rows++;
         } else {
-            complexmatrix_data *array = (complexmatrix_data *)
-                                malloc(sizeof(complexmatrix_data));
+            complexmatrix_data *array = new_complexmatrix_data(newsize);
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            array->data = (phloat *) malloc(2 * newsize * sizeof(phloat));
-            if (array->data == NULL) {
-                if (interactive)
-                    free_vartype(newx);
-                free(array);
-                return ERR_INSUFFICIENT_MEMORY;
-            }
             for (i = 0; i < 2 * matedit_i * columns; i++)
                 array->data[i] = cm->array->data[i];
             for (i = 2 * matedit_i * columns;
@@ -181,7 +157,6 @@ int docmd_insr(arg_struct *arg) {
                 array->data[i] = 0;
             for (i = 2 * (matedit_i + 1) * columns; i < 2 * newsize; i++)
                 array->data[i] = cm->array->data[i - 2 * columns];
-            array->refcount = 1;
             cm->array->refcount--;
             cm->array = array;
             cm->rows++;
@@ -273,11 +248,7 @@ static int mappable_ln_1_x(phloat x, phloat *y) {
 
 int docmd_ln_1_x(arg_struct *arg) {
     if (reg_x->type == TYPE_REAL || reg_x->type == TYPE_REALMATRIX) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_ln_1_x, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_ln_1_x, NULL);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -290,7 +261,6 @@ int docmd_old(arg_struct *arg) {
 
 int docmd_posa(arg_struct *arg) {
     int pos = -1;
-    vartype *v;
     if (reg_x->type == TYPE_REAL) {
         phloat x = ((vartype_real *) reg_x)->x;
         char c;
@@ -320,11 +290,7 @@ int docmd_posa(arg_struct *arg) {
         }
     } else
         return ERR_INVALID_TYPE;
-    v = new_real(pos);
-    if (v == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    unary_result(v);
-    return ERR_NONE;
+    return unary_real_result(pos);
 }
 
 int docmd_putm(arg_struct *arg) {
@@ -377,6 +343,8 @@ int docmd_putm(arg_struct *arg) {
                 dst->array->is_string[n2] = src->array->is_string[n1];
                 dst->array->data[n2] = src->array->data[n1];
             }
+        if (!src->array->no_strings)
+            dst->array->no_strings = false;
         return ERR_NONE;
     } else if (reg_x->type == TYPE_REALMATRIX) {
         vartype_realmatrix *src = (vartype_realmatrix *) reg_x;
@@ -473,7 +441,6 @@ int docmd_rclij(arg_struct *arg) {
 
 int docmd_rnrm(arg_struct *arg) {
     if (reg_x->type == TYPE_REALMATRIX) {
-        vartype *v;
         vartype_realmatrix *rm = (vartype_realmatrix *) reg_x;
         int4 size = rm->rows * rm->columns;
         int4 i, j;
@@ -500,13 +467,8 @@ int docmd_rnrm(arg_struct *arg) {
             if (nrm > max)
                 max = nrm;
         }
-        v = new_real(max);
-        if (v == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        unary_result(v);
-        return ERR_NONE;
+        return unary_real_result(max);
     } else if (reg_x->type == TYPE_COMPLEXMATRIX) {
-        vartype *v;
         vartype_complexmatrix *cm = (vartype_complexmatrix *) reg_x;
         int4 i, j;
         phloat max = 0;
@@ -527,11 +489,7 @@ int docmd_rnrm(arg_struct *arg) {
             if (nrm > max)
                 max = nrm;
         }
-        v = new_real(max);
-        if (v == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        unary_result(v);
-        return ERR_NONE;
+        return unary_real_result(max);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -740,11 +698,7 @@ static int mappable_sinh_c(phloat xre, phloat xim, phloat *yre, phloat *yim) {
 
 int docmd_sinh(arg_struct *arg) {
     if (reg_x->type != TYPE_STRING) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_sinh_r, mappable_sinh_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_sinh_r, mappable_sinh_c);
     } else
         return ERR_ALPHA_DATA_IS_INVALID;
 }
@@ -788,6 +742,7 @@ int docmd_stoel(arg_struct *arg) {
             vartype_string *s = (vartype_string *) reg_x;
             int i;
             rm->array->is_string[n] = 1;
+            rm->array->no_strings = false;
             phloat_length(rm->array->data[n]) = s->length;
             for (i = 0; i < s->length; i++)
                 phloat_text(rm->array->data[n])[i] = s->text[i];
@@ -924,11 +879,7 @@ static int mappable_tanh_c(phloat xre, phloat xim, phloat *yre, phloat *yim) {
 
 int docmd_tanh(arg_struct *arg) {
     if (reg_x->type != TYPE_STRING) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_tanh_r, mappable_tanh_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_tanh_r, mappable_tanh_c);
     } else
         return ERR_ALPHA_DATA_IS_INVALID;
 }
@@ -950,6 +901,7 @@ int docmd_trans(arg_struct *arg) {
                 dst->array->is_string[n2] = src->array->is_string[n1];
                 dst->array->data[n2] = src->array->data[n1];
             }
+        dst->array->no_strings = src->array->no_strings;
         unary_result((vartype *) dst);
         return ERR_NONE;
     } else if (reg_x->type == TYPE_COMPLEXMATRIX) {
@@ -1119,6 +1071,7 @@ static int matedit_move(int direction) {
             vartype_string *s = (vartype_string *) reg_x;
             int i;
             rm->array->is_string[old_n] = 1;
+            rm->array->no_strings = false;
             phloat_length(rm->array->data[old_n]) = s->length;
             for (i = 0; i < s->length; i++)
                 phloat_text(rm->array->data[old_n])[i] = s->text[i];
@@ -113,22 +113,16 @@ int docmd_allsigma(arg_struct *arg) {
 int docmd_and(arg_struct *arg) {
     int8 x, y;
     int err;
-    vartype *v;
     if ((err = get_base_param(reg_x, &x)) != ERR_NONE)
         return err;
     if ((err = get_base_param(reg_y, &y)) != ERR_NONE)
         return err;
-    v = new_real((phloat) (x & y));
-    if (v == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    binary_result(v);
-    return ERR_NONE;
+    return binary_real_result((phloat) (x & y));
 }
 
 int docmd_baseadd(arg_struct *arg) {
     int8 x, y, res;
     int err;
-    vartype *v;
     if ((err = get_base_param(reg_x, &x)) != ERR_NONE)
         return err;
     if ((err = get_base_param(reg_y, &y)) != ERR_NONE)
@@ -136,17 +130,12 @@ int docmd_baseadd(arg_struct *arg) {
     res = x + y;
     if ((err = base_range_check(&res)) != ERR_NONE)
         return err;
-    v = new_real((phloat) res);
-    if (v == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    binary_result(v);
-    return ERR_NONE;
+    return binary_real_result((phloat) res);
 }
 
 int docmd_basesub(arg_struct *arg) {
     int8 x, y, res;
     int err;
-    vartype *v;
     if ((err = get_base_param(reg_x, &x)) != ERR_NONE)
         return err;
     if ((err = get_base_param(reg_y, &y)) != ERR_NONE)
@@ -154,18 +143,13 @@ int docmd_basesub(arg_struct *arg) {
     res = y - x;
     if ((err = base_range_check(&res)) != ERR_NONE)
         return err;
-    v = new_real((phloat) res);
-    if (v == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    binary_result(v);
-    return ERR_NONE;
+    return binary_real_result((phloat) res);
 }
 
 int docmd_basemul(arg_struct *arg) {
     int8 x, y;
     double res;
     int err;
-    vartype *v;
     if ((err = get_base_param(reg_x, &x)) != ERR_NONE)
         return err;
     if ((err = get_base_param(reg_y, &y)) != ERR_NONE)
@@ -186,17 +170,12 @@ int docmd_basemul(arg_struct *arg) {
         else
             return ERR_OUT_OF_RANGE;
     }
-    v = new_real(res);
-    if (v == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    binary_result(v);
-    return ERR_NONE;
+    return binary_real_result(res);
 }
 
 int docmd_basediv(arg_struct *arg) {
     int8 x, y, res;
     int err;
-    vartype *v;
     if ((err = get_base_param(reg_x, &x)) != ERR_NONE)
         return err;
     if ((err = get_base_param(reg_y, &y)) != ERR_NONE)
@@ -206,11 +185,7 @@ int docmd_basediv(arg_struct *arg) {
     res = y / x;
     if ((err = base_range_check(&res)) != ERR_NONE)
         return err;
-    v = new_real((phloat) res);
-    if (v == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    binary_result(v);
-    return ERR_NONE;
+    return binary_real_result((phloat) res);
 }
 
 int docmd_basechs(arg_struct *arg) {
@@ -492,17 +467,13 @@ static int mappable_fcstx(phloat x, phloat *y) {
 
 int docmd_fcstx(arg_struct *arg) {
     int err = get_model_summation(get_model());
-    vartype *v;
     if (err != ERR_NONE)
         return err;
     err = slope_yint_helper();
     if (err != ERR_NONE)
         return err;
     if (reg_x->type == TYPE_REAL || reg_x->type == TYPE_REALMATRIX) {
-        err = map_unary(reg_x, &v, mappable_fcstx, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_fcstx, NULL);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -527,17 +498,13 @@ static int mappable_fcsty(phloat x, phloat *y) {
 
 int docmd_fcsty(arg_struct *arg) {
     int err = get_model_summation(get_model());
-    vartype *v;
     if (err != ERR_NONE)
         return err;
     err = slope_yint_helper();
     if (err != ERR_NONE)
         return err;
     if (reg_x->type == TYPE_REAL || reg_x->type == TYPE_REALMATRIX) {
-        err = map_unary(reg_x, &v, mappable_fcsty, NULL);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_fcsty, NULL);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -719,14 +686,9 @@ int docmd_linsigma(arg_struct *arg) {
 int docmd_not(arg_struct *arg) {
     int8 x;
     int err;
-    vartype *v;
     if ((err = get_base_param(reg_x, &x)) != ERR_NONE)
         return err;
-    v = new_real((phloat) ~x);
-    if (v == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    unary_result(v);
-    return ERR_NONE;
+    return unary_real_result((phloat) ~x);
 }
 
 int docmd_or(arg_struct *arg) {
@@ -972,7 +934,6 @@ int docmd_to_dec(arg_struct *arg) {
             oct = -oct;
         if (oct > 777777777777.0 || oct != floor(oct))
             return ERR_INVALID_DATA;
-        vartype *v;
         #ifdef BCD_MATH
             phloat dec = 0, mul = 1;
             while (oct != 0) {
@@ -997,11 +958,7 @@ int docmd_to_dec(arg_struct *arg) {
             }
             res = (double) (neg ? -dec : dec);
         #endif
-        v = new_real(res);
-        if (v == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        unary_result(v);
-        return ERR_NONE;
+        return unary_real_result(res);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -1017,7 +974,6 @@ int docmd_to_oct(arg_struct *arg) {
             dec = -dec;
         if (dec > 68719476735.0 || dec != floor(dec))
             return ERR_INVALID_DATA;
-        vartype *v;
         #ifdef BCD_MATH
             phloat oct = 0, mul = 1;
             while (dec != 0) {
@@ -1038,11 +994,7 @@ int docmd_to_oct(arg_struct *arg) {
             }
             res = (double) (neg ? -oct : oct);
         #endif
-        v = new_real(res);
-        if (v == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        unary_result(v);
-        return ERR_NONE;
+        return unary_real_result(res);
     } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
@@ -1127,6 +1079,7 @@ static int sigma_helper_1(int weight) {
         if (r->array->is_string[i])
             return ERR_ALPHA_DATA_IS_INVALID;
     sigmaregs = r->array->data + first;
+    matrix_data_modified(r->array->data);
 
     /* All summation registers present, real-valued, non-string. */
     switch (reg_x->type) {
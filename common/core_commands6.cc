@@ -64,11 +64,7 @@ static int mappable_sin_c(phloat xre, phloat xim, phloat *yre, phloat *yim) {
 
 int docmd_sin(arg_struct *arg) {
     if (reg_x->type != TYPE_STRING) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_sin_r, mappable_sin_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_sin_r, mappable_sin_c);
     } else
         return ERR_ALPHA_DATA_IS_INVALID;
 }
@@ -110,11 +106,7 @@ static int mappable_cos_c(phloat xre, phloat xim, phloat *yre, phloat *yim) {
 
 int docmd_cos(arg_struct *arg) {
     if (reg_x->type != TYPE_STRING) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_cos_r, mappable_cos_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_cos_r, mappable_cos_c);
     } else
         return ERR_ALPHA_DATA_IS_INVALID;
 }
@@ -225,11 +217,7 @@ static int mappable_tan_c(phloat xre, phloat xim, phloat *yre, phloat *yim) {
 
 int docmd_tan(arg_struct *arg) {
     if (reg_x->type != TYPE_STRING) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_tan_r, mappable_tan_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_tan_r, mappable_tan_c);
     } else
         return ERR_ALPHA_DATA_IS_INVALID;
 }
@@ -371,11 +359,7 @@ int docmd_atan(arg_struct *arg) {
     if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_atan_r, mappable_atan_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_atan_r, mappable_atan_c);
     }
 }
 
@@ -433,11 +417,7 @@ int docmd_log(arg_struct *arg) {
             }
         }
     } else {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_log_r, mappable_log_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_log_r, mappable_log_c);
     }
 }
 
@@ -484,12 +464,7 @@ static int mappable_10_pow_x_c(phloat xre, phloat xim, phloat *yre, phloat *yim)
 
 int docmd_10_pow_x(arg_struct *arg) {
     if (reg_x->type != TYPE_STRING) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_10_pow_x_r,
-                                       mappable_10_pow_x_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_10_pow_x_r, mappable_10_pow_x_c);
     } else
         return ERR_ALPHA_DATA_IS_INVALID;
 }
@@ -548,11 +523,7 @@ int docmd_ln(arg_struct *arg) {
             }
         }
     } else {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_ln_r, mappable_ln_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_ln_r, mappable_ln_c);
     }
 }
 
@@ -595,11 +566,7 @@ static int mappable_e_pow_x_c(phloat xre, phloat xim, phloat *yre, phloat *yim){
 
 int docmd_e_pow_x(arg_struct *arg) {
     if (reg_x->type != TYPE_STRING) {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_e_pow_x_r, mappable_e_pow_x_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_e_pow_x_r, mappable_e_pow_x_c);
     } else
         return ERR_ALPHA_DATA_IS_INVALID;
 }
@@ -641,12 +608,7 @@ int docmd_sqrt(arg_struct *arg) {
     } else if (reg_x->type == TYPE_STRING) {
         return ERR_ALPHA_DATA_IS_INVALID;
     } else {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_sqrt_r, mappable_sqrt_c);
-        if (err != ERR_NONE)
-            return err;
-        unary_result(v);
-        return ERR_NONE;
+        return map_unary_result(mappable_sqrt_r, mappable_sqrt_c);
     }
 }
 
@@ -688,11 +650,7 @@ int docmd_square(arg_struct *arg) {
     if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_square_r, mappable_square_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_square_r, mappable_square_c);
     }
 }
 
@@ -733,11 +691,7 @@ int docmd_inv(arg_struct *arg) {
     if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else {
-        vartype *v;
-        int err = map_unary(reg_x, &v, mappable_inv_r, mappable_inv_c);
-        if (err == ERR_NONE)
-            unary_result(v);
-        return err;
+        return map_unary_result(mappable_inv_r, mappable_inv_c);
     }
 }
 
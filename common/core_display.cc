@@ -16,6 +16,7 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "core_display.h"
 #include "core_commands2.h"
@@ -520,9 +521,22 @@ static char smallchars_map[128] =
 
 static char display[272];
 
+/* bigchars transposed: one byte per pixel row, with the leftmost column in
+ * the least significant bit, like the display itself. Built on first use by
+ * draw_char().
+ */
+static unsigned char bigchars_rows[130][8];
+static bool bigchars_rows_built = false;
+
 static int is_dirty = 0;
 static int dirty_top, dirty_left, dirty_bottom, dirty_right;
 
+/* Minimum time between display updates while a program is running, in
+ * milliseconds; see core_set_display_rate().
+ */
+static uint4 frame_interval = 1000 / 60;
+static uint4 last_frame_time = 0;
+
 static int catalogmenu_section[5];
 static int catalogmenu_rows[5];
 static int catalogmenu_row[5];
@@ -544,6 +558,7 @@ static int appmenu_exitcallback;
 /*******************************/
 
 static void mark_dirty(int top, int left, int bottom, int right);
+static void blit_dirty();
 static void fill_rect(int x, int y, int width, int height, int color);
 static int get_cat_index();
 
@@ -655,13 +670,32 @@ bool unpersist_display(int version) {
 }
 
 void clear_display() {
-    int i;
-    for (i = 0; i < 272; i++)
-        display[i] = 0;
+    memset(display, 0, 272);
     mark_dirty(0, 0, 16, 131);
 }
 
 void flush_display() {
+    if (!is_dirty)
+        return;
+    if (frame_interval != 0 && mode_running && !mode_pause && !mode_getkey) {
+        /* While a program is running, changes are collected, and passed to
+         * the shell at most once per frame. Whatever is left over is flushed
+         * by core_keydown() when the program yields, and by set_running()
+         * when it stops.
+         */
+        uint4 now = shell_milliseconds();
+        if (now - last_frame_time < frame_interval)
+            return;
+        last_frame_time = now;
+    }
+    blit_dirty();
+}
+
+void set_display_rate(int fps) {
+    frame_interval = fps <= 0 ? 0 : 1000 / fps;
+}
+
+static void blit_dirty() {
     if (!is_dirty)
         return;
     shell_blitter(display, 17, dirty_left, dirty_top,
@@ -772,8 +806,11 @@ void fly_goose() {
 }
 
 void squeak() {
-    if (flags.f.audio_enable)
+    if (flags.f.audio_enable) {
+        /* Don't keep a pending frame waiting while the sound plays */
+        blit_dirty();
         shell_beeper(1835, 125);
+    }
 }
 
 void tone(int n) {
@@ -792,6 +829,7 @@ void tone(int n) {
             case 9: frequency = 550; break;
             default: return;
         }
+        blit_dirty();
         shell_beeper(frequency, 250);
     }
 }
@@ -816,25 +854,44 @@ static void mark_dirty(int top, int left, int bottom, int right) {
     }
 }
 
+static void build_bigchars_rows() {
+    int c, h, v;
+    for (c = 0; c < 130; c++)
+        for (v = 0; v < 8; v++) {
+            unsigned char row = 0;
+            for (h = 0; h < 5; h++)
+                if (bigchars[c][h] & (1 << v))
+                    row |= 1 << h;
+            bigchars_rows[c][v] = row;
+        }
+    bigchars_rows_built = true;
+}
+
 void draw_char(int x, int y, char c) {
-    int X, Y, h, v;
+    /* Each row of the character is 5 pixels wide, so it spans at most two
+     * bytes of the display; those are updated a whole byte at a time.
+     */
+    int X, Y, v, shift;
+    unsigned int mask;
+    unsigned char *d;
     unsigned char uc = (unsigned char) c;
     if (x < 0 || x >= 22 || y < 0 || y >= 2)
         return;
     if (uc >= 130)
         uc -= 128;
+    if (!bigchars_rows_built)
+        build_bigchars_rows();
     X = x * 6;
     Y = y * 8;
+    shift = X & 7;
+    mask = 0x1f << shift;
+    d = (unsigned char *) display + Y * 17 + (X >> 3);
     for (v = 0; v < 8; v++) {
-        int YY = Y + v;
-        for (h = 0; h < 5; h++) {
-            int XX = X + h;
-            char mask = 1 << (XX & 7);
-            if (bigchars[uc][h] & (1 << v))
-                display[YY * 17 + (XX >> 3)] |= mask;
-            else
-                display[YY * 17 + (XX >> 3)] &= ~mask;
-        }
+        unsigned int row = bigchars_rows[uc][v] << shift;
+        d[0] = (d[0] & ~mask) | row;
+        if (shift > 3)
+            d[1] = (d[1] & ~(mask >> 8)) | (row >> 8);
+        d += 17;
     }
     mark_dirty(Y, X, Y + 8, X + 5);
 }
@@ -859,13 +916,26 @@ void draw_string(int x, int y, const char *s, int length) {
 }
 
 static void fill_rect(int x, int y, int width, int height, int color) {
+    int first = x >> 3;
+    int last = (x + width - 1) >> 3;
+    unsigned char first_mask = 255 << (x & 7);
+    unsigned char last_mask = 255 >> (7 - ((x + width - 1) & 7));
     int h, v;
-    for (v = y; v < y + height; v++)
-        for (h = x; h < x + width; h++)
+    if (width <= 0 || height <= 0)
+        return;
+    if (first == last)
+        first_mask &= last_mask;
+    for (v = y; v < y + height; v++) {
+        unsigned char *d = (unsigned char *) display + v * 17;
+        for (h = first; h <= last; h++) {
+            unsigned char mask = h == first ? first_mask
+                                : h == last ? last_mask : 255;
             if (color)
-                display[v * 17 + (h >> 3)] |= 1 << (h & 7);
+                d[h] |= mask;
             else
-                display[v * 17 + (h >> 3)] &= ~(1 << (h & 7));
+                d[h] &= ~mask;
+        }
+    }
     mark_dirty(y, x, y + height, x + width);
 }
 
@@ -937,8 +1007,8 @@ void clear_row(int row) {
     fill_rect(0, row * 8, 131, 8, 0);
 }
 
-static int prgmline2buf(char *buf, int len, int4 line, int highlight,
-                        int cmd, arg_struct *arg) {
+int prgmline2buf(char *buf, int len, int4 line, int highlight,
+                 int cmd, arg_struct *arg) {
     int bufptr = 0;
     if (line != -1) {
         if (line < 10)
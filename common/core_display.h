@@ -26,6 +26,7 @@ bool persist_display();
 bool unpersist_display(int version);
 void clear_display();
 void flush_display();
+void set_display_rate(int fps);
 void repaint_display();
 void draw_pixel(int x, int y);
 void draw_pattern(phloat dx, phloat dy, const char *pattern, int pattern_width);
@@ -52,6 +53,8 @@ void redisplay();
 void print_display();
 int print_program(int prgm_index, int4 pc, int4 lines, int normal);
 void print_program_line(int prgm_index, int4 pc);
+int prgmline2buf(char *buf, int len, int4 line, int highlight,
+                 int cmd, arg_struct *arg);
 int command2buf(char *buf, int len, int cmd, const arg_struct *arg);
 
 #define MENULEVEL_COMMAND   0
@@ -16,6 +16,7 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "core_globals.h"
 #include "core_commands2.h"
@@ -663,6 +664,7 @@ int state_file_number_format;
  * from locking the user out.
  */
 bool no_keystrokes_yet;
+bool journal_activity = false;
 
 
 /*******************/
@@ -694,20 +696,56 @@ static int array_count;
 static int array_list_capacity;
 static void **array_list;
 
+/* Matrices whose data takes up at least STATE_PAYLOAD_MIN_SIZE bytes are not
+ * written inline, but as separate payloads, following the end marker of the
+ * state file. Each payload starts at a multiple of STATE_PAYLOAD_ALIGN bytes
+ * from the start of the file, so that the shell can map it into memory instead
+ * of reading it; see shell_map_saved_state(). In the inline part, the matrix
+ * header is followed by the payload number, or by -1 if the data is inline.
+ * The payloads are preceded by a table with their offsets, relative to the
+ * end of the table, and their lengths.
+ */
+#define STATE_PAYLOAD_MIN_SIZE 16384
+#define STATE_PAYLOAD_ALIGN 4096
+
+typedef struct {
+    void *array; /* realmatrix_data or complexmatrix_data */
+    bool is_complex;
+    int4 count; /* number of phloats */
+} payload_struct;
+
+/* Whether matrices in the stream being read or written have a payload number;
+ * true for state files of version 20 and later, false for the journal.
+ */
+static bool state_has_payloads;
+static int payload_count;
+static int payload_capacity;
+static payload_struct *payload_list;
+
+/* Identifies the last saved state file; see "State journal", below */
+static int4 journal_id = 0;
+
 
-static bool read_int(int *n);
-static bool write_int(int n);
-static bool read_int4(int4 *n);
-static bool write_int4(int4 n);
 static bool read_bool(bool *n);
 static bool write_bool(bool n);
 
 static bool array_list_grow();
 static int array_list_search(void *array);
+static int payload_add(void *array, bool is_complex, int4 count);
+static bool persist_payloads();
+static bool unpersist_payloads();
 static bool persist_vartype(vartype *v);
 static bool unpersist_vartype(vartype **v, bool padded);
 static void update_label_table(int prgm, int4 pc, int inserted);
+static void insert_label(int prgm, int4 pc, const char *name, int length);
+static void remove_label(int prgm, int4 pc);
+static void split_label_table(int prgm, int4 pc);
+static void merge_label_table(int prgm, int4 offset);
+static void invalidate_label_index();
 static void invalidate_lclbls(int prgm_index);
+static bool build_lclbl_table();
+static void discard_caches(prgm_struct *prgm);
+static bool decode_current_prgm();
 static int pc_line_convert(int4 loc, int loc_is_pc);
 static bool convert_programs();
 #ifdef BCD_MATH
@@ -743,6 +781,22 @@ static int array_list_search(void *array) {
     return -1;
 }
 
+static int payload_add(void *array, bool is_complex, int4 count) {
+    if (payload_count == payload_capacity) {
+        int newcap = payload_capacity + 16;
+        payload_struct *p = (payload_struct *)
+                    realloc(payload_list, newcap * sizeof(payload_struct));
+        if (p == NULL)
+            return -1;
+        payload_list = p;
+        payload_capacity = newcap;
+    }
+    payload_list[payload_count].array = array;
+    payload_list[payload_count].is_complex = is_complex;
+    payload_list[payload_count].count = count;
+    return payload_count++;
+}
+
 static bool persist_vartype(vartype *v) {
     if (v == NULL) {
         int type = TYPE_NULL;
@@ -790,8 +844,19 @@ static bool persist_vartype(vartype *v) {
             if (!shell_write_saved_state(&mp, sizeof(matrix_persister)))
                 return false;
             if (must_write) {
-                if (!shell_write_saved_state(rm->array->data,
-                                            size * sizeof(phloat)))
+                int4 payload = -1;
+                if (state_has_payloads) {
+                    if (size * sizeof(phloat) >= STATE_PAYLOAD_MIN_SIZE) {
+                        payload = payload_add(rm->array, false, size);
+                        if (payload == -1)
+                            return false;
+                    }
+                    if (!write_int4(payload))
+                        return false;
+                }
+                if (payload == -1
+                        && !shell_write_saved_state(rm->array->data,
+                                                    size * sizeof(phloat)))
                     return false;
                 if (!shell_write_saved_state(rm->array->is_string, size))
                     return false;
@@ -825,8 +890,19 @@ static bool persist_vartype(vartype *v) {
             if (!shell_write_saved_state(&mp, sizeof(matrix_persister)))
                 return false;
             if (must_write) {
-                if (!shell_write_saved_state(cm->array->data,
-                                            2 * size * sizeof(phloat)))
+                int4 payload = -1;
+                if (state_has_payloads) {
+                    if (2 * size * sizeof(phloat) >= STATE_PAYLOAD_MIN_SIZE) {
+                        payload = payload_add(cm->array, true, 2 * size);
+                        if (payload == -1)
+                            return false;
+                    }
+                    if (!write_int4(payload))
+                        return false;
+                }
+                if (payload == -1
+                        && !shell_write_saved_state(cm->array->data,
+                                                    2 * size * sizeof(phloat)))
                     return false;
             }
             return true;
@@ -845,6 +921,34 @@ struct fake_bcd {
     char data[16];
 };
 
+#ifdef BCD_MATH
+#define FOREIGN_PHLOAT_SIZE ((int) sizeof(double))
+#else
+#define FOREIGN_PHLOAT_SIZE ((int) sizeof(fake_bcd))
+#endif
+
+/* Converts 'count' phloats, as written by the other (binary or decimal)
+ * version, from 'src' to 'dst'. If 'is_string' is not NULL, elements for which
+ * it is nonzero hold strings, and are copied as is.
+ */
+static void convert_foreign_phloats(phloat *dst, const char *src, int4 count,
+                                    const char *is_string) {
+    for (int4 i = 0; i < count; i++) {
+        const char *s = src + i * FOREIGN_PHLOAT_SIZE;
+        if (is_string != NULL && is_string[i]) {
+            char *d = (char *) (dst + i);
+            for (int j = 0; j < 7; j++)
+                *d++ = *s++;
+        } else {
+            #ifdef BCD_MATH
+                dst[i] = *(const double *) s;
+            #else
+                dst[i] = decimal2double((void *) s);
+            #endif
+        }
+    }
+}
+
 static bool unpersist_vartype(vartype **v, bool padded) {
     int type;
     if (shell_read_saved_state(&type, sizeof(int)) != sizeof(int))
@@ -986,17 +1090,30 @@ static bool unpersist_vartype(vartype **v, bool padded) {
             bool shared = mp.rows < 0;
             if (shared)
                 mp.rows = -mp.rows;
-            vartype_realmatrix *rm = (vartype_realmatrix *) new_realmatrix(mp.rows, mp.columns);
+            int4 payload = -1;
+            if (state_has_payloads && !read_int4(&payload))
+                return false;
+            vartype_realmatrix *rm;
+            if (payload == -1)
+                rm = (vartype_realmatrix *) new_realmatrix(mp.rows, mp.columns);
+            else
+                rm = (vartype_realmatrix *) new_realmatrix_nodata(mp.rows, mp.columns);
             if (rm == NULL)
                 return false;
-            if (bin_dec_mode_switch()) {
+            rm->array->no_strings = false;
+            if (payload != -1) {
+                // The data will be filled in by unpersist_payloads()
                 int4 size = mp.rows * mp.columns;
-                #ifdef BCD_MATH
-                    int phsz = sizeof(double);
-                #else
-                    int phsz = sizeof(fake_bcd);
-                #endif
-                int4 tsz = size * phsz;
+                if (payload != payload_count
+                        || payload_add(rm->array, false, size) == -1
+                        || shell_read_saved_state(rm->array->is_string, size)
+                                != size) {
+                    free_vartype((vartype *) rm);
+                    return false;
+                }
+            } else if (bin_dec_mode_switch()) {
+                int4 size = mp.rows * mp.columns;
+                int4 tsz = size * FOREIGN_PHLOAT_SIZE;
                 char *temp = (char *) malloc(tsz);
                 if (temp == NULL) {
                     free_vartype((vartype *) rm);
@@ -1012,29 +1129,8 @@ static bool unpersist_vartype(vartype **v, bool padded) {
                     free_vartype((vartype *) rm);
                     return false;
                 }
-                #ifdef BCD_MATH
-                    for (int4 i = 0; i < size; i++) {
-                        if (rm->array->is_string[i]) {
-                            char *src = temp + i * phsz;
-                            char *dst = (char *) (rm->array->data + i);
-                            for (int j = 0; j < 7; j++)
-                                *dst++ = *src++;
-                        } else {
-                            rm->array->data[i] = ((double *) temp)[i];
-                        }
-                    }
-                #else
-                    for (int4 i = 0; i < size; i++) {
-                        if (rm->array->is_string[i]) {
-                            char *src = temp + i * phsz;
-                            char *dst = (char *) (rm->array->data + i);
-                            for (int j = 0; j < 7; j++)
-                                *dst++ = *src++;
-                        } else {
-                            rm->array->data[i] = decimal2double((char *) (temp + phsz * i));
-                        }
-                    }
-                #endif
+                convert_foreign_phloats(rm->array->data, temp, size,
+                                        rm->array->is_string);
                 free(temp);
             } else {
                 int4 size = mp.rows * mp.columns * sizeof(phloat);
@@ -1082,11 +1178,27 @@ static bool unpersist_vartype(vartype **v, bool padded) {
             bool shared = mp.rows < 0;
             if (shared)
                 mp.rows = -mp.rows;
-            vartype_complexmatrix *cm = (vartype_complexmatrix *)
-                                        new_complexmatrix(mp.rows, mp.columns);
+            int4 payload = -1;
+            if (state_has_payloads && !read_int4(&payload))
+                return false;
+            vartype_complexmatrix *cm;
+            if (payload == -1)
+                cm = (vartype_complexmatrix *)
+                                new_complexmatrix(mp.rows, mp.columns);
+            else
+                cm = (vartype_complexmatrix *)
+                                new_complexmatrix_nodata(mp.rows, mp.columns);
             if (cm == NULL)
                 return false;
-            if (bin_dec_mode_switch()) {
+            if (payload != -1) {
+                // The data will be filled in by unpersist_payloads()
+                if (payload != payload_count
+                        || payload_add(cm->array, true,
+                                       2 * mp.rows * mp.columns) == -1) {
+                    free_vartype((vartype *) cm);
+                    return false;
+                }
+            } else if (bin_dec_mode_switch()) {
                 int4 size = 2 * mp.rows * mp.columns;
                 for (int4 i = 0; i < size; i++)
                     if (!read_phloat(cm->array->data + i)) {
@@ -1122,6 +1234,125 @@ static bool unpersist_vartype(vartype **v, bool padded) {
     }
 }
 
+static bool persist_payloads() {
+    int4 start = shell_saved_state_position();
+    int4 table_end = start + (1 + 2 * payload_count) * sizeof(int4);
+    int4 pos = table_end;
+    int i;
+    if (!write_int4(payload_count))
+        return false;
+    for (i = 0; i < payload_count; i++) {
+        int4 length = payload_list[i].count * sizeof(phloat);
+        pos += (STATE_PAYLOAD_ALIGN - pos % STATE_PAYLOAD_ALIGN)
+                    % STATE_PAYLOAD_ALIGN;
+        if (!write_int4(pos - table_end))
+            return false;
+        if (!write_int4(length))
+            return false;
+        pos += length;
+    }
+    pos = table_end;
+    for (i = 0; i < payload_count; i++) {
+        payload_struct *p = payload_list + i;
+        int4 pad = (STATE_PAYLOAD_ALIGN - pos % STATE_PAYLOAD_ALIGN)
+                    % STATE_PAYLOAD_ALIGN;
+        if (pad > 0) {
+            char zeros[STATE_PAYLOAD_ALIGN];
+            memset(zeros, 0, pad);
+            if (!shell_write_saved_state(zeros, pad))
+                return false;
+        }
+        phloat *data = p->is_complex ? ((complexmatrix_data *) p->array)->data
+                                     : ((realmatrix_data *) p->array)->data;
+        int4 length = p->count * sizeof(phloat);
+        if (!shell_write_saved_state(data, length))
+            return false;
+        pos += pad + length;
+    }
+    return true;
+}
+
+static bool unpersist_payloads() {
+    int4 n;
+    if (!read_int4(&n))
+        return false;
+    if (n != payload_count)
+        return false;
+    int4 *table = (int4 *) malloc(2 * n * sizeof(int4) + 1);
+    if (table == NULL)
+        return false;
+    bool ret = false;
+    int4 pos = 0;
+    if (shell_read_saved_state(table, 2 * n * sizeof(int4))
+            != (int4) (2 * n * sizeof(int4)))
+        goto done;
+
+    for (int i = 0; i < n; i++) {
+        payload_struct *p = payload_list + i;
+        int4 offset = table[2 * i];
+        int4 length = table[2 * i + 1];
+        int4 size = p->count * sizeof(phloat);
+        phloat *data;
+        char *is_string = p->is_complex ? NULL
+                                : ((realmatrix_data *) p->array)->is_string;
+        if (offset < pos)
+            goto done;
+        if (length != (bin_dec_mode_switch() ? p->count * FOREIGN_PHLOAT_SIZE
+                                             : size))
+            goto done;
+
+        data = NULL;
+        if (!bin_dec_mode_switch()) {
+            data = (phloat *) shell_map_saved_state(offset - pos, length);
+            if (data != NULL && !register_mapped_data(data, length)) {
+                shell_unmap_saved_state(data, length);
+                data = NULL;
+            }
+        }
+        if (data == NULL) {
+            // Not mapped; skip to the payload and read it
+            while (pos < offset) {
+                char dummy[1024];
+                int4 count = offset - pos;
+                if (count > 1024)
+                    count = 1024;
+                if (shell_read_saved_state(dummy, count) != count)
+                    goto done;
+                pos += count;
+            }
+            data = (phloat *) malloc(size);
+            if (data == NULL)
+                goto done;
+            if (bin_dec_mode_switch()) {
+                char *temp = (char *) malloc(length);
+                if (temp == NULL
+                        || shell_read_saved_state(temp, length) != length) {
+                    free(temp);
+                    free(data);
+                    goto done;
+                }
+                convert_foreign_phloats(data, temp, p->count, is_string);
+                free(temp);
+            } else {
+                if (shell_read_saved_state(data, length) != length) {
+                    free(data);
+                    goto done;
+                }
+            }
+            pos += length;
+        }
+        if (p->is_complex)
+            ((complexmatrix_data *) p->array)->data = data;
+        else
+            ((realmatrix_data *) p->array)->data = data;
+    }
+    ret = true;
+
+    done:
+    free(table);
+    return ret;
+}
+
 static bool persist_globals() {
     int i;
     array_count = 0;
@@ -1300,8 +1531,10 @@ static bool unpersist_globals(int4 ver) {
             goto done;
         }
     vars_capacity = vars_count;
-    for (i = 0; i < vars_count; i++)
+    for (i = 0; i < vars_count; i++) {
         vars[i].value = NULL;
+        vars[i].hashed = false;
+    }
     for (i = 0; i < vars_count; i++)
         if (!unpersist_vartype(&vars[i].value, padded)) {
             purge_all_vars();
@@ -1333,6 +1566,12 @@ static bool unpersist_globals(int4 ver) {
         prgms[i].capacity = prgms[i].size;
         prgms[i].text = (unsigned char *) malloc(prgms[i].size);
         // TODO - handle memory allocation failure
+        prgms[i].decoded = NULL;
+        prgms[i].decoded_index = NULL;
+        prgms[i].lclbl_table = NULL;
+        prgms[i].line_index = NULL;
+        prgms[i].hp42s_length = -1;
+        prgms[i].text_hashed = false;
     }
     for (i = 0; i < prgms_count; i++) {
         if (shell_read_saved_state(prgms[i].text, prgms[i].size)
@@ -1413,6 +1652,7 @@ static bool unpersist_globals(int4 ver) {
     ret = true;
 
     done:
+    rebuild_var_index();
     free(array_list);
     return ret;
 }
@@ -1420,9 +1660,11 @@ static bool unpersist_globals(int4 ver) {
 void clear_all_prgms() {
     if (prgms != NULL) {
         int i;
-        for (i = 0; i < prgms_count; i++)
+        for (i = 0; i < prgms_count; i++) {
             if (prgms[i].text != NULL)
                 free(prgms[i].text);
+            discard_caches(prgms + i);
+        }
         free(prgms);
     }
     prgms = NULL;
@@ -1433,6 +1675,7 @@ void clear_all_prgms() {
     labels = NULL;
     labels_capacity = 0;
     labels_count = 0;
+    invalidate_label_index();
 }
 
 int clear_prgm(const arg_struct *arg) {
@@ -1468,6 +1711,7 @@ int clear_prgm_by_index(int prgm_index) {
     else if (current_prgm > prgm_index)
         current_prgm--;
     free(prgms[prgm_index].text);
+    discard_caches(prgms + prgm_index);
     for (i = prgm_index; i < prgms_count - 1; i++)
         prgms[i] = prgms[i + 1];
     prgms_count--;
@@ -1483,6 +1727,7 @@ int clear_prgm_by_index(int prgm_index) {
             i++;
     }
     labels_count = i;
+    invalidate_label_index();
     if (prgms_count == 0 || prgm_index == prgms_count) {
         int saved_prgm = current_prgm;
         int saved_pc = pc;
@@ -1532,6 +1777,7 @@ void clear_prgm_lines(int4 count) {
             i++;
     }
     labels_count = i;
+    invalidate_label_index();
 
     invalidate_lclbls(current_prgm);
     clear_all_rtns();
@@ -1567,6 +1813,12 @@ void goto_dot_dot() {
     prgms[current_prgm].size = 0;
     prgms[current_prgm].lclbl_invalid = 1;
     prgms[current_prgm].text = NULL;
+    prgms[current_prgm].decoded = NULL;
+    prgms[current_prgm].decoded_index = NULL;
+    prgms[current_prgm].lclbl_table = NULL;
+    prgms[current_prgm].line_index = NULL;
+    prgms[current_prgm].hp42s_length = -1;
+    prgms[current_prgm].text_hashed = false;
     command = CMD_END;
     arg.type = ARGTYPE_NONE;
     store_command(0, command, &arg);
@@ -1721,15 +1973,124 @@ void get_next_command(int4 *pc, int *command, arg_struct *arg, int find_target){
     }
 }
 
+static void discard_caches(prgm_struct *prgm) {
+    prgm->text_hashed = false;
+    if (prgm->decoded != NULL) {
+        free(prgm->decoded);
+        free(prgm->decoded_index);
+        prgm->decoded = NULL;
+        prgm->decoded_index = NULL;
+    }
+    if (prgm->lclbl_table != NULL) {
+        free(prgm->lclbl_table);
+        prgm->lclbl_table = NULL;
+    }
+    if (prgm->line_index != NULL) {
+        free(prgm->line_index);
+        prgm->line_index = NULL;
+    }
+    prgm->hp42s_length = -1;
+}
+
+static bool decode_current_prgm() {
+    /* Decodes the entire current program into an array of decoded_command,
+     * plus an index that maps each pc to its entry in that array (or -1 if
+     * the pc is not at the start of a command). This is done once, the
+     * first time the program is run after it was changed, so continue_running()
+     * does not have to unpack the same instructions over and over again.
+     * Local label targets are not searched for here; that still happens
+     * lazily, in get_next_decoded_command().
+     */
+    prgm_struct *prgm = prgms + current_prgm;
+    int4 count = 0;
+    int4 pc2 = 0;
+    while (pc2 < prgm->size) {
+        pc2 += get_command_length(current_prgm, pc2);
+        count++;
+    }
+    decoded_command *dec = (decoded_command *)
+                            malloc(count * sizeof(decoded_command));
+    int4 *index = (int4 *) malloc(prgm->size * sizeof(int4));
+    if (dec == NULL || index == NULL) {
+        free(dec);
+        free(index);
+        return false;
+    }
+    int4 i = 0;
+    pc2 = 0;
+    while (pc2 < prgm->size) {
+        decoded_command *dc = dec + i;
+        int4 start = pc2;
+        get_next_command(&pc2, &dc->cmd, &dc->arg, 0);
+        if ((dc->cmd == CMD_GTO || dc->cmd == CMD_XEQ)
+                && (dc->arg.type == ARGTYPE_NUM
+                    || dc->arg.type == ARGTYPE_LCLBL)) {
+            int4 target = 0;
+            for (int j = 2; j < 6; j++)
+                target = (target << 8) | prgm->text[start + j];
+            dc->arg.target = target;
+        }
+        dc->next_pc = pc2;
+        index[start] = i++;
+        while (++start < pc2)
+            index[start] = -1;
+    }
+    prgm->decoded = dec;
+    prgm->decoded_index = index;
+    return true;
+}
+
+void get_next_decoded_command(int4 *pc, int *command, arg_struct *arg) {
+    /* Equivalent to get_next_command(pc, command, arg, 1), but using the
+     * decoded form of the current program; for use by the program run loop.
+     */
+    prgm_struct *prgm = prgms + current_prgm;
+    if ((prgm->decoded == NULL && !decode_current_prgm())
+            || prgm->decoded_index[*pc] == -1) {
+        get_next_command(pc, command, arg, 1);
+        return;
+    }
+    decoded_command *dc = prgm->decoded + prgm->decoded_index[*pc];
+    if (dc->arg.target == -1 && (dc->cmd == CMD_GTO || dc->cmd == CMD_XEQ)
+            && (dc->arg.type == ARGTYPE_NUM || dc->arg.type == ARGTYPE_LCLBL)) {
+        /* Target not known yet; this looks it up, and stores it in the
+         * program text as well as in our decoded copy.
+         */
+        int4 pc2 = *pc;
+        get_next_command(&pc2, &dc->cmd, &dc->arg, 1);
+    }
+    *command = dc->cmd;
+    *arg = dc->arg;
+    *pc = dc->next_pc;
+}
+
+/* Set when the label table could not be grown to hold a new label, so that
+ * it is missing entries. The incremental updates still keep the remaining
+ * entries right; the table is rebuilt before the next edit, or the next
+ * global label lookup, and stays stale until that succeeds.
+ */
+static bool labels_stale = false;
+
+static bool grow_label_table() {
+    label_struct *newlabels = (label_struct *)
+            realloc(labels, (labels_capacity + 50) * sizeof(label_struct));
+    if (newlabels == NULL)
+        return false;
+    labels = newlabels;
+    labels_capacity += 50;
+    return true;
+}
+
 void rebuild_label_table() {
-    /* TODO -- this is *not* efficient; inserting and deleting ENDs and
-     * global LBLs should not cause every single program to get rescanned!
-     * But, I don't feel like dealing with that at the moment, so just
-     * this ugly brute force approach for now.
+    /* Scans all programs and builds the label table from scratch. This is
+     * only needed after loading or importing programs; when programs are
+     * edited, store_command() and delete_command() update the table
+     * incrementally.
      */
     int prgm_index;
     int4 pc;
     labels_count = 0;
+    labels_stale = false;
     for (prgm_index = 0; prgm_index < prgms_count; prgm_index++) {
         prgm_struct *prgm = prgms + prgm_index;
         pc = 0;
@@ -1742,18 +2103,9 @@ void rebuild_label_table() {
             if (command == CMD_END
                         || (command == CMD_LBL && argtype == ARGTYPE_STR)) {
                 label_struct *newlabel;
-                if (labels_count == labels_capacity) {
-                    label_struct *newlabels;
-                    int i;
-                    labels_capacity += 50;
-                    newlabels = (label_struct *)
-                                malloc(labels_capacity * sizeof(label_struct));
-                    // TODO - handle memory allocation failure
-                    for (i = 0; i < labels_count; i++)
-                        newlabels[i] = labels[i];
-                    if (labels != NULL)
-                        free(labels);
-                    labels = newlabels;
+                if (labels_count == labels_capacity && !grow_label_table()) {
+                    labels_stale = true;
+                    goto done;
                 }
                 newlabel = labels + labels_count++;
                 if (command == CMD_END)
@@ -1770,6 +2122,8 @@ void rebuild_label_table() {
             pc += get_command_length(prgm_index, pc);
         }
     }
+    done:
+    invalidate_label_index();
 }
 
 static void update_label_table(int prgm, int4 pc, int inserted) {
@@ -1782,8 +2136,140 @@ static void update_label_table(int prgm, int4 pc, int inserted) {
     }
 }
 
+/* The label table is ordered by program and pc; this finds the position of
+ * the first entry that is at or after the given location.
+ */
+static int label_position(int prgm, int4 pc) {
+    int lo = 0, hi = labels_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (labels[mid].prgm < prgm
+                || labels[mid].prgm == prgm && labels[mid].pc < pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void insert_label(int prgm, int4 pc, const char *name, int length) {
+    int pos = label_position(prgm, pc);
+    int i;
+    if (labels_count == labels_capacity && !grow_label_table()) {
+        /* Leave the table as it is; see labels_stale */
+        labels_stale = true;
+        invalidate_label_index();
+        return;
+    }
+    for (i = labels_count; i > pos; i--)
+        labels[i] = labels[i - 1];
+    labels_count++;
+    labels[pos].length = length;
+    for (i = 0; i < length; i++)
+        labels[pos].name[i] = name[i];
+    labels[pos].prgm = prgm;
+    labels[pos].pc = pc;
+    invalidate_label_index();
+}
+
+static void remove_label(int prgm, int4 pc) {
+    int pos = label_position(prgm, pc);
+    int i;
+    if (pos == labels_count || labels[pos].prgm != prgm
+            || labels[pos].pc != pc)
+        return;
+    labels_count--;
+    for (i = pos; i < labels_count; i++)
+        labels[i] = labels[i + 1];
+    invalidate_label_index();
+}
+
+/* Called when an END is inserted at 'pc' in program 'prgm', so the labels
+ * at or after 'pc' now belong to the new program following it. The entry for
+ * the new END itself is not added here.
+ */
+static void split_label_table(int prgm, int4 pc) {
+    int i;
+    for (i = labels_count - 1; i >= 0; i--) {
+        if (labels[i].prgm > prgm)
+            labels[i].prgm++;
+        else if (labels[i].prgm == prgm && labels[i].pc >= pc) {
+            labels[i].prgm++;
+            labels[i].pc -= pc;
+        } else
+            break;
+    }
+}
+
+/* Called when the END of program 'prgm' has been removed, and the program
+ * following it appended to it, at 'offset'. The entry for the removed END
+ * must already be gone.
+ */
+static void merge_label_table(int prgm, int4 offset) {
+    int i;
+    for (i = labels_count - 1; i >= 0; i--) {
+        if (labels[i].prgm > prgm + 1)
+            labels[i].prgm--;
+        else if (labels[i].prgm == prgm + 1) {
+            labels[i].prgm--;
+            labels[i].pc += offset;
+        } else
+            break;
+    }
+}
+
+/* Hash index over the global labels, used by find_global_label(). Each slot
+ * holds an index into 'labels', or -1 if it is empty; collisions are
+ * resolved by linear probing. Since label indexes shift whenever a label is
+ * added or removed, the index is not updated in place; anything that changes
+ * the label table just marks it invalid, and find_global_label() rebuilds it
+ * when it is next needed.
+ */
+
+static int *label_index = NULL;
+static int label_index_size = 0;
+static bool label_index_valid = false;
+
+static void invalidate_label_index() {
+    label_index_valid = false;
+}
+
+static bool rebuild_label_index() {
+    int size = 16;
+    int i;
+    while (size < labels_count * 2)
+        size <<= 1;
+    if (size != label_index_size) {
+        free(label_index);
+        label_index = (int *) malloc(size * sizeof(int));
+        if (label_index == NULL) {
+            label_index_size = 0;
+            return false;
+        }
+        label_index_size = size;
+    }
+    for (i = 0; i < label_index_size; i++)
+        label_index[i] = -1;
+    for (i = 0; i < labels_count; i++) {
+        int mask = label_index_size - 1;
+        int h;
+        if (labels[i].length == 0)
+            continue;
+        h = string_hash(labels[i].name, labels[i].length) & mask;
+        while (label_index[h] != -1)
+            h = (h + 1) & mask;
+        label_index[h] = i;
+    }
+    label_index_valid = true;
+    return true;
+}
+
 static void invalidate_lclbls(int prgm_index) {
     prgm_struct *prgm = prgms + prgm_index;
+    /* Every change to a program's text ends up here, so this is also where
+     * we throw away its decoded form, local label table, and line index.
+     */
+    discard_caches(prgm);
     if (!prgm->lclbl_invalid) {
         int4 pc2 = 0;
         while (pc2 < prgm->size) {
@@ -1817,6 +2303,14 @@ void delete_command(int4 pc) {
     command |= (argtype & 240) << 4;
     argtype &= 15;
 
+    if (labels_stale)
+        rebuild_label_table();
+
+    /* Drop the caches right away, rather than waiting for invalidate_lclbls(),
+     * in case anything looks at the program while it is being changed.
+     */
+    discard_caches(prgm);
+
     if (command == CMD_END) {
         int4 newsize;
         prgm_struct *nextprgm;
@@ -1825,6 +2319,8 @@ void delete_command(int4 pc) {
             return;
         nextprgm = prgm + 1;
         prgm->size -= 2;
+        remove_label(current_prgm, prgm->size);
+        merge_label_table(current_prgm, prgm->size);
         newsize = prgm->size + nextprgm->size;
         if (newsize > prgm->capacity) {
             int4 newcapacity = (newsize + 511) & ~511;
@@ -1839,10 +2335,10 @@ void delete_command(int4 pc) {
         for (pos = 0; pos < nextprgm->size; pos++)
             prgm->text[prgm->size++] = nextprgm->text[pos];
         free(nextprgm->text);
+        discard_caches(nextprgm);
         for (pos = current_prgm + 1; pos < prgms_count - 1; pos++)
             prgms[pos] = prgms[pos + 1];
         prgms_count--;
-        rebuild_label_table();
         invalidate_lclbls(current_prgm);
         clear_all_rtns();
         draw_varmenu();
@@ -1853,24 +2349,20 @@ void delete_command(int4 pc) {
         prgm->text[pos] = prgm->text[pos + length];
     prgm->size -= length;
     if (command == CMD_LBL && argtype == ARGTYPE_STR)
-        rebuild_label_table();
-    else
-        update_label_table(current_prgm, pc, -length);
+        remove_label(current_prgm, pc);
+    update_label_table(current_prgm, pc, -length);
     invalidate_lclbls(current_prgm);
     clear_all_rtns();
     draw_varmenu();
 }
 
-void store_command(int4 pc, int command, arg_struct *arg) {
-    unsigned char buf[100];
+int encode_command(int command, arg_struct *arg, unsigned char *buf) {
+    /* Encodes a command in the program text format, and returns its length,
+     * which is at most MAX_COMMAND_LENGTH. Local GTO and XEQ targets are
+     * written as 'unknown'.
+     */
     int bufptr = 0;
     int i;
-    int4 pos;
-    prgm_struct *prgm = prgms + current_prgm;
-
-    /* We should never be called with pc = -1, but just to be safe... */
-    if (pc == -1)
-        pc = 0;
 
     if (arg->type == ARGTYPE_NUM && arg->val.num < 0) {
         arg->type = ARGTYPE_NEG_NUM;
@@ -1901,6 +2393,73 @@ void store_command(int4 pc, int command, arg_struct *arg) {
     buf[bufptr++] = command & 255;
     buf[bufptr++] = arg->type | ((command & ~255) >> 4);
 
+    if ((command == CMD_GTO || command == CMD_XEQ)
+            && (arg->type == ARGTYPE_NUM || arg->type == ARGTYPE_LCLBL))
+        for (i = 0; i < 4; i++)
+            buf[bufptr++] = 255;
+    switch (arg->type) {
+        case ARGTYPE_NUM:
+        case ARGTYPE_NEG_NUM:
+        case ARGTYPE_IND_NUM: {
+            int4 num = arg->val.num;
+            char tmpbuf[5];
+            int tmplen = 0;
+            while (num > 127) {
+                tmpbuf[tmplen++] = num & 127;
+                num >>= 7;
+            }
+            tmpbuf[tmplen++] = num;
+            tmpbuf[0] |= 128;
+            while (--tmplen >= 0)
+                buf[bufptr++] = tmpbuf[tmplen];
+            break;
+        }
+        case ARGTYPE_STK:
+        case ARGTYPE_IND_STK:
+            buf[bufptr++] = arg->val.stk;
+            break;
+        case ARGTYPE_STR:
+        case ARGTYPE_IND_STR: {
+            buf[bufptr++] = arg->length;
+            for (i = 0; i < arg->length; i++)
+                buf[bufptr++] = arg->val.text[i];
+            break;
+        }
+        case ARGTYPE_LCLBL:
+            buf[bufptr++] = arg->val.lclbl;
+            break;
+        case ARGTYPE_DOUBLE: {
+            unsigned char *b = (unsigned char *) &arg->val_d;
+            for (int i = 0; i < (int) sizeof(phloat); i++)
+                buf[bufptr++] = *b++;
+            break;
+        }
+    }
+
+    return bufptr;
+}
+
+void store_command(int4 pc, int command, arg_struct *arg) {
+    unsigned char buf[MAX_COMMAND_LENGTH];
+    int bufptr;
+    int i;
+    int4 pos;
+    prgm_struct *prgm = prgms + current_prgm;
+
+    /* We should never be called with pc = -1, but just to be safe... */
+    if (pc == -1)
+        pc = 0;
+
+    if (labels_stale)
+        rebuild_label_table();
+
+    /* Drop the caches right away, rather than waiting for invalidate_lclbls();
+     * print_program_line() may look at the program before we get there.
+     */
+    discard_caches(prgm);
+
+    bufptr = encode_command(command, arg, buf);
+
     /* If the program is nonempty, it must already contain an END,
      * since that's the very first thing that gets stored in any new
      * program. In this case, we need to split the program.
@@ -1931,6 +2490,12 @@ void store_command(int4 pc, int command, arg_struct *arg) {
         new_prgm->capacity = (new_prgm->size + 511) & ~511;
         new_prgm->text = (unsigned char *) malloc(new_prgm->capacity);
         // TODO - handle memory allocation failure
+        new_prgm->decoded = NULL;
+        new_prgm->decoded_index = NULL;
+        new_prgm->lclbl_table = NULL;
+        new_prgm->line_index = NULL;
+        new_prgm->hp42s_length = -1;
+        new_prgm->text_hashed = false;
         for (i = pc; i < prgm->size; i++)
             new_prgm->text[i - pc] = prgm->text[i];
         current_prgm++;
@@ -1946,7 +2511,8 @@ void store_command(int4 pc, int command, arg_struct *arg) {
         if (flags.f.trace_print || flags.f.normal_print)
             print_program_line(current_prgm - 1, pc);
 
-        rebuild_label_table();
+        split_label_table(current_prgm - 1, pc);
+        insert_label(current_prgm - 1, pc, NULL, 0);
         invalidate_lclbls(current_prgm);
         invalidate_lclbls(current_prgm - 1);
         clear_all_rtns();
@@ -1954,49 +2520,6 @@ void store_command(int4 pc, int command, arg_struct *arg) {
         return;
     }
 
-    if ((command == CMD_GTO || command == CMD_XEQ)
-            && (arg->type == ARGTYPE_NUM || arg->type == ARGTYPE_LCLBL))
-        for (i = 0; i < 4; i++)
-            buf[bufptr++] = 255;
-    switch (arg->type) {
-        case ARGTYPE_NUM:
-        case ARGTYPE_NEG_NUM:
-        case ARGTYPE_IND_NUM: {
-            int4 num = arg->val.num;
-            char tmpbuf[5];
-            int tmplen = 0;
-            while (num > 127) {
-                tmpbuf[tmplen++] = num & 127;
-                num >>= 7;
-            }
-            tmpbuf[tmplen++] = num;
-            tmpbuf[0] |= 128;
-            while (--tmplen >= 0)
-                buf[bufptr++] = tmpbuf[tmplen];
-            break;
-        }
-        case ARGTYPE_STK:
-        case ARGTYPE_IND_STK:
-            buf[bufptr++] = arg->val.stk;
-            break;
-        case ARGTYPE_STR:
-        case ARGTYPE_IND_STR: {
-            buf[bufptr++] = arg->length;
-            for (i = 0; i < arg->length; i++)
-                buf[bufptr++] = arg->val.text[i];
-            break;
-        }
-        case ARGTYPE_LCLBL:
-            buf[bufptr++] = arg->val.lclbl;
-            break;
-        case ARGTYPE_DOUBLE: {
-            unsigned char *b = (unsigned char *) &arg->val_d;
-            for (int i = 0; i < (int) sizeof(phloat); i++)
-                buf[bufptr++] = *b++;
-            break;
-        }
-    }
-
     if (bufptr + prgm->size > prgm->capacity) {
         unsigned char *newtext;
         prgm->capacity += 512;
@@ -2019,11 +2542,11 @@ void store_command(int4 pc, int command, arg_struct *arg) {
     if (command != CMD_END && (flags.f.trace_print || flags.f.normal_print))
         print_program_line(current_prgm, pc);
     
-    if (command == CMD_END ||
-            (command == CMD_LBL && arg->type == ARGTYPE_STR))
-        rebuild_label_table();
-    else
-        update_label_table(current_prgm, pc, bufptr);
+    update_label_table(current_prgm, pc, bufptr);
+    if (command == CMD_END)
+        insert_label(current_prgm, pc, NULL, 0);
+    else if (command == CMD_LBL && arg->type == ARGTYPE_STR)
+        insert_label(current_prgm, pc, arg->val.text, arg->length);
     invalidate_lclbls(current_prgm);
     clear_all_rtns();
     draw_varmenu();
@@ -2037,11 +2560,93 @@ void store_command_after(int4 *pc, int command, arg_struct *arg) {
     store_command(*pc, command, arg);
 }
 
+bool append_program(const unsigned char *text, int4 size) {
+    /* Appends a new program after the last one, consisting of 'size' bytes
+     * of text produced by encode_command(), followed by an END. This does the
+     * same as goto_dot_dot() followed by a store_command_after() for every
+     * command, but copies the text in one go, and doesn't insert the global
+     * labels it contains; core_import_programs() uses it, and calls
+     * rebuild_label_table() once it has appended everything.
+     */
+    prgm_struct *prgm;
+    int4 newsize = size + 2;
+    goto_dot_dot();
+    prgm = prgms + current_prgm;
+    if (newsize > prgm->capacity) {
+        int4 newcapacity = (newsize + 511) & ~511;
+        unsigned char *newtext = (unsigned char *)
+                                    realloc(prgm->text, newcapacity);
+        if (newtext == NULL)
+            return false;
+        prgm->text = newtext;
+        prgm->capacity = newcapacity;
+    }
+    /* The program is empty, so all it contains at this point is its END */
+    memmove(prgm->text + size, prgm->text, 2);
+    memcpy(prgm->text, text, size);
+    prgm->size = newsize;
+    update_label_table(current_prgm, 0, size);
+    invalidate_lclbls(current_prgm);
+    build_lclbl_table();
+    clear_all_rtns();
+    return true;
+}
+
+static bool build_line_index() {
+    /* Builds the table of line start offsets for the current program, so
+     * pc_line_convert() can do a binary search instead of walking the
+     * program. Entry i is the pc of line i + 1; the last entry is the END.
+     */
+    prgm_struct *prgm = prgms + current_prgm;
+    int4 count = 0;
+    int4 pc2 = 0;
+    int4 *index;
+    while (1) {
+        count++;
+        if (prgm->text[pc2] == CMD_END)
+            break;
+        pc2 += get_command_length(current_prgm, pc2);
+    }
+    index = (int4 *) malloc(count * sizeof(int4));
+    if (index == NULL)
+        return false;
+    pc2 = 0;
+    for (int4 i = 0; i < count; i++) {
+        index[i] = pc2;
+        if (i < count - 1)
+            pc2 += get_command_length(current_prgm, pc2);
+    }
+    prgm->line_index = index;
+    prgm->line_count = count;
+    return true;
+}
+
 static int pc_line_convert(int4 loc, int loc_is_pc) {
     int4 pc = 0;
     int4 line = 1;
     prgm_struct *prgm = prgms + current_prgm;
 
+    if (prgm->line_index != NULL || build_line_index()) {
+        int4 n = prgm->line_count;
+        if (loc_is_pc) {
+            int4 lo = 0, hi = n - 1;
+            while (lo < hi) {
+                int4 mid = (lo + hi) / 2;
+                if (prgm->line_index[mid] < loc)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            return lo + 1;
+        } else {
+            if (loc < 1)
+                loc = 1;
+            else if (loc > n)
+                loc = n;
+            return prgm->line_index[loc - 1];
+        }
+    }
+
     while (1) {
         if (loc_is_pc) {
             if (pc >= loc)
@@ -2071,6 +2676,75 @@ int4 line2pc(int4 line) {
         return pc_line_convert(line, 0);
 }
 
+static int4 lclbl_key(int argtype, int4 num, char lclbl) {
+    if (argtype == ARGTYPE_NUM)
+        return num;
+    else
+        return 0x10000 + (unsigned char) lclbl;
+}
+
+static int lclbl_compare(const void *a, const void *b) {
+    const lclbl_entry *e1 = (const lclbl_entry *) a;
+    const lclbl_entry *e2 = (const lclbl_entry *) b;
+    if (e1->key != e2->key)
+        return e1->key < e2->key ? -1 : 1;
+    else
+        return e1->pc < e2->pc ? -1 : e1->pc > e2->pc ? 1 : 0;
+}
+
+static bool build_lclbl_table() {
+    /* Collects all the numeric and single-letter local labels in the current
+     * program, sorted by label and then by pc, so find_local_label() can
+     * use a binary search instead of walking the program.
+     */
+    prgm_struct *prgm = prgms + current_prgm;
+    int4 count = 0;
+    int4 pc2 = 0;
+    lclbl_entry *table;
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            /* Always allocate at least one entry, so that an empty table can
+             * be told apart from no table at all.
+             */
+            table = (lclbl_entry *) malloc((count + 1) * sizeof(lclbl_entry));
+            if (table == NULL)
+                return false;
+            count = 0;
+            pc2 = 0;
+        }
+        while (pc2 < prgm->size) {
+            int command = prgm->text[pc2];
+            int argtype = prgm->text[pc2 + 1];
+            command |= (argtype & 240) << 4;
+            argtype &= 15;
+            if (command == CMD_LBL && (argtype == ARGTYPE_NUM
+                                    || argtype == ARGTYPE_LCLBL)) {
+                if (pass == 1) {
+                    int4 num = 0;
+                    if (argtype == ARGTYPE_NUM) {
+                        unsigned char c;
+                        int4 pos = pc2 + 2;
+                        do {
+                            c = prgm->text[pos++];
+                            num = (num << 7) | (c & 127);
+                        } while ((c & 128) == 0);
+                    }
+                    table[count].key = lclbl_key(argtype, num,
+                                                 prgm->text[pc2 + 2]);
+                    table[count].pc = pc2;
+                }
+                count++;
+            }
+            pc2 += get_command_length(current_prgm, pc2);
+        }
+    }
+    qsort(table, count, sizeof(lclbl_entry), lclbl_compare);
+    prgm->lclbl_table = table;
+    prgm->lclbl_count = count;
+    return true;
+}
+
 int4 find_local_label(const arg_struct *arg) {
     int4 orig_pc = pc;
     int4 search_pc;
@@ -2079,8 +2753,41 @@ int4 find_local_label(const arg_struct *arg) {
 
     if (orig_pc == -1)
         orig_pc = 0;
-    search_pc = orig_pc;
 
+    if (prgm->lclbl_table != NULL || build_lclbl_table()) {
+        /* The search starts at the current pc and wraps around to the top
+         * of the program, so we want the first occurrence of the label at or
+         * after orig_pc, or, failing that, the first one overall.
+         */
+        int4 key = lclbl_key(arg->type, arg->val.num, arg->val.lclbl);
+        int4 lo = 0, hi = prgm->lclbl_count;
+        int4 first;
+        while (lo < hi) {
+            int4 mid = (lo + hi) / 2;
+            if (prgm->lclbl_table[mid].key < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        first = lo;
+        if (first == prgm->lclbl_count || prgm->lclbl_table[first].key != key)
+            return -2;
+        hi = prgm->lclbl_count;
+        while (lo < hi) {
+            int4 mid = (lo + hi) / 2;
+            if (prgm->lclbl_table[mid].key == key
+                    && prgm->lclbl_table[mid].pc < orig_pc)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < prgm->lclbl_count && prgm->lclbl_table[lo].key == key)
+            return prgm->lclbl_table[lo].pc;
+        else
+            return prgm->lclbl_table[first].pc;
+    }
+
+    search_pc = orig_pc;
     while (!wrapped || search_pc < orig_pc) {
         int command, argtype;
         if (search_pc >= prgm->size - 2) {
@@ -2120,6 +2827,27 @@ int find_global_label(const arg_struct *arg, int *prgm, int4 *pc) {
     int i;
     const char *name = arg->val.text;
     int namelen = arg->length;
+    if (labels_stale)
+        rebuild_label_table();
+    if (namelen > 0 && (label_index_valid || rebuild_label_index())) {
+        /* If a label occurs more than once, the last one wins, just like
+         * with the linear search below.
+         */
+        int mask = label_index_size - 1;
+        int h = string_hash(name, namelen) & mask;
+        int found = -1;
+        while ((i = label_index[h]) != -1) {
+            if (i > found && string_equals(labels[i].name, labels[i].length,
+                                           name, namelen))
+                found = i;
+            h = (h + 1) & mask;
+        }
+        if (found == -1)
+            return 0;
+        *prgm = labels[found].prgm;
+        *pc = labels[found].pc;
+        return 1;
+    }
     for (i = labels_count - 1; i >= 0; i--) {
         int j;
         char *labelname;
@@ -2190,19 +2918,19 @@ void unwind_stack_until_solve() {
     while (rtn_prgm[--rtn_sp] != -2);
 }
 
-static bool read_int(int *n) {
+bool read_int(int *n) {
     return shell_read_saved_state(n, sizeof(int)) == sizeof(int);
 }
 
-static bool write_int(int n) {
+bool write_int(int n) {
     return shell_write_saved_state(&n, sizeof(int));
 }
 
-static bool read_int4(int4 *n) {
+bool read_int4(int4 *n) {
     return shell_read_saved_state(n, sizeof(int4)) == sizeof(int4);
 }
 
-static bool write_int4(int4 n) {
+bool write_int4(int4 n) {
     return shell_write_saved_state(&n, sizeof(int4));
 }
 
@@ -2262,6 +2990,8 @@ bool load_state(int4 ver) {
      */
 
     state_bool_is_int = ver < 9;
+    state_has_payloads = ver >= 20;
+    payload_count = 0;
 
     if (ver < 9) {
         state_file_number_format = NUMBER_FORMAT_BINARY;
@@ -2331,6 +3061,10 @@ bool load_state(int4 ver) {
         if (!read_bool(&core_settings.enable_ext_heading)) return false;
         if (!read_bool(&core_settings.enable_ext_time)) return false;
     }
+    if (ver < 19)
+        core_settings.matrix_fastbinary = false;
+    else
+        if (!read_bool(&core_settings.matrix_fastbinary)) return false;
     #if defined (FREE42_FPTEST)
         core_settings.enable_ext_fptest = true;
     #else
@@ -2453,6 +3187,11 @@ bool load_state(int4 ver) {
         return false;
 #endif
 
+    if (ver < 21)
+        journal_id = shell_milliseconds();
+    else
+        if (!read_int4(&journal_id)) return false;
+
     if (!read_int4(&magic)) return false;
     if (magic != FREE42_MAGIC)
         return false;
@@ -2460,104 +3199,776 @@ bool load_state(int4 ver) {
     if (version != ver)
         return false;
 
+    if (state_has_payloads && !unpersist_payloads())
+        return false;
+
     return true;
 }
 
-void save_state() {
+bool save_state() {
     /* The shell has written the initial magic and version numbers,
      * and the shell state, before we got called.
      */
 
+    state_has_payloads = true;
+    payload_count = 0;
+
     #ifdef BCD_MATH
-        if (!write_bool(true)) return;
+        if (!write_bool(true)) return false;
     #else
-        if (!write_bool(false)) return;
+        if (!write_bool(false)) return false;
     #endif
-    if (!write_bool(core_settings.matrix_singularmatrix)) return;
-    if (!write_bool(core_settings.matrix_outofrange)) return;
-    if (!write_bool(core_settings.raw_text)) return;
-    if (!write_bool(core_settings.auto_repeat)) return;
-    if (!write_bool(core_settings.enable_ext_copan)) return;
-    if (!write_bool(core_settings.enable_ext_bigstack)) return;
-    if (!write_bool(core_settings.enable_ext_accel)) return;
-    if (!write_bool(core_settings.enable_ext_locat)) return;
-    if (!write_bool(core_settings.enable_ext_heading)) return;
-    if (!write_bool(core_settings.enable_ext_time)) return;
-    if (!write_bool(mode_clall)) return;
-    if (!write_bool(mode_command_entry)) return;
-    if (!write_bool(mode_number_entry)) return;
-    if (!write_bool(mode_alpha_entry)) return;
-    if (!write_bool(mode_shift)) return;
-    if (!write_int(mode_appmenu)) return;
-    if (!write_int(mode_plainmenu)) return;
-    if (!write_bool(mode_plainmenu_sticky)) return;
-    if (!write_int(mode_transientmenu)) return;
-    if (!write_int(mode_alphamenu)) return;
-    if (!write_int(mode_commandmenu)) return;
-    if (!write_bool(mode_running)) return;
-    if (!write_bool(mode_varmenu)) return;
-    if (!write_bool(mode_updown)) return;
-    if (!write_bool(mode_getkey)) return;
-
-    if (!write_phloat(entered_number)) return;
-    if (!write_int(entered_string_length)) return;
-    if (!shell_write_saved_state(entered_string, 15)) return;
-
-    if (!write_int(pending_command)) return;
-    if (!write_arg(&pending_command_arg)) return;
-    if (!write_int(xeq_invisible)) return;
-
-    if (!write_int(incomplete_command)) return;
-    if (!write_int(incomplete_ind)) return;
-    if (!write_int(incomplete_alpha)) return;
-    if (!write_int(incomplete_length)) return;
-    if (!write_int(incomplete_maxdigits)) return;
-    if (!write_int(incomplete_argtype)) return;
-    if (!write_int(incomplete_num)) return;
-    if (!shell_write_saved_state(incomplete_str, 7)) return;
-    if (!write_int4(incomplete_saved_pc)) return;
-    if (!write_int4(incomplete_saved_highlight_row)) return;
-
-    if (!shell_write_saved_state(cmdline, 100)) return;
-    if (!write_int(cmdline_length)) return;
-    if (!write_int(cmdline_row)) return;
-
-    if (!write_int(matedit_mode)) return;
-    if (!shell_write_saved_state(matedit_name, 7)) return;
-    if (!write_int(matedit_length)) return;
-    if (!persist_vartype(matedit_x)) return;
-    if (!write_int4(matedit_i)) return;
-    if (!write_int4(matedit_j)) return;
-    if (!write_int(matedit_prev_appmenu)) return;
-
-    if (!shell_write_saved_state(input_name, 11)) return;
-    if (!write_int(input_length)) return;
-    if (!write_arg(&input_arg)) return;
-
-    if (!write_int(baseapp)) return;
-
-    if (!write_phloat(random_number)) return;
-
-    if (!write_int(deferred_print)) return;
-
-    if (!write_int(keybuf_head)) return;
-    if (!write_int(keybuf_tail)) return;
-    if (!shell_write_saved_state(keybuf, 16 * sizeof(int))) return;
+    if (!write_bool(core_settings.matrix_singularmatrix)) return false;
+    if (!write_bool(core_settings.matrix_outofrange)) return false;
+    if (!write_bool(core_settings.raw_text)) return false;
+    if (!write_bool(core_settings.auto_repeat)) return false;
+    if (!write_bool(core_settings.enable_ext_copan)) return false;
+    if (!write_bool(core_settings.enable_ext_bigstack)) return false;
+    if (!write_bool(core_settings.enable_ext_accel)) return false;
+    if (!write_bool(core_settings.enable_ext_locat)) return false;
+    if (!write_bool(core_settings.enable_ext_heading)) return false;
+    if (!write_bool(core_settings.enable_ext_time)) return false;
+    if (!write_bool(core_settings.matrix_fastbinary)) return false;
+    if (!write_bool(mode_clall)) return false;
+    if (!write_bool(mode_command_entry)) return false;
+    if (!write_bool(mode_number_entry)) return false;
+    if (!write_bool(mode_alpha_entry)) return false;
+    if (!write_bool(mode_shift)) return false;
+    if (!write_int(mode_appmenu)) return false;
+    if (!write_int(mode_plainmenu)) return false;
+    if (!write_bool(mode_plainmenu_sticky)) return false;
+    if (!write_int(mode_transientmenu)) return false;
+    if (!write_int(mode_alphamenu)) return false;
+    if (!write_int(mode_commandmenu)) return false;
+    if (!write_bool(mode_running)) return false;
+    if (!write_bool(mode_varmenu)) return false;
+    if (!write_bool(mode_updown)) return false;
+    if (!write_bool(mode_getkey)) return false;
+
+    if (!write_phloat(entered_number)) return false;
+    if (!write_int(entered_string_length)) return false;
+    if (!shell_write_saved_state(entered_string, 15)) return false;
+
+    if (!write_int(pending_command)) return false;
+    if (!write_arg(&pending_command_arg)) return false;
+    if (!write_int(xeq_invisible)) return false;
+
+    if (!write_int(incomplete_command)) return false;
+    if (!write_int(incomplete_ind)) return false;
+    if (!write_int(incomplete_alpha)) return false;
+    if (!write_int(incomplete_length)) return false;
+    if (!write_int(incomplete_maxdigits)) return false;
+    if (!write_int(incomplete_argtype)) return false;
+    if (!write_int(incomplete_num)) return false;
+    if (!shell_write_saved_state(incomplete_str, 7)) return false;
+    if (!write_int4(incomplete_saved_pc)) return false;
+    if (!write_int4(incomplete_saved_highlight_row)) return false;
+
+    if (!shell_write_saved_state(cmdline, 100)) return false;
+    if (!write_int(cmdline_length)) return false;
+    if (!write_int(cmdline_row)) return false;
+
+    if (!write_int(matedit_mode)) return false;
+    if (!shell_write_saved_state(matedit_name, 7)) return false;
+    if (!write_int(matedit_length)) return false;
+    if (!persist_vartype(matedit_x)) return false;
+    if (!write_int4(matedit_i)) return false;
+    if (!write_int4(matedit_j)) return false;
+    if (!write_int(matedit_prev_appmenu)) return false;
+
+    if (!shell_write_saved_state(input_name, 11)) return false;
+    if (!write_int(input_length)) return false;
+    if (!write_arg(&input_arg)) return false;
+
+    if (!write_int(baseapp)) return false;
+
+    if (!write_phloat(random_number)) return false;
+
+    if (!write_int(deferred_print)) return false;
+
+    if (!write_int(keybuf_head)) return false;
+    if (!write_int(keybuf_tail)) return false;
+    if (!shell_write_saved_state(keybuf, 16 * sizeof(int))) return false;
 
     if (!persist_display())
-        return;
+        return false;
     if (!persist_globals())
-        return;
+        return false;
     if (!persist_math())
-        return;
+        return false;
+
+    // Checkpoints written after this belong to the new state file
+    int4 new_journal_id = journal_id * 69069 + shell_milliseconds() + 1;
+    if (!write_int4(new_journal_id)) return false;
+
+    if (!write_int4(FREE42_MAGIC)) return false;
+    if (!write_int4(FREE42_VERSION)) return false;
+
+    if (!persist_payloads()) return false;
+
+    journal_id = new_journal_id;
+    return true;
+}
+
+/*****************/
+/* State journal */
+/*****************/
+
+/* Between full saves of the state, the shell can call core_checkpoint() to
+ * append the parts of the state that have changed since the previous
+ * checkpoint (or since the state was loaded or saved) to a journal, and
+ * core_replay_journal() to apply that journal after loading the state.
+ *
+ * Changes are found by comparing 64-bit fingerprints of the stack and ALPHA
+ * (which go with the program position and the return stack), the variables,
+ * the programs, and the flags, with those taken at the previous checkpoint.
+ * To keep that from costing a pass over the whole state every time, the
+ * fingerprints of variables and programs are kept in var_struct and
+ * prgm_struct, and only recomputed after something may have changed them:
+ * store_var() and recall_var() clear a variable's, and discard_caches()
+ * clears a program's. The stack, ALPHA, and the flags are
+ * changed in too many places for that, but they are only changed by
+ * keystrokes and the commands they run, so they are only looked at when
+ * journal_activity says that some of those have happened. The solver and
+ * integrator state has a change counter, math_changes(), instead.
+ *
+ * Each checkpoint consists of a header, a sequence of records, and an end
+ * record. The header contains the journal ID, which is changed every time the
+ * full state is saved, so checkpoints that predate the state file they are
+ * replayed against are recognized and skipped. Each record is read in full
+ * before it is applied, so a checkpoint that was cut short is applied up to
+ * its last complete record.
+ */
+
+#define JOURNAL_MAGIC 0x4a6b3432
+
+#define JOURNAL_END 0
+#define JOURNAL_REGS 1
+#define JOURNAL_FLAGS 2
+#define JOURNAL_MATH 3
+#define JOURNAL_PRGMS 4
+#define JOURNAL_VAR 5
+#define JOURNAL_PURGE 6
+#define JOURNAL_PURGE_ALL 7
+
+typedef struct {
+    int length;
+    char name[7];
+    uint8 hash;
+} journal_var_struct;
+
+static bool journal_baseline = false;
+static journal_var_struct *journal_vars = NULL;
+static int journal_vars_count = 0;
+static uint8 *journal_prgms = NULL;
+static int journal_prgms_count = 0;
+static uint8 journal_regs;
+static uint8 journal_flags;
+static uint4 journal_math;
+
+static uint8 fingerprint(uint8 h, const void *data, int4 n) {
+    // FNV-1a
+    const unsigned char *p = (const unsigned char *) data;
+    for (int4 i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+#define FINGERPRINT_INIT 14695981039346656037ULL
+
+static uint8 vartype_fingerprint(uint8 h, const vartype *v) {
+    if (v == NULL) {
+        int type = TYPE_NULL;
+        return fingerprint(h, &type, sizeof(int));
+    }
+    h = fingerprint(h, &v->type, sizeof(int));
+    switch (v->type) {
+        case TYPE_REAL:
+            return fingerprint(h, &((vartype_real *) v)->x, sizeof(phloat));
+        case TYPE_COMPLEX: {
+            vartype_complex *c = (vartype_complex *) v;
+            h = fingerprint(h, &c->re, sizeof(phloat));
+            return fingerprint(h, &c->im, sizeof(phloat));
+        }
+        case TYPE_STRING: {
+            vartype_string *s = (vartype_string *) v;
+            h = fingerprint(h, &s->length, sizeof(int));
+            return fingerprint(h, s->text, s->length);
+        }
+        case TYPE_REALMATRIX: {
+            vartype_realmatrix *rm = (vartype_realmatrix *) v;
+            int4 size = rm->rows * rm->columns;
+            h = fingerprint(h, &rm->rows, sizeof(int4));
+            h = fingerprint(h, &rm->columns, sizeof(int4));
+            h = fingerprint(h, rm->array->data, size * sizeof(phloat));
+            return fingerprint(h, rm->array->is_string, size);
+        }
+        case TYPE_COMPLEXMATRIX: {
+            vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
+            int4 size = 2 * cm->rows * cm->columns;
+            h = fingerprint(h, &cm->rows, sizeof(int4));
+            h = fingerprint(h, &cm->columns, sizeof(int4));
+            return fingerprint(h, cm->array->data, size * sizeof(phloat));
+        }
+        default:
+            return h;
+    }
+}
+
+static uint8 regs_fingerprint() {
+    uint8 h = FINGERPRINT_INIT;
+    h = vartype_fingerprint(h, reg_x);
+    h = vartype_fingerprint(h, reg_y);
+    h = vartype_fingerprint(h, reg_z);
+    h = vartype_fingerprint(h, reg_t);
+    h = vartype_fingerprint(h, reg_lastx);
+    h = fingerprint(h, &reg_alpha_length, sizeof(int));
+    h = fingerprint(h, reg_alpha, reg_alpha_length);
+    h = fingerprint(h, &current_prgm, sizeof(int));
+    h = fingerprint(h, &pc, sizeof(int4));
+    h = fingerprint(h, &rtn_sp, sizeof(int));
+    h = fingerprint(h, rtn_prgm, rtn_sp * sizeof(int));
+    return fingerprint(h, rtn_pc, rtn_sp * sizeof(int4));
+}
+
+/* Takes fingerprints of the current state. The arrays for the variables and
+ * programs are allocated here, and must be freed by the caller.
+ */
+static bool take_fingerprints(journal_var_struct **jvars, uint8 **jprgms,
+                              uint8 *regs, uint8 *flgs) {
+    int i;
+    *jvars = (journal_var_struct *)
+                    malloc((vars_count + 1) * sizeof(journal_var_struct));
+    *jprgms = (uint8 *) malloc((prgms_count + 1) * sizeof(uint8));
+    if (*jvars == NULL || *jprgms == NULL) {
+        free(*jvars);
+        free(*jprgms);
+        return false;
+    }
+    for (i = 0; i < vars_count; i++) {
+        journal_var_struct *jv = *jvars + i;
+        jv->length = vars[i].length;
+        memcpy(jv->name, vars[i].name, 7);
+        if (!vars[i].hashed) {
+            vars[i].hash = vartype_fingerprint(FINGERPRINT_INIT,
+                                               vars[i].value);
+            vars[i].hashed = true;
+        }
+        jv->hash = vars[i].hash;
+    }
+    for (i = 0; i < prgms_count; i++) {
+        prgm_struct *prgm = prgms + i;
+        if (!prgm->text_hashed) {
+            prgm->text_hash = fingerprint(FINGERPRINT_INIT, prgm->text,
+                                          prgm->size);
+            prgm->text_hashed = true;
+        }
+        /* The local label targets in the text are filled in without going
+         * through discard_caches(), but they're only a cache, and valid
+         * or not, the text is written out together with the matching
+         * lclbl_invalid.
+         */
+        (*jprgms)[i] = fingerprint(prgm->text_hash, &prgm->lclbl_invalid,
+                                   sizeof(int));
+    }
+    if (journal_activity || !journal_baseline) {
+        *regs = regs_fingerprint();
+        *flgs = fingerprint(FINGERPRINT_INIT, flags.farray, 100);
+    } else {
+        *regs = journal_regs;
+        *flgs = journal_flags;
+    }
+    return true;
+}
+
+void reset_journal() {
+    journal_var_struct *jvars;
+    uint8 *jprgms;
+    free(journal_vars);
+    free(journal_prgms);
+    journal_vars = NULL;
+    journal_prgms = NULL;
+    // So that take_fingerprints() looks at everything
+    journal_baseline = false;
+    journal_baseline = take_fingerprints(&jvars, &jprgms, &journal_regs,
+                                         &journal_flags);
+    if (journal_baseline) {
+        journal_vars = jvars;
+        journal_vars_count = vars_count;
+        journal_prgms = jprgms;
+        journal_prgms_count = prgms_count;
+        journal_math = math_changes();
+        journal_activity = false;
+    }
+}
+
+/* Matrices are written out in full in every journal record that contains
+ * them, even if they are shared; shared matrices are written only once in the
+ * state file, but in the journal, the other references to them may be in
+ * records that are skipped.
+ */
+static bool persist_journal_vartype(vartype *v) {
+    array_count = 0;
+    return persist_vartype(v);
+}
+
+static bool write_journal_regs() {
+    if (!write_int(JOURNAL_REGS))
+        return false;
+    if (!persist_journal_vartype(reg_x))
+        return false;
+    if (!persist_journal_vartype(reg_y))
+        return false;
+    if (!persist_journal_vartype(reg_z))
+        return false;
+    if (!persist_journal_vartype(reg_t))
+        return false;
+    if (!persist_journal_vartype(reg_lastx))
+        return false;
+    if (!write_int(reg_alpha_length))
+        return false;
+    if (!shell_write_saved_state(reg_alpha, 44))
+        return false;
+    /* The return stack goes with pc: if a checkpoint is taken while a
+     * subroutine is running or stopped, pc is somewhere inside it, and RTN
+     * has to go back to where it was called from, not to wherever the
+     * return stack in the state file says.
+     */
+    if (!write_int(current_prgm))
+        return false;
+    if (!write_int4(pc))
+        return false;
+    if (!write_int(rtn_sp))
+        return false;
+    for (int i = 0; i < rtn_sp; i++)
+        if (!write_int(rtn_prgm[i]) || !write_int4(rtn_pc[i]))
+            return false;
+    return true;
+}
+
+bool write_journal() {
+    journal_var_struct *jvars;
+    uint8 *jprgms;
+    uint8 regs, flgs;
+    uint4 math = math_changes();
+    uint8 *oldhash = NULL;
+    char *seen = NULL;
+    bool prgms_changed;
+    bool ret = false;
+    int i;
+
+    if (!take_fingerprints(&jvars, &jprgms, &regs, &flgs))
+        return false;
+
+    array_count = 0;
+    array_list_capacity = 0;
+    array_list = NULL;
+    state_has_payloads = false;
+
+    if (!write_int4(JOURNAL_MAGIC))
+        goto done;
+    if (!write_int4(FREE42_VERSION))
+        goto done;
+    #ifdef BCD_MATH
+        if (!write_bool(true))
+            goto done;
+    #else
+        if (!write_bool(false))
+            goto done;
+    #endif
+    if (!write_int4(journal_id))
+        goto done;
+
+    /* Programs: the new count, followed by the size, label cache state, and
+     * text of each program that has changed, or -1 for the ones that haven't.
+     */
+    prgms_changed = !journal_baseline || prgms_count != journal_prgms_count;
+    for (i = 0; !prgms_changed && i < prgms_count; i++)
+        prgms_changed = jprgms[i] != journal_prgms[i];
+    if (prgms_changed) {
+        if (!write_int(JOURNAL_PRGMS))
+            goto done;
+        if (!write_int(prgms_count))
+            goto done;
+        for (i = 0; i < prgms_count; i++) {
+            if (journal_baseline && i < journal_prgms_count
+                    && jprgms[i] == journal_prgms[i]) {
+                if (!write_int4(-1))
+                    goto done;
+            } else {
+                if (!write_int4(prgms[i].size))
+                    goto done;
+                if (!write_int(prgms[i].lclbl_invalid))
+                    goto done;
+                if (!shell_write_saved_state(prgms[i].text, prgms[i].size))
+                    goto done;
+            }
+        }
+    }
+
+    /* Variables: a purge record for each variable that no longer exists, and
+     * the value of each one that is new or that has changed.
+     */
+    oldhash = (uint8 *) malloc((vars_count + 1) * sizeof(uint8));
+    seen = (char *) malloc(vars_count + 1);
+    if (oldhash == NULL || seen == NULL)
+        goto done;
+    memset(seen, 0, vars_count);
+    if (journal_baseline) {
+        for (i = 0; i < journal_vars_count; i++) {
+            journal_var_struct *jv = journal_vars + i;
+            int n = lookup_var(jv->name, jv->length);
+            if (n == -1) {
+                if (!write_int(JOURNAL_PURGE))
+                    goto done;
+                if (!write_int(jv->length))
+                    goto done;
+                if (!shell_write_saved_state(jv->name, 7))
+                    goto done;
+            } else {
+                seen[n] = 1;
+                oldhash[n] = jv->hash;
+            }
+        }
+    } else {
+        if (!write_int(JOURNAL_PURGE_ALL))
+            goto done;
+    }
+    for (i = 0; i < vars_count; i++) {
+        if (seen[i] && oldhash[i] == jvars[i].hash)
+            continue;
+        if (!write_int(JOURNAL_VAR))
+            goto done;
+        if (!write_int(vars[i].length))
+            goto done;
+        if (!shell_write_saved_state(vars[i].name, 7))
+            goto done;
+        if (!persist_journal_vartype(vars[i].value))
+            goto done;
+    }
+
+    if (!journal_baseline || flgs != journal_flags) {
+        if (!write_int(JOURNAL_FLAGS))
+            goto done;
+        if (!shell_write_saved_state(flags.farray, 100))
+            goto done;
+    }
+    if (!journal_baseline || math != journal_math)
+        if (!write_int(JOURNAL_MATH) || !write_math_state())
+            goto done;
+    // Written last, since current_prgm and pc refer to the programs
+    if (!journal_baseline || regs != journal_regs)
+        if (!write_journal_regs())
+            goto done;
+    if (!write_int(JOURNAL_END))
+        goto done;
+    ret = true;
+
+    done:
+    free(array_list);
+    free(oldhash);
+    free(seen);
+    if (ret) {
+        free(journal_vars);
+        free(journal_prgms);
+        journal_vars = jvars;
+        journal_vars_count = vars_count;
+        journal_prgms = jprgms;
+        journal_prgms_count = prgms_count;
+        journal_regs = regs;
+        journal_flags = flgs;
+        journal_math = math;
+        journal_baseline = true;
+        journal_activity = false;
+    } else {
+        free(jvars);
+        free(jprgms);
+    }
+    return ret;
+}
+
+static bool replay_journal_regs(bool apply) {
+    vartype *regs[5];
+    int i, n;
+    int alpha_length, prgm;
+    int4 prgm_pc;
+    char alpha[44];
+    int sp;
+    int sp_prgm[MAX_RTNS];
+    int4 sp_pc[MAX_RTNS];
+    bool position_ok;
+    bool ok = false;
+    for (n = 0; n < 5; n++)
+        if (!unpersist_vartype(regs + n, false))
+            goto done;
+    if (!read_int(&alpha_length)
+            || alpha_length < 0 || alpha_length > 44
+            || shell_read_saved_state(alpha, 44) != 44
+            || !read_int(&prgm)
+            || !read_int4(&prgm_pc)
+            || !read_int(&sp)
+            || sp < 0 || sp > MAX_RTNS)
+        goto done;
+    for (i = 0; i < sp; i++)
+        if (!read_int(sp_prgm + i) || !read_int4(sp_pc + i))
+            goto done;
+    ok = true;
+    if (!apply)
+        goto done;
+
+    /* The position and the return stack are restored together, or not at
+     * all; -2 and -3 are the solver's and integrator's return addresses.
+     */
+    position_ok = prgm >= 0 && prgm < prgms_count
+            && prgm_pc >= -1 && prgm_pc < prgms[prgm].size;
+    for (i = 0; position_ok && i < sp; i++)
+        if (sp_prgm[i] >= 0)
+            position_ok = sp_prgm[i] < prgms_count
+                    && sp_pc[i] >= -1 && sp_pc[i] <= prgms[sp_prgm[i]].size;
+        else
+            position_ok = sp_prgm[i] == -2 || sp_prgm[i] == -3;
+
+    free_vartype(reg_x);
+    free_vartype(reg_y);
+    free_vartype(reg_z);
+    free_vartype(reg_t);
+    free_vartype(reg_lastx);
+    reg_x = regs[0];
+    reg_y = regs[1];
+    reg_z = regs[2];
+    reg_t = regs[3];
+    reg_lastx = regs[4];
+    reg_alpha_length = alpha_length;
+    memcpy(reg_alpha, alpha, 44);
+    if (position_ok) {
+        current_prgm = prgm;
+        pc = prgm_pc;
+        rtn_sp = sp;
+        for (i = 0; i < sp; i++) {
+            rtn_prgm[i] = sp_prgm[i];
+            rtn_pc[i] = sp_pc[i];
+        }
+    }
+    return true;
+
+    done:
+    for (i = 0; i < n; i++)
+        free_vartype(regs[i]);
+    return ok;
+}
+
+static bool replay_journal_prgms(bool apply) {
+    int count, i, n;
+    bool ok = false;
+    if (!read_int(&count) || count < 0)
+        return false;
+    unsigned char **text = (unsigned char **)
+                    malloc((count + 1) * sizeof(unsigned char *));
+    int4 *size = (int4 *) malloc((count + 1) * sizeof(int4));
+    int *lclbl_invalid = (int *) malloc((count + 1) * sizeof(int));
+    if (text == NULL || size == NULL || lclbl_invalid == NULL) {
+        free(text);
+        free(size);
+        free(lclbl_invalid);
+        return false;
+    }
+    for (n = 0; n < count; n++) {
+        text[n] = NULL;
+        if (!read_int4(size + n))
+            goto done;
+        if (size[n] == -1) {
+            if (apply && n >= prgms_count)
+                goto done;
+            continue;
+        }
+        if (size[n] < 0 || !read_int(lclbl_invalid + n))
+            goto done;
+        text[n] = (unsigned char *) malloc(size[n] + 1);
+        if (text[n] == NULL)
+            goto done;
+        if (shell_read_saved_state(text[n], size[n]) != size[n]) {
+            n++;
+            goto done;
+        }
+    }
+    ok = true;
+    if (!apply)
+        goto done;
+
+    if (count > prgms_capacity) {
+        prgm_struct *newprgms = (prgm_struct *)
+                    realloc(prgms, count * sizeof(prgm_struct));
+        if (newprgms == NULL) {
+            ok = false;
+            goto done;
+        }
+        prgms = newprgms;
+        prgms_capacity = count;
+    }
+    for (i = count; i < prgms_count; i++) {
+        free(prgms[i].text);
+        discard_caches(prgms + i);
+    }
+    for (i = 0; i < count; i++) {
+        if (text[i] == NULL)
+            continue;
+        prgm_struct *prgm = prgms + i;
+        if (i < prgms_count) {
+            free(prgm->text);
+            discard_caches(prgm);
+        } else {
+            prgm->decoded = NULL;
+            prgm->decoded_index = NULL;
+            prgm->lclbl_table = NULL;
+            prgm->line_index = NULL;
+            prgm->hp42s_length = -1;
+            prgm->text_hashed = false;
+        }
+        prgm->text = text[i];
+        prgm->size = size[i];
+        prgm->capacity = size[i] + 1;
+        prgm->lclbl_invalid = lclbl_invalid[i];
+        text[i] = NULL;
+    }
+    prgms_count = count;
+    if (current_prgm >= prgms_count) {
+        current_prgm = prgms_count - 1;
+        pc = -1;
+    }
+    n = count;
 
-    if (!write_int4(FREE42_MAGIC)) return;
-    if (!write_int4(FREE42_VERSION)) return;
+    done:
+    for (i = 0; i < n; i++)
+        free(text[i]);
+    free(text);
+    free(size);
+    free(lclbl_invalid);
+    return ok;
+}
+
+bool replay_journal() {
+    bool applied = false;
+    int4 magic, version, id;
+    bool decimal;
+
+    /* The journal is always written by this version, using the native
+     * number format, regardless of what the state file was.
+     */
+    state_bool_is_int = false;
+    #ifdef BCD_MATH
+        state_file_number_format = NUMBER_FORMAT_BID128;
+    #else
+        state_file_number_format = NUMBER_FORMAT_BINARY;
+    #endif
+    state_has_payloads = false;
+
+    while (true) {
+        if (!read_int4(&magic) || magic != JOURNAL_MAGIC)
+            break;
+        if (!read_int4(&version) || version != FREE42_VERSION)
+            break;
+        #ifdef BCD_MATH
+            if (!read_bool(&decimal) || !decimal)
+                break;
+        #else
+            if (!read_bool(&decimal) || decimal)
+                break;
+        #endif
+        if (!read_int4(&id))
+            break;
+        /* Checkpoints that were written before the state file was, are
+         * parsed and skipped.
+         */
+        bool apply = id == journal_id;
+        bool ok = true;
+        array_count = 0;
+        array_list_capacity = 0;
+        array_list = NULL;
+
+        while (ok) {
+            int type;
+            if (!read_int(&type)) {
+                ok = false;
+                break;
+            }
+            if (type == JOURNAL_END)
+                break;
+            switch (type) {
+                case JOURNAL_REGS: {
+                    ok = replay_journal_regs(apply);
+                    break;
+                }
+                case JOURNAL_FLAGS: {
+                    char buf[100];
+                    ok = shell_read_saved_state(buf, 100) == 100;
+                    if (ok && apply)
+                        memcpy(flags.farray, buf, 100);
+                    break;
+                }
+                case JOURNAL_MATH: {
+                    ok = read_math_state(apply);
+                    break;
+                }
+                case JOURNAL_PRGMS: {
+                    ok = replay_journal_prgms(apply);
+                    break;
+                }
+                case JOURNAL_VAR: {
+                    int length;
+                    char name[7];
+                    vartype *value;
+                    ok = read_int(&length) && length >= 0 && length <= 7
+                            && shell_read_saved_state(name, 7) == 7
+                            && unpersist_vartype(&value, false);
+                    if (!ok)
+                        break;
+                    if (apply)
+                        store_var(name, length, value);
+                    else
+                        free_vartype(value);
+                    break;
+                }
+                case JOURNAL_PURGE: {
+                    int length;
+                    char name[7];
+                    ok = read_int(&length) && length >= 0 && length <= 7
+                            && shell_read_saved_state(name, 7) == 7;
+                    if (ok && apply)
+                        purge_var(name, length);
+                    break;
+                }
+                case JOURNAL_PURGE_ALL: {
+                    if (apply)
+                        purge_all_vars();
+                    break;
+                }
+                default:
+                    ok = false;
+                    break;
+            }
+            if (ok && apply)
+                applied = true;
+        }
+        free(array_list);
+        if (!ok)
+            break;
+    }
+
+    if (applied) {
+        rebuild_label_table();
+        reset_journal();
+    }
+    return applied;
 }
 
 void hard_reset(int bad_state_file) {
     vartype *regs;
 
+    /* Don't let any old journal be applied to the new state */
+    journal_id = shell_milliseconds();
+
     /* Clear stack */
     free_vartype(reg_x);
     free_vartype(reg_y);
@@ -2590,6 +4001,7 @@ void hard_reset(int bad_state_file) {
         labels = NULL;
         labels_capacity = 0;
         labels_count = 0;
+        invalidate_label_index();
     }
     goto_dot_dot();
 
@@ -2720,6 +4132,7 @@ void hard_reset(int bad_state_file) {
     #else
         core_settings.enable_ext_fptest = false;
     #endif
+    core_settings.matrix_fastbinary = false;
 
     reset_math();
 
@@ -3176,11 +4589,11 @@ static void convert_bigstack_drop() {
 }
 #endif
 
-#ifdef ANDROID
 void reinitialize_globals() {
-    /* The Android version may call core_init() after core_quit(), in other
-     * words, the globals may live for more than one session. This caused
-     * crashes in the initial builds, because of course global initializers
+    /* The Android version, and the benchmark runner in bench/, may call
+     * core_init() after core_quit(), in other words, the globals may live
+     * for more than one session. This caused crashes in the initial Android
+     * builds, because of course global initializers
      * are only invoked once, and core_quit() did not bother to clean things
      * up so that core_init() would be able to run safely.
      * In my defense, this wasn't sloppy coding; core_quit() does deallocate
@@ -3201,12 +4614,14 @@ void reinitialize_globals() {
     vars_capacity = 0;
     vars_count = 0;
     vars = NULL;
+    rebuild_var_index();
     prgms_capacity = 0;
     prgms_count = 0;
     prgms = NULL;
     labels_capacity = 0;
     labels_count = 0;
     labels = NULL;
+    invalidate_label_index();
     current_prgm = -1;
     prgm_highlight_row = 0;
     mode_interruptible = NULL;
@@ -3218,7 +4633,6 @@ void reinitialize_globals() {
     remove_program_catalog = 0;
     rtn_sp = 0;
 }
-#endif
 
 #ifdef IPHONE
 bool off_enabled() {
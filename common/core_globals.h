@@ -233,6 +233,16 @@ typedef struct {
     int refcount;
     phloat *data;
     char *is_string;
+    /* True if none of the elements are strings. False means "not known", not
+     * necessarily that there are strings; contains_no_strings() checks and
+     * sets it. Anything that puts a string into the matrix must clear it.
+     */
+    bool no_strings;
+    /* True if 'data' and 'is_string' live in the same block as this struct
+     * (see new_realmatrix_data()); false if they were allocated separately,
+     * or mapped from the state file.
+     */
+    bool inline_data;
 } realmatrix_data;
 
 typedef struct {
@@ -246,6 +256,7 @@ typedef struct {
 typedef struct {
     int refcount;
     phloat *data;
+    bool inline_data;
 } complexmatrix_data;
 
 typedef struct {
@@ -365,6 +376,13 @@ typedef struct {
     unsigned char length;
     char name[7];
     vartype *value;
+    /* Fields after this point are not persisted; see var_struct_32bit */
+    /* Fingerprint of the value, for the state journal; only valid while
+     * 'hashed' is set. store_var() and recall_var() clear it, since whoever
+     * gets the value from recall_var() may change it in place.
+     */
+    bool hashed;
+    uint8 hash;
 } var_struct;
 typedef struct {
     unsigned char length;
@@ -376,11 +394,44 @@ extern int vars_count;
 extern var_struct *vars;
 
 /* Programs */
+/* Upper bound on the encoded length of a single command; see encode_command() */
+#define MAX_COMMAND_LENGTH 100
+typedef struct {
+    int cmd;
+    int4 next_pc;
+    arg_struct arg;
+} decoded_command;
+typedef struct {
+    int4 key;
+    int4 pc;
+} lclbl_entry;
 typedef struct {
     int4 capacity;
     int4 size;
     int lclbl_invalid;
     unsigned char *text;
+    /* Fields after this point are not persisted; see prgm_struct_32bit */
+    decoded_command *decoded;
+    int4 *decoded_index;
+    lclbl_entry *lclbl_table;
+    int4 lclbl_count;
+    int4 *line_index;
+    int4 line_count;
+    /* Length of the HP-42S encoding of the program, as exported, and its
+     * size as shown on line 00; see core_export_programs() and
+     * core_program_size(). Only valid if hp42s_length is not -1, and if the
+     * decimal point, which numbers are encoded with, still matches
+     * hp42s_dot.
+     */
+    int4 hp42s_length;
+    int4 hp42s_size;
+    char hp42s_dot;
+    /* Fingerprint of the text, for the state journal; only valid while
+     * 'text_hashed' is set. Cleared by discard_caches(), like the caches
+     * above, whenever the text changes.
+     */
+    bool text_hashed;
+    uint8 text_hash;
 } prgm_struct;
 typedef struct {
     int4 capacity;
@@ -522,6 +573,12 @@ extern int state_file_number_format;
 
 extern bool no_keystrokes_yet;
 
+/* Set by the core_*() functions that handle keystrokes and run commands,
+ * which is how the stack, ALPHA, and the flags get changed; the state journal
+ * only looks at those when this is set. See write_journal().
+ */
+extern bool journal_activity;
+
 
 /*********************/
 /* Utility functions */
@@ -536,10 +593,13 @@ int mvar_prgms_exist();
 int label_has_mvar(int lblindex);
 int get_command_length(int prgm, int4 pc);
 void get_next_command(int4 *pc, int *command, arg_struct *arg, int find_target);
+void get_next_decoded_command(int4 *pc, int *command, arg_struct *arg);
 void rebuild_label_table();
 void delete_command(int4 pc);
+int encode_command(int command, arg_struct *arg, unsigned char *buf);
 void store_command(int4 pc, int command, arg_struct *arg);
 void store_command_after(int4 *pc, int command, arg_struct *arg);
+bool append_program(const unsigned char *text, int4 size);
 int4 pc2line(int4 pc);
 int4 line2pc(int4 line);
 int4 find_local_label(const arg_struct *arg);
@@ -552,17 +612,22 @@ bool integ_active();
 void unwind_stack_until_solve();
 
 bool load_state(int4 version);
-void save_state();
+bool save_state();
 void hard_reset(int bad_state_file);
+void reset_journal();
+bool write_journal();
+bool replay_journal();
 
 bool read_arg(arg_struct *arg, bool old);
 bool write_arg(const arg_struct *arg);
+bool read_int(int *n);
+bool write_int(int n);
+bool read_int4(int4 *n);
+bool write_int4(int4 n);
 bool read_phloat(phloat *d);
 bool write_phloat(phloat d);
 
-#ifdef ANDROID
 void reinitialize_globals();
-#endif
 
 #ifdef IPHONE
 bool off_enabled();
@@ -177,13 +177,57 @@ void binary_result(vartype *x) {
     free_vartype(reg_lastx);
     reg_lastx = reg_x;
     reg_x = x;
-    free_vartype(reg_y);
+    vartype *old_y = reg_y;
     reg_y = reg_z;
-    reg_z = dup_vartype(reg_t);
+    reg_z = recycle_vartype(old_y, reg_t);
+    if (reg_z == NULL)
+        free_vartype(old_y);
     if (flags.f.trace_print && flags.f.printer_exists)
         docmd_prx(NULL);
 }
 
+/* Like unary_result() and binary_result(), for scalar results. The old LASTX
+ * is about to be dropped, so the result is stored in it when it is of the
+ * right type, instead of in a newly allocated real or complex; since LASTX
+ * gets the old X, which is usually a number as well, a run of scalar
+ * operations keeps passing the same few objects around.
+ */
+int unary_real_result(phloat x) {
+    vartype *v = recycle_real(reg_lastx, x);
+    if (v == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    reg_lastx = NULL;
+    unary_result(v);
+    return ERR_NONE;
+}
+
+int unary_complex_result(phloat re, phloat im) {
+    vartype *v = recycle_complex(reg_lastx, re, im);
+    if (v == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    reg_lastx = NULL;
+    unary_result(v);
+    return ERR_NONE;
+}
+
+int binary_real_result(phloat x) {
+    vartype *v = recycle_real(reg_lastx, x);
+    if (v == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    reg_lastx = NULL;
+    binary_result(v);
+    return ERR_NONE;
+}
+
+int binary_complex_result(phloat re, phloat im) {
+    vartype *v = recycle_complex(reg_lastx, re, im);
+    if (v == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    reg_lastx = NULL;
+    binary_result(v);
+    return ERR_NONE;
+}
+
 phloat rad_to_angle(phloat x) {
     if (flags.f.rad)
         return x;
@@ -249,6 +293,17 @@ int string_equals(const char *s1, int s1len, const char *s2, int s2len) {
     return 1;
 }
 
+int string_hash(const char *s, int slen) {
+    /* FNV-1a, with the high bits folded in, since the hash tables that use
+     * this only look at the low bits
+     */
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < slen; i++)
+        h = (h ^ (unsigned char) s[i]) * 16777619u;
+    return (int) (h ^ (h >> 15));
+}
+
 int virtual_flag_handler(int flagop, int flagnum) {
     /* NOTE: the determination which flag numbers are handled by this
      * function is made by docmd_sf() etc.; they do this based on a constant
@@ -808,7 +863,8 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
         vartype_realmatrix *oldmatrix = (vartype_realmatrix *) matrix;
         if (oldmatrix->rows == rows && oldmatrix->columns == columns)
             return ERR_NONE;
-        if (oldmatrix->array->refcount == 1) {
+        if (oldmatrix->array->refcount == 1
+                && !oldmatrix->array->inline_data) {
             /* Since there are no shared references to this array,
              * I can modify it in place using a realloc(). However, I
              * only use realloc() on the 'data' array, not on the
@@ -823,7 +879,7 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
                 return ERR_INSUFFICIENT_MEMORY;
             int4 i, s, oldsize;
             phloat *new_data = (phloat *)
-                                    realloc(oldmatrix->array->data,
+                                    realloc_matrix_data(oldmatrix->array->data,
                                             size * sizeof(phloat));
             if (new_data == NULL) {
                 free(new_is_string);
@@ -844,28 +900,18 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
             oldmatrix->columns = columns;
             return ERR_NONE;
         } else {
-            /* There are shared references to the matrix. This means I
-             * can't realloc() it; I'm going to allocate a brand-new instance,
+            /* There are shared references to the matrix, or its data is
+             * in the same block as the array struct. This means I can't
+             * realloc() it; I'm going to allocate a brand-new instance,
              * and copy the contents from the old instance. I don't use
              * disentangle(); that's only useful if you want to eliminate
              * shared references without resizing.
              */
             realmatrix_data *new_array;
             int4 i, s, oldsize;
-            new_array = (realmatrix_data *) malloc(sizeof(realmatrix_data));
+            new_array = new_realmatrix_data(size);
             if (new_array == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
-            new_array->data = (phloat *) malloc(size * sizeof(phloat));
-            if (new_array->data == NULL) {
-                free(new_array);
-                return ERR_INSUFFICIENT_MEMORY;
-            }
-            new_array->is_string = (char *) malloc(size);
-            if (new_array->is_string == NULL) {
-                free(new_array->data);
-                free(new_array);
-                return ERR_INSUFFICIENT_MEMORY;
-            }
             oldsize = oldmatrix->rows * oldmatrix->columns;
             s = oldsize < size ? oldsize : size;
             for (i = 0; i < s; i++) {
@@ -876,8 +922,9 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
                 new_array->is_string[i] = 0;
                 new_array->data[i] = 0;
             }
-            new_array->refcount = 1;
-            oldmatrix->array->refcount--;
+            new_array->no_strings = oldmatrix->array->no_strings;
+            if (--(oldmatrix->array->refcount) == 0)
+                free_realmatrix_data(oldmatrix->array);
             oldmatrix->array = new_array;
             oldmatrix->rows = rows;
             oldmatrix->columns = columns;
@@ -887,13 +934,15 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
         vartype_complexmatrix *oldmatrix = (vartype_complexmatrix *) matrix;
         if (oldmatrix->rows == rows && oldmatrix->columns == columns)
             return ERR_NONE;
-        if (oldmatrix->array->refcount == 1) {
+        if (oldmatrix->array->refcount == 1
+                && !oldmatrix->array->inline_data) {
             /* Since there are no shared references to this array,
              * I can modify it in place using a realloc().
              */
             int4 i, oldsize;
             phloat *new_data = (phloat *)
-                    realloc(oldmatrix->array->data, 2 * size * sizeof(phloat));
+                    realloc_matrix_data(oldmatrix->array->data,
+                                        2 * size * sizeof(phloat));
             if (new_data == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
             oldsize = oldmatrix->rows * oldmatrix->columns;
@@ -904,31 +953,26 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
             oldmatrix->columns = columns;
             return ERR_NONE;
         } else {
-            /* There are shared references to the matrix. This means I
-             * can't realloc() it; I'm going to allocate a brand-new instance,
+            /* There are shared references to the matrix, or its data is
+             * in the same block as the array struct. This means I can't
+             * realloc() it; I'm going to allocate a brand-new instance,
              * and copy the contents from the old instance. I don't use
              * disentangle(); that's only useful if you want to eliminate
              * shared references without resizing.
              */
             complexmatrix_data *new_array;
             int4 i, s, oldsize;
-            new_array = (complexmatrix_data *)
-                                        malloc(sizeof(complexmatrix_data));
+            new_array = new_complexmatrix_data(size);
             if (new_array == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
-            new_array->data = (phloat *) malloc(2 * size * sizeof(phloat));
-            if (new_array->data == NULL) {
-                free(new_array);
-                return ERR_INSUFFICIENT_MEMORY;
-            }
             oldsize = oldmatrix->rows * oldmatrix->columns;
             s = oldsize < size ? oldsize : size;
             for (i = 0; i < 2 * s; i++)
                 new_array->data[i] = oldmatrix->array->data[i];
             for (i = 2 * s; i < 2 * size; i++)
                 new_array->data[i] = 0;
-            new_array->refcount = 1;
-            oldmatrix->array->refcount--;
+            if (--(oldmatrix->array->refcount) == 0)
+                free_complexmatrix_data(oldmatrix->array);
             oldmatrix->array = new_array;
             oldmatrix->rows = rows;
             oldmatrix->columns = columns;
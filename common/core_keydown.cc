@@ -1807,10 +1807,12 @@ void keydown_normal_mode(int shift, int key) {
                     display_prgm_line(0, -1);
         } else {
             if (!flags.f.stack_lift_disable) {
-                free_vartype(reg_t);
+                vartype *v = recycle_vartype(reg_t, reg_x);
+                if (v == NULL)
+                    free_vartype(reg_t);
                 reg_t = reg_z;
                 reg_z = reg_y;
-                reg_y = dup_vartype(reg_x);
+                reg_y = v;
             } else
                 flags.f.stack_lift_disable = 0;
             flags.f.numeric_data_input = 1;
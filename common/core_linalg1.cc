@@ -16,11 +16,109 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#ifdef BCD_MATH
+#include <math.h>
+#endif
 
 #include "core_linalg1.h"
 #include "core_linalg2.h"
 #include "core_main.h"
 #include "core_variables.h"
+#include "shell.h"
+
+
+/************************************/
+/***** Factorization workspaces *****/
+/************************************/
+
+/* The LU matrix and permutation vector used by linalg_div(), linalg_inv(),
+ * and linalg_det() are not freed when the factorization is done, but kept
+ * here, so that a series of operations on same-sized matrices (e.g. repeated
+ * SIMQ solves) don't have to allocate and clear a fresh n*n block each time.
+ * One matrix is kept per type; a workspace is owned by at most one operation
+ * at a time, since get_lu_workspace() detaches it while it is in use.
+ * When memory runs out, the cached workspaces are the first thing to go: the
+ * get_*_workspace() functions free them and try again, and the entry points
+ * free them before reporting ERR_INSUFFICIENT_MEMORY.
+ */
+
+static vartype *lu_real_ws = NULL;
+static vartype *lu_complex_ws = NULL;
+static int4 *perm_ws = NULL;
+static int4 perm_ws_size = 0;
+
+static vartype *get_lu_workspace(int type, int4 n) {
+    vartype **ws = type == TYPE_REALMATRIX ? &lu_real_ws : &lu_complex_ws;
+    vartype *lu = *ws;
+    if (lu != NULL) {
+        int4 rows, columns;
+        *ws = NULL;
+        if (type == TYPE_REALMATRIX) {
+            rows = ((vartype_realmatrix *) lu)->rows;
+            columns = ((vartype_realmatrix *) lu)->columns;
+        } else {
+            rows = ((vartype_complexmatrix *) lu)->rows;
+            columns = ((vartype_complexmatrix *) lu)->columns;
+        }
+        if (rows == n && columns == n)
+            return lu;
+        free_vartype(lu);
+    }
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (type == TYPE_REALMATRIX)
+            lu = new_realmatrix(n, n);
+        else
+            lu = new_complexmatrix(n, n);
+        if (lu != NULL)
+            break;
+        linalg_free_workspaces();
+    }
+    return lu;
+}
+
+static int4 *get_perm_workspace(int4 n) {
+    int4 *perm = perm_ws;
+    perm_ws = NULL;
+    if (perm != NULL && perm_ws_size == n)
+        return perm;
+    free(perm);
+    perm = (int4 *) malloc(n * sizeof(int4));
+    if (perm == NULL) {
+        linalg_free_workspaces();
+        perm = (int4 *) malloc(n * sizeof(int4));
+    }
+    return perm;
+}
+
+static void release_workspace(vartype *lu, int4 *perm) {
+    vartype **ws = lu->type == TYPE_REALMATRIX ? &lu_real_ws : &lu_complex_ws;
+    free_vartype(*ws);
+    *ws = lu;
+    free(perm_ws);
+    perm_ws = perm;
+    perm_ws_size = lu->type == TYPE_REALMATRIX
+                        ? ((vartype_realmatrix *) lu)->rows
+                        : ((vartype_complexmatrix *) lu)->rows;
+}
+
+/* For when an operation can't go ahead for lack of memory: frees its
+ * workspaces, if it has any yet, and the cached ones.
+ */
+static void drop_workspaces(vartype *lu, int4 *perm) {
+    free_vartype(lu);
+    free(perm);
+    linalg_free_workspaces();
+}
+
+void linalg_free_workspaces() {
+    free_vartype(lu_real_ws);
+    lu_real_ws = NULL;
+    free_vartype(lu_complex_ws);
+    lu_complex_ws = NULL;
+    free(perm_ws);
+    perm_ws = NULL;
+    perm_ws_size = 0;
+}
 
 
 /**********************************/
@@ -62,21 +160,20 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_DIMENSION_ERROR, NULL);
                 return ERR_DIMENSION_ERROR;
             }
-            perm = (int4 *) malloc(rows * sizeof(int4));
+            perm = get_perm_workspace(rows);
             if (perm == NULL) {
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            lu = new_realmatrix(rows, rows);
+            lu = get_lu_workspace(TYPE_REALMATRIX, rows);
             if (lu == NULL) {
-                free(perm);
+                drop_workspaces(NULL, perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
             res = new_realmatrix(rows, columns);
             if (res == NULL) {
-                free(perm);
-                free_vartype(lu);
+                drop_workspaces(lu, perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
@@ -97,21 +194,20 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_DIMENSION_ERROR, NULL);
                 return ERR_DIMENSION_ERROR;
             }
-            perm = (int4 *) malloc(rows * sizeof(int4));
+            perm = get_perm_workspace(rows);
             if (perm == NULL) {
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            lu = new_complexmatrix(rows, rows);
+            lu = get_lu_workspace(TYPE_COMPLEXMATRIX, rows);
             if (lu == NULL) {
-                free(perm);
+                drop_workspaces(NULL, perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
             res = new_complexmatrix(rows, columns);
             if (res == NULL) {
-                free(perm);
-                free_vartype(lu);
+                drop_workspaces(lu, perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
@@ -134,21 +230,20 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_DIMENSION_ERROR, 0);
                 return ERR_DIMENSION_ERROR;
             }
-            perm = (int4 *) malloc(rows * sizeof(int4));
+            perm = get_perm_workspace(rows);
             if (perm == NULL) {
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            lu = new_realmatrix(rows, rows);
+            lu = get_lu_workspace(TYPE_REALMATRIX, rows);
             if (lu == NULL) {
-                free(perm);
+                drop_workspaces(NULL, perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
             res = new_complexmatrix(rows, columns);
             if (res == NULL) {
-                free(perm);
-                free_vartype(lu);
+                drop_workspaces(lu, perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
@@ -169,21 +264,20 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_DIMENSION_ERROR, NULL);
                 return ERR_DIMENSION_ERROR;
             }
-            perm = (int4 *) malloc(rows * sizeof(int4));
+            perm = get_perm_workspace(rows);
             if (perm == NULL) {
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
-            lu = new_complexmatrix(rows, rows);
+            lu = get_lu_workspace(TYPE_COMPLEXMATRIX, rows);
             if (lu == NULL) {
-                free(perm);
+                drop_workspaces(NULL, perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
             res = new_complexmatrix(rows, columns);
             if (res == NULL) {
-                free(perm);
-                free_vartype(lu);
+                drop_workspaces(lu, perm);
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
                 return ERR_INSUFFICIENT_MEMORY;
             }
@@ -200,8 +294,7 @@ int linalg_div(const vartype *left, const vartype *right,
 static int div_rr_completion1(int error, vartype_realmatrix *a, int4 *perm,
                                          phloat det) {
     if (error != ERR_NONE) {
-        free_vartype((vartype *) a);
-        free(perm);
+        release_workspace((vartype *) a, perm);
         free_vartype(linalg_div_result);
         return error;
     } else {
@@ -216,16 +309,14 @@ static void div_rr_completion2(int error, vartype_realmatrix *a, int4 *perm,
                                           vartype_realmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    release_workspace((vartype *) a, perm);
     linalg_div_completion(error, linalg_div_result);
 }
 
 static int div_rc_completion1(int error, vartype_complexmatrix *a, int4 *perm,
                                          phloat det_re, phloat det_im) {
     if (error != ERR_NONE) {
-        free_vartype((vartype *) a);
-        free(perm);
+        release_workspace((vartype *) a, perm);
         free_vartype(linalg_div_result);
         return error;
     } else {
@@ -240,16 +331,14 @@ static void div_rc_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                           vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    release_workspace((vartype *) a, perm);
     linalg_div_completion(error, linalg_div_result);
 }
 
 static int div_cr_completion1(int error, vartype_realmatrix *a, int4 *perm,
                                     phloat det) {
     if (error != ERR_NONE) {
-        free_vartype((vartype *) a);
-        free(perm);
+        release_workspace((vartype *) a, perm);
         free_vartype(linalg_div_result);
         return error;
     } else {
@@ -264,16 +353,14 @@ static void div_cr_completion2(int error, vartype_realmatrix *a, int4 *perm,
                                     vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    release_workspace((vartype *) a, perm);
     linalg_div_completion(error, linalg_div_result);
 }
 
 static int div_cc_completion1(int error, vartype_complexmatrix *a, int4 *perm,
                                     phloat det_re, phloat det_im) {
     if (error != ERR_NONE) {
-        free_vartype((vartype *) a);
-        free(perm);
+        release_workspace((vartype *) a, perm);
         free_vartype(linalg_div_result);
         return error;
     } else {
@@ -288,8 +375,7 @@ static void div_cc_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                     vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    release_workspace((vartype *) a, perm);
     linalg_div_completion(error, linalg_div_result);
 }
 
@@ -298,12 +384,161 @@ static void div_cc_completion2(int error, vartype_complexmatrix *a, int4 *perm,
 /***** Matrix-matrix multiplication *****/
 /****************************************/
 
+/* The multiplications are blocked: the product is computed one block of
+ * mul_block_size x mul_block_size at a time, so that the part of the right-
+ * hand matrix being worked on stays in the CPU cache, rather than striding
+ * through all of it for every element of the result. Within a block, the
+ * loops run in i, k, j order, so all three matrices are accessed row by row.
+ * Each element of the result still gets its terms added in order of
+ * increasing k, starting from zero, so the results are exactly the same as
+ * with the straightforward i, j, k algorithm.
+ * The best block size depends on the CPU, so in the binary version, it is
+ * determined by timing a few candidates the first time a large product is
+ * computed. In the decimal version, the arithmetic is so much slower than the
+ * memory accesses that blocking makes little difference, and we just use the
+ * default.
+ */
+
+#define MUL_DEFAULT_BLOCK_SIZE 32
+#define MUL_CALIBRATION_THRESHOLD 128
+#define MUL_OPS_PER_SLICE 50000
+#define MUL_FAST_OPS_PER_SLICE 1000000
+
+static int4 mul_block_size = 0;
+
+typedef struct {
+    int4 i, j, k;
+    int4 ii;
+    int4 bs;
+} mul_pos_struct;
+
+static void mul_row_rr(phloat *prow, const phloat *lrow, const phloat *r,
+                       int4 n, int4 jjmax, int4 kkmax) {
+    for (int4 kk = 0; kk < kkmax; kk++) {
+        phloat tmp = lrow[kk];
+        const phloat *rrow = r + kk * n;
+        for (int4 jj = 0; jj < jjmax; jj++)
+            prow[jj] += tmp * rrow[jj];
+    }
+}
+
+#ifndef BCD_MATH
+static int4 calibrate_mul_block_size() {
+    /* Times a 256 x 256 product with each of the candidate block sizes, and
+     * returns the fastest. This takes on the order of 100 milliseconds.
+     */
+    const int4 t = 256;
+    static const int4 candidates[] = { 16, 24, 32, 48, 64, 96, 128, 0 };
+    phloat *a = (phloat *) malloc(3 * t * t * sizeof(phloat));
+    if (a == NULL)
+        return MUL_DEFAULT_BLOCK_SIZE;
+    phloat *b = a + t * t;
+    phloat *c = b + t * t;
+    int4 i, j, k, ii, c_i;
+    int4 best = MUL_DEFAULT_BLOCK_SIZE;
+    uint4 best_time = 0xffffffff;
+    for (i = 0; i < t * t; i++) {
+        a[i] = (i % 13) * 0.125;
+        b[i] = (i % 7) * 0.25;
+    }
+    for (c_i = 0; candidates[c_i] != 0; c_i++) {
+        int4 bs = candidates[c_i];
+        uint4 start, elapsed;
+        for (i = 0; i < t * t; i++)
+            c[i] = 0;
+        start = shell_milliseconds();
+        for (i = 0; i < t; i += bs)
+            for (j = 0; j < t; j += bs)
+                for (k = 0; k < t; k += bs)
+                    for (ii = i; ii < i + bs && ii < t; ii++)
+                        mul_row_rr(c + ii * t + j, a + ii * t + k,
+                                   b + k * t + j, t,
+                                   t - j < bs ? t - j : bs,
+                                   t - k < bs ? t - k : bs);
+        elapsed = shell_milliseconds() - start;
+        if (elapsed < best_time) {
+            best = bs;
+            best_time = elapsed;
+        }
+    }
+    free(a);
+    return best;
+}
+#endif
+
+static void mul_init_pos(mul_pos_struct *pos, int4 m, int4 n, int4 q) {
+    if (mul_block_size == 0) {
+        if (m < MUL_CALIBRATION_THRESHOLD && n < MUL_CALIBRATION_THRESHOLD
+                && q < MUL_CALIBRATION_THRESHOLD)
+            /* Too small for the block size to matter much */
+            pos->bs = MUL_DEFAULT_BLOCK_SIZE;
+        else {
+#ifdef BCD_MATH
+            mul_block_size = MUL_DEFAULT_BLOCK_SIZE;
+#else
+            mul_block_size = calibrate_mul_block_size();
+#endif
+            pos->bs = mul_block_size;
+        }
+    } else
+        pos->bs = mul_block_size;
+    pos->i = 0;
+    pos->j = 0;
+    pos->k = 0;
+    pos->ii = 0;
+}
+
+/* Moves on to the next row of the current block, or to the first row of
+ * the next block. Returns false if there are no more blocks.
+ */
+static bool mul_next_row(mul_pos_struct *pos, int4 m, int4 n, int4 q) {
+    int4 bs = pos->bs;
+    if (++pos->ii < bs && pos->i + pos->ii < m)
+        return true;
+    pos->ii = 0;
+    if ((pos->k += bs) < q)
+        return true;
+    pos->k = 0;
+    if ((pos->j += bs) < n)
+        return true;
+    pos->j = 0;
+    return (pos->i += bs) < m;
+}
+
+static int mul_check_range(phloat *x) {
+    int inf;
+    if ((inf = p_isinf(*x)) != 0) {
+        if (core_settings.matrix_outofrange && !flags.f.range_error_ignore)
+            return ERR_OUT_OF_RANGE;
+        else
+            *x = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+    }
+    return ERR_NONE;
+}
+
+#ifdef BCD_MATH
+static void mul_row_d(double *prow, const double *lrow, const double *r,
+                      int4 n, int4 jjmax, int4 kkmax) {
+    for (int4 kk = 0; kk < kkmax; kk++) {
+        double tmp = lrow[kk];
+        const double *rrow = r + kk * n;
+        for (int4 jj = 0; jj < jjmax; jj++)
+            prow[jj] += tmp * rrow[jj];
+    }
+}
+#endif
+
 typedef struct {
     vartype_realmatrix *left;
     vartype_realmatrix *right;
     vartype *result;
-    int4 i, j, k;
-    phloat sum;
+    mul_pos_struct pos;
+#ifdef BCD_MATH
+    /* Binary64 copies of the operands and the result, when using the
+     * fast binary mode; see core_settings.matrix_fastbinary.
+     */
+    double *dleft, *dright, *dresult;
+#endif
     void (*completion)(int error, vartype *result);
 } mul_rr_data_struct;
 
@@ -311,6 +546,30 @@ static mul_rr_data_struct *mul_rr_data;
 
 static int matrix_mul_rr_worker(int interrupted);
 
+#ifdef BCD_MATH
+static void mul_rr_free_fast(mul_rr_data_struct *dat) {
+    free(dat->dleft);
+    free(dat->dright);
+    free(dat->dresult);
+    dat->dleft = dat->dright = dat->dresult = NULL;
+}
+
+/* Sets up the binary64 copies of the operands. If that fails, because we're
+ * out of memory, or because some elements are outside the binary64 range,
+ * we just use decimal.
+ */
+static void mul_rr_start_fast(mul_rr_data_struct *dat) {
+    int4 m = dat->left->rows;
+    int4 n = dat->right->columns;
+    int4 q = dat->left->columns;
+    dat->dleft = matrix_to_double(dat->left->array->data, m, q, false);
+    dat->dright = matrix_to_double(dat->right->array->data, q, n, false);
+    dat->dresult = (double *) calloc(m * n, sizeof(double));
+    if (dat->dleft == NULL || dat->dright == NULL || dat->dresult == NULL)
+        mul_rr_free_fast(dat);
+}
+#endif
+
 static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
                          void (*completion)(int, vartype *)) {
 
@@ -342,11 +601,13 @@ static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
 
     dat->left = left;
     dat->right = right;
-    dat->i = 0;
-    dat->j = 0;
-    dat->k = 0;
-    dat->sum = 0;
+    mul_init_pos(&dat->pos, left->rows, right->columns, left->columns);
     dat->completion = completion;
+#ifdef BCD_MATH
+    dat->dleft = dat->dright = dat->dresult = NULL;
+    if (core_settings.matrix_fastbinary)
+        mul_rr_start_fast(dat);
+#endif
 
     mul_rr_data = dat;
     mode_interruptible = matrix_mul_rr_worker;
@@ -360,204 +621,95 @@ static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
 
 static int matrix_mul_rr_worker(int interrupted) {
     mul_rr_data_struct *dat = mul_rr_data;
-    int count = 0;
-    int inf;
+    mul_pos_struct *pos = &dat->pos;
+    int4 count = 0;
     phloat *l = dat->left->array->data;
     phloat *r = dat->right->array->data;
     phloat *p = ((vartype_realmatrix *) dat->result)->array->data;
-    int4 i = dat->i;
-    int4 j = dat->j;
-    int4 k = dat->k;
     int4 m = dat->left->rows;
     int4 n = dat->right->columns;
     int4 q = dat->left->columns;
-    phloat sum = dat->sum;
 
     if (interrupted) {
+#ifdef BCD_MATH
+        mul_rr_free_fast(dat);
+#endif
         dat->completion(ERR_INTERRUPTED, NULL);
         free_vartype(dat->result);
         free(dat);
         return ERR_INTERRUPTED;
     }
 
-    while (count++ < 1000) {
-        sum += l[i * q + k] * r[k * n + j];
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
+#ifdef BCD_MATH
+    if (dat->dresult != NULL) {
+        /* Fast binary mode. The additions are done in the same order as in
+         * the decimal version, but the loop over jj is simple enough for the
+         * compiler to vectorize.
+         */
+        double *dp = dat->dresult;
+        while (count < MUL_FAST_OPS_PER_SLICE) {
+            int4 row = pos->i + pos->ii;
+            int4 jjmax = n - pos->j < pos->bs ? n - pos->j : pos->bs;
+            int4 kkmax = q - pos->k < pos->bs ? q - pos->k : pos->bs;
+            double *prow = dp + row * n + pos->j;
+            mul_row_d(prow, dat->dleft + row * q + pos->k,
+                      dat->dright + pos->k * n + pos->j, n, jjmax, kkmax);
+            if (pos->k + kkmax == q)
+                for (int4 jj = 0; jj < jjmax; jj++)
+                    if (!isfinite(prow[jj])) {
+                        /* Out of binary64 range, but not necessarily
+                         * out of decimal range; that includes NaN, from
+                         * inf - inf, where the decimal sum may well be
+                         * finite. Start over in decimal.
+                         */
+                        mul_rr_free_fast(dat);
+                        mul_init_pos(pos, m, n, q);
+                        return ERR_INTERRUPTIBLE;
+                    }
+            count += jjmax * kkmax;
+            if (!mul_next_row(pos, m, n, q)) {
+                matrix_from_double(p, dp, m, n, false);
+                mul_rr_free_fast(dat);
+                dat->completion(ERR_NONE, dat->result);
                 free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+                return ERR_NONE;
+            }
         }
-        p[i * n + j] = sum;
-        sum = 0;
-        if (++j < n)
-            continue;
-        j = 0;
-        if (++i < m)
-            continue;
-        else {
+        return ERR_INTERRUPTIBLE;
+    }
+#endif
+
+    while (count < MUL_OPS_PER_SLICE) {
+        int4 row = pos->i + pos->ii;
+        int4 jjmax = n - pos->j < pos->bs ? n - pos->j : pos->bs;
+        int4 kkmax = q - pos->k < pos->bs ? q - pos->k : pos->bs;
+        phloat *prow = p + row * n + pos->j;
+        mul_row_rr(prow, l + row * q + pos->k, r + pos->k * n + pos->j,
+                   n, jjmax, kkmax);
+        if (pos->k + kkmax == q)
+            for (int4 jj = 0; jj < jjmax; jj++)
+                if (mul_check_range(prow + jj) != ERR_NONE) {
+                    dat->completion(ERR_OUT_OF_RANGE, NULL);
+                    free_vartype(dat->result);
+                    free(dat);
+                    return ERR_OUT_OF_RANGE;
+                }
+        count += jjmax * kkmax;
+        if (!mul_next_row(pos, m, n, q)) {
             dat->completion(ERR_NONE, dat->result);
             free(dat);
             return ERR_NONE;
         }
     }
 
-    dat->i = i;
-    dat->j = j;
-    dat->k = k;
-    dat->sum = sum;
     return ERR_INTERRUPTIBLE;
 }
 
-#if 0
-/* TODO: Blocked matrix multiplication
- * This commented-out function implements a working blocked matrix
- * multiplication algorithm. It works by breaking up the multiplication into
- * multiplications of submatrices of the multiplicands. If the submatrices are
- * sufficiently small, they can be made to fit entirely in the CPU's L1 cache.
- * With block sizes of around 45, I have observed a speed-up factor of circa
- * 1.7 on a Pentium MMX, and with block sizes of about 90, I have observed a
- * speed-up factor of circa 3 on a Duron. (Those were the optimum block sizes
- * observed for each processor.) These numbers suggest the Pentium MMX has a 32
- * kilobyte L1 cache, and the Duron has a 128 kilobyte L1 cache.
- * For production use, the block size should be a user-configurable parameter,
- * with a built-in tool to automatically determine the optimum value. Since the
- * UI for this kind of advanced configuration does not exist yet, and sice the
- * determination of optimum block size is a very slow process, and since I
- * expect most HP-42S users will not be very interested in using a calculator
- * to work with order-100+ matrices, and since even in the optimum case the
- * speed-up is not staggering, I'm putting full implementation of this feature
- * off until some later date.
- */
-static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
-                         vartype **result) {
-    phloat *cache = NULL;
-    phloat *leftcache, *rightcache;
-
-    phloat *l = left->array->data;
-    phloat *r = right->array->data;
-    phloat *p;
-    int inf;
-    int4 m, n, q;
-    int4 i, j, k;
-
-    q = left->columns;
-    if (q != right->rows)
-        return ERR_DIMENSION_ERROR;
-    m = left->rows;
-    n = right->columns;
-
-    if (!contains_no_strings(left) || !contains_no_strings(right))
-        return ERR_ALPHA_DATA_IS_INVALID;
-
-    *result = new_realmatrix(m, n);
-    if (*result == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    p = ((vartype_realmatrix *) *result)->array->data;
-
-    if (BLOCK_SIZE > 0) {
-        int4 cachesize = 2 * BLOCK_SIZE * BLOCK_SIZE;
-        int4 alignment = CACHE_ALIGNMENT;
-        int4 misalgn;
-        if (alignment == 0)
-            alignment = 1;
-        misalgn = alignment % sizeof(phloat);
-        if (misalgn != 0)
-            alignment += sizeof(phloat) - misalgn;
-
-        cache = (phloat *) malloc(cachesize * sizeof(phloat) + alignment);
-        if (cache != NULL) {
-            misalgn = ((unsigned long) cache) % alignment;
-            if (misalgn == 0)
-                leftcache = cache;
-            else
-                leftcache = cache + (alignment - misalgn) / sizeof(phloat);
-            rightcache = leftcache + BLOCK_SIZE * BLOCK_SIZE;
-        }
-    }
-
-    if (cache == NULL) {
-
-        /* Falling back on basic i,j,k algorithm */
-        for (i = 0; i < m; i++)
-            for (j = 0; j < n; j++) {
-                phloat sum = 0;
-                for (k = 0; k < q; k++)
-                    sum += l[i * q + k] * r[k * n + j];
-                if ((inf = p_isinf(sum)) != 0) {
-                    if (core_settings.matrix_outofrange
-                                            && !flags.f.range_error_ignore)
-                        return ERR_OUT_OF_RANGE;
-                    else
-                        sum = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-                }
-                p[i * n + j] = sum;
-            }
-        return ERR_NONE;
-
-    } else {
-
-        /* Blocked i,j,k algorithm for optimal cache utilization */
-        int4 i, j, k, ii, jj, kk;
-        for (i = 0; i < m; i += BLOCK_SIZE) {
-            int4 iimax = m - i;
-            if (iimax > BLOCK_SIZE)
-                iimax = BLOCK_SIZE;
-            for (j = 0; j < n; j += BLOCK_SIZE) {
-                int4 jjmax = n - j;
-                if (jjmax > BLOCK_SIZE)
-                    jjmax = BLOCK_SIZE;
-                for (k = 0; k < q; k += BLOCK_SIZE) {
-                    int4 kkmax = q - k;
-                    if (kkmax > BLOCK_SIZE)
-                        kkmax = BLOCK_SIZE;
-                    for (ii = 0; ii < iimax; ii++)
-                        for (kk = 0; kk < kkmax; kk++)
-                            leftcache[ii * BLOCK_SIZE + kk]
-                                = l[(ii + i) * q + (kk + k)];
-                    for (kk = 0; kk < kkmax; kk++)
-                        for (jj = 0; jj < jjmax; jj++)
-                            rightcache[kk * BLOCK_SIZE + jj]
-                                = r[(kk + k) * n + (jj + j)];
-                    for (ii = 0; ii < iimax; ii++)
-                        for (jj = 0; jj < jjmax; jj++) {
-                            phloat sum = p[(ii + i) * n + (jj + j)];
-                            for (kk = 0; kk < kkmax; kk++)
-                                sum += leftcache[ii * BLOCK_SIZE + kk]
-                                        * rightcache[kk * BLOCK_SIZE + jj];
-                            if ((inf = p_isinf(sum)) != 0) {
-                                if (core_settings.matrix_outofrange
-                                            && !flags.f.range_error_ignore) {
-                                    free(cache);
-                                    return ERR_OUT_OF_RANGE;
-                                } else
-                                    sum = inf < 0 ? NEG_HUGE_PHLOAT
-                                                  : POS_HUGE_PHLOAT;
-                            }
-                            p[(ii + i) * n + (jj + j)] = sum;
-                        }
-                }
-            }
-        }
-        free(cache);
-        return ERR_NONE;
-
-    }
-}
-#endif
-
 typedef struct {
     vartype_realmatrix *left;
     vartype_complexmatrix *right;
     vartype *result;
-    int4 i, j, k;
-    phloat sum_re, sum_im;
+    mul_pos_struct pos;
     void (*completion)(int error, vartype *result);
 } mul_rc_data_struct;
 
@@ -596,11 +748,7 @@ static int matrix_mul_rc(vartype_realmatrix *left, vartype_complexmatrix *right,
 
     dat->left = left;
     dat->right = right;
-    dat->i = 0;
-    dat->j = 0;
-    dat->k = 0;
-    dat->sum_re = 0;
-    dat->sum_im = 0;
+    mul_init_pos(&dat->pos, left->rows, right->columns, left->columns);
     dat->completion = completion;
 
     mul_rc_data = dat;
@@ -615,19 +763,14 @@ static int matrix_mul_rc(vartype_realmatrix *left, vartype_complexmatrix *right,
 
 static int matrix_mul_rc_worker(int interrupted) {
     mul_rc_data_struct *dat = mul_rc_data;
-    int count = 0;
-    int inf;
+    mul_pos_struct *pos = &dat->pos;
+    int4 count = 0;
     phloat *l = dat->left->array->data;
     phloat *r = dat->right->array->data;
     phloat *p = ((vartype_complexmatrix *) dat->result)->array->data;
-    int4 i = dat->i;
-    int4 j = dat->j;
-    int4 k = dat->k;
     int4 m = dat->left->rows;
     int4 n = dat->right->columns;
     int4 q = dat->left->columns;
-    phloat sum_re = dat->sum_re;
-    phloat sum_im = dat->sum_im;
 
     if (interrupted) {
         dat->completion(ERR_INTERRUPTED, NULL);
@@ -636,52 +779,37 @@ static int matrix_mul_rc_worker(int interrupted) {
         return ERR_INTERRUPTED;
     }
 
-    while (count++ < 1000) {
-        phloat tmp = l[i * q + k];
-        sum_re += tmp * r[2 * (k * n + j)];
-        sum_im += tmp * r[2 * (k * n + j) + 1];
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum_re)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-        }
-        if ((inf = p_isinf(sum_im)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_im = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+    while (count < MUL_OPS_PER_SLICE) {
+        int4 row = pos->i + pos->ii;
+        int4 jjmax = n - pos->j < pos->bs ? n - pos->j : pos->bs;
+        int4 kkmax = q - pos->k < pos->bs ? q - pos->k : pos->bs;
+        phloat *prow = p + 2 * (row * n + pos->j);
+        phloat *lrow = l + row * q + pos->k;
+        int4 jj, kk;
+        for (kk = 0; kk < kkmax; kk++) {
+            phloat tmp = lrow[kk];
+            phloat *rrow = r + 2 * ((pos->k + kk) * n + pos->j);
+            for (jj = 0; jj < 2 * jjmax; jj += 2) {
+                prow[jj] += tmp * rrow[jj];
+                prow[jj + 1] += tmp * rrow[jj + 1];
+            }
         }
-        p[2 * (i * n + j)] = sum_re;
-        p[2 * (i * n + j) + 1] = sum_im;
-        sum_re = 0;
-        sum_im = 0;
-        if (++j < n)
-            continue;
-        j = 0;
-        if (++i < m)
-            continue;
-        else {
+        if (pos->k + kkmax == q)
+            for (jj = 0; jj < 2 * jjmax; jj++)
+                if (mul_check_range(prow + jj) != ERR_NONE) {
+                    dat->completion(ERR_OUT_OF_RANGE, NULL);
+                    free_vartype(dat->result);
+                    free(dat);
+                    return ERR_OUT_OF_RANGE;
+                }
+        count += jjmax * kkmax;
+        if (!mul_next_row(pos, m, n, q)) {
             dat->completion(ERR_NONE, dat->result);
             free(dat);
             return ERR_NONE;
         }
     }
 
-    dat->i = i;
-    dat->j = j;
-    dat->k = k;
-    dat->sum_re = sum_re;
-    dat->sum_im = sum_im;
     return ERR_INTERRUPTIBLE;
 }
 
@@ -689,8 +817,7 @@ typedef struct {
     vartype_complexmatrix *left;
     vartype_realmatrix *right;
     vartype *result;
-    int4 i, j, k;
-    phloat sum_re, sum_im;
+    mul_pos_struct pos;
     void (*completion)(int error, vartype *result);
 } mul_cr_data_struct;
 
@@ -729,11 +856,7 @@ static int matrix_mul_cr(vartype_complexmatrix *left, vartype_realmatrix *right,
 
     dat->left = left;
     dat->right = right;
-    dat->i = 0;
-    dat->j = 0;
-    dat->k = 0;
-    dat->sum_re = 0;
-    dat->sum_im = 0;
+    mul_init_pos(&dat->pos, left->rows, right->columns, left->columns);
     dat->completion = completion;
 
     mul_cr_data = dat;
@@ -748,19 +871,14 @@ static int matrix_mul_cr(vartype_complexmatrix *left, vartype_realmatrix *right,
 
 static int matrix_mul_cr_worker(int interrupted) {
     mul_cr_data_struct *dat = mul_cr_data;
-    int count = 0;
-    int inf;
+    mul_pos_struct *pos = &dat->pos;
+    int4 count = 0;
     phloat *l = dat->left->array->data;
     phloat *r = dat->right->array->data;
     phloat *p = ((vartype_complexmatrix *) dat->result)->array->data;
-    int4 i = dat->i;
-    int4 j = dat->j;
-    int4 k = dat->k;
     int4 m = dat->left->rows;
     int4 n = dat->right->columns;
     int4 q = dat->left->columns;
-    phloat sum_re = dat->sum_re;
-    phloat sum_im = dat->sum_im;
 
     if (interrupted) {
         dat->completion(ERR_INTERRUPTED, NULL);
@@ -769,52 +887,39 @@ static int matrix_mul_cr_worker(int interrupted) {
         return ERR_INTERRUPTED;
     }
 
-    while (count++ < 1000) {
-        phloat tmp = r[k * n + j];
-        sum_re += tmp * l[2 * (i * q + k)];
-        sum_im += tmp * l[2 * (i * q + k) + 1];
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum_re)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-        }
-        if ((inf = p_isinf(sum_im)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_im = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+    while (count < MUL_OPS_PER_SLICE) {
+        int4 row = pos->i + pos->ii;
+        int4 jjmax = n - pos->j < pos->bs ? n - pos->j : pos->bs;
+        int4 kkmax = q - pos->k < pos->bs ? q - pos->k : pos->bs;
+        phloat *prow = p + 2 * (row * n + pos->j);
+        phloat *lrow = l + 2 * (row * q + pos->k);
+        int4 jj, kk;
+        for (kk = 0; kk < kkmax; kk++) {
+            phloat l_re = lrow[2 * kk];
+            phloat l_im = lrow[2 * kk + 1];
+            phloat *rrow = r + (pos->k + kk) * n + pos->j;
+            for (jj = 0; jj < jjmax; jj++) {
+                phloat tmp = rrow[jj];
+                prow[2 * jj] += tmp * l_re;
+                prow[2 * jj + 1] += tmp * l_im;
+            }
         }
-        p[2 * (i * n + j)] = sum_re;
-        p[2 * (i * n + j) + 1] = sum_im;
-        sum_re = 0;
-        sum_im = 0;
-        if (++j < n)
-            continue;
-        j = 0;
-        if (++i < m)
-            continue;
-        else {
+        if (pos->k + kkmax == q)
+            for (jj = 0; jj < 2 * jjmax; jj++)
+                if (mul_check_range(prow + jj) != ERR_NONE) {
+                    dat->completion(ERR_OUT_OF_RANGE, NULL);
+                    free_vartype(dat->result);
+                    free(dat);
+                    return ERR_OUT_OF_RANGE;
+                }
+        count += jjmax * kkmax;
+        if (!mul_next_row(pos, m, n, q)) {
             dat->completion(ERR_NONE, dat->result);
             free(dat);
             return ERR_NONE;
         }
     }
 
-    dat->i = i;
-    dat->j = j;
-    dat->k = k;
-    dat->sum_re = sum_re;
-    dat->sum_im = sum_im;
     return ERR_INTERRUPTIBLE;
 }
 
@@ -822,8 +927,7 @@ typedef struct {
     vartype_complexmatrix *left;
     vartype_complexmatrix *right;
     vartype *result;
-    int4 i, j, k;
-    phloat sum_re, sum_im;
+    mul_pos_struct pos;
     void (*completion)(int error, vartype *result);
 } mul_cc_data_struct;
 
@@ -857,11 +961,7 @@ static int matrix_mul_cc(vartype_complexmatrix *left, vartype_complexmatrix *rig
 
     dat->left = left;
     dat->right = right;
-    dat->i = 0;
-    dat->j = 0;
-    dat->k = 0;
-    dat->sum_re = 0;
-    dat->sum_im = 0;
+    mul_init_pos(&dat->pos, left->rows, right->columns, left->columns);
     dat->completion = completion;
 
     mul_cc_data = dat;
@@ -876,19 +976,14 @@ static int matrix_mul_cc(vartype_complexmatrix *left, vartype_complexmatrix *rig
 
 static int matrix_mul_cc_worker(int interrupted) {
     mul_cc_data_struct *dat = mul_cc_data;
-    int count = 0;
-    int inf;
+    mul_pos_struct *pos = &dat->pos;
+    int4 count = 0;
     phloat *l = dat->left->array->data;
     phloat *r = dat->right->array->data;
     phloat *p = ((vartype_complexmatrix *) dat->result)->array->data;
-    int4 i = dat->i;
-    int4 j = dat->j;
-    int4 k = dat->k;
     int4 m = dat->left->rows;
     int4 n = dat->right->columns;
     int4 q = dat->left->columns;
-    phloat sum_re = dat->sum_re;
-    phloat sum_im = dat->sum_im;
 
     if (interrupted) {
         dat->completion(ERR_INTERRUPTED, NULL);
@@ -897,55 +992,40 @@ static int matrix_mul_cc_worker(int interrupted) {
         return ERR_INTERRUPTED;
     }
 
-    while (count++ < 1000) {
-        phloat l_re = l[2 * (i * q + k)];
-        phloat l_im = l[2 * (i * q + k) + 1];
-        phloat r_re = r[2 * (k * n + j)];
-        phloat r_im = r[2 * (k * n + j) + 1];
-        sum_re += l_re * r_re - l_im * r_im;
-        sum_im += l_im * r_re + l_re * r_im;
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum_re)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-        }
-        if ((inf = p_isinf(sum_im)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_im = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+    while (count < MUL_OPS_PER_SLICE) {
+        int4 row = pos->i + pos->ii;
+        int4 jjmax = n - pos->j < pos->bs ? n - pos->j : pos->bs;
+        int4 kkmax = q - pos->k < pos->bs ? q - pos->k : pos->bs;
+        phloat *prow = p + 2 * (row * n + pos->j);
+        phloat *lrow = l + 2 * (row * q + pos->k);
+        int4 jj, kk;
+        for (kk = 0; kk < kkmax; kk++) {
+            phloat l_re = lrow[2 * kk];
+            phloat l_im = lrow[2 * kk + 1];
+            phloat *rrow = r + 2 * ((pos->k + kk) * n + pos->j);
+            for (jj = 0; jj < 2 * jjmax; jj += 2) {
+                phloat r_re = rrow[jj];
+                phloat r_im = rrow[jj + 1];
+                prow[jj] += l_re * r_re - l_im * r_im;
+                prow[jj + 1] += l_im * r_re + l_re * r_im;
+            }
         }
-        p[2 * (i * n + j)] = sum_re;
-        p[2 * (i * n + j) + 1] = sum_im;
-        sum_re = 0;
-        sum_im = 0;
-        if (++j < n)
-            continue;
-        j = 0;
-        if (++i < m)
-            continue;
-        else {
+        if (pos->k + kkmax == q)
+            for (jj = 0; jj < 2 * jjmax; jj++)
+                if (mul_check_range(prow + jj) != ERR_NONE) {
+                    dat->completion(ERR_OUT_OF_RANGE, NULL);
+                    free_vartype(dat->result);
+                    free(dat);
+                    return ERR_OUT_OF_RANGE;
+                }
+        count += jjmax * kkmax;
+        if (!mul_next_row(pos, m, n, q)) {
             dat->completion(ERR_NONE, dat->result);
             free(dat);
             return ERR_NONE;
         }
     }
 
-    dat->i = i;
-    dat->j = j;
-    dat->k = k;
-    dat->sum_re = sum_re;
-    dat->sum_im = sum_im;
     return ERR_INTERRUPTIBLE;
 }
 
@@ -1000,17 +1080,19 @@ int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
             return ERR_DIMENSION_ERROR;
         if (!contains_no_strings(ma))
             return ERR_ALPHA_DATA_IS_INVALID;
-        lu = new_realmatrix(n, n);
-        if (lu == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
         inv = new_realmatrix(n, n);
         if (inv == NULL) {
-            free_vartype(lu);
+            linalg_free_workspaces();
             return ERR_INSUFFICIENT_MEMORY;
         }
-        perm = (int4 *) malloc(n * sizeof(int4));
+        perm = get_perm_workspace(n);
         if (perm == NULL) {
-            free_vartype(lu);
+            free_vartype(inv);
+            return ERR_INSUFFICIENT_MEMORY;
+        }
+        lu = get_lu_workspace(TYPE_REALMATRIX, n);
+        if (lu == NULL) {
+            drop_workspaces(NULL, perm);
             free_vartype(inv);
             return ERR_INSUFFICIENT_MEMORY;
         }
@@ -1024,17 +1106,19 @@ int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
         n = ma->rows;
         if (n != ma->columns)
             return ERR_DIMENSION_ERROR;
-        lu = new_complexmatrix(n, n);
-        if (lu == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
         inv = new_complexmatrix(n, n);
         if (inv == NULL) {
-            free_vartype(lu);
+            linalg_free_workspaces();
             return ERR_INSUFFICIENT_MEMORY;
         }
-        perm = (int4 *) malloc(n * sizeof(int4));
+        perm = get_perm_workspace(n);
         if (perm == NULL) {
-            free_vartype(lu);
+            free_vartype(inv);
+            return ERR_INSUFFICIENT_MEMORY;
+        }
+        lu = get_lu_workspace(TYPE_COMPLEXMATRIX, n);
+        if (lu == NULL) {
+            drop_workspaces(NULL, perm);
             free_vartype(inv);
             return ERR_INSUFFICIENT_MEMORY;
         }
@@ -1050,8 +1134,7 @@ static int inv_r_completion1(int error, vartype_realmatrix *a, int4 *perm,
                                 phloat det) {
     if (error != ERR_NONE) {
         free_vartype(linalg_inv_result);
-        free_vartype((vartype *) a);
-        free(perm);
+        release_workspace((vartype *) a, perm);
         linalg_inv_completion(error, NULL);
         return error;
     } else {
@@ -1067,8 +1150,7 @@ static void inv_r_completion2(int error, vartype_realmatrix *a, int4 *perm,
                                 vartype_realmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_inv_result); /* Note: linalg_inv_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    release_workspace((vartype *) a, perm);
     linalg_inv_completion(error, linalg_inv_result);
 }
 
@@ -1076,8 +1158,7 @@ static int inv_c_completion1(int error, vartype_complexmatrix *a, int4 *perm,
                                 phloat det_re, phloat det_im) {
     if (error != ERR_NONE) {
         free_vartype(linalg_inv_result);
-        free_vartype((vartype *) a);
-        free(perm);
+        release_workspace((vartype *) a, perm);
         linalg_inv_completion(error, NULL);
         return error;
     } else {
@@ -1094,8 +1175,7 @@ static void inv_c_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                 vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_inv_result); /* Note: linalg_inv_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    release_workspace((vartype *) a, perm);
     linalg_inv_completion(error, linalg_inv_result);
 }
 
@@ -1126,22 +1206,18 @@ int linalg_det(const vartype *src, void (*completion)(int, vartype *)) {
             completion(ERR_ALPHA_DATA_IS_INVALID, 0);
             return ERR_ALPHA_DATA_IS_INVALID;
         }
-        ma = (vartype_realmatrix *) dup_vartype(src);
-        if (ma == NULL) {
-            completion(ERR_INSUFFICIENT_MEMORY, 0);
-            return ERR_INSUFFICIENT_MEMORY;
-        }
-        if (!disentangle((vartype *) ma)) {
-            free_vartype((vartype *) ma);
+        perm = get_perm_workspace(n);
+        if (perm == NULL) {
             completion(ERR_INSUFFICIENT_MEMORY, 0);
             return ERR_INSUFFICIENT_MEMORY;
         }
-        perm = (int4 *) malloc(n * sizeof(int4));
-        if (perm == NULL) {
-            free_vartype((vartype *) ma);
+        ma = (vartype_realmatrix *) get_lu_workspace(TYPE_REALMATRIX, n);
+        if (ma == NULL) {
+            drop_workspaces(NULL, perm);
             completion(ERR_INSUFFICIENT_MEMORY, 0);
             return ERR_INSUFFICIENT_MEMORY;
         }
+        matrix_copy((vartype *) ma, src);
 
         /* Before calling lu_decomp_r, make sure the 'singular matrix'
          * error reporting mode is on; we don't want the HP-42S compatible
@@ -1160,19 +1236,15 @@ int linalg_det(const vartype *src, void (*completion)(int, vartype *)) {
         n = ma->rows;
         if (n != ma->columns)
             return ERR_DIMENSION_ERROR;
-        ma = (vartype_complexmatrix *) dup_vartype(src);
-        if (ma == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        if (!disentangle((vartype *) ma)) {
-            free_vartype((vartype *) ma);
+        perm = get_perm_workspace(n);
+        if (perm == NULL)
             return ERR_INSUFFICIENT_MEMORY;
-        }
-        n = ma->rows;
-        perm = (int4 *) malloc(n * sizeof(int4));
-        if (perm == NULL) {
-            free_vartype((vartype *) ma);
+        ma = (vartype_complexmatrix *) get_lu_workspace(TYPE_COMPLEXMATRIX, n);
+        if (ma == NULL) {
+            drop_workspaces(NULL, perm);
             return ERR_INSUFFICIENT_MEMORY;
         }
+        matrix_copy((vartype *) ma, src);
 
         /* Before calling lu_decomp_c, make sure the 'singular matrix'
          * error reporting mode is on; we don't want the HP-42S compatible
@@ -1195,8 +1267,7 @@ static int det_r_completion(int error, vartype_realmatrix *a, int4 *perm,
 
     core_settings.matrix_singularmatrix = linalg_det_prev_sm_err;
 
-    free_vartype((vartype *) a);
-    free(perm);
+    release_workspace((vartype *) a, perm);
     if (error == ERR_SINGULAR_MATRIX) {
         det = 0;
         error = ERR_NONE;
@@ -1226,8 +1297,7 @@ static int det_c_completion(int error, vartype_complexmatrix *a, int4 *perm,
 
     core_settings.matrix_singularmatrix = linalg_det_prev_sm_err;
 
-    free_vartype((vartype *) a);
-    free(perm);
+    release_workspace((vartype *) a, perm);
     if (error == ERR_SINGULAR_MATRIX) {
         det_re = 0;
         det_im = 0;
@@ -26,5 +26,6 @@ int linalg_mul(const vartype *left, const vartype *right,
                              void (*completion)(int, vartype *));
 int linalg_inv(const vartype *src, void (*completion)(int, vartype *));
 int linalg_det(const vartype *src, void (*completion)(int, vartype *));
+void linalg_free_workspaces();
 
 #endif
@@ -16,6 +16,17 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#ifdef BCD_MATH
+#include <float.h>
+#include <math.h>
+#endif
+#ifdef WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #include "core_linalg2.h"
 #include "core_globals.h"
@@ -31,6 +42,196 @@
         ;
 
 
+/**************************/
+/***** Worker threads *****/
+/**************************/
+
+/* Large LU decompositions and back-substitutions are spread over all CPU
+ * cores. The threads are started the first time they are needed, and then
+ * stay around, waiting for work. The main thread hands out a job, does its
+ * own share of it, and waits for the other threads to finish theirs, so the
+ * threads are always idle when the worker returns to the shell, and
+ * interrupting a calculation requires no special handling.
+ * The jobs only ever write to disjoint parts of the matrices. In the decimal
+ * version, every operation also updates the decimal library's exception
+ * flags, which it is built to keep in a global (GLOBAL_FLAGS=1). bid_conf.h
+ * declares that global, and the rounding mode, BID_THREAD, which makes each
+ * thread get its own copy, except on Apple platforms, where BID_THREAD is
+ * empty; so the decimal version only uses threads elsewhere.
+ */
+
+#define LINALG_MAX_THREADS 16
+
+#ifdef BCD_MATH
+/* Minimum matrix size for using threads, and the minimum number of
+ * multiply-adds to give to each thread
+ */
+#define LINALG_PARALLEL_MIN_SIZE 32
+#define LINALG_PARALLEL_MIN_OPS 1000
+#else
+#define LINALG_PARALLEL_MIN_SIZE 256
+#define LINALG_PARALLEL_MIN_OPS 20000
+#endif
+/* Number of multiply-adds per thread before returning to the shell */
+#define LINALG_PARALLEL_OPS_PER_SLICE 20000
+
+typedef int (*par_job)(void *arg, int4 begin, int4 end);
+
+typedef struct {
+    par_job job;
+    void *arg;
+    int4 begin, end;
+    int result;
+} par_task_struct;
+
+static int par_nthreads = 0;
+static par_task_struct par_task[LINALG_MAX_THREADS];
+static int par_index[LINALG_MAX_THREADS];
+
+#ifdef WINDOWS
+static HANDLE par_start[LINALG_MAX_THREADS];
+static HANDLE par_done;
+static volatile LONG par_pending;
+
+static DWORD WINAPI par_thread(LPVOID arg) {
+    par_task_struct *task = par_task + *(int *) arg;
+    while (true) {
+        WaitForSingleObject(par_start[task - par_task], INFINITE);
+        task->result = task->job(task->arg, task->begin, task->end);
+        if (InterlockedDecrement(&par_pending) == 0)
+            SetEvent(par_done);
+    }
+    return 0;
+}
+#else
+static pthread_mutex_t par_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t par_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t par_done = PTHREAD_COND_INITIALIZER;
+static int par_pending;
+static int4 par_generation = 0;
+
+static void *par_thread(void *arg) {
+    par_task_struct *task = par_task + *(int *) arg;
+    int4 generation = 0;
+    pthread_mutex_lock(&par_mutex);
+    while (true) {
+        while (par_generation == generation)
+            pthread_cond_wait(&par_start, &par_mutex);
+        generation = par_generation;
+        pthread_mutex_unlock(&par_mutex);
+        task->result = task->job(task->arg, task->begin, task->end);
+        pthread_mutex_lock(&par_mutex);
+        if (--par_pending == 0)
+            pthread_cond_signal(&par_done);
+    }
+    return NULL;
+}
+#endif
+
+/* Returns the number of threads available for linear algebra, including
+ * the main thread; starts the other threads the first time it is called.
+ */
+static int par_threads() {
+    if (par_nthreads != 0)
+        return par_nthreads;
+    int ncpus;
+#if defined(BCD_MATH) && defined(__APPLE__)
+    /* Shared decimal exception flags; see above */
+    ncpus = 1;
+#elif defined(WINDOWS)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    ncpus = (int) info.dwNumberOfProcessors;
+    par_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (par_done == NULL)
+        ncpus = 1;
+#else
+    ncpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (ncpus > LINALG_MAX_THREADS)
+        ncpus = LINALG_MAX_THREADS;
+    par_nthreads = 1;
+    while (par_nthreads < ncpus) {
+        int t = par_nthreads;
+        par_index[t] = t;
+#ifdef WINDOWS
+        par_start[t] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (par_start[t] == NULL)
+            break;
+        HANDLE h = CreateThread(NULL, 0, par_thread, par_index + t, 0, NULL);
+        if (h == NULL) {
+            CloseHandle(par_start[t]);
+            break;
+        }
+        CloseHandle(h);
+#else
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, par_thread, par_index + t) != 0)
+            break;
+        pthread_detach(thread);
+#endif
+        par_nthreads++;
+    }
+    return par_nthreads;
+}
+
+/* Calls job(arg, b, e) for consecutive ranges [b, e) covering [begin, end),
+ * using as many threads as are available, but giving each at least 'grain'
+ * items. Returns the first nonzero job result, if any.
+ */
+static int par_run(par_job job, void *arg, int4 begin, int4 end, int4 grain) {
+    int4 count = end - begin;
+    int nt = par_threads();
+    if (grain < 1)
+        grain = 1;
+    if (nt > count / grain)
+        nt = (int) (count / grain);
+    if (nt <= 1)
+        return job(arg, begin, end);
+
+    int t;
+    for (t = 0; t < nt; t++) {
+        par_task[t].job = job;
+        par_task[t].arg = arg;
+        par_task[t].begin = begin + (int4) ((int8) count * t / nt);
+        par_task[t].end = begin + (int4) ((int8) count * (t + 1) / nt);
+    }
+#ifdef WINDOWS
+    par_pending = nt - 1;
+    for (t = 1; t < nt; t++)
+        SetEvent(par_start[t]);
+#else
+    /* Threads that aren't needed this time get an empty range */
+    for (t = nt; t < par_nthreads; t++) {
+        par_task[t].job = job;
+        par_task[t].arg = arg;
+        par_task[t].begin = par_task[t].end = end;
+    }
+    pthread_mutex_lock(&par_mutex);
+    par_pending = par_nthreads - 1;
+    par_generation++;
+    pthread_cond_broadcast(&par_start);
+    pthread_mutex_unlock(&par_mutex);
+#endif
+
+    par_task[0].result = job(arg, par_task[0].begin, par_task[0].end);
+
+#ifdef WINDOWS
+    WaitForSingleObject(par_done, INFINITE);
+#else
+    pthread_mutex_lock(&par_mutex);
+    while (par_pending > 0)
+        pthread_cond_wait(&par_done, &par_mutex);
+    pthread_mutex_unlock(&par_mutex);
+#endif
+
+    for (t = 0; t < nt; t++)
+        if (par_task[t].result != 0)
+            return par_task[t].result;
+    return 0;
+}
+
+
 /****************************/
 /***** LU decomposition *****/
 /****************************/
@@ -48,9 +249,36 @@ typedef struct {
 lu_r_data_struct *lu_r_data;
 
 static int lu_decomp_r_worker(int interrupted);
+static bool lu_decomp_r_par(vartype_realmatrix *a, int4 *perm,
+                int (*completion)(int, vartype_realmatrix *, int4 *, phloat));
+#ifdef BCD_MATH
+static bool lu_decomp_r_fast(vartype_realmatrix *a, int4 *perm,
+                int (*completion)(int, vartype_realmatrix *, int4 *, phloat),
+                int *err);
+static int lu_decomp_r_exact(vartype_realmatrix *a, int4 *perm,
+                int (*completion)(int, vartype_realmatrix *, int4 *, phloat));
 
 int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
                 int (*completion)(int, vartype_realmatrix *, int4 *, phloat)) {
+    int fast_err;
+    if (core_settings.matrix_fastbinary
+            && lu_decomp_r_fast(a, perm, completion, &fast_err))
+        return fast_err;
+    return lu_decomp_r_exact(a, perm, completion);
+}
+
+/* LU decomposition in decimal; this is also where the fast binary version
+ * ends up when it runs into something it can't handle.
+ */
+static int lu_decomp_r_exact(vartype_realmatrix *a, int4 *perm,
+                int (*completion)(int, vartype_realmatrix *, int4 *, phloat)) {
+#else
+int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
+                int (*completion)(int, vartype_realmatrix *, int4 *, phloat)) {
+#endif
+    if (lu_decomp_r_par(a, perm, completion))
+        return ERR_INTERRUPTIBLE;
+
     lu_r_data_struct *dat =
                 (lu_r_data_struct *) malloc(sizeof(lu_r_data_struct));
 
@@ -223,7 +451,7 @@ typedef struct {
     int4 *perm;
     phloat det_re, det_im;
     int4 i, imax, j, k;
-    phloat max, tmp, tmp_re, tmp_im, sum_re, sum_im, *scale;
+    phloat max, tmp, tmp_re, tmp_im, sum_re, sum_im, s_re, s_im, *scale;
     int state;
     int (*completion)(int, vartype_complexmatrix *, int4 *, phloat, phloat);
 } lu_c_data_struct;
@@ -231,10 +459,16 @@ typedef struct {
 lu_c_data_struct *lu_c_data;
 
 static int lu_decomp_c_worker(int interrupted);
+static bool lu_decomp_c_par(vartype_complexmatrix *a, int4 *perm,
+                int (*completion)(int, vartype_complexmatrix *,
+                                          int4 *, phloat, phloat));
 
 int lu_decomp_c(vartype_complexmatrix *a, int4 *perm,
                 int (*completion)(int, vartype_complexmatrix *,
                                           int4 *, phloat, phloat)) {
+    if (lu_decomp_c_par(a, perm, completion))
+        return ERR_INTERRUPTIBLE;
+
     lu_c_data_struct *dat =
                 (lu_c_data_struct *) malloc(sizeof(lu_c_data_struct));
 
@@ -280,11 +514,12 @@ static int lu_decomp_c_worker(int interrupted) {
     phloat tmp_im = dat->tmp_im;
     phloat sum_re = dat->sum_re;
     phloat sum_im = dat->sum_im;
+    phloat s_re = dat->s_re;
+    phloat s_im = dat->s_im;
 
     phloat xre, xim, yre, yim;
     phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
     phloat tiny;
-    phloat s_re, s_im;
 
     if (interrupted) {
         free(scale);
@@ -380,7 +615,7 @@ static int lu_decomp_c_worker(int interrupted) {
         if (tmp_re == 0 && tmp_im == 0) {
             if (core_settings.matrix_singularmatrix) {
                 free(scale);
-                err = dat->completion(ERR_NONE, dat->a, perm, 0, 0);
+                err = dat->completion(ERR_SINGULAR_MATRIX, dat->a, perm, 0, 0);
                 free(dat);
                 return err;
             } else {
@@ -433,6 +668,8 @@ static int lu_decomp_c_worker(int interrupted) {
     dat->tmp_im = tmp_im;
     dat->sum_re = sum_re;
     dat->sum_im = sum_im;
+    dat->s_re = s_re;
+    dat->s_im = s_im;
     return ERR_INTERRUPTIBLE;
 }
 
@@ -441,6 +678,13 @@ static int lu_decomp_c_worker(int interrupted) {
 /***** Back-substitution *****/
 /*****************************/
 
+#define BACKSUB_RR 0
+#define BACKSUB_RC 1
+#define BACKSUB_CC 2
+
+static bool backsub_par(int type, vartype *a, int4 *perm, vartype *b,
+                        void (*completion)());
+
 typedef struct {
     vartype_realmatrix *a;
     int4 *perm;
@@ -454,10 +698,41 @@ typedef struct {
 static backsub_rr_data_struct *backsub_rr_data;
 
 static int lu_backsubst_rr_worker(int interrupted);
+#ifdef BCD_MATH
+static bool lu_backsubst_rr_fast(vartype_realmatrix *a, int4 *perm,
+                    vartype_realmatrix *b,
+                    void (*completion)(int, vartype_realmatrix *,
+                                    int4 *, vartype_realmatrix *));
+static int lu_backsubst_rr_exact(vartype_realmatrix *a, int4 *perm,
+                    vartype_realmatrix *b,
+                    void (*completion)(int, vartype_realmatrix *,
+                                    int4 *, vartype_realmatrix *));
 
 int lu_backsubst_rr(vartype_realmatrix *a, int4 *perm, vartype_realmatrix *b,
                     void (*completion)(int, vartype_realmatrix *,
                                     int4 *, vartype_realmatrix *)) {
+    if (core_settings.matrix_fastbinary
+            && lu_backsubst_rr_fast(a, perm, b, completion))
+        return ERR_INTERRUPTIBLE;
+    return lu_backsubst_rr_exact(a, perm, b, completion);
+}
+
+/* Back-substitution in decimal; this is also where the fast binary version
+ * ends up when it runs into something it can't handle.
+ */
+static int lu_backsubst_rr_exact(vartype_realmatrix *a, int4 *perm,
+                    vartype_realmatrix *b,
+                    void (*completion)(int, vartype_realmatrix *,
+                                    int4 *, vartype_realmatrix *)) {
+#else
+int lu_backsubst_rr(vartype_realmatrix *a, int4 *perm, vartype_realmatrix *b,
+                    void (*completion)(int, vartype_realmatrix *,
+                                    int4 *, vartype_realmatrix *)) {
+#endif
+    if (backsub_par(BACKSUB_RR, (vartype *) a, perm, (vartype *) b,
+                    (void (*)()) completion))
+        return ERR_INTERRUPTIBLE;
+
     backsub_rr_data_struct *dat =
             (backsub_rr_data_struct *) malloc(sizeof(backsub_rr_data_struct));
 
@@ -574,6 +849,10 @@ static int lu_backsubst_rc_worker(int interrupted);
 int lu_backsubst_rc(vartype_realmatrix *a, int4 *perm, vartype_complexmatrix *b,
                     void (*completion)(int, vartype_realmatrix *,
                                 int4 *, vartype_complexmatrix *)) {
+    if (backsub_par(BACKSUB_RC, (vartype *) a, perm, (vartype *) b,
+                    (void (*)()) completion))
+        return ERR_INTERRUPTIBLE;
+
     backsub_rc_data_struct *dat =
             (backsub_rc_data_struct *) malloc(sizeof(backsub_rc_data_struct));
 
@@ -711,6 +990,10 @@ static int lu_backsubst_cc_worker(int interrupted);
 int lu_backsubst_cc(vartype_complexmatrix *a, int4 *perm, vartype_complexmatrix *b,
                     void (*completion)(int, vartype_complexmatrix *,
                                 int4 *, vartype_complexmatrix *)) {
+    if (backsub_par(BACKSUB_CC, (vartype *) a, perm, (vartype *) b,
+                    (void (*)()) completion))
+        return ERR_INTERRUPTIBLE;
+
     backsub_cc_data_struct *dat =
             (backsub_cc_data_struct *) malloc(sizeof(backsub_cc_data_struct));
 
@@ -840,3 +1123,1024 @@ static int lu_backsubst_cc_worker(int interrupted) {
     dat->sum_im = sum_im;
     return ERR_INTERRUPTIBLE;
 }
+
+
+/*****************************************************************/
+/***** Parallel LU decomposition and back-substitution *****/
+/*****************************************************************/
+
+/* The parallel LU decomposition uses the right-looking form of the
+ * algorithm: after choosing the pivot for column j, the trailing part of
+ * the matrix is updated using row j and column j, and that update is spread
+ * over the worker threads, by rows. Every element gets exactly the same
+ * operations, in the same order, as in the Crout algorithm used by the
+ * serial workers, so the results are identical. The exception is when the
+ * matrix has a row of all zeroes; those are handled by the serial workers.
+ * The parallel back-substitution simply handles several right-hand-side
+ * columns at once.
+ */
+
+static int4 par_grain(int4 ops_per_item) {
+    return ops_per_item == 0 ? 1
+                : (LINALG_PARALLEL_MIN_OPS + ops_per_item - 1) / ops_per_item;
+}
+
+/* Returns the scale factors for the rows of 'a' (the largest absolute value
+ * in each row), or NULL if 'a' has a row of all zeroes, or if we're out of
+ * memory.
+ */
+static phloat *par_row_scales(const phloat *a, int4 n, bool cpx) {
+    phloat *scale = (phloat *) malloc(n * sizeof(phloat));
+    if (scale == NULL)
+        return NULL;
+    for (int4 i = 0; i < n; i++) {
+        phloat max = 0, tmp;
+        for (int4 j = 0; j < n; j++) {
+            if (cpx)
+                tmp = hypot(a[2 * (i * n + j)], a[2 * (i * n + j) + 1]);
+            else {
+                tmp = a[i * n + j];
+                if (tmp < 0)
+                    tmp = -tmp;
+            }
+            if (tmp > max)
+                max = tmp;
+        }
+        if (max == 0) {
+            free(scale);
+            return NULL;
+        }
+        scale[i] = max;
+    }
+    return scale;
+}
+
+typedef struct {
+    phloat *a;
+    int4 n, j;
+} par_update_struct;
+
+static int lu_r_update_rows(void *arg, int4 begin, int4 end) {
+    par_update_struct *u = (par_update_struct *) arg;
+    phloat *a = u->a;
+    int4 n = u->n;
+    int4 j = u->j;
+    const phloat *urow = a + j * n;
+    for (int4 i = begin; i < end; i++) {
+        phloat *row = a + i * n;
+        phloat l = row[j];
+        for (int4 k = j + 1; k < n; k++)
+            row[k] -= l * urow[k];
+    }
+    return 0;
+}
+
+static int lu_c_update_rows(void *arg, int4 begin, int4 end) {
+    par_update_struct *u = (par_update_struct *) arg;
+    phloat *a = u->a;
+    int4 n = u->n;
+    int4 j = u->j;
+    const phloat *urow = a + 2 * j * n;
+    for (int4 i = begin; i < end; i++) {
+        phloat *row = a + 2 * i * n;
+        phloat xre = row[2 * j];
+        phloat xim = row[2 * j + 1];
+        for (int4 k = j + 1; k < n; k++) {
+            phloat yre = urow[2 * k];
+            phloat yim = urow[2 * k + 1];
+            row[2 * k] -= xre * yre - xim * yim;
+            row[2 * k + 1] -= xim * yre + xre * yim;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    vartype_realmatrix *a;
+    int4 *perm;
+    phloat det;
+    phloat *scale;
+    int4 j;
+    int (*completion)(int, vartype_realmatrix *, int4 *, phloat);
+} lu_r_par_data_struct;
+
+static lu_r_par_data_struct *lu_r_par_data;
+
+static int lu_decomp_r_par_worker(int interrupted);
+
+/* Returns false if the parallel version should not be used for this matrix,
+ * in which case the caller should proceed with the serial version.
+ */
+static bool lu_decomp_r_par(vartype_realmatrix *a, int4 *perm,
+                int (*completion)(int, vartype_realmatrix *, int4 *, phloat)) {
+    int4 n = a->rows;
+    if (n < LINALG_PARALLEL_MIN_SIZE || par_threads() < 2)
+        return false;
+    lu_r_par_data_struct *dat =
+            (lu_r_par_data_struct *) malloc(sizeof(lu_r_par_data_struct));
+    if (dat == NULL)
+        return false;
+    dat->scale = par_row_scales(a->array->data, n, false);
+    if (dat->scale == NULL) {
+        free(dat);
+        return false;
+    }
+
+    dat->a = a;
+    dat->perm = perm;
+    dat->det = 1;
+    dat->j = 0;
+    dat->completion = completion;
+
+    lu_r_par_data = dat;
+    mode_interruptible = lu_decomp_r_par_worker;
+    mode_stoppable = false;
+    return true;
+}
+
+static int lu_decomp_r_par_worker(int interrupted) {
+    lu_r_par_data_struct *dat = lu_r_par_data;
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    phloat *scale = dat->scale;
+    int4 *perm = dat->perm;
+    int nt = par_threads();
+    int4 count = 0;
+    int4 i, imax, j, k;
+    phloat max, tmp;
+    par_update_struct u;
+    int err;
+
+    if (interrupted) {
+        err = ERR_INTERRUPTED;
+        goto finish;
+    }
+
+    while (count < LINALG_PARALLEL_OPS_PER_SLICE) {
+        j = dat->j;
+
+        max = 0;
+        imax = j;
+        for (i = j; i < n; i++) {
+            tmp = a[i * n + j];
+            tmp = (tmp < 0 ? -tmp : tmp) / scale[i];
+            if (tmp > max) {
+                imax = i;
+                max = tmp;
+            }
+        }
+
+        if (j != imax) {
+            for (k = 0; k < n; k++) {
+                tmp = a[imax * n + k];
+                a[imax * n + k] = a[j * n + k];
+                a[j * n + k] = tmp;
+            }
+            dat->det = -dat->det;
+            scale[imax] = scale[j];
+        }
+
+        perm[j] = imax;
+        if (a[j * n + j] == 0) {
+            if (core_settings.matrix_singularmatrix) {
+                err = ERR_SINGULAR_MATRIX;
+                goto finish;
+            } else {
+                /* Same substitution as in lu_decomp_r_worker() */
+                phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
+                phloat tiny = pow(10, floor(log10(scale[j])) - 20);
+                if (tiny < tiniest)
+                    tiny = tiniest;
+                a[j * n + j] = tiny;
+            }
+        }
+        dat->det *= a[j * n + j];
+        if (j == n - 1) {
+            err = ERR_NONE;
+            goto finish;
+        }
+        tmp = 1 / a[j * n + j];
+        for (i = j + 1; i < n; i++)
+            a[i * n + j] *= tmp;
+
+        u.a = a;
+        u.n = n;
+        u.j = j;
+        par_run(lu_r_update_rows, &u, j + 1, n, par_grain(n - j - 1));
+
+        dat->j = j + 1;
+        count += (n - j) * (n - j) / nt + 1;
+    }
+    return ERR_INTERRUPTIBLE;
+
+    finish:
+    free(scale);
+    err = dat->completion(err, dat->a, perm, err == ERR_NONE ? dat->det : 0);
+    free(dat);
+    return err;
+}
+
+typedef struct {
+    vartype_complexmatrix *a;
+    int4 *perm;
+    phloat det_re, det_im;
+    phloat *scale;
+    int4 j;
+    int (*completion)(int, vartype_complexmatrix *, int4 *, phloat, phloat);
+} lu_c_par_data_struct;
+
+static lu_c_par_data_struct *lu_c_par_data;
+
+static int lu_decomp_c_par_worker(int interrupted);
+
+/* Returns false if the parallel version should not be used for this matrix,
+ * in which case the caller should proceed with the serial version.
+ */
+static bool lu_decomp_c_par(vartype_complexmatrix *a, int4 *perm,
+                int (*completion)(int, vartype_complexmatrix *,
+                                          int4 *, phloat, phloat)) {
+    int4 n = a->rows;
+    if (n < LINALG_PARALLEL_MIN_SIZE || par_threads() < 2)
+        return false;
+    lu_c_par_data_struct *dat =
+            (lu_c_par_data_struct *) malloc(sizeof(lu_c_par_data_struct));
+    if (dat == NULL)
+        return false;
+    dat->scale = par_row_scales(a->array->data, n, true);
+    if (dat->scale == NULL) {
+        free(dat);
+        return false;
+    }
+
+    dat->a = a;
+    dat->perm = perm;
+    dat->det_re = 1;
+    dat->det_im = 0;
+    dat->j = 0;
+    dat->completion = completion;
+
+    lu_c_par_data = dat;
+    mode_interruptible = lu_decomp_c_par_worker;
+    mode_stoppable = false;
+    return true;
+}
+
+static int lu_decomp_c_par_worker(int interrupted) {
+    lu_c_par_data_struct *dat = lu_c_par_data;
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    phloat *scale = dat->scale;
+    int4 *perm = dat->perm;
+    int nt = par_threads();
+    int4 count = 0;
+    int4 i, imax, j, k;
+    phloat max, tmp, tmp_re, tmp_im, s_re, s_im;
+    par_update_struct u;
+    int err;
+
+    if (interrupted) {
+        err = ERR_INTERRUPTED;
+        goto finish;
+    }
+
+    while (count < LINALG_PARALLEL_OPS_PER_SLICE) {
+        j = dat->j;
+
+        max = 0;
+        imax = j;
+        for (i = j; i < n; i++) {
+            tmp = hypot(a[2 * (i * n + j)], a[2 * (i * n + j) + 1]) / scale[i];
+            if (tmp > max) {
+                imax = i;
+                max = tmp;
+            }
+        }
+
+        if (j != imax) {
+            for (k = 0; k < n; k++) {
+                tmp = a[2 * (imax * n + k)];
+                a[2 * (imax * n + k)] = a[2 * (j * n + k)];
+                a[2 * (j * n + k)] = tmp;
+                tmp = a[2 * (imax * n + k) + 1];
+                a[2 * (imax * n + k) + 1] = a[2 * (j * n + k) + 1];
+                a[2 * (j * n + k) + 1] = tmp;
+            }
+            dat->det_re = -dat->det_re;
+            dat->det_im = -dat->det_im;
+            scale[imax] = scale[j];
+        }
+
+        perm[j] = imax;
+        tmp_re = a[2 * (j * n + j)];
+        tmp_im = a[2 * (j * n + j) + 1];
+        if (tmp_re == 0 && tmp_im == 0) {
+            if (core_settings.matrix_singularmatrix) {
+                err = ERR_SINGULAR_MATRIX;
+                goto finish;
+            } else {
+                /* Same substitution as in lu_decomp_c_worker() */
+                phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
+                phloat tiny = pow(10, floor(log10(scale[j])) - 20);
+                if (tiny < tiniest)
+                    tiny = tiniest;
+                a[2 * (j * n + j)] = tmp_re = tiny;
+                a[2 * (j * n + j) + 1] = tmp_im = 0;
+            }
+        }
+        tmp = dat->det_re * tmp_re - dat->det_im * tmp_im;
+        dat->det_im = dat->det_im * tmp_re + dat->det_re * tmp_im;
+        dat->det_re = tmp;
+        if (j == n - 1) {
+            err = ERR_NONE;
+            goto finish;
+        }
+        tmp = hypot(tmp_re, tmp_im);
+        s_re = tmp_re / tmp / tmp;
+        s_im = -tmp_im / tmp / tmp;
+        for (i = j + 1; i < n; i++) {
+            tmp_re = a[2 * (i * n + j)];
+            tmp_im = a[2 * (i * n + j) + 1];
+            a[2 * (i * n + j)] = tmp_re * s_re - tmp_im * s_im;
+            a[2 * (i * n + j) + 1] = tmp_im * s_re + tmp_re * s_im;
+        }
+
+        u.a = a;
+        u.n = n;
+        u.j = j;
+        par_run(lu_c_update_rows, &u, j + 1, n, par_grain(4 * (n - j - 1)));
+
+        dat->j = j + 1;
+        count += 4 * (n - j) * (n - j) / nt + 1;
+    }
+    return ERR_INTERRUPTIBLE;
+
+    finish:
+    free(scale);
+    if (err == ERR_NONE)
+        err = dat->completion(ERR_NONE, dat->a, perm, dat->det_re,
+                                                            dat->det_im);
+    else
+        err = dat->completion(err, dat->a, perm, 0, 0);
+    free(dat);
+    return err;
+}
+
+/* Back-substitution for column k of b; these do the same thing as the loop
+ * bodies in the serial workers.
+ */
+
+static int backsub_range_check(phloat *t) {
+    if (p_isinf(*t) || p_isnan(*t)) {
+        if (core_settings.matrix_outofrange && !flags.f.range_error_ignore)
+            return ERR_OUT_OF_RANGE;
+        else
+            *t = *t < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+    }
+    return ERR_NONE;
+}
+
+static int backsub_rr_column(const phloat *a, const int4 *perm, phloat *b,
+                             int4 n, int4 q, int4 k) {
+    int4 i, ii, j, ll;
+    phloat sum, t;
+    ii = -1;
+    for (i = 0; i < n; i++) {
+        ll = perm[i];
+        sum = b[ll * q + k];
+        b[ll * q + k] = b[i * q + k];
+        if (ii != -1) {
+            for (j = ii; j < i; j++)
+                sum -= a[i * n + j] * b[j * q + k];
+        } else if (sum != 0)
+            ii = i;
+        b[i * q + k] = sum;
+    }
+    for (i = n - 1; i >= 0; i--) {
+        sum = b[i * q + k];
+        for (j = i + 1; j < n; j++)
+            sum -= a[i * n + j] * b[j * q + k];
+        t = sum / a[i * n + i];
+        if (backsub_range_check(&t) != ERR_NONE)
+            return ERR_OUT_OF_RANGE;
+        b[i * q + k] = t;
+    }
+    return ERR_NONE;
+}
+
+static int backsub_rc_column(const phloat *a, const int4 *perm, phloat *b,
+                             int4 n, int4 q, int4 k) {
+    int4 i, ii, j, ll;
+    phloat sum_re, sum_im, tmp, t_re, t_im;
+    ii = -1;
+    for (i = 0; i < n; i++) {
+        ll = perm[i];
+        sum_re = b[2 * (ll * q + k)];
+        sum_im = b[2 * (ll * q + k) + 1];
+        b[2 * (ll * q + k)] = b[2 * (i * q + k)];
+        b[2 * (ll * q + k) + 1] = b[2 * (i * q + k) + 1];
+        if (ii != -1) {
+            for (j = ii; j < i; j++) {
+                tmp = a[i * n + j];
+                sum_re -= tmp * b[2 * (j * q + k)];
+                sum_im -= tmp * b[2 * (j * q + k) + 1];
+            }
+        } else if (sum_re != 0 || sum_im != 0)
+            ii = i;
+        b[2 * (i * q + k)] = sum_re;
+        b[2 * (i * q + k) + 1] = sum_im;
+    }
+    for (i = n - 1; i >= 0; i--) {
+        sum_re = b[2 * (i * q + k)];
+        sum_im = b[2 * (i * q + k) + 1];
+        for (j = i + 1; j < n; j++) {
+            tmp = a[i * n + j];
+            sum_re -= tmp * b[2 * (j * q + k)];
+            sum_im -= tmp * b[2 * (j * q + k) + 1];
+        }
+        tmp = a[i * n + i];
+        t_re = sum_re / tmp;
+        t_im = sum_im / tmp;
+        if (backsub_range_check(&t_re) != ERR_NONE
+                || backsub_range_check(&t_im) != ERR_NONE)
+            return ERR_OUT_OF_RANGE;
+        b[2 * (i * q + k)] = t_re;
+        b[2 * (i * q + k) + 1] = t_im;
+    }
+    return ERR_NONE;
+}
+
+static int backsub_cc_column(const phloat *a, const int4 *perm, phloat *b,
+                             int4 n, int4 q, int4 k) {
+    int4 i, ii, j, ll;
+    phloat sum_re, sum_im, bre, bim, tmp, tmp_re, tmp_im, t_re, t_im;
+    ii = -1;
+    for (i = 0; i < n; i++) {
+        ll = perm[i];
+        sum_re = b[2 * (ll * q + k)];
+        sum_im = b[2 * (ll * q + k) + 1];
+        b[2 * (ll * q + k)] = b[2 * (i * q + k)];
+        b[2 * (ll * q + k) + 1] = b[2 * (i * q + k) + 1];
+        if (ii != -1) {
+            for (j = ii; j < i; j++) {
+                bre = b[2 * (j * q + k)];
+                bim = b[2 * (j * q + k) + 1];
+                tmp_re = a[2 * (i * n + j)];
+                tmp_im = a[2 * (i * n + j) + 1];
+                sum_re -= bre * tmp_re - bim * tmp_im;
+                sum_im -= bim * tmp_re + bre * tmp_im;
+            }
+        } else if (sum_re != 0 || sum_im != 0)
+            ii = i;
+        b[2 * (i * q + k)] = sum_re;
+        b[2 * (i * q + k) + 1] = sum_im;
+    }
+    for (i = n - 1; i >= 0; i--) {
+        sum_re = b[2 * (i * q + k)];
+        sum_im = b[2 * (i * q + k) + 1];
+        for (j = i + 1; j < n; j++) {
+            bre = b[2 * (j * q + k)];
+            bim = b[2 * (j * q + k) + 1];
+            tmp_re = a[2 * (i * n + j)];
+            tmp_im = a[2 * (i * n + j) + 1];
+            sum_re -= bre * tmp_re - bim * tmp_im;
+            sum_im -= bim * tmp_re + bre * tmp_im;
+        }
+        tmp_re = a[2 * (i * n + i)];
+        tmp_im = a[2 * (i * n + i) + 1];
+        tmp = hypot(tmp_re, tmp_im);
+        tmp_re = tmp_re / tmp / tmp;
+        tmp_im = -tmp_im / tmp / tmp;
+        t_re = sum_re * tmp_re - sum_im * tmp_im;
+        t_im = sum_im * tmp_re + sum_re * tmp_im;
+        if (backsub_range_check(&t_re) != ERR_NONE
+                || backsub_range_check(&t_im) != ERR_NONE)
+            return ERR_OUT_OF_RANGE;
+        b[2 * (i * q + k)] = t_re;
+        b[2 * (i * q + k) + 1] = t_im;
+    }
+    return ERR_NONE;
+}
+
+typedef struct {
+    int type;
+    vartype *a;
+    int4 *perm;
+    vartype *b;
+    phloat *adata, *bdata;
+    int4 n, q, k, kend;
+    union {
+        void (*rr)(int, vartype_realmatrix *, int4 *, vartype_realmatrix *);
+        void (*rc)(int, vartype_realmatrix *, int4 *, vartype_complexmatrix *);
+        void (*cc)(int, vartype_complexmatrix *, int4 *,
+                                                vartype_complexmatrix *);
+    } completion;
+} backsub_par_data_struct;
+
+static backsub_par_data_struct *backsub_par_data;
+
+static int backsub_par_worker(int interrupted);
+
+static int backsub_par_columns(void *arg, int4 begin, int4 end) {
+    backsub_par_data_struct *dat = (backsub_par_data_struct *) arg;
+    int err = ERR_NONE;
+    for (int4 k = begin; k < end && err == ERR_NONE; k++)
+        switch (dat->type) {
+            case BACKSUB_RR:
+                err = backsub_rr_column(dat->adata, dat->perm, dat->bdata,
+                                        dat->n, dat->q, k);
+                break;
+            case BACKSUB_RC:
+                err = backsub_rc_column(dat->adata, dat->perm, dat->bdata,
+                                        dat->n, dat->q, k);
+                break;
+            case BACKSUB_CC:
+                err = backsub_cc_column(dat->adata, dat->perm, dat->bdata,
+                                        dat->n, dat->q, k);
+                break;
+        }
+    return err;
+}
+
+/* Returns false if the parallel version should not be used for these
+ * matrices, in which case the caller should proceed with the serial version.
+ * The completion pointer is passed as a generic function pointer, and cast
+ * back according to 'type'.
+ */
+static bool backsub_par(int type, vartype *a, int4 *perm, vartype *b,
+                        void (*completion)()) {
+    int4 n, q;
+    phloat *adata, *bdata;
+    if (type == BACKSUB_CC) {
+        n = ((vartype_complexmatrix *) a)->rows;
+        adata = ((vartype_complexmatrix *) a)->array->data;
+    } else {
+        n = ((vartype_realmatrix *) a)->rows;
+        adata = ((vartype_realmatrix *) a)->array->data;
+    }
+    if (type == BACKSUB_RR) {
+        q = ((vartype_realmatrix *) b)->columns;
+        bdata = ((vartype_realmatrix *) b)->array->data;
+    } else {
+        q = ((vartype_complexmatrix *) b)->columns;
+        bdata = ((vartype_complexmatrix *) b)->array->data;
+    }
+    if (n < LINALG_PARALLEL_MIN_SIZE || q < 2 || par_threads() < 2)
+        return false;
+
+    backsub_par_data_struct *dat =
+        (backsub_par_data_struct *) malloc(sizeof(backsub_par_data_struct));
+    if (dat == NULL)
+        return false;
+    dat->type = type;
+    dat->a = a;
+    dat->perm = perm;
+    dat->b = b;
+    dat->adata = adata;
+    dat->bdata = bdata;
+    dat->n = n;
+    dat->q = q;
+    dat->k = 0;
+    switch (type) {
+        case BACKSUB_RR:
+            dat->completion.rr = (void (*)(int, vartype_realmatrix *, int4 *,
+                                    vartype_realmatrix *)) completion;
+            break;
+        case BACKSUB_RC:
+            dat->completion.rc = (void (*)(int, vartype_realmatrix *, int4 *,
+                                    vartype_complexmatrix *)) completion;
+            break;
+        case BACKSUB_CC:
+            dat->completion.cc = (void (*)(int, vartype_complexmatrix *,
+                                    int4 *, vartype_complexmatrix *)) completion;
+            break;
+    }
+
+    backsub_par_data = dat;
+    mode_interruptible = backsub_par_worker;
+    mode_stoppable = false;
+    return true;
+}
+
+static int backsub_par_worker(int interrupted) {
+    backsub_par_data_struct *dat = backsub_par_data;
+    int nt = par_threads();
+    int4 n = dat->n;
+    int4 ops = (dat->type == BACKSUB_CC ? 4 : dat->type == BACKSUB_RC ? 2 : 1)
+                    * n * n;
+    int4 count = 0;
+    int err;
+
+    if (interrupted) {
+        err = ERR_INTERRUPTED;
+        goto finish;
+    }
+
+    while (count < LINALG_PARALLEL_OPS_PER_SLICE) {
+        /* One column per thread at a time */
+        int4 kend = dat->k + nt;
+        if (kend > dat->q)
+            kend = dat->q;
+        err = par_run(backsub_par_columns, dat, dat->k, kend, 1);
+        if (err != ERR_NONE)
+            goto finish;
+        dat->k = kend;
+        if (kend == dat->q)
+            goto finish;
+        count += ops;
+    }
+    return ERR_INTERRUPTIBLE;
+
+    finish:
+    switch (dat->type) {
+        case BACKSUB_RR:
+            dat->completion.rr(err, (vartype_realmatrix *) dat->a, dat->perm,
+                               (vartype_realmatrix *) dat->b);
+            break;
+        case BACKSUB_RC:
+            dat->completion.rc(err, (vartype_realmatrix *) dat->a, dat->perm,
+                               (vartype_complexmatrix *) dat->b);
+            break;
+        case BACKSUB_CC:
+            dat->completion.cc(err, (vartype_complexmatrix *) dat->a,
+                               dat->perm, (vartype_complexmatrix *) dat->b);
+            break;
+    }
+    free(dat);
+    return err;
+}
+
+
+#ifdef BCD_MATH
+
+/*******************************************/
+/***** Fast binary matrix arithmetic *****/
+/*******************************************/
+
+/* When core_settings.matrix_fastbinary is set, the decimal version performs
+ * LU decomposition and back-substitution of real matrices in binary64, using
+ * the same algorithms as above. The matrices are converted to double up
+ * front, and back to decimal when done. The decimal library calls are what
+ * makes the decimal version slow, so this is typically 10 to 50 times
+ * faster for large matrices, but the results are only good to about 16
+ * digits, and are subject to binary rounding.
+ * The fast workers don't need to be able to suspend at arbitrary points;
+ * they process whole columns, and return to the shell after about
+ * LINALG_FAST_OPS_PER_SLICE multiply-adds.
+ * Intermediate results can overflow binary64 where they would not overflow
+ * decimal, and after that, inf - inf produces NaN. So, the workers check
+ * every sum they compute, and if one is not finite, they throw away the
+ * binary64 copies, which they work on instead of the matrices themselves,
+ * and start over in decimal, which deals with overflow as usual.
+ */
+
+#define LINALG_FAST_OPS_PER_SLICE 1000000
+
+double *matrix_to_double(const phloat *src, int4 rows, int4 columns,
+                         bool transpose) {
+    double *dst = (double *) malloc(rows * columns * sizeof(double));
+    if (dst == NULL)
+        return NULL;
+    for (int4 i = 0; i < rows; i++)
+        for (int4 j = 0; j < columns; j++) {
+            phloat p = src[i * columns + j];
+            double d = to_double(p);
+            double ad = d < 0 ? -d : d;
+            if (ad > DBL_MAX || (ad < DBL_MIN && p != 0)) {
+                /* Would overflow or lose precision */
+                free(dst);
+                return NULL;
+            }
+            if (transpose)
+                dst[j * rows + i] = d;
+            else
+                dst[i * columns + j] = d;
+        }
+    return dst;
+}
+
+void matrix_from_double(phloat *dst, const double *src, int4 rows,
+                        int4 columns, bool transpose) {
+    for (int4 i = 0; i < rows; i++)
+        for (int4 j = 0; j < columns; j++) {
+            double d = transpose ? src[j * rows + i] : src[i * columns + j];
+            if (isinf(d))
+                dst[i * columns + j] = d < 0 ? NEG_HUGE_PHLOAT
+                                             : POS_HUGE_PHLOAT;
+            else
+                dst[i * columns + j] = d;
+        }
+}
+
+typedef struct {
+    vartype_realmatrix *m;
+    int4 *perm;
+    phloat det;
+    double *a, *scale;
+    int4 j;
+    int (*completion)(int, vartype_realmatrix *, int4 *, phloat);
+} lu_r_fast_data_struct;
+
+static lu_r_fast_data_struct *lu_r_fast_data;
+
+static int lu_decomp_r_fast_worker(int interrupted);
+
+/* Returns false if the fast path can't be used for this matrix, in which case
+ * the caller should proceed with the decimal version. Otherwise, starts the
+ * worker, and returns the error code to be returned by lu_decomp_r() in *err.
+ */
+static bool lu_decomp_r_fast(vartype_realmatrix *m, int4 *perm,
+                int (*completion)(int, vartype_realmatrix *, int4 *, phloat),
+                int *err) {
+    int4 n = m->rows;
+    int4 i, j;
+    lu_r_fast_data_struct *dat =
+            (lu_r_fast_data_struct *) malloc(sizeof(lu_r_fast_data_struct));
+    if (dat == NULL)
+        return false;
+    dat->a = matrix_to_double(m->array->data, n, n, false);
+    if (dat->a == NULL) {
+        free(dat);
+        return false;
+    }
+    dat->scale = (double *) malloc(n * sizeof(double));
+    if (dat->scale == NULL) {
+        free(dat->a);
+        free(dat);
+        return false;
+    }
+
+    for (i = 0; i < n; i++) {
+        double max = 0;
+        for (j = 0; j < n; j++) {
+            double tmp = dat->a[i * n + j];
+            if (tmp < 0)
+                tmp = -tmp;
+            if (tmp > max)
+                max = tmp;
+        }
+        dat->scale[i] = max;
+    }
+
+    dat->m = m;
+    dat->perm = perm;
+    dat->det = 1;
+    dat->j = 0;
+    dat->completion = completion;
+
+    lu_r_fast_data = dat;
+    mode_interruptible = lu_decomp_r_fast_worker;
+    mode_stoppable = false;
+    *err = ERR_INTERRUPTIBLE;
+    return true;
+}
+
+static int lu_decomp_r_fast_worker(int interrupted) {
+    lu_r_fast_data_struct *dat = lu_r_fast_data;
+    double *a = dat->a;
+    double *scale = dat->scale;
+    int4 *perm = dat->perm;
+    int4 n = dat->m->rows;
+    int4 count = 0;
+    int4 i, imax, j, k;
+    double max, tmp, sum;
+    int err;
+
+    if (interrupted) {
+        err = ERR_INTERRUPTED;
+        goto finish;
+    }
+
+    while (count < LINALG_FAST_OPS_PER_SLICE) {
+        j = dat->j;
+        if (j == n) {
+            matrix_from_double(dat->m->array->data, a, n, n, false);
+            err = ERR_NONE;
+            goto finish;
+        }
+
+        for (i = 0; i < j; i++) {
+            sum = a[i * n + j];
+            for (k = 0; k < i; k++)
+                sum -= a[i * n + k] * a[k * n + j];
+            if (!isfinite(sum))
+                goto use_decimal;
+            a[i * n + j] = sum;
+        }
+
+        max = 0;
+        imax = j;
+        for (i = j; i < n; i++) {
+            sum = a[i * n + j];
+            for (k = 0; k < j; k++)
+                sum -= a[i * n + k] * a[k * n + j];
+            if (!isfinite(sum))
+                goto use_decimal;
+            a[i * n + j] = sum;
+            if (scale[i] == 0) {
+                imax = i;
+                break;
+            }
+            tmp = (sum < 0 ? -sum : sum) / scale[i];
+            if (tmp > max) {
+                imax = i;
+                max = tmp;
+            }
+        }
+
+        if (j != imax) {
+            for (k = 0; k < n; k++) {
+                tmp = a[imax * n + k];
+                a[imax * n + k] = a[j * n + k];
+                a[j * n + k] = tmp;
+            }
+            dat->det = -dat->det;
+            scale[imax] = scale[j];
+        }
+
+        perm[j] = imax;
+        if (a[j * n + j] == 0) {
+            if (core_settings.matrix_singularmatrix) {
+                err = ERR_SINGULAR_MATRIX;
+                goto finish;
+            } else {
+                /* Same substitution as in the decimal version, but limited
+                 * by the binary64 range.
+                 */
+                double tiniest = 1e20 / DBL_MAX;
+                double tiny;
+                if (scale[j] == 0)
+                    tiny = tiniest;
+                else {
+                    tiny = pow(10.0, floor(log10(scale[j])) - 20);
+                    if (tiny < tiniest)
+                        tiny = tiniest;
+                }
+                a[j * n + j] = tiny;
+            }
+        }
+        /* The determinant is accumulated in decimal, since it can easily
+         * overflow the binary64 range when the matrix elements don't.
+         */
+        dat->det *= phloat(a[j * n + j]);
+        if (j != n - 1) {
+            tmp = 1 / a[j * n + j];
+            for (i = j + 1; i < n; i++) {
+                a[i * n + j] *= tmp;
+                if (!isfinite(a[i * n + j]))
+                    goto use_decimal;
+            }
+        }
+
+        dat->j = j + 1;
+        count += n * (j + 1);
+    }
+    return ERR_INTERRUPTIBLE;
+
+    finish:
+    free(a);
+    free(scale);
+    err = dat->completion(err, dat->m, perm, err == ERR_NONE ? dat->det : 0);
+    free(dat);
+    return err;
+
+    use_decimal:
+    free(a);
+    free(scale);
+    {
+        vartype_realmatrix *m = dat->m;
+        int (*completion)(int, vartype_realmatrix *, int4 *, phloat)
+                = dat->completion;
+        free(dat);
+        return lu_decomp_r_exact(m, perm, completion);
+    }
+}
+
+typedef struct {
+    vartype_realmatrix *ma;
+    int4 *perm;
+    vartype_realmatrix *mb;
+    double *a, *b;
+    int4 k;
+    void (*completion)(int, vartype_realmatrix *, int4 *, vartype_realmatrix *);
+} backsub_rr_fast_data_struct;
+
+static backsub_rr_fast_data_struct *backsub_rr_fast_data;
+
+static int lu_backsubst_rr_fast_worker(int interrupted);
+
+/* Returns false if the fast path can't be used for these matrices, in which
+ * case the caller should proceed with the decimal version.
+ */
+static bool lu_backsubst_rr_fast(vartype_realmatrix *ma, int4 *perm,
+                    vartype_realmatrix *mb,
+                    void (*completion)(int, vartype_realmatrix *,
+                                    int4 *, vartype_realmatrix *)) {
+    backsub_rr_fast_data_struct *dat = (backsub_rr_fast_data_struct *)
+                malloc(sizeof(backsub_rr_fast_data_struct));
+    if (dat == NULL)
+        return false;
+    dat->a = matrix_to_double(ma->array->data, ma->rows, ma->rows, false);
+    if (dat->a == NULL) {
+        free(dat);
+        return false;
+    }
+    /* The right-hand side is stored column by column, so that the
+     * substitution loops access both matrices sequentially.
+     */
+    dat->b = matrix_to_double(mb->array->data, mb->rows, mb->columns, true);
+    if (dat->b == NULL) {
+        free(dat->a);
+        free(dat);
+        return false;
+    }
+
+    dat->ma = ma;
+    dat->perm = perm;
+    dat->mb = mb;
+    dat->k = 0;
+    dat->completion = completion;
+
+    backsub_rr_fast_data = dat;
+    mode_interruptible = lu_backsubst_rr_fast_worker;
+    mode_stoppable = false;
+    return true;
+}
+
+static int lu_backsubst_rr_fast_worker(int interrupted) {
+    backsub_rr_fast_data_struct *dat = backsub_rr_fast_data;
+    double *a = dat->a;
+    int4 n = dat->ma->rows;
+    int4 q = dat->mb->columns;
+    int4 *perm = dat->perm;
+    int4 count = 0;
+    int4 i, ii, j, ll;
+    double sum, t, *b;
+    int err;
+
+    if (interrupted) {
+        err = ERR_INTERRUPTED;
+        goto finish;
+    }
+
+    while (count < LINALG_FAST_OPS_PER_SLICE) {
+        if (dat->k == q) {
+            matrix_from_double(dat->mb->array->data, dat->b, n, q, true);
+            err = ERR_NONE;
+            goto finish;
+        }
+        b = dat->b + dat->k * n;
+
+        ii = -1;
+        for (i = 0; i < n; i++) {
+            ll = perm[i];
+            sum = b[ll];
+            b[ll] = b[i];
+            if (ii != -1) {
+                for (j = ii; j < i; j++)
+                    sum -= a[i * n + j] * b[j];
+            } else if (sum != 0)
+                ii = i;
+            if (!isfinite(sum))
+                goto use_decimal;
+            b[i] = sum;
+        }
+        for (i = n - 1; i >= 0; i--) {
+            sum = b[i];
+            for (j = i + 1; j < n; j++)
+                sum -= a[i * n + j] * b[j];
+            t = sum / a[i * n + i];
+            if (!isfinite(t))
+                /* Out of range, in binary64 at least; whether it is in
+                 * decimal, and what to do about it, is for the decimal
+                 * version to decide.
+                 */
+                goto use_decimal;
+            b[i] = t;
+        }
+
+        dat->k++;
+        count += n * n;
+    }
+    return ERR_INTERRUPTIBLE;
+
+    finish:
+    free(a);
+    free(dat->b);
+    dat->completion(err, dat->ma, perm, dat->mb);
+    free(dat);
+    return err;
+
+    use_decimal:
+    free(a);
+    free(dat->b);
+    {
+        vartype_realmatrix *ma = dat->ma;
+        vartype_realmatrix *mb = dat->mb;
+        void (*completion)(int, vartype_realmatrix *, int4 *,
+                           vartype_realmatrix *) = dat->completion;
+        free(dat);
+        return lu_backsubst_rr_exact(ma, perm, mb, completion);
+    }
+}
+
+#endif
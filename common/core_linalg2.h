@@ -20,6 +20,21 @@
 
 #include "core_globals.h"
 
+#ifdef BCD_MATH
+/* Helpers for the fast binary matrix mode; see core_settings.matrix_fastbinary.
+ * matrix_to_double() returns NULL if it runs out of memory, or if any of the
+ * elements are outside the normal binary64 range; in either case, callers
+ * should fall back on exact decimal arithmetic.
+ * If 'transpose' is true, the matrix is stored column by column.
+ * matrix_from_double() converts infinities to POS_HUGE_PHLOAT and
+ * NEG_HUGE_PHLOAT, so callers should check for those first.
+ */
+double *matrix_to_double(const phloat *src, int4 rows, int4 columns,
+                         bool transpose);
+void matrix_from_double(phloat *dst, const double *src, int4 rows,
+                        int4 columns, bool transpose);
+#endif
+
 int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
                        int (*completion)(int, vartype_realmatrix *,
                                           int4 *, phloat));
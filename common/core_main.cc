@@ -15,7 +15,9 @@
  * along with this program; if not, see http://www.gnu.org/licenses/.
  *****************************************************************************/
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "core_main.h"
 #include "core_commands2.h"
@@ -23,6 +25,7 @@
 #include "core_display.h"
 #include "core_helpers.h"
 #include "core_keydown.h"
+#include "core_linalg1.h"
 #include "core_math1.h"
 #include "core_sto_rcl.h"
 #include "core_tables.h"
@@ -48,6 +51,37 @@ int repeating_key;
 
 static int4 oldpc;
 
+/* Polling budget for continue_running(); see wants_to_yield() */
+#define POLL_MS 10
+#define MAX_POLL_INTERVAL 65536
+#define CLOCK_CHECK_INTERVAL 256
+static int poll_interval = 1;
+static int poll_countdown;
+static int clock_countdown;
+static uint4 last_poll_time;
+static volatile int event_flag = 0;
+
+/* Profiler; see core_profile_start(). The per-line counts are kept in a hash
+ * table keyed by program and pc, using linear probing; unused slots have
+ * prgm == -1.
+ */
+typedef struct {
+    int prgm;
+    int4 pc;
+    int cmd;
+    uint4 count;
+    uint8 time;
+} profile_entry;
+static uint4 (*profile_clock)() = NULL;
+static profile_entry *profile_table = NULL;
+static int4 profile_table_size = 0;
+static int4 profile_entries = 0;
+static uint4 profile_cmd_count[CMD_SENTINEL];
+static uint8 profile_cmd_time[CMD_SENTINEL];
+
+static void profile_record(int prgm, int4 pc, int cmd, uint4 time);
+static void profile_clear();
+
 core_settings_struct core_settings;
 
 void core_init(int read_saved_state, int4 version) {
@@ -61,6 +95,7 @@ void core_init(int read_saved_state, int4 version) {
     phloat_init();
     if (read_saved_state != 1 || !load_state(version))
         hard_reset(read_saved_state != 0);
+    reset_journal();
 
     repaint_display();
     shell_annunciators(mode_updown,
@@ -77,6 +112,7 @@ void core_enter_background() {
         stop_interruptible();
     set_running(false);
     save_state();
+    reset_journal();
 }
 #endif
 
@@ -98,17 +134,51 @@ void core_quit() {
     clear_all_prgms();
     if (vars != NULL)
         free(vars);
+    profile_clear();
     clean_vartype_pools();
-
-#ifdef ANDROID
     reinitialize_globals();
-#endif
+}
+
+bool core_save_state() {
+    if (mode_interruptible != NULL)
+        return false;
+    if (!save_state())
+        return false;
+    reset_journal();
+    return true;
+}
+
+bool core_saved_state_unmodified(const void *buf, int4 nbytes) {
+    return mapped_data_unmodified(buf, nbytes);
+}
+
+bool core_checkpoint() {
+    if (mode_interruptible != NULL)
+        return false;
+    return write_journal();
+}
+
+bool core_replay_journal() {
+    if (!replay_journal())
+        return false;
+    repaint_display();
+    shell_annunciators(mode_updown,
+                       mode_shift,
+                       0 /*print*/,
+                       mode_running,
+                       flags.f.grad,
+                       flags.f.rad || flags.f.grad);
+    return true;
 }
 
 void core_repaint_display() {
     repaint_display();
 }
 
+void core_set_display_rate(int fps) {
+    set_display_rate(fps);
+}
+
 int core_menu() {
     return mode_clall || get_front_menu() != NULL;
 }
@@ -127,6 +197,7 @@ int core_keydown(int key, int *enqueued, int *repeat) {
 
     *enqueued = 0;
     *repeat = 0;
+    journal_activity = true;
 
     if (key != 0)
         no_keystrokes_yet = false;
@@ -219,6 +290,7 @@ int core_keydown(int key, int *enqueued, int *repeat) {
             set_shift(false);
         }
         continue_running();
+        flush_display();
         if ((mode_running && !mode_getkey && !mode_pause) || keybuf_tail != keybuf_head)
             return 1;
         else {
@@ -296,6 +368,7 @@ int core_keydown(int key, int *enqueued, int *repeat) {
 }
 
 int core_repeat() {
+    journal_activity = true;
     keydown(repeating_shift, repeating_key);
     int rpt = repeating;
     repeating = 0;
@@ -342,6 +415,7 @@ void core_keytimeout2() {
 }
 
 bool core_timeout3(int repaint) {
+    journal_activity = true;
     if (mode_pause) {
         if (repaint) {
             /* The PSE ended normally */
@@ -365,6 +439,7 @@ bool core_timeout3(int repaint) {
 }
 
 int core_keyup() {
+    journal_activity = true;
     if (mode_pause) {
         /* The only way this can happen is if they key in question was Shift */
         return 0;
@@ -530,6 +605,7 @@ int core_allows_powerdown(int *want_cpu) {
 }
 
 int core_powercycle() {
+    journal_activity = true;
     bool need_redisplay = false;
 
     if (mode_interruptible != NULL)
@@ -660,295 +736,262 @@ int core_list_programs(char *buf, int bufsize) {
     return count;
 }
 
-static int export_hp42s(int index, int (*progress_report)(const char *)) {
-    int4 pc = 0;
-    int cmd;
-    arg_struct arg;
-    int saved_prgm = current_prgm;
+static int hp42s_encode_command(int cmd, arg_struct *arg, char *cmdbuf) {
+    /* Encodes one command the way the HP-42S stores it, and returns its
+     * length, which is at most 25 bytes; commands that have no HP-42S
+     * encoding are dropped, and yield 0.
+     */
     uint4 hp42s_code;
     unsigned char code_flags, code_name, code_std_1, code_std_2;
-    char cmdbuf[25];
     int cmdlen;
-    char buf[1000];
-    int buflen = 0;
     int i;
-    int cancel = 0;
 
-    current_prgm = index;
-    do {
-        get_next_command(&pc, &cmd, &arg, 0);
-        hp42s_code = cmdlist(cmd)->hp42s_code;
-        code_flags = hp42s_code >> 24;
-        code_name = hp42s_code >> 16;
-        code_std_1 = hp42s_code >> 8;
-        code_std_2 = hp42s_code;
-        cmdlen = 0;
-        switch (code_flags) {
-            case 1:
-                /* A command that requires some special attention */
-                if (cmd == CMD_STO) {
-                    if (arg.type == ARGTYPE_NUM && arg.val.num <= 15)
-                        cmdbuf[cmdlen++] = 0x30 + arg.val.num;
-                    else
-                        goto normal;
-                } else if (cmd == CMD_RCL) {
-                    if (arg.type == ARGTYPE_NUM && arg.val.num <= 15)
-                        cmdbuf[cmdlen++] = 0x20 + arg.val.num;
-                    else
-                        goto normal;
-                } else if (cmd == CMD_FIX || cmd == CMD_SCI || cmd == CMD_ENG) {
-                    char byte2;
-                    if (arg.type != ARGTYPE_NUM || arg.val.num <= 9)
-                        goto normal;
-                    cmdbuf[cmdlen++] = (char) 0xF1;
-                    if (arg.val.num == 10) {
-                        switch (cmd) {
-                            case CMD_FIX: byte2 = (char) 0xD5; break;
-                            case CMD_SCI: byte2 = (char) 0xD6; break;
-                            case CMD_ENG: byte2 = (char) 0xD7; break;
-                        }
-                    } else {
-                        switch (cmd) {
-                            case CMD_FIX: byte2 = (char) 0xE5; break;
-                            case CMD_SCI: byte2 = (char) 0xE6; break;
-                            case CMD_ENG: byte2 = (char) 0xE7; break;
-                        }
-                    }
-                    cmdbuf[cmdlen++] = byte2;
-                } else if (cmd == CMD_SIZE) {
-                    cmdbuf[cmdlen++] = (char) 0xF3;
-                    cmdbuf[cmdlen++] = (char) 0xF7;
-                    cmdbuf[cmdlen++] = arg.val.num >> 8;
-                    cmdbuf[cmdlen++] = arg.val.num;
-                } else if (cmd == CMD_LBL) {
-                    if (arg.type == ARGTYPE_NUM) {
-                        if (arg.val.num <= 14)
-                            cmdbuf[cmdlen++] = 0x01 + arg.val.num;
-                        else
-                            goto normal;
-                    } else if (arg.type == ARGTYPE_STR) {
-                        if (progress_report != NULL) {
-                            char s[52];
-                            int sl = hp2ascii(s + 1, arg.val.text, arg.length);
-                            s[0] = s[sl + 1] = '"';
-                            s[sl + 2] = 0;
-                            if (progress_report(s)) {
-                                cancel = 1;
-                                goto done;
-                            }
-                        }
-                        cmdbuf[cmdlen++] = (char) 0xC0;
-                        cmdbuf[cmdlen++] = 0x00;
-                        cmdbuf[cmdlen++] = 0xF1 + arg.length;
-                        cmdbuf[cmdlen++] = 0x00;
-                        for (i = 0; i < arg.length; i++)
-                            cmdbuf[cmdlen++] = arg.val.text[i];
-                    } else
-                        goto normal;
-                } else if (cmd == CMD_INPUT) {
-                    if (arg.type == ARGTYPE_IND_NUM
-                            || arg.type == ARGTYPE_IND_STK)
-                        code_std_2 = 0xEE;
+    hp42s_code = cmdlist(cmd)->hp42s_code;
+    code_flags = hp42s_code >> 24;
+    code_name = hp42s_code >> 16;
+    code_std_1 = hp42s_code >> 8;
+    code_std_2 = hp42s_code;
+    cmdlen = 0;
+    switch (code_flags) {
+        case 1:
+            /* A command that requires some special attention */
+            if (cmd == CMD_STO) {
+                if (arg->type == ARGTYPE_NUM && arg->val.num <= 15)
+                    cmdbuf[cmdlen++] = 0x30 + arg->val.num;
+                else
                     goto normal;
-                } else if (cmd == CMD_XEQ) {
-                    if (arg.type == ARGTYPE_NUM || arg.type == ARGTYPE_LCLBL) {
-                        code_std_1 = 0xE0;
-                        code_std_2 = 0x00;
-                        goto normal;
-                    } else if (arg.type == ARGTYPE_STR) {
-                        cmdbuf[cmdlen++] = 0x1E;
-                        cmdbuf[cmdlen++] = 0xF0 + arg.length;
-                        for (i = 0; i < arg.length; i++)
-                            cmdbuf[cmdlen++] = arg.val.text[i];
-                    } else
-                        goto normal;
-                } else if (cmd == CMD_GTO) {
-                    if (arg.type == ARGTYPE_NUM && arg.val.num <= 14) {
-                        cmdbuf[cmdlen++] = 0xB1 + arg.val.num;
-                        cmdbuf[cmdlen++] = 0x00;
-                    } else if (arg.type == ARGTYPE_NUM
-                                        || arg.type == ARGTYPE_LCLBL) {
-                        code_std_1 = 0xD0;
-                        code_std_2 = 0x00;
-                        goto normal;
-                    } else if (arg.type == ARGTYPE_IND_NUM
-                                        || arg.type == ARGTYPE_IND_STK) {
-                        cmdbuf[cmdlen++] = (char) 0xAE;
-                        if (arg.type == ARGTYPE_IND_NUM)
-                            arg.type = ARGTYPE_NUM;
-                        else
-                            arg.type = ARGTYPE_STK;
-                        goto non_string_suffix;
-                    } else if (arg.type == ARGTYPE_STR) {
-                        cmdbuf[cmdlen++] = 0x1D;
-                        cmdbuf[cmdlen++] = 0xF0 + arg.length;
-                        for (i = 0; i < arg.length; i++)
-                            cmdbuf[cmdlen++] = arg.val.text[i];
-                    } else
-                        goto normal;
-                } else if (cmd == CMD_END) {
-                    if (progress_report != NULL && progress_report("END")) {
-                        cancel = 1;
-                        goto done;
+            } else if (cmd == CMD_RCL) {
+                if (arg->type == ARGTYPE_NUM && arg->val.num <= 15)
+                    cmdbuf[cmdlen++] = 0x20 + arg->val.num;
+                else
+                    goto normal;
+            } else if (cmd == CMD_FIX || cmd == CMD_SCI || cmd == CMD_ENG) {
+                char byte2;
+                if (arg->type != ARGTYPE_NUM || arg->val.num <= 9)
+                    goto normal;
+                cmdbuf[cmdlen++] = (char) 0xF1;
+                if (arg->val.num == 10) {
+                    switch (cmd) {
+                        case CMD_FIX: byte2 = (char) 0xD5; break;
+                        case CMD_SCI: byte2 = (char) 0xD6; break;
+                        case CMD_ENG: byte2 = (char) 0xD7; break;
                     }
+                } else {
+                    switch (cmd) {
+                        case CMD_FIX: byte2 = (char) 0xE5; break;
+                        case CMD_SCI: byte2 = (char) 0xE6; break;
+                        case CMD_ENG: byte2 = (char) 0xE7; break;
+                    }
+                }
+                cmdbuf[cmdlen++] = byte2;
+            } else if (cmd == CMD_SIZE) {
+                cmdbuf[cmdlen++] = (char) 0xF3;
+                cmdbuf[cmdlen++] = (char) 0xF7;
+                cmdbuf[cmdlen++] = arg->val.num >> 8;
+                cmdbuf[cmdlen++] = arg->val.num;
+            } else if (cmd == CMD_LBL) {
+                if (arg->type == ARGTYPE_NUM) {
+                    if (arg->val.num <= 14)
+                        cmdbuf[cmdlen++] = 0x01 + arg->val.num;
+                    else
+                        goto normal;
+                } else if (arg->type == ARGTYPE_STR) {
                     cmdbuf[cmdlen++] = (char) 0xC0;
                     cmdbuf[cmdlen++] = 0x00;
-                    cmdbuf[cmdlen++] = 0x0D;
-                } else if (cmd == CMD_NUMBER) {
-                    char *p = phloat2program(arg.val_d);
-                    char dot = flags.f.decimal_point ? '.' : ',';
-                    char c;
-                    while ((c = *p++) != 0) {
-                        if (c >= '0' && c <= '9')
-                            cmdbuf[cmdlen++] = 0x10 + c - '0';
-                        else if (c == dot)
-                            cmdbuf[cmdlen++] = 0x1A;
-                        else if (c == 24)
-                            cmdbuf[cmdlen++] = 0x1B;
-                        else if (c == '-')
-                            cmdbuf[cmdlen++] = 0x1C;
-                        else
-                            /* Should not happen */
-                            continue;
-                    }
+                    cmdbuf[cmdlen++] = 0xF1 + arg->length;
                     cmdbuf[cmdlen++] = 0x00;
-                } else if (cmd == CMD_STRING) {
-                    cmdbuf[cmdlen++] = 0xF0 + arg.length;
-                    for (i = 0; i < arg.length; i++)
-                        cmdbuf[cmdlen++] = arg.val.text[i];
-                } else if (cmd >= CMD_ASGN01 && cmd <= CMD_ASGN18) {
-                    if (arg.type == ARGTYPE_STR) {
-                        cmdbuf[cmdlen++] = 0xF2 + arg.length;
-                        cmdbuf[cmdlen++] = (char) 0xC0;
-                        for (i = 0; i < arg.length; i++)
-                            cmdbuf[cmdlen++] = arg.val.text[i];
-                    } else {
-                        /* arg.type == ARGTYPE_COMMAND; we don't use that
-                         * any more, but just to be safe (in case anyone ever
-                         * actually used this in a program), we handle it
-                         * anyway.
-                         */
-                        const command_spec *cs = cmdlist(arg.val.cmd);
-                        cmdbuf[cmdlen++] = 0xF2 + cs->name_length;
-                        cmdbuf[cmdlen++] = (char) 0xC0;
-                        for (i = 0; i < cs->name_length; i++)
-                            cmdbuf[cmdlen++] = cs->name[i];
-                    }
-                    cmdbuf[cmdlen++] = cmd - CMD_ASGN01;
-                } else if ((cmd >= CMD_KEY1G && cmd <= CMD_KEY9G) 
-                            || (cmd >= CMD_KEY1X && cmd <= CMD_KEY9X)) {
-                    int keyg = cmd <= CMD_KEY9G;
-                    int keynum = cmd - (keyg ? CMD_KEY1G : CMD_KEY1X) + 1;
-                    if (arg.type == ARGTYPE_STR || arg.type == ARGTYPE_IND_STR){
-                        cmdbuf[cmdlen++] = 0xF2 + arg.length;
-                        cmdbuf[cmdlen++] = keyg ? 0xC3 : 0xC2;
-                        if (arg.type == ARGTYPE_IND_STR)
-                            cmdbuf[cmdlen - 1] += 8;
-                        cmdbuf[cmdlen++] = keynum;
-                        for (i = 0; i < arg.length; i++)
-                            cmdbuf[cmdlen++] = arg.val.text[i];
-                    } else {
-                        cmdbuf[cmdlen++] = (char) 0xF3;
-                        cmdbuf[cmdlen++] = keyg ? 0xE3 : 0xE2;
-                        cmdbuf[cmdlen++] = keynum;
-                        goto non_string_suffix;
-                    }
-                } else if (cmd == CMD_XROM) {
-                    cmdbuf[cmdlen++] = (char) (0xA0 + ((arg.val.num >> 8) & 7));
-                    cmdbuf[cmdlen++] = (char) arg.val.num;
+                    for (i = 0; i < arg->length; i++)
+                        cmdbuf[cmdlen++] = arg->val.text[i];
+                } else
+                    goto normal;
+            } else if (cmd == CMD_INPUT) {
+                if (arg->type == ARGTYPE_IND_NUM
+                        || arg->type == ARGTYPE_IND_STK)
+                    code_std_2 = 0xEE;
+                goto normal;
+            } else if (cmd == CMD_XEQ) {
+                if (arg->type == ARGTYPE_NUM || arg->type == ARGTYPE_LCLBL) {
+                    code_std_1 = 0xE0;
+                    code_std_2 = 0x00;
+                    goto normal;
+                } else if (arg->type == ARGTYPE_STR) {
+                    cmdbuf[cmdlen++] = 0x1E;
+                    cmdbuf[cmdlen++] = 0xF0 + arg->length;
+                    for (i = 0; i < arg->length; i++)
+                        cmdbuf[cmdlen++] = arg->val.text[i];
+                } else
+                    goto normal;
+            } else if (cmd == CMD_GTO) {
+                if (arg->type == ARGTYPE_NUM && arg->val.num <= 14) {
+                    cmdbuf[cmdlen++] = 0xB1 + arg->val.num;
+                    cmdbuf[cmdlen++] = 0x00;
+                } else if (arg->type == ARGTYPE_NUM
+                                    || arg->type == ARGTYPE_LCLBL) {
+                    code_std_1 = 0xD0;
+                    code_std_2 = 0x00;
+                    goto normal;
+                } else if (arg->type == ARGTYPE_IND_NUM
+                                    || arg->type == ARGTYPE_IND_STK) {
+                    cmdbuf[cmdlen++] = (char) 0xAE;
+                    if (arg->type == ARGTYPE_IND_NUM)
+                        arg->type = ARGTYPE_NUM;
+                    else
+                        arg->type = ARGTYPE_STK;
+                    goto non_string_suffix;
+                } else if (arg->type == ARGTYPE_STR) {
+                    cmdbuf[cmdlen++] = 0x1D;
+                    cmdbuf[cmdlen++] = 0xF0 + arg->length;
+                    for (i = 0; i < arg->length; i++)
+                        cmdbuf[cmdlen++] = arg->val.text[i];
+                } else
+                    goto normal;
+            } else if (cmd == CMD_END) {
+                cmdbuf[cmdlen++] = (char) 0xC0;
+                cmdbuf[cmdlen++] = 0x00;
+                cmdbuf[cmdlen++] = 0x0D;
+            } else if (cmd == CMD_NUMBER) {
+                char *p = phloat2program(arg->val_d);
+                char dot = flags.f.decimal_point ? '.' : ',';
+                char c;
+                while ((c = *p++) != 0) {
+                    if (c >= '0' && c <= '9')
+                        cmdbuf[cmdlen++] = 0x10 + c - '0';
+                    else if (c == dot)
+                        cmdbuf[cmdlen++] = 0x1A;
+                    else if (c == 24)
+                        cmdbuf[cmdlen++] = 0x1B;
+                    else if (c == '-')
+                        cmdbuf[cmdlen++] = 0x1C;
+                    else
+                        /* Should not happen */
+                        continue;
+                }
+                cmdbuf[cmdlen++] = 0x00;
+            } else if (cmd == CMD_STRING) {
+                cmdbuf[cmdlen++] = 0xF0 + arg->length;
+                for (i = 0; i < arg->length; i++)
+                    cmdbuf[cmdlen++] = arg->val.text[i];
+            } else if (cmd >= CMD_ASGN01 && cmd <= CMD_ASGN18) {
+                if (arg->type == ARGTYPE_STR) {
+                    cmdbuf[cmdlen++] = 0xF2 + arg->length;
+                    cmdbuf[cmdlen++] = (char) 0xC0;
+                    for (i = 0; i < arg->length; i++)
+                        cmdbuf[cmdlen++] = arg->val.text[i];
                 } else {
-                    /* Shouldn't happen */
-                    continue;
+                    /* arg->type == ARGTYPE_COMMAND; we don't use that
+                     * any more, but just to be safe (in case anyone ever
+                     * actually used this in a program), we handle it
+                     * anyway.
+                     */
+                    const command_spec *cs = cmdlist(arg->val.cmd);
+                    cmdbuf[cmdlen++] = 0xF2 + cs->name_length;
+                    cmdbuf[cmdlen++] = (char) 0xC0;
+                    for (i = 0; i < cs->name_length; i++)
+                        cmdbuf[cmdlen++] = cs->name[i];
                 }
-                break;
-            case 0:
-            normal:
-                if (arg.type == ARGTYPE_STR || arg.type == ARGTYPE_IND_STR) {
-                    int i;
-                    cmdbuf[cmdlen++] = 0xF0 + arg.length + 1;
-                    cmdbuf[cmdlen++] = arg.type == ARGTYPE_STR ? code_name
-                                                            : code_name + 8;
-                    for (i = 0; i < arg.length; i++)
-                        cmdbuf[cmdlen++] = arg.val.text[i];
+                cmdbuf[cmdlen++] = cmd - CMD_ASGN01;
+            } else if ((cmd >= CMD_KEY1G && cmd <= CMD_KEY9G) 
+                        || (cmd >= CMD_KEY1X && cmd <= CMD_KEY9X)) {
+                int keyg = cmd <= CMD_KEY9G;
+                int keynum = cmd - (keyg ? CMD_KEY1G : CMD_KEY1X) + 1;
+                if (arg->type == ARGTYPE_STR || arg->type == ARGTYPE_IND_STR){
+                    cmdbuf[cmdlen++] = 0xF2 + arg->length;
+                    cmdbuf[cmdlen++] = keyg ? 0xC3 : 0xC2;
+                    if (arg->type == ARGTYPE_IND_STR)
+                        cmdbuf[cmdlen - 1] += 8;
+                    cmdbuf[cmdlen++] = keynum;
+                    for (i = 0; i < arg->length; i++)
+                        cmdbuf[cmdlen++] = arg->val.text[i];
                 } else {
-                    unsigned char suffix;
-                    if (code_std_1 != 0)
-                        cmdbuf[cmdlen++] = code_std_1;
-                    cmdbuf[cmdlen++] = code_std_2;
-
-                    non_string_suffix:
-                    suffix = 0;
-                    switch (arg.type) {
-                        case ARGTYPE_NONE:
-                            goto no_suffix;
-                        case ARGTYPE_IND_NUM:
-                            suffix = 0x80;
-                        case ARGTYPE_NUM:
-                            suffix += arg.val.num;
-                            break;
-                        case ARGTYPE_IND_STK:
-                            suffix = 0x80;
-                        case ARGTYPE_STK:
-                            switch (arg.val.stk) {
-                                case 'X': suffix += 0x73; break;
-                                case 'Y': suffix += 0x72; break;
-                                case 'Z': suffix += 0x71; break;
-                                case 'T': suffix += 0x70; break;
-                                case 'L': suffix += 0x74; break;
-                                default:
-                                    /* Shouldn't happen */
-                                    continue;
-                            }
-                            break;
-                        case ARGTYPE_LCLBL:
-                            if (arg.val.lclbl >= 'A' && arg.val.lclbl <= 'J')
-                                suffix = arg.val.lclbl - 'A' + 0x66;
-                            else if (arg.val.lclbl >= 'a' &&
-                                                        arg.val.lclbl <= 'e')
-                                suffix = arg.val.lclbl - 'a' + 0x7B;
-                            else
+                    cmdbuf[cmdlen++] = (char) 0xF3;
+                    cmdbuf[cmdlen++] = keyg ? 0xE3 : 0xE2;
+                    cmdbuf[cmdlen++] = keynum;
+                    goto non_string_suffix;
+                }
+            } else if (cmd == CMD_XROM) {
+                cmdbuf[cmdlen++] = (char) (0xA0 + ((arg->val.num >> 8) & 7));
+                cmdbuf[cmdlen++] = (char) arg->val.num;
+            } else {
+                /* Shouldn't happen */
+                return 0;
+            }
+            break;
+        case 0:
+        normal:
+            if (arg->type == ARGTYPE_STR || arg->type == ARGTYPE_IND_STR) {
+                int i;
+                cmdbuf[cmdlen++] = 0xF0 + arg->length + 1;
+                cmdbuf[cmdlen++] = arg->type == ARGTYPE_STR ? code_name
+                                                        : code_name + 8;
+                for (i = 0; i < arg->length; i++)
+                    cmdbuf[cmdlen++] = arg->val.text[i];
+            } else {
+                unsigned char suffix;
+                if (code_std_1 != 0)
+                    cmdbuf[cmdlen++] = code_std_1;
+                cmdbuf[cmdlen++] = code_std_2;
+
+                non_string_suffix:
+                suffix = 0;
+                switch (arg->type) {
+                    case ARGTYPE_NONE:
+                        goto no_suffix;
+                    case ARGTYPE_IND_NUM:
+                        suffix = 0x80;
+                    case ARGTYPE_NUM:
+                        suffix += arg->val.num;
+                        break;
+                    case ARGTYPE_IND_STK:
+                        suffix = 0x80;
+                    case ARGTYPE_STK:
+                        switch (arg->val.stk) {
+                            case 'X': suffix += 0x73; break;
+                            case 'Y': suffix += 0x72; break;
+                            case 'Z': suffix += 0x71; break;
+                            case 'T': suffix += 0x70; break;
+                            case 'L': suffix += 0x74; break;
+                            default:
                                 /* Shouldn't happen */
-                                continue;
-                            break;
-                        default:
+                                return 0;
+                        }
+                        break;
+                    case ARGTYPE_LCLBL:
+                        if (arg->val.lclbl >= 'A' && arg->val.lclbl <= 'J')
+                            suffix = arg->val.lclbl - 'A' + 0x66;
+                        else if (arg->val.lclbl >= 'a' &&
+                                                    arg->val.lclbl <= 'e')
+                            suffix = arg->val.lclbl - 'a' + 0x7B;
+                        else
                             /* Shouldn't happen */
-                            /* Values not handled above are ARGTYPE_NEG_NUM,
-                             * which is converted to ARGTYPE_NUM by
-                             * get_next_command(); ARGTYPE_DOUBLE, which only
-                             * occurs with CMD_NUMBER, which is handled in the
-                             * special-case section, above; ARGTYPE_COMMAND,
-                             * which is handled in the special-case section;
-                             * and ARGTYPE_LBLINDEX, which is converted to
-                             * ARGTYPE_STR before being stored in a program.
-                             */
-                            continue;
-                    }
-                    cmdbuf[cmdlen++] = suffix;
-                    no_suffix:
-                    ;
+                            return 0;
+                        break;
+                    default:
+                        /* Shouldn't happen */
+                        /* Values not handled above are ARGTYPE_NEG_NUM,
+                         * which is converted to ARGTYPE_NUM by
+                         * get_next_command(); ARGTYPE_DOUBLE, which only
+                         * occurs with CMD_NUMBER, which is handled in the
+                         * special-case section, above; ARGTYPE_COMMAND,
+                         * which is handled in the special-case section;
+                         * and ARGTYPE_LBLINDEX, which is converted to
+                         * ARGTYPE_STR before being stored in a program.
+                         */
+                        return 0;
                 }
-                break;
-            case 2:
-            default:
-                /* Illegal command */
-                continue;
-        }
-        if (buflen + cmdlen > 1000) {
-            if (!shell_write(buf, buflen))
-                goto done;
-            buflen = 0;
-        }
-        for (i = 0; i < cmdlen; i++)
-            buf[buflen++] = cmdbuf[i];
-    } while (cmd != CMD_END && pc < prgms[index].size);
-    if (buflen > 0)
-        shell_write(buf, buflen);
-    done:
-    current_prgm = saved_prgm;
-    return cancel;
+                cmdbuf[cmdlen++] = suffix;
+                no_suffix:
+                ;
+            }
+            break;
+        case 2:
+        default:
+            /* Illegal command */
+            return 0;
+    }
+    return cmdlen;
 }
 
-int4 core_program_size(int prgm_index) {
+static int4 program_size(int prgm_index) {
     int4 pc = 0;
     int cmd;
     arg_struct arg;
@@ -1064,17 +1107,158 @@ int4 core_program_size(int prgm_index) {
     return size;
 }
 
+static int4 measure_program(int index) {
+    /* Returns the length of the HP-42S encoding of a program, and keeps it,
+     * together with the size for core_program_size(), until the program is
+     * changed (see discard_caches()) or the decimal point is.
+     */
+    prgm_struct *prgm = prgms + index;
+    char dot = flags.f.decimal_point;
+    int4 pc = 0;
+    int cmd;
+    arg_struct arg;
+    int saved_prgm = current_prgm;
+    char buf[25];
+    int4 length = 0;
+
+    if (prgm->hp42s_length != -1 && prgm->hp42s_dot == dot)
+        return prgm->hp42s_length;
+
+    current_prgm = index;
+    do {
+        get_next_command(&pc, &cmd, &arg, 0);
+        length += hp42s_encode_command(cmd, &arg, buf);
+    } while (cmd != CMD_END && pc < prgm->size);
+    current_prgm = saved_prgm;
+
+    prgm->hp42s_length = length;
+    prgm->hp42s_size = program_size(index);
+    prgm->hp42s_dot = dot;
+    return length;
+}
+
+static void encode_program(int index, char *buf) {
+    /* Encodes a program the way core_export_programs() writes it; 'buf' must
+     * have room for measure_program(index) bytes.
+     */
+    int4 pc = 0;
+    int cmd;
+    arg_struct arg;
+    int saved_prgm = current_prgm;
+    int4 length = 0;
+
+    current_prgm = index;
+    do {
+        get_next_command(&pc, &cmd, &arg, 0);
+        length += hp42s_encode_command(cmd, &arg, buf + length);
+    } while (cmd != CMD_END && pc < prgms[index].size);
+    current_prgm = saved_prgm;
+}
+
+int4 core_program_size(int prgm_index) {
+    measure_program(prgm_index);
+    return prgms[prgm_index].hp42s_size;
+}
+
+static int report_labels(int index, int (*progress_report)(const char *)) {
+    /* Reports the global labels and the END of a program, in order, as
+     * core_export_programs() promises.
+     */
+    int4 pc = 0;
+    int cmd;
+    arg_struct arg;
+    int saved_prgm = current_prgm;
+    int cancel = 0;
+
+    current_prgm = index;
+    do {
+        get_next_command(&pc, &cmd, &arg, 0);
+        if (cmd == CMD_LBL && arg.type == ARGTYPE_STR) {
+            char s[52];
+            int sl = hp2ascii(s + 1, arg.val.text, arg.length);
+            s[0] = s[sl + 1] = '"';
+            s[sl + 2] = 0;
+            cancel = progress_report(s);
+        } else if (cmd == CMD_END)
+            cancel = progress_report("END");
+    } while (!cancel && cmd != CMD_END && pc < prgms[index].size);
+    current_prgm = saved_prgm;
+    return cancel;
+}
+
+static void export_hp42s(int index) {
+    /* Fallback for when core_export_programs() can't get the memory it
+     * needs: encodes the program and writes it in small pieces.
+     */
+    int4 pc = 0;
+    int cmd;
+    arg_struct arg;
+    int saved_prgm = current_prgm;
+    char buf[1000];
+    int buflen = 0;
+
+    current_prgm = index;
+    do {
+        get_next_command(&pc, &cmd, &arg, 0);
+        if (buflen + 25 > 1000) {
+            if (!shell_write(buf, buflen))
+                goto done;
+            buflen = 0;
+        }
+        buflen += hp42s_encode_command(cmd, &arg, buf + buflen);
+    } while (cmd != CMD_END && pc < prgms[index].size);
+    if (buflen > 0)
+        shell_write(buf, buflen);
+    done:
+    current_prgm = saved_prgm;
+}
+
 int core_export_programs(int count, const int *indexes,
                           int (*progress_report)(const char *)) {
+    /* Each program is encoded into a buffer of exactly the right size, which
+     * is handed to shell_write() in one piece and freed right after.
+     */
     int i;
     for (i = 0; i < count; i++) {
         int p = indexes[i];
-        if (export_hp42s(p, progress_report))
+        int4 length;
+        char *buf;
+        if (progress_report != NULL && report_labels(p, progress_report))
             return 1;
+        length = measure_program(p);
+        buf = (char *) malloc(length + 1);
+        if (buf != NULL) {
+            encode_program(p, buf);
+            shell_write(buf, length);
+            free(buf);
+        } else
+            export_hp42s(p);
     }
     return 0;
 }
 
+char *core_export_programs_to_memory(int count, const int *indexes,
+                                     int4 *length) {
+    int4 total = 0;
+    char *buf;
+    int i;
+    for (i = 0; i < count; i++)
+        total += measure_program(indexes[i]);
+    /* Always allocate at least one byte, so that an empty result can be
+     * told apart from a failure.
+     */
+    buf = (char *) malloc(total + 1);
+    if (buf == NULL)
+        return NULL;
+    total = 0;
+    for (i = 0; i < count; i++) {
+        encode_program(indexes[i], buf + total);
+        total += prgms[indexes[i]].hp42s_length;
+    }
+    *length = total;
+    return buf;
+}
+
 static int hp42tofree42[] = {
     /* Flag values: 0 = simple 1-byte command; 1 = 1-byte command with
      * embedded argument; 2 = 2-byte command, argument follows;
@@ -1550,19 +1734,21 @@ void core_import_programs(int (*progress_report)(const char *)) {
     int done_flag = 0;
     arg_struct arg;
     int assign = 0;
-    int at_end = 1;
     int instrcount = -1;
     int report_label = 0;
 
-    set_running(false);
-
-    /* Set print mode to MAN during the import, to prevent store_command()
-     * from printing programs as they load
+    /* Each program is encoded into this buffer, and appended to the program
+     * list as a whole when its END is reached; the global label table is
+     * rebuilt once, at the end. Storing the commands one at a time, with
+     * store_command_after(), makes importing large programs quadratic.
      */
-    int saved_trace = flags.f.trace_print;
-    int saved_normal = flags.f.normal_print;
-    flags.f.trace_print = 0;
-    flags.f.normal_print = 0;
+    unsigned char *text = NULL;
+    int4 text_size = 0;
+    int4 text_capacity = 0;
+    int4 last_pc = -1;
+
+    journal_activity = true;
+    set_running(false);
 
     while (!done_flag) {
         skip:
@@ -1720,9 +1906,16 @@ void core_import_programs(int (*progress_report)(const char *)) {
                     goto done;
                 if (str_len < 0x0F1) {
                     /* END */
+                    if (text_size > 0) {
+                        bool ok = append_program(text, text_size);
+                        text_size = 0;
+                        need_to_rebuild_label_table = 1;
+                        if (!ok)
+                            goto done;
+                        pc = last_pc;
+                    }
                     if (progress_report != NULL && progress_report("END"))
                         goto done;
-                    at_end = 1;
                     goto skip;
                 } else {
                     /* LBL "" */
@@ -1949,22 +2142,51 @@ void core_import_programs(int (*progress_report)(const char *)) {
             }
         }
         store:
-        if (at_end) {
-            goto_dot_dot();
-            at_end = 0;
+        if (text_size + MAX_COMMAND_LENGTH > text_capacity) {
+            int4 newcapacity = text_capacity == 0 ? 4096 : text_capacity * 2;
+            unsigned char *newtext = (unsigned char *)
+                                        realloc(text, newcapacity);
+            if (newtext == NULL)
+                goto done;
+            text = newtext;
+            text_capacity = newcapacity;
         }
-        store_command_after(&pc, cmd, &arg);
-        need_to_rebuild_label_table = 1;
+        last_pc = text_size;
+        text_size += encode_command(cmd, &arg, text + text_size);
     }
 
     done:
+    if (text_size > 0) {
+        if (append_program(text, text_size))
+            pc = last_pc;
+        need_to_rebuild_label_table = 1;
+    }
+    free(text);
     if (need_to_rebuild_label_table) {
         rebuild_label_table();
         update_catalog();
     }
+}
 
-    flags.f.trace_print = saved_trace;
-    flags.f.normal_print = saved_normal;
+void core_event_pending() {
+    event_flag = 1;
+}
+
+int core_xeq(const char *name, int namelen) {
+    journal_activity = true;
+    if (mode_interruptible != NULL)
+        stop_interruptible();
+    mode_pause = false;
+    mode_getkey = false;
+    set_running(false);
+    if (namelen > 7)
+        namelen = 7;
+    pending_command = CMD_XEQ;
+    pending_command_arg.type = ARGTYPE_STR;
+    pending_command_arg.length = namelen;
+    for (int i = 0; i < namelen; i++)
+        pending_command_arg.val.text[i] = name[i];
+    return core_keyup();
 }
 
 void core_copy(char *buf, int buflen) {
@@ -2031,6 +2253,8 @@ void core_paste(const char *buf) {
     int i, s1, e1, s2, e2;
     vartype *v;
 
+    journal_activity = true;
+
     int base = get_base();
     if (base != 10) {
         int bpd = base == 2 ? 1 : base == 8 ? 3 : 4;
@@ -2209,6 +2433,235 @@ void core_paste(const char *buf) {
     redisplay();
 }
 
+void core_get_vartype_stats(core_vartype_stats *stats) {
+    int4 live[6];
+    get_vartype_stats(live, &stats->slabs);
+    stats->reals = live[TYPE_REAL];
+    stats->complexes = live[TYPE_COMPLEX];
+    stats->strings = live[TYPE_STRING];
+    stats->realmatrices = live[TYPE_REALMATRIX];
+    stats->complexmatrices = live[TYPE_COMPLEXMATRIX];
+}
+
+bool core_profile_start(uint4 (*clock)()) {
+    profile_clear();
+    profile_table_size = 1024;
+    profile_table = (profile_entry *)
+                    malloc(profile_table_size * sizeof(profile_entry));
+    if (profile_table == NULL) {
+        profile_table_size = 0;
+        return false;
+    }
+    for (int4 i = 0; i < profile_table_size; i++)
+        profile_table[i].prgm = -1;
+    profile_clock = clock;
+    return true;
+}
+
+void core_profile_stop() {
+    profile_clock = NULL;
+}
+
+static void profile_clear() {
+    profile_clock = NULL;
+    free(profile_table);
+    profile_table = NULL;
+    profile_table_size = 0;
+    profile_entries = 0;
+    for (int i = 0; i < CMD_SENTINEL; i++) {
+        profile_cmd_count[i] = 0;
+        profile_cmd_time[i] = 0;
+    }
+}
+
+static profile_entry *profile_slot(profile_entry *table, int4 size,
+                                   int prgm, int4 pc) {
+    uint4 h = ((uint4) prgm * 2654435761u) ^ ((uint4) pc * 40503u);
+    int4 mask = size - 1;
+    int4 i = (h ^ (h >> 16)) & mask;
+    while (table[i].prgm != -1
+            && (table[i].prgm != prgm || table[i].pc != pc))
+        i = (i + 1) & mask;
+    return table + i;
+}
+
+static void profile_record(int prgm, int4 pc, int cmd, uint4 time) {
+    profile_entry *e;
+    profile_cmd_count[cmd]++;
+    profile_cmd_time[cmd] += time;
+    if (profile_entries * 2 >= profile_table_size) {
+        int4 newsize = profile_table_size * 2;
+        profile_entry *newtable = (profile_entry *)
+                                  malloc(newsize * sizeof(profile_entry));
+        if (newtable == NULL)
+            /* Keep counting commands, but no new lines */
+            goto old_table;
+        for (int4 i = 0; i < newsize; i++)
+            newtable[i].prgm = -1;
+        for (int4 i = 0; i < profile_table_size; i++)
+            if (profile_table[i].prgm != -1)
+                *profile_slot(newtable, newsize, profile_table[i].prgm,
+                              profile_table[i].pc) = profile_table[i];
+        free(profile_table);
+        profile_table = newtable;
+        profile_table_size = newsize;
+    }
+    old_table:
+    e = profile_slot(profile_table, profile_table_size, prgm, pc);
+    if (e->prgm == -1) {
+        if (profile_entries * 2 >= profile_table_size)
+            return;
+        e->prgm = prgm;
+        e->pc = pc;
+        e->count = 0;
+        e->time = 0;
+        profile_entries++;
+    }
+    e->cmd = cmd;
+    e->count++;
+    e->time += time;
+}
+
+static int profile_compare(const void *a, const void *b) {
+    const profile_entry *e1 = (const profile_entry *) a;
+    const profile_entry *e2 = (const profile_entry *) b;
+    if (e1->time != e2->time)
+        return e1->time > e2->time ? -1 : 1;
+    if (e1->count != e2->count)
+        return e1->count > e2->count ? -1 : 1;
+    if (e1->prgm != e2->prgm)
+        return e1->prgm < e2->prgm ? -1 : 1;
+    return e1->pc < e2->pc ? -1 : e1->pc > e2->pc ? 1 : 0;
+}
+
+void core_profile_report(void (*writer)(const char *text), int max_lines) {
+    char line[400];
+    char cmdbuf[50];
+    int cmdlen;
+    uint8 total_time = 0;
+    uint4 total_count = 0;
+    profile_entry *sorted;
+    int4 n;
+    int *first_label;
+    int saved_prgm = current_prgm;
+    int i;
+
+    for (i = 0; i < CMD_SENTINEL; i++) {
+        total_time += profile_cmd_time[i];
+        total_count += profile_cmd_count[i];
+    }
+    sprintf(line, "%u instructions, %.3f ms", total_count,
+            total_time / 1000.0);
+    writer(line);
+    if (total_count == 0)
+        return;
+    if (total_time == 0)
+        /* Clock too coarse to see anything; avoid dividing by zero */
+        total_time = 1;
+
+    /* Program lines, hottest first. Each program is identified by its first
+     * global label, like in the PGM catalog.
+     */
+    n = profile_entries > CMD_SENTINEL ? profile_entries : CMD_SENTINEL;
+    sorted = (profile_entry *) malloc(n * sizeof(profile_entry));
+    first_label = (int *) malloc((prgms_count + 1) * sizeof(int));
+    if (sorted == NULL || first_label == NULL) {
+        free(sorted);
+        free(first_label);
+        writer("Insufficient memory for the report");
+        return;
+    }
+    n = 0;
+    for (int4 j = 0; j < profile_table_size; j++)
+        if (profile_table[j].prgm != -1)
+            sorted[n++] = profile_table[j];
+    qsort(sorted, n, sizeof(profile_entry), profile_compare);
+    for (i = 0; i < prgms_count; i++)
+        first_label[i] = -1;
+    for (i = 0; i < labels_count; i++)
+        if (labels[i].length > 0 && first_label[labels[i].prgm] == -1)
+            first_label[labels[i].prgm] = i;
+
+    writer("");
+    writer(" time (ms)       %       count  line");
+    if (max_lines > n)
+        max_lines = n;
+    for (i = 0; i < max_lines; i++) {
+        profile_entry *e = sorted + i;
+        char name[40];
+        int namelen;
+        int4 lineno = 0;
+        cmdlen = 0;
+        if (e->prgm >= prgms_count || e->pc >= prgms[e->prgm].size) {
+            /* The program has been changed since this was recorded */
+            strcpy(name, "?");
+            namelen = 1;
+        } else {
+            int li = first_label[e->prgm];
+            if (li == -1) {
+                strcpy(name, e->prgm == prgms_count - 1 ? ".END." : "END");
+                namelen = (int) strlen(name);
+            } else {
+                name[0] = '"';
+                namelen = 1 + hp2ascii(name + 1, labels[li].name,
+                                       labels[li].length);
+                name[namelen++] = '"';
+            }
+            current_prgm = e->prgm;
+            lineno = pc2line(e->pc);
+            if (line2pc(lineno) == e->pc) {
+                int4 pc2 = e->pc;
+                int cmd;
+                arg_struct arg;
+                get_next_command(&pc2, &cmd, &arg, 0);
+                cmdlen = prgmline2buf(cmdbuf, 50, -1, 0, cmd, &arg);
+            } else
+                lineno = 0;
+        }
+        name[namelen] = 0;
+        int len = sprintf(line, "%10.3f %6.2f%% %11u  %s %03d ",
+                          e->time / 1000.0, e->time * 100.0 / total_time,
+                          e->count, name, lineno);
+        len += hp2ascii(line + len, cmdbuf, cmdlen);
+        line[len] = 0;
+        writer(line);
+    }
+    current_prgm = saved_prgm;
+
+    /* Totals per command */
+    n = 0;
+    for (i = 0; i < CMD_SENTINEL; i++)
+        if (profile_cmd_count[i] != 0) {
+            sorted[n].cmd = i;
+            sorted[n].prgm = 0;
+            sorted[n].pc = 0;
+            sorted[n].count = profile_cmd_count[i];
+            sorted[n].time = profile_cmd_time[i];
+            n++;
+        }
+    qsort(sorted, n, sizeof(profile_entry), profile_compare);
+    writer("");
+    writer(" time (ms)       %       count  command");
+    for (i = 0; i < n; i++) {
+        const command_spec *cs = cmdlist(sorted[i].cmd);
+        int len = sprintf(line, "%10.3f %6.2f%% %11u  ",
+                          sorted[i].time / 1000.0,
+                          sorted[i].time * 100.0 / total_time,
+                          sorted[i].count);
+        if (sorted[i].cmd == CMD_NUMBER)
+            len += sprintf(line + len, "(number)");
+        else if (sorted[i].cmd == CMD_STRING)
+            len += sprintf(line + len, "(string)");
+        else
+            len += hp2ascii(line + len, cs->name, cs->name_length);
+        line[len] = 0;
+        writer(line);
+    }
+
+    free(sorted);
+    free(first_label);
+}
+
 void set_alpha_entry(bool state) {
     mode_alpha_entry = state;
 }
@@ -2217,6 +2670,9 @@ void set_running(bool state) {
     if (mode_running != state) {
         mode_running = state;
         shell_annunciators(-1, -1, -1, state, -1, -1);
+        if (!state)
+            /* Show any changes held back by flush_display() */
+            flush_display();
     }
     if (state) {
         /* Cancel any pending INPUT command */
@@ -2316,11 +2772,64 @@ void do_interactive(int command) {
     }
 }
 
+static bool wants_to_yield() {
+    /* Calling shell_wants_cpu() is not free -- in the GTK shell, for instance,
+     * it checks all the main loop's event sources -- so we don't do it before
+     * every instruction, but only every poll_interval instructions. That
+     * interval is adjusted so that the polls end up roughly POLL_MS apart,
+     * whatever the program is doing. Since it can take a long time to run
+     * poll_interval instructions after a program switches from fast
+     * instructions to slow ones, the clock is also checked every
+     * CLOCK_CHECK_INTERVAL instructions, and if POLL_MS have passed, we poll
+     * early, and scale poll_interval to what was actually achieved.
+     * Shells that learn about events asynchronously can call
+     * core_event_pending() to get the CPU back without waiting for the next
+     * poll.
+     */
+    if (event_flag) {
+        event_flag = 0;
+        return true;
+    }
+    if (--poll_countdown > 0) {
+        if (--clock_countdown > 0)
+            return false;
+        clock_countdown = CLOCK_CHECK_INTERVAL;
+        if (shell_milliseconds() - last_poll_time < POLL_MS)
+            return false;
+    }
+    uint4 now = shell_milliseconds();
+    uint4 elapsed = now - last_poll_time;
+    int done = poll_interval - poll_countdown;
+    last_poll_time = now;
+    if (elapsed < POLL_MS / 2) {
+        if (poll_interval < MAX_POLL_INTERVAL)
+            poll_interval <<= 1;
+    } else if (elapsed > POLL_MS) {
+        poll_interval = (int) ((uint4) done * POLL_MS / elapsed);
+        if (poll_interval < 1)
+            poll_interval = 1;
+    }
+    poll_countdown = poll_interval;
+    clock_countdown = CLOCK_CHECK_INTERVAL;
+    return shell_wants_cpu() != 0;
+}
+
 static void continue_running() {
     int error;
-    while (!shell_wants_cpu()) {
+    /* event_flag is not cleared here; an event that the shell reported just
+     * before this call still has to make us yield.
+     */
+    last_poll_time = shell_milliseconds();
+    poll_countdown = poll_interval;
+    clock_countdown = CLOCK_CHECK_INTERVAL;
+    while (!wants_to_yield()) {
         int cmd;
         arg_struct arg;
+        int prof_prgm = current_prgm;
+        int4 prof_pc;
+        uint4 prof_start = 0;
+        if (profile_clock != NULL)
+            prof_start = profile_clock();
         oldpc = pc;
         if (pc == -1)
             pc = 0;
@@ -2329,11 +2838,15 @@ static void continue_running() {
             set_running(false);
             return;
         }
-        get_next_command(&pc, &cmd, &arg, 1);
+        prof_pc = pc;
+        get_next_decoded_command(&pc, &cmd, &arg);
         if (flags.f.trace_print && flags.f.printer_exists)
             print_program_line(current_prgm, oldpc);
         mode_disable_stack_lift = false;
         error = cmdlist(cmd)->handler(&arg);
+        if (profile_clock != NULL)
+            profile_record(prof_prgm, prof_pc, cmd,
+                           profile_clock() - prof_start);
         if (mode_pause) {
             shell_request_timeout3(1000);
             return;
@@ -59,6 +59,53 @@ void core_enter_background();
  */
 void core_quit();
 
+/* core_save_state()
+ *
+ * This function writes the complete state, using shell_write_saved_state(),
+ * just like core_quit(), but without shutting down. Journal checkpoints
+ * written before this call will not be replayed on top of the new state file.
+ * Returns false if the state could not be written, either because of an error
+ * from shell_write_saved_state(), or because the core is in the middle of an
+ * operation that can't be saved, like a running SOLVE or INTEG; in the latter
+ * case, nothing is written, and the shell should try again later.
+ */
+bool core_save_state();
+
+/* core_saved_state_unmodified()
+ *
+ * Shells that implement shell_map_saved_state() may call this from
+ * shell_write_saved_state(), while the state is being written by
+ * core_save_state() or core_quit(). It returns true if buf is memory that was
+ * returned by shell_map_saved_state(), and that the core has not written to
+ * since, so that its contents are still the same as the bytes it was mapped
+ * from. The shell may then copy those bytes from the old state file instead
+ * of from buf.
+ */
+bool core_saved_state_unmodified(const void *buf, int4 nbytes);
+
+/* core_checkpoint()
+ *
+ * This function appends the parts of the state that have changed since the
+ * state was loaded or saved, or since the last checkpoint, to the journal,
+ * using shell_write_saved_state(). The shell should open its journal file for
+ * appending before calling this function. Returns false if nothing was
+ * written, because the core is busy (see core_save_state()), or because of a
+ * write error; the next checkpoint will include the changes that were missed.
+ * It is up to the shell to decide when the journal has grown large enough to
+ * be worth compacting, by writing a complete state file using
+ * core_save_state() and then discarding the journal.
+ */
+bool core_checkpoint();
+
+/* core_replay_journal()
+ *
+ * This function reads the journal using shell_read_saved_state(), and applies
+ * the checkpoints in it that were written after the state file that was
+ * loaded by core_init(). The shell should call it right after core_init(), if
+ * a journal exists. Returns true if any changes were applied.
+ */
+bool core_replay_journal();
+
 /* core_repaint_display()
  *
  * This function asks the emulator core to repaint the display. The core will
@@ -69,6 +116,18 @@ void core_quit();
  */
 void core_repaint_display();
 
+/* core_set_display_rate()
+ *
+ * While a program is running, changes to the display are collected, and
+ * passed to shell_blitter() at most 'fps' times per second, so that programs
+ * that draw a lot, like graphing programs doing thousands of PIXELs, don't
+ * spend most of their time repainting. When the program stops, pauses, or
+ * waits for GETKEY, the display is brought up to date right away. The
+ * default is 60; 0 turns the limit off, and every change is shown as soon
+ * as it is made, as when no program is running.
+ */
+void core_set_display_rate(int fps);
+
 /* core_menu()
  *
  * The shell uses this function to check if a menu is active. This affects
@@ -273,7 +332,8 @@ int4 core_program_size(int prgm_index);
  * confirmed the operation (supplied a file name etc.). 
  * The 'count' parameter indicates how many programs are to be exported; the
  * 'indexes' parameter is an array of program indexes. The core will pass the
- * raw file data to the shell using the shell_write() function.
+ * raw file data to the shell using the shell_write() function, passing it
+ * each program in one piece.
  * The 'progress_report' parameter is an optional callback that will be invoked
  * to report when each program was written. If the callback returns zero, the
  * export will abort.
@@ -286,6 +346,15 @@ int4 core_program_size(int prgm_index);
 int core_export_programs(int count, const int *indexes,
                          int (*progress_report)(const char *));
 
+/* core_export_programs_to_memory()
+ *
+ * Like core_export_programs(), but returns the raw file data in a buffer
+ * allocated with malloc(), which the caller should free(), and its length in
+ * *length. Returns NULL if there is not enough memory.
+ */
+char *core_export_programs_to_memory(int count, const int *indexes,
+                                     int4 *length);
+
 /* core_import_programs()
  *
  * This function is called by the shell after the user has selected a file to
@@ -298,6 +367,36 @@ int core_export_programs(int count, const int *indexes,
  */
 void core_import_programs(int (*progress_report)(const char *));
 
+/* core_event_pending()
+ *
+ * Tells the core that the shell has an event waiting to be handled. While a
+ * program is running, the core only calls shell_wants_cpu() every so often
+ * (roughly every 10 milliseconds), rather than before every instruction;
+ * calling this function makes it give up the CPU at the next instruction
+ * instead, just as if shell_wants_cpu() had returned 1.
+ * All this does is set a flag, so it is safe to call from other threads;
+ * that is what it is for: shells that run the core on a thread of its own,
+ * like the Mac and iPhone versions. Shells that run the core on the same
+ * thread that handles events, like the GTK version, can't call this while a
+ * program is running, and rely on shell_wants_cpu() instead.
+ * The flag stays set until a running program has yielded because of it.
+ */
+void core_event_pending();
+
+/* core_xeq()
+ *
+ * Starts execution of the program at global label 'name', just as if the
+ * user had entered XEQ "name" from the keyboard. The name is given in the
+ * HP-42S character set; 'namelen' is its length, which is truncated to 7 if
+ * it is longer than that.
+ * This is for shells that run programs without any user interaction, like
+ * the command-line batch runner. The return value has the same meaning as
+ * that of core_keyup(): if it is 1, the program is running, and the shell
+ * should keep calling core_keydown() with a key code of 0 for as long as
+ * that keeps returning 1.
+ */
+int core_xeq(const char *name, int namelen);
+
 /* core_copy()
  *
  * Returns a string representation of the contents of the X register.
@@ -314,6 +413,50 @@ void core_copy(char *buf, int buflen);
  */
 void core_paste(const char *s);
 
+/* core_vartype_stats
+ *
+ * Live object counts, as returned by core_get_vartype_stats(). Reals,
+ * complex numbers, and strings are allocated from 4 KB slabs; 'slabs' is the
+ * number of those currently allocated. The matrix counts include the LU
+ * workspaces (at most one real and one complex) that matrix division, INVRT,
+ * and DET keep between calls; those are freed when memory runs short.
+ * For diagnostics only; a steadily growing count while nothing is being
+ * stored is a sign of a leak.
+ */
+typedef struct {
+    int4 reals;
+    int4 complexes;
+    int4 strings;
+    int4 realmatrices;
+    int4 complexmatrices;
+    int4 slabs;
+} core_vartype_stats;
+
+void core_get_vartype_stats(core_vartype_stats *stats);
+
+/* core_profile_start()
+ * core_profile_stop()
+ * core_profile_report()
+ *
+ * Instruction-level profiler for running programs. After
+ * core_profile_start(), every program line that is executed is counted, and
+ * the time spent in it is added up, per line and per command, until
+ * core_profile_stop() is called. The clock is supplied by the shell, since
+ * shell_milliseconds() is too coarse for timing single instructions; it should
+ * return microseconds, relative to anything. Time spent in the background
+ * parts of SOLVE, INTEG, and the matrix functions is not counted.
+ * Calling core_profile_start() again clears the counts. It returns false if
+ * there is not enough memory.
+ * core_profile_report() passes a report to 'writer', one line of text at a
+ * time: the totals, the 'max_lines' lines in which the most time was spent,
+ * and the time spent per command. Lines are identified by the first global
+ * label of their program and their line number. If programs are edited while
+ * profiling, lines recorded before the edit are not shown correctly.
+ */
+bool core_profile_start(uint4 (*clock)());
+void core_profile_stop();
+void core_profile_report(void (*writer)(const char *text), int max_lines);
+
 /* core_settings
  *
  * This is a struct that stores user-configurable core settings. The shell
@@ -332,6 +475,13 @@ typedef struct {
     bool enable_ext_heading;
     bool enable_ext_time;
     bool enable_ext_fptest;
+    /* Only used in the decimal version: perform real matrix multiplication,
+     * LU decomposition, and back-substitution (x, /, INVRT, DET, SIMQ) in
+     * binary64 instead of decimal. This trades decimal exactness (results
+     * are good to about 16 digits, with binary rounding) for a 10 to 50
+     * times speedup on large matrices.
+     */
+    bool matrix_fastbinary;
 } core_settings_struct;
 
 extern core_settings_struct core_settings;
@@ -23,6 +23,7 @@
 #endif 
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "core_math1.h"
 #include "core_commands2.h"
@@ -98,6 +99,11 @@ typedef struct {
 
 static integ_state integ;
 
+/* Bumped by everything that may change 'solve' or 'integ'; see
+ * math_changes().
+ */
+static uint4 change_count = 0;
+
 
 static void reset_solve();
 static void reset_integ();
@@ -120,6 +126,8 @@ bool unpersist_math(bool discard) {
     bool success;
     void *dummy;
 
+    change_count++;
+
     if (shell_read_saved_state(&size, sizeof(int)) != sizeof(int))
         return false;
     if (!discard && size == sizeof(solve_state)) {
@@ -159,7 +167,192 @@ bool unpersist_math(bool discard) {
     return true;
 }
 
+/* The solver and integrator state, for the state journal (see
+ * write_journal() in core_globals.cc). The fields are written one by one,
+ * using the same functions as the rest of the state, rather than as raw
+ * structs, so padding bytes stay out of the journal.
+ */
+
+static bool write_name(const char *name, int length) {
+    return write_int(length) && shell_write_saved_state(name, 7);
+}
+
+static bool read_name(char *name, int *length) {
+    return read_int(length) && *length >= 0 && *length <= 7
+            && shell_read_saved_state(name, 7) == 7;
+}
+
+static bool write_phloats(const phloat *p, int n) {
+    for (int i = 0; i < n; i++)
+        if (!write_phloat(p[i]))
+            return false;
+    return true;
+}
+
+static bool read_phloats(phloat *p, int n) {
+    for (int i = 0; i < n; i++)
+        if (!read_phloat(p + i))
+            return false;
+    return true;
+}
+
+static bool write_solve_state(const solve_state *s) {
+    int i;
+    if (!write_int(s->version)) return false;
+    if (!write_name(s->prgm_name, s->prgm_length)) return false;
+    if (!write_name(s->active_prgm_name, s->active_prgm_length)) return false;
+    if (!write_name(s->var_name, s->var_length)) return false;
+    if (!write_int(s->keep_running)) return false;
+    if (!write_int(s->prev_prgm)) return false;
+    if (!write_int4(s->prev_pc)) return false;
+    if (!write_int(s->state)) return false;
+    if (!write_int(s->which)) return false;
+    if (!write_int(s->toggle)) return false;
+    if (!write_int(s->retry_counter)) return false;
+    if (!write_phloat(s->retry_value)) return false;
+    if (!write_phloat(s->x1)) return false;
+    if (!write_phloat(s->x2)) return false;
+    if (!write_phloat(s->x3)) return false;
+    if (!write_phloat(s->fx1)) return false;
+    if (!write_phloat(s->fx2)) return false;
+    if (!write_phloat(s->prev_x)) return false;
+    if (!write_phloat(s->curr_x)) return false;
+    if (!write_phloat(s->curr_f)) return false;
+    if (!write_phloat(s->xm)) return false;
+    if (!write_phloat(s->fxm)) return false;
+    for (i = 0; i < NUM_SHADOWS; i++)
+        if (!write_name(s->shadow_name[i], s->shadow_length[i])) return false;
+    if (!write_phloats(s->shadow_value, NUM_SHADOWS)) return false;
+    return write_int4(s->last_disp_time);
+}
+
+static bool read_solve_state(solve_state *s) {
+    int i;
+    int4 t;
+    if (!read_int(&s->version)) return false;
+    if (!read_name(s->prgm_name, &s->prgm_length)) return false;
+    if (!read_name(s->active_prgm_name, &s->active_prgm_length)) return false;
+    if (!read_name(s->var_name, &s->var_length)) return false;
+    if (!read_int(&s->keep_running)) return false;
+    if (!read_int(&s->prev_prgm)) return false;
+    if (!read_int4(&s->prev_pc)) return false;
+    if (!read_int(&s->state)) return false;
+    if (!read_int(&s->which)) return false;
+    if (!read_int(&s->toggle)) return false;
+    if (!read_int(&s->retry_counter)) return false;
+    if (!read_phloat(&s->retry_value)) return false;
+    if (!read_phloat(&s->x1)) return false;
+    if (!read_phloat(&s->x2)) return false;
+    if (!read_phloat(&s->x3)) return false;
+    if (!read_phloat(&s->fx1)) return false;
+    if (!read_phloat(&s->fx2)) return false;
+    if (!read_phloat(&s->prev_x)) return false;
+    if (!read_phloat(&s->curr_x)) return false;
+    if (!read_phloat(&s->curr_f)) return false;
+    if (!read_phloat(&s->xm)) return false;
+    if (!read_phloat(&s->fxm)) return false;
+    for (i = 0; i < NUM_SHADOWS; i++)
+        if (!read_name(s->shadow_name[i], &s->shadow_length[i])) return false;
+    if (!read_phloats(s->shadow_value, NUM_SHADOWS)) return false;
+    if (!read_int4(&t)) return false;
+    s->last_disp_time = (uint4) t;
+    return true;
+}
+
+static bool write_integ_state(const integ_state *g) {
+    if (!write_int(g->version)) return false;
+    if (!write_name(g->prgm_name, g->prgm_length)) return false;
+    if (!write_name(g->active_prgm_name, g->active_prgm_length)) return false;
+    if (!write_name(g->var_name, g->var_length)) return false;
+    if (!write_int(g->keep_running)) return false;
+    if (!write_int(g->prev_prgm)) return false;
+    if (!write_int4(g->prev_pc)) return false;
+    if (!write_int(g->state)) return false;
+    if (!write_phloat(g->llim)) return false;
+    if (!write_phloat(g->ulim)) return false;
+    if (!write_phloat(g->acc)) return false;
+    if (!write_phloat(g->a)) return false;
+    if (!write_phloat(g->b)) return false;
+    if (!write_phloat(g->eps)) return false;
+    if (!write_int(g->n)) return false;
+    if (!write_int(g->m)) return false;
+    if (!write_int(g->i)) return false;
+    if (!write_int(g->k)) return false;
+    if (!write_phloat(g->h)) return false;
+    if (!write_phloat(g->sum)) return false;
+    if (!write_phloats(g->c, ROMB_K)) return false;
+    if (!write_phloats(g->s, ROMB_K + 1)) return false;
+    if (!write_int(g->nsteps)) return false;
+    if (!write_phloat(g->p)) return false;
+    if (!write_phloat(g->t)) return false;
+    if (!write_phloat(g->u)) return false;
+    if (!write_phloat(g->prev_int)) return false;
+    return write_int(g->evalCount);
+}
+
+static bool read_integ_state(integ_state *g) {
+    if (!read_int(&g->version)) return false;
+    if (!read_name(g->prgm_name, &g->prgm_length)) return false;
+    if (!read_name(g->active_prgm_name, &g->active_prgm_length)) return false;
+    if (!read_name(g->var_name, &g->var_length)) return false;
+    if (!read_int(&g->keep_running)) return false;
+    if (!read_int(&g->prev_prgm)) return false;
+    if (!read_int4(&g->prev_pc)) return false;
+    if (!read_int(&g->state)) return false;
+    if (!read_phloat(&g->llim)) return false;
+    if (!read_phloat(&g->ulim)) return false;
+    if (!read_phloat(&g->acc)) return false;
+    if (!read_phloat(&g->a)) return false;
+    if (!read_phloat(&g->b)) return false;
+    if (!read_phloat(&g->eps)) return false;
+    if (!read_int(&g->n)) return false;
+    if (!read_int(&g->m)) return false;
+    if (!read_int(&g->i)) return false;
+    if (!read_int(&g->k)) return false;
+    if (!read_phloat(&g->h)) return false;
+    if (!read_phloat(&g->sum)) return false;
+    if (!read_phloats(g->c, ROMB_K)) return false;
+    if (!read_phloats(g->s, ROMB_K + 1)) return false;
+    if (!read_int(&g->nsteps)) return false;
+    if (!read_phloat(&g->p)) return false;
+    if (!read_phloat(&g->t)) return false;
+    if (!read_phloat(&g->u)) return false;
+    if (!read_phloat(&g->prev_int)) return false;
+    return read_int(&g->evalCount);
+}
+
+bool write_math_state() {
+    solve.version = SOLVE_VERSION;
+    integ.version = INTEG_VERSION;
+    return write_solve_state(&solve) && write_integ_state(&integ);
+}
+
+/* Reads the state written by write_math_state(), and applies it if 'apply'
+ * is set. Returns false if it could not be read in full.
+ */
+bool read_math_state(bool apply) {
+    solve_state s;
+    integ_state g;
+    if (!read_solve_state(&s) || !read_integ_state(&g))
+        return false;
+    if (!apply)
+        return true;
+    change_count++;
+    solve = s;
+    integ = g;
+    if (solve.version != SOLVE_VERSION)
+        reset_solve();
+    if (integ.version != INTEG_VERSION)
+        reset_integ();
+    return true;
+}
+
+uint4 math_changes() {
+    return change_count;
+}
+
 void reset_math() {
+    change_count++;
     reset_solve();
     reset_integ();
 }
@@ -183,6 +376,7 @@ static int find_shadow(const char *name, int length) {
 }
 
 void put_shadow(const char *name, int length, phloat value) {
+    change_count++;
     int i = find_shadow(name, length);
     if (i == -1) {
         for (i = 0; i < NUM_SHADOWS; i++)
@@ -211,6 +405,7 @@ int get_shadow(const char *name, int length, phloat *value) {
 }
 
 void remove_shadow(const char *name, int length) {
+    change_count++;
     int i = find_shadow(name, length);
     int j;
     if (i == -1)
@@ -224,6 +419,7 @@ void remove_shadow(const char *name, int length) {
 }
 
 void set_solve_prgm(const char *name, int length) {
+    change_count++;
     string_copy(solve.prgm_name, &solve.prgm_length, name, length);
 }
 
@@ -257,6 +453,7 @@ static int call_solve_fn(int which, int state) {
 }
 
 int start_solve(const char *name, int length, phloat x1, phloat x2) {
+    change_count++;
     if (solve_active())
         return ERR_SOLVE_SOLVE;
     string_copy(solve.var_name, &solve.var_length, name, length);
@@ -415,6 +612,7 @@ int return_to_solve(int failure) {
     phloat f, slope, s, xnew, prev_f = solve.curr_f;
     uint4 now_time;
 
+    change_count++;
     if (solve.state == 0)
         return ERR_INTERNAL_ERROR;
     if (!failure) {
@@ -807,6 +1005,7 @@ static void reset_integ() {
 }
 
 void set_integ_prgm(const char *name, int length) {
+    change_count++;
     string_copy(integ.prgm_name, &integ.prgm_length, name, length);
 }
 
@@ -815,6 +1014,7 @@ void get_integ_prgm(char *name, int *length) {
 }
 
 void set_integ_var(const char *name, int length) {
+    change_count++;
     string_copy(integ.var_name, &integ.var_length, name, length);
 }
 
@@ -848,6 +1048,7 @@ static int call_integ_fn() {
 }
 
 int start_integ(const char *name, int length) {
+    change_count++;
     vartype *v;
     if (integ_active())
         return ERR_INTEG_INTEG;
@@ -953,6 +1154,7 @@ static int finish_integ() {
  */
 
 int return_to_integ(int failure) {
+    change_count++;
     switch (integ.state) {
     case 0:
         return ERR_INTERNAL_ERROR;
@@ -23,6 +23,9 @@
 
 bool persist_math();
 bool unpersist_math(bool discard);
+bool write_math_state();
+bool read_math_state(bool apply);
+uint4 math_changes();
 void reset_math();
 
 void put_shadow(const char *name, int length, phloat value);
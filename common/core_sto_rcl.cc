@@ -398,6 +398,7 @@ int generic_sto(arg_struct *arg, char operation) {
                     for (i = 0; i < len; i++)
                         phloat_text(*ds)[i] = vs->text[i];
                     rm->array->is_string[num] = 1;
+                    rm->array->no_strings = false;
                     return ERR_NONE;
                 } else if (reg_x->type == TYPE_REAL) {
                     if (!disentangle((vartype *) rm))
@@ -690,6 +691,38 @@ int map_unary(const vartype *src, vartype **dst, mappable_r mr, mappable_c mc) {
     }
 }
 
+/* Applies a unary operator to X, and replaces X with the result, the way
+ * map_unary() followed by unary_result() would, but without allocating
+ * anything when X is a real or complex number.
+ */
+int map_unary_result(mappable_r mr, mappable_c mc) {
+    int error;
+    switch (reg_x->type) {
+        case TYPE_REAL: {
+            phloat r;
+            error = mr(((vartype_real *) reg_x)->x, &r);
+            if (error != ERR_NONE)
+                return error;
+            return unary_real_result(r);
+        }
+        case TYPE_COMPLEX: {
+            phloat rre, rim;
+            error = mc(((vartype_complex *) reg_x)->re,
+                       ((vartype_complex *) reg_x)->im, &rre, &rim);
+            if (error != ERR_NONE)
+                return error;
+            return unary_complex_result(rre, rim);
+        }
+        default: {
+            vartype *v;
+            error = map_unary(reg_x, &v, mr, mc);
+            if (error == ERR_NONE)
+                unary_result(v);
+            return error;
+        }
+    }
+}
+
 int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
         mappable_rr mrr, mappable_rc mrc, mappable_cr mcr, mappable_cc mcc) {
     int error;
@@ -16,155 +16,353 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "core_globals.h"
 #include "core_helpers.h"
+#include "core_linalg1.h"
 #include "core_display.h"
 #include "core_variables.h"
+#include "shell.h"
 
 
-// We cache vartype_real, vartype_complex, and vartype_string instances, to
-// cut down on the malloc/free overhead. This overhead is particularly painful
-// in the PalmOS ARM version, because it has to do an ARM-to-68K call for each
-// malloc or free, and that's a performance killer when running programs.
-// TODO: Pools may cause memory fragmentation. To fix, override malloc() and
-// realloc() with versions that empty the pools and retry before returning
-// NULL.
+// Reals, complex numbers, and strings are allocated from slabs: blocks of
+// SLAB_SIZE bytes, each holding a number of same-sized cells, with a bitmap
+// to keep track of which ones are in use. This keeps allocating and freeing
+// them about as cheap as with plain free lists, which matters when running
+// programs, but unlike free lists, slabs go back to the system once all their
+// cells are free, so a large temporary computation doesn't leave its
+// high-water mark behind for the rest of the session.
+// Each cell starts with a pointer to its slab, so that free_vartype() can
+// find it without requiring aligned allocations. The cells and the slab
+// header are padded to a multiple of sizeof(slab_cell), which is aligned for
+// anything a vartype may contain; in the decimal version, that includes
+// BID_UINT128, which wants 16 bytes, more than the pointer or a double.
 
-typedef struct pool_real {
-    vartype_real r;
-    struct pool_real *next;
-} pool_real;
+#define SLAB_SIZE 4096
+#define SLAB_MAP_WORDS 8
 
-static pool_real *realpool = NULL;
+struct slab_class;
 
-typedef struct pool_complex {
-    vartype_complex c;
-    struct pool_complex *next;
-} pool_complex;
+typedef struct slab {
+    struct slab *prev;
+    struct slab *next;
+    struct slab_class *cls;
+    int used;
+    uint4 map[SLAB_MAP_WORDS];
+} slab;
 
-static pool_complex *complexpool = NULL;
+typedef union slab_cell {
+    slab *owner;
+    double align_d;
+    int8 align_i;
+#ifdef BCD_MATH
+    BID_UINT128 align_b;
+#endif
+} slab_cell;
 
-typedef struct pool_string {
-    vartype_string s;
-    struct pool_string *next;
-} pool_string;
+#define SLAB_ROUND(n) (((n) + sizeof(slab_cell) - 1) \
+                            / sizeof(slab_cell) * sizeof(slab_cell))
+#define SLAB_HEADER_SIZE SLAB_ROUND(sizeof(slab))
+#define SLAB_CELL_SIZE(t) SLAB_ROUND(sizeof(slab_cell) + sizeof(t))
 
-static pool_string *stringpool = NULL;
+typedef struct slab_class {
+    int cellsize;
+    int ncells;
+    // Slabs with at least one free cell; full slabs aren't linked anywhere
+    slab *avail;
+    // One empty slab is kept around, so that a value that keeps getting
+    // allocated and freed at a slab boundary doesn't cause a malloc() and
+    // free() every time
+    slab *spare;
+    int4 live;
+    int4 slabs;
+} slab_class;
 
-vartype *new_real(phloat value) {
-    pool_real *r;
-    if (realpool == NULL) {
-        r = (pool_real *) malloc(sizeof(pool_real));
-        if (r == NULL)
-            return NULL;
-        r->r.type = TYPE_REAL;
-    } else {
-        r = realpool;
-        realpool = realpool->next;
+static slab_class real_slabs = { SLAB_CELL_SIZE(vartype_real), 0, NULL, NULL, 0, 0 };
+static slab_class complex_slabs = { SLAB_CELL_SIZE(vartype_complex), 0, NULL, NULL, 0, 0 };
+static slab_class string_slabs = { SLAB_CELL_SIZE(vartype_string), 0, NULL, NULL, 0, 0 };
+
+static int4 realmatrix_count = 0;
+static int4 complexmatrix_count = 0;
+
+static void *slab_alloc(slab_class *cls) {
+    slab *s = cls->avail;
+    if (s == NULL) {
+        if (cls->spare != NULL) {
+            s = cls->spare;
+            cls->spare = NULL;
+        } else {
+            if (cls->ncells == 0) {
+                cls->ncells = (SLAB_SIZE - SLAB_HEADER_SIZE) / cls->cellsize;
+                if (cls->ncells > SLAB_MAP_WORDS * 32)
+                    cls->ncells = SLAB_MAP_WORDS * 32;
+            }
+            s = (slab *) malloc(SLAB_SIZE);
+            if (s == NULL)
+                return NULL;
+            s->cls = cls;
+            s->used = 0;
+            // Mark the nonexistent cells past the end as taken, so the
+            // search below never has to check for them
+            for (int w = 0; w < SLAB_MAP_WORDS; w++) {
+                int n = cls->ncells - w * 32;
+                if (n >= 32)
+                    s->map[w] = 0;
+                else if (n <= 0)
+                    s->map[w] = 0xffffffff;
+                else
+                    s->map[w] = 0xffffffff << n;
+            }
+            cls->slabs++;
+        }
+        s->prev = NULL;
+        s->next = NULL;
+        cls->avail = s;
+    }
+
+    int w = 0;
+    while (s->map[w] == 0xffffffff)
+        w++;
+    uint4 bits = ~s->map[w];
+    int b = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        b++;
+    }
+    s->map[w] |= 1u << b;
+    if (++s->used == cls->ncells) {
+        cls->avail = s->next;
+        if (s->next != NULL)
+            s->next->prev = NULL;
+    }
+    cls->live++;
+
+    slab_cell *c = (slab_cell *) ((char *) s + SLAB_HEADER_SIZE
+                                        + (w * 32 + b) * cls->cellsize);
+    c->owner = s;
+    return c + 1;
+}
+
+static void slab_free(void *p) {
+    slab_cell *c = (slab_cell *) p - 1;
+    slab *s = c->owner;
+    slab_class *cls = s->cls;
+    int i = ((char *) c - ((char *) s + SLAB_HEADER_SIZE)) / cls->cellsize;
+    s->map[i >> 5] &= ~(1u << (i & 31));
+    cls->live--;
+
+    if (s->used-- == cls->ncells) {
+        // It was full; make it available again
+        s->prev = NULL;
+        s->next = cls->avail;
+        if (cls->avail != NULL)
+            cls->avail->prev = s;
+        cls->avail = s;
+    }
+    if (s->used == 0) {
+        if (s->prev == NULL)
+            cls->avail = s->next;
+        else
+            s->prev->next = s->next;
+        if (s->next != NULL)
+            s->next->prev = s->prev;
+        if (cls->spare == NULL)
+            cls->spare = s;
+        else {
+            free(s);
+            cls->slabs--;
+        }
     }
-    r->r.x = value;
+}
+
+static void slab_clean(slab_class *cls) {
+    if (cls->spare != NULL) {
+        free(cls->spare);
+        cls->spare = NULL;
+        cls->slabs--;
+    }
+}
+
+vartype *new_real(phloat value) {
+    vartype_real *r = (vartype_real *) slab_alloc(&real_slabs);
+    if (r == NULL)
+        return NULL;
+    r->type = TYPE_REAL;
+    r->x = value;
     return (vartype *) r;
 }
 
 vartype *new_complex(phloat re, phloat im) {
-    pool_complex *c;
-    if (complexpool == NULL) {
-        c = (pool_complex *) malloc(sizeof(pool_complex));
-        if (c == NULL)
-            return NULL;
-        c->c.type = TYPE_COMPLEX;
-    } else {
-        c = complexpool;
-        complexpool = complexpool->next;
-    }
-    c->c.re = re;
-    c->c.im = im;
+    vartype_complex *c = (vartype_complex *) slab_alloc(&complex_slabs);
+    if (c == NULL)
+        return NULL;
+    c->type = TYPE_COMPLEX;
+    c->re = re;
+    c->im = im;
     return (vartype *) c;
 }
 
 vartype *new_string(const char *text, int length) {
-    pool_string *s;
-    if (stringpool == NULL) {
-        s = (pool_string *) malloc(sizeof(pool_string));
-        if (s == NULL)
-            return NULL;
-        s->s.type = TYPE_STRING;
-    } else {
-        s = stringpool;
-        stringpool = stringpool->next;
-    }
+    vartype_string *s = (vartype_string *) slab_alloc(&string_slabs);
+    if (s == NULL)
+        return NULL;
     int i;
-    s->s.type = TYPE_STRING;
-    s->s.length = length > 6 ? 6 : length;
-    for (i = 0; i < s->s.length; i++)
-        s->s.text[i] = text[i];
+    s->type = TYPE_STRING;
+    s->length = length > 6 ? 6 : length;
+    for (i = 0; i < s->length; i++)
+        s->text[i] = text[i];
     return (vartype *) s;
 }
 
+// Matrix data arrays are allocated as a single block: the realmatrix_data or
+// complexmatrix_data struct, followed by the elements, followed, for real
+// matrices, by the is_string flags. The elements start at a multiple of 16
+// bytes from the start of the block, so they are as well aligned as the block
+// itself.
+#define MATRIX_DATA_OFFSET(t) ((sizeof(t) + 15) & ~15)
+
+realmatrix_data *new_realmatrix_data(int4 size) {
+    char *block = (char *) malloc(MATRIX_DATA_OFFSET(realmatrix_data)
+                                    + size * (sizeof(phloat) + 1));
+    if (block == NULL)
+        return NULL;
+    realmatrix_data *array = (realmatrix_data *) block;
+    array->refcount = 1;
+    array->data = (phloat *) (block + MATRIX_DATA_OFFSET(realmatrix_data));
+    array->is_string = (char *) (array->data + size);
+    array->no_strings = false;
+    array->inline_data = true;
+    return array;
+}
+
+complexmatrix_data *new_complexmatrix_data(int4 size) {
+    char *block = (char *) malloc(MATRIX_DATA_OFFSET(complexmatrix_data)
+                                    + 2 * size * sizeof(phloat));
+    if (block == NULL)
+        return NULL;
+    complexmatrix_data *array = (complexmatrix_data *) block;
+    array->refcount = 1;
+    array->data = (phloat *) (block + MATRIX_DATA_OFFSET(complexmatrix_data));
+    array->inline_data = true;
+    return array;
+}
+
+void free_realmatrix_data(realmatrix_data *array) {
+    if (!array->inline_data) {
+        free_matrix_data(array->data);
+        free(array->is_string);
+    }
+    free(array);
+}
+
+void free_complexmatrix_data(complexmatrix_data *array) {
+    if (!array->inline_data)
+        free_matrix_data(array->data);
+    free(array);
+}
+
+static void clear_matrix_data(phloat *data, int4 n) {
+#ifdef BCD_MATH
+    // Decimal zero is not all zero bits
+    for (int4 i = 0; i < n; i++)
+        data[i] = 0;
+#else
+    memset(data, 0, n * sizeof(phloat));
+#endif
+}
+
 vartype *new_realmatrix(int4 rows, int4 columns) {
     vartype_realmatrix *rm = (vartype_realmatrix *)
                                         malloc(sizeof(vartype_realmatrix));
     if (rm == NULL)
         return NULL;
-    int4 i, sz;
+    int4 sz = rows * columns;
     rm->type = TYPE_REALMATRIX;
     rm->rows = rows;
     rm->columns = columns;
-    sz = rows * columns;
-    rm->array = (realmatrix_data *) malloc(sizeof(realmatrix_data));
+    rm->array = new_realmatrix_data(sz);
     if (rm->array == NULL) {
         free(rm);
         return NULL;
     }
-    rm->array->data = (phloat *) malloc(sz * sizeof(phloat));
-    if (rm->array->data == NULL) {
-        /* Oops */
-        free(rm->array);
+    clear_matrix_data(rm->array->data, sz);
+    memset(rm->array->is_string, 0, sz);
+    rm->array->no_strings = true;
+    realmatrix_count++;
+    return (vartype *) rm;
+}
+
+vartype *new_complexmatrix(int4 rows, int4 columns) {
+    vartype_complexmatrix *cm = (vartype_complexmatrix *)
+                                        malloc(sizeof(vartype_complexmatrix));
+    if (cm == NULL)
+        return NULL;
+    int4 sz = rows * columns;
+    cm->type = TYPE_COMPLEXMATRIX;
+    cm->rows = rows;
+    cm->columns = columns;
+    cm->array = new_complexmatrix_data(sz);
+    if (cm->array == NULL) {
+        free(cm);
+        return NULL;
+    }
+    clear_matrix_data(cm->array->data, 2 * sz);
+    complexmatrix_count++;
+    return (vartype *) cm;
+}
+
+/* new_realmatrix_nodata() and new_complexmatrix_nodata() are like
+ * new_realmatrix() and new_complexmatrix(), except that they leave the
+ * 'data' array unallocated (NULL). They are used by the state file loader,
+ * for matrices whose contents are mapped or read in after the rest of the
+ * state has been loaded. The 'is_string' array is allocated, but not cleared.
+ * Since the data is allocated separately, these arrays are not inline.
+ */
+vartype *new_realmatrix_nodata(int4 rows, int4 columns) {
+    vartype_realmatrix *rm = (vartype_realmatrix *)
+                                        malloc(sizeof(vartype_realmatrix));
+    if (rm == NULL)
+        return NULL;
+    rm->type = TYPE_REALMATRIX;
+    rm->rows = rows;
+    rm->columns = columns;
+    rm->array = (realmatrix_data *) malloc(sizeof(realmatrix_data));
+    if (rm->array == NULL) {
         free(rm);
         return NULL;
     }
-    rm->array->is_string = (char *) malloc(sz);
+    rm->array->data = NULL;
+    rm->array->is_string = (char *) malloc(rows * columns);
     if (rm->array->is_string == NULL) {
-        /* Oops */
-        free(rm->array->data);
         free(rm->array);
         free(rm);
         return NULL;
     }
-    for (i = 0; i < sz; i++)
-        rm->array->data[i] = 0;
-    for (i = 0; i < sz; i++)
-        rm->array->is_string[i] = 0;
     rm->array->refcount = 1;
+    rm->array->no_strings = false;
+    rm->array->inline_data = false;
+    realmatrix_count++;
     return (vartype *) rm;
 }
 
-vartype *new_complexmatrix(int4 rows, int4 columns) {
+vartype *new_complexmatrix_nodata(int4 rows, int4 columns) {
     vartype_complexmatrix *cm = (vartype_complexmatrix *)
                                         malloc(sizeof(vartype_complexmatrix));
     if (cm == NULL)
         return NULL;
-    int4 i, sz;
     cm->type = TYPE_COMPLEXMATRIX;
     cm->rows = rows;
     cm->columns = columns;
-    sz = rows * columns * 2;
     cm->array = (complexmatrix_data *) malloc(sizeof(complexmatrix_data));
     if (cm->array == NULL) {
         free(cm);
         return NULL;
     }
-    cm->array->data = (phloat *) malloc(sz * sizeof(phloat));
-    if (cm->array->data == NULL) {
-        /* Oops */
-        free(cm->array);
-        free(cm);
-        return NULL;
-    }
-    for (i = 0; i < sz; i++)
-        cm->array->data[i] = 0;
+    cm->array->data = NULL;
     cm->array->refcount = 1;
+    cm->array->inline_data = false;
+    complexmatrix_count++;
     return (vartype *) cm;
 }
 
@@ -177,6 +375,7 @@ vartype *new_matrix_alias(vartype *m) {
             return NULL;
         *rm2 = *rm1;
         rm2->array->refcount++;
+        realmatrix_count++;
         return (vartype *) rm2;
     } else if (m->type == TYPE_COMPLEXMATRIX) {
         vartype_complexmatrix *cm1 = (vartype_complexmatrix *) m;
@@ -186,6 +385,7 @@ vartype *new_matrix_alias(vartype *m) {
             return NULL;
         *cm2 = *cm1;
         cm2->array->refcount++;
+        complexmatrix_count++;
         return (vartype *) cm2;
     } else
         return NULL;
@@ -195,62 +395,47 @@ void free_vartype(vartype *v) {
     if (v == NULL)
         return;
     switch (v->type) {
-        case TYPE_REAL: {
-            pool_real *r = (pool_real *) v;
-            r->next = realpool;
-            realpool = r;
-            break;
-        }
-        case TYPE_COMPLEX: {
-            pool_complex *c = (pool_complex *) v;
-            c->next = complexpool;
-            complexpool = c;
-            break;
-        }
-        case TYPE_STRING: {
-            pool_string *s = (pool_string *) v;
-            s->next = stringpool;
-            stringpool = s;
+        case TYPE_REAL:
+        case TYPE_COMPLEX:
+        case TYPE_STRING:
+            slab_free(v);
             break;
-        }
         case TYPE_REALMATRIX: {
             vartype_realmatrix *rm = (vartype_realmatrix *) v;
-            if (--(rm->array->refcount) == 0) {
-                free(rm->array->data);
-                free(rm->array->is_string);
-                free(rm->array);
-            }
+            if (--(rm->array->refcount) == 0)
+                free_realmatrix_data(rm->array);
             free(rm);
+            realmatrix_count--;
             break;
         }
         case TYPE_COMPLEXMATRIX: {
             vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
-            if (--(cm->array->refcount) == 0) {
-                free(cm->array->data);
-                free(cm->array);
-            }
+            if (--(cm->array->refcount) == 0)
+                free_complexmatrix_data(cm->array);
             free(cm);
+            complexmatrix_count--;
             break;
         }
     }
 }
 
 void clean_vartype_pools() {
-    while (realpool != NULL) {
-        pool_real *r = realpool;
-        realpool = r->next;
-        free(r);
-    }
-    while (complexpool != NULL) {
-        pool_complex *c = complexpool;
-        complexpool = c->next;
-        free(c);
-    }
-    while (stringpool != NULL) {
-        pool_string *s = stringpool;
-        stringpool = s->next;
-        free(s);
-    }
+    // The LU workspaces cached by the matrix division, INVRT, and DET code
+    // are plain matrices, but they count as held by nobody, so they go too.
+    linalg_free_workspaces();
+    slab_clean(&real_slabs);
+    slab_clean(&complex_slabs);
+    slab_clean(&string_slabs);
+}
+
+void get_vartype_stats(int4 *live, int4 *slabs) {
+    live[TYPE_NULL] = 0;
+    live[TYPE_REAL] = real_slabs.live;
+    live[TYPE_COMPLEX] = complex_slabs.live;
+    live[TYPE_REALMATRIX] = realmatrix_count;
+    live[TYPE_COMPLEXMATRIX] = complexmatrix_count;
+    live[TYPE_STRING] = string_slabs.live;
+    *slabs = real_slabs.slabs + complex_slabs.slabs + string_slabs.slabs;
 }
 
 vartype *dup_vartype(const vartype *v) {
@@ -276,6 +461,7 @@ vartype *dup_vartype(const vartype *v) {
             rm2->columns = rm->columns;
             rm2->array = rm->array;
             rm->array->refcount++;
+            realmatrix_count++;
             return (vartype *) rm2;
         }
         case TYPE_COMPLEXMATRIX: {
@@ -289,6 +475,7 @@ vartype *dup_vartype(const vartype *v) {
             cm2->columns = cm->columns;
             cm2->array = cm->array;
             cm->array->refcount++;
+            complexmatrix_count++;
             return (vartype *) cm2;
         }
         case TYPE_STRING: {
@@ -300,35 +487,169 @@ vartype *dup_vartype(const vartype *v) {
     }
 }
 
+// Like dup_vartype(), for the common case where a stack register is about to
+// be dropped while another one is copied: if 'old' is a scalar of the same
+// type as 'v', the copy is made in place, so the stack shuffles that go with
+// ENTER and the two-argument functions don't have to go through the pools.
+// Otherwise, a new copy is made, and 'old' is freed. Returns NULL if the copy
+// can't be allocated; 'old' is left alone in that case.
+vartype *recycle_vartype(vartype *old, const vartype *v) {
+    if (old != NULL && v != NULL && old->type == v->type) {
+        switch (v->type) {
+            case TYPE_REAL:
+                ((vartype_real *) old)->x = ((vartype_real *) v)->x;
+                return old;
+            case TYPE_COMPLEX:
+                ((vartype_complex *) old)->re = ((vartype_complex *) v)->re;
+                ((vartype_complex *) old)->im = ((vartype_complex *) v)->im;
+                return old;
+            case TYPE_STRING: {
+                vartype_string *os = (vartype_string *) old;
+                vartype_string *s = (vartype_string *) v;
+                os->length = s->length;
+                memcpy(os->text, s->text, s->length);
+                return old;
+            }
+        }
+    }
+    vartype *copy = dup_vartype(v);
+    if (copy != NULL)
+        free_vartype(old);
+    return copy;
+}
+
+// The same, for a result that was computed as a plain number: if 'old' is a
+// real (or complex), the number is stored in it, so functions that put their
+// result where LASTX used to be don't have to allocate anything. Otherwise, a
+// new one is allocated, and 'old' is freed.
+vartype *recycle_real(vartype *old, phloat x) {
+    if (old != NULL && old->type == TYPE_REAL) {
+        ((vartype_real *) old)->x = x;
+        return old;
+    }
+    vartype *v = new_real(x);
+    if (v != NULL)
+        free_vartype(old);
+    return v;
+}
+
+vartype *recycle_complex(vartype *old, phloat re, phloat im) {
+    if (old != NULL && old->type == TYPE_COMPLEX) {
+        ((vartype_complex *) old)->re = re;
+        ((vartype_complex *) old)->im = im;
+        return old;
+    }
+    vartype *v = new_complex(re, im);
+    if (v != NULL)
+        free_vartype(old);
+    return v;
+}
+
+// Matrix data arrays that were mapped from the state file, rather than
+// allocated from the heap. There are only ever a handful of these (only
+// large matrices are stored out of line), so a linear list is fine.
+// Until one of them is written to, its contents are still the same as the
+// bytes in the state file, which lets a shell save it without copying it;
+// see core_saved_state_unmodified().
+
+typedef struct {
+    phloat *data;
+    int4 nbytes;
+    bool modified;
+} mapped_data_struct;
+
+static mapped_data_struct *mapped_list = NULL;
+static int mapped_count = 0;
+static int mapped_capacity = 0;
+
+static int mapped_data_search(const phloat *data) {
+    if (data == NULL)
+        return -1;
+    for (int i = 0; i < mapped_count; i++)
+        if (mapped_list[i].data == data)
+            return i;
+    return -1;
+}
+
+bool register_mapped_data(phloat *data, int4 nbytes) {
+    if (mapped_count == mapped_capacity) {
+        int newcap = mapped_capacity + 8;
+        mapped_data_struct *newlist = (mapped_data_struct *)
+                realloc(mapped_list, newcap * sizeof(mapped_data_struct));
+        if (newlist == NULL)
+            return false;
+        mapped_list = newlist;
+        mapped_capacity = newcap;
+    }
+    mapped_list[mapped_count].data = data;
+    mapped_list[mapped_count].nbytes = nbytes;
+    mapped_list[mapped_count].modified = false;
+    mapped_count++;
+    return true;
+}
+
+void matrix_data_modified(const phloat *data) {
+    int n = mapped_data_search(data);
+    if (n != -1)
+        mapped_list[n].modified = true;
+}
+
+bool mapped_data_unmodified(const void *data, int4 nbytes) {
+    int n = mapped_data_search((const phloat *) data);
+    return n != -1 && !mapped_list[n].modified
+            && nbytes <= mapped_list[n].nbytes;
+}
+
+void free_matrix_data(phloat *data) {
+    int n = mapped_data_search(data);
+    if (n == -1) {
+        free(data);
+        return;
+    }
+    shell_unmap_saved_state(data, mapped_list[n].nbytes);
+    mapped_list[n] = mapped_list[--mapped_count];
+}
+
+// Matrix data is moved and copied with realloc() and memcpy(). In the
+// decimal version, phloat is a class, but its only member is a plain
+// BID_UINT128 value, with no pointers into itself and no destructor, so
+// copying its bytes is the same as copying it with operator=; the (void *)
+// casts tell the compiler that this is intentional.
+
+phloat *realloc_matrix_data(phloat *data, int4 nbytes) {
+    int n = mapped_data_search(data);
+    if (n == -1)
+        return (phloat *) realloc((void *) data, nbytes);
+    // Mapped memory can't be resized, so move it to the heap
+    phloat *newdata = (phloat *) malloc(nbytes);
+    if (newdata == NULL)
+        return NULL;
+    int4 oldbytes = mapped_list[n].nbytes;
+    memcpy((void *) newdata, data, oldbytes < nbytes ? oldbytes : nbytes);
+    shell_unmap_saved_state(data, oldbytes);
+    mapped_list[n] = mapped_list[--mapped_count];
+    return newdata;
+}
+
 int disentangle(vartype *v) {
     switch (v->type) {
         case TYPE_REALMATRIX: {
             vartype_realmatrix *rm = (vartype_realmatrix *) v;
-            if (rm->array->refcount == 1)
+            if (rm->array->refcount == 1) {
+                // The caller is about to write to it
+                matrix_data_modified(rm->array->data);
                 return 1;
+            }
             else {
-                realmatrix_data *md = (realmatrix_data *)
-                                        malloc(sizeof(realmatrix_data));
-                if (md == NULL)
-                    return 0;
                 int4 sz = rm->rows * rm->columns;
-                int4 i;
-                md->data = (phloat *) malloc(sz * sizeof(phloat));
-                if (md->data == NULL) {
-                    free(md);
-                    return 0;
-                }
-                md->is_string = (char *) malloc(sz);
-                if (md->is_string == NULL) {
-                    free(md->data);
-                    free(md);
+                realmatrix_data *md = new_realmatrix_data(sz);
+                if (md == NULL)
                     return 0;
-                }
-                for (i = 0; i < sz; i++)
-                    md->data[i] = rm->array->data[i];
-                for (i = 0; i < sz; i++)
-                    md->is_string[i] = rm->array->is_string[i];
-                md->refcount = 1;
+                // See realloc_matrix_data() about the (void *) casts
+                memcpy((void *) md->data, rm->array->data,
+                       sz * sizeof(phloat));
+                memcpy(md->is_string, rm->array->is_string, sz);
+                md->no_strings = rm->array->no_strings;
                 rm->array->refcount--;
                 rm->array = md;
                 return 1;
@@ -336,23 +657,16 @@ int disentangle(vartype *v) {
         }
         case TYPE_COMPLEXMATRIX: {
             vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
-            if (cm->array->refcount == 1)
+            if (cm->array->refcount == 1) {
+                matrix_data_modified(cm->array->data);
                 return 1;
-            else {
-                complexmatrix_data *md = (complexmatrix_data *)
-                                            malloc(sizeof(complexmatrix_data));
+            } else {
+                int4 sz = cm->rows * cm->columns;
+                complexmatrix_data *md = new_complexmatrix_data(sz);
                 if (md == NULL)
                     return 0;
-                int4 sz = cm->rows * cm->columns * 2;
-                int4 i;
-                md->data = (phloat *) malloc(sz * sizeof(phloat));
-                if (md->data == NULL) {
-                    free(md);
-                    return 0;
-                }
-                for (i = 0; i < sz; i++)
-                    md->data[i] = cm->array->data[i];
-                md->refcount = 1;
+                memcpy((void *) md->data, cm->array->data,
+                       2 * sz * sizeof(phloat));
                 cm->array->refcount--;
                 cm->array = md;
                 return 1;
@@ -366,11 +680,57 @@ int disentangle(vartype *v) {
     }
 }
 
+// Open-addressing hash index over the variable names, so that lookup_var()
+// does not have to scan the entire 'vars' array. Each slot holds an index
+// into 'vars', or -1 if it is empty; collisions are resolved by linear
+// probing. The table is kept at most half full. If it could not be
+// allocated, var_index_size is 0, and lookup_var() falls back on a linear
+// search.
+// Any code that adds, removes, or reorders entries in 'vars' must keep the
+// index in sync, either directly or by calling rebuild_var_index().
+
+static int *var_index = NULL;
+static int var_index_size = 0;
+
+static void var_index_insert(int varindex) {
+    int mask = var_index_size - 1;
+    int i = string_hash(vars[varindex].name, vars[varindex].length) & mask;
+    while (var_index[i] != -1)
+        i = (i + 1) & mask;
+    var_index[i] = varindex;
+}
+
+void rebuild_var_index() {
+    int size = 16;
+    while (size < vars_count * 2)
+        size <<= 1;
+    if (size != var_index_size) {
+        free(var_index);
+        var_index = (int *) malloc(size * sizeof(int));
+        if (var_index == NULL) {
+            var_index_size = 0;
+            return;
+        }
+        var_index_size = size;
+    }
+    for (int i = 0; i < var_index_size; i++)
+        var_index[i] = -1;
+    for (int i = 0; i < vars_count; i++)
+        var_index_insert(i);
+}
+
 int lookup_var(const char *name, int namelength) {
-    /* TODO: memoize lookups.
-     * Also make sure that purge_var updates the lookup cache!
-     */
     int i, j;
+    if (var_index_size != 0) {
+        int mask = var_index_size - 1;
+        i = string_hash(name, namelength) & mask;
+        while ((j = var_index[i]) != -1) {
+            if (string_equals(vars[j].name, vars[j].length, name, namelength))
+                return j;
+            i = (i + 1) & mask;
+        }
+        return -1;
+    }
     for (i = 0; i < vars_count; i++) {
         if (vars[i].length == namelength) {
             for (j = 0; j < namelength; j++)
@@ -387,8 +747,9 @@ vartype *recall_var(const char *name, int namelength) {
     int varindex = lookup_var(name, namelength);
     if (varindex == -1)
         return NULL;
-    else
-        return vars[varindex].value;
+    // The caller may change the value in place; see var_struct
+    vars[varindex].hashed = false;
+    return vars[varindex].value;
 }
 
 void store_var(const char *name, int namelength, vartype *value) {
@@ -405,6 +766,10 @@ void store_var(const char *name, int namelength, vartype *value) {
         vars[varindex].length = namelength;
         for (i = 0; i < namelength; i++)
             vars[varindex].name[i] = name[i];
+        if (vars_count * 2 > var_index_size)
+            rebuild_var_index();
+        else
+            var_index_insert(varindex);
     } else {
         if (matedit_mode != 0 &&
                 string_equals(name, namelength, matedit_name, matedit_length)) {
@@ -428,6 +793,7 @@ void store_var(const char *name, int namelength, vartype *value) {
         free_vartype(vars[varindex].value);
     }
     vars[varindex].value = value;
+    vars[varindex].hashed = false;
     update_catalog();
 }
 
@@ -440,6 +806,10 @@ int purge_var(const char *name, int namelength) {
     for (i = varindex; i < vars_count - 1; i++)
         vars[i] = vars[i + 1];
     vars_count--;
+    /* Removing an entry from a linear-probing table is awkward, and the
+     * indexes of all the following variables have changed anyway.
+     */
+    rebuild_var_index();
     update_catalog();
     return 1;
 }
@@ -449,6 +819,7 @@ void purge_all_vars() {
     for (i = 0; i < vars_count; i++)
         free_vartype(vars[i].value);
     vars_count = 0;
+    rebuild_var_index();
 }
 
 int vars_exist(int real, int cpx, int matrix) {
@@ -478,11 +849,14 @@ int vars_exist(int real, int cpx, int matrix) {
 }
 
 int contains_no_strings(const vartype_realmatrix *rm) {
+    if (rm->array->no_strings)
+        return 1;
     int4 size = rm->rows * rm->columns;
     int4 i;
     for (i = 0; i < size; i++)
         if (rm->array->is_string[i])
             return 0;
+    rm->array->no_strings = true;
     return 1;
 }
 
@@ -495,10 +869,11 @@ int matrix_copy(vartype *dst, const vartype *src) {
             if (s->rows != d->rows || s->columns != d->columns)
                 return ERR_DIMENSION_ERROR;
             size = s->rows * s->columns;
-            for (i = 0; i < size; i++) {
-                d->array->is_string[i] = s->array->is_string[i];
-                d->array->data[i] = s->array->data[i];
-            }
+            memcpy(d->array->is_string, s->array->is_string, size);
+            // See realloc_matrix_data() about the (void *) cast
+            memcpy((void *) d->array->data, s->array->data,
+                    size * sizeof(phloat));
+            d->array->no_strings = s->array->no_strings;
             return ERR_NONE;
         } else if (dst->type == TYPE_COMPLEXMATRIX) {
             vartype_complexmatrix *d = (vartype_complexmatrix *) dst;
@@ -521,8 +896,8 @@ int matrix_copy(vartype *dst, const vartype *src) {
         if (s->rows != d->rows || s->columns != d->columns)
             return ERR_DIMENSION_ERROR;
         size = s->rows * s->columns * 2;
-        for (i = 0; i < size; i++)
-            d->array->data[i] = s->array->data[i];
+        memcpy((void *) d->array->data, s->array->data,
+                size * sizeof(phloat));
         return ERR_NONE;
     } else
         return ERR_INVALID_TYPE;
@@ -25,12 +25,23 @@ vartype *new_complex(phloat re, phloat im);
 vartype *new_string(const char *s, int slen);
 vartype *new_realmatrix(int4 rows, int4 columns);
 vartype *new_complexmatrix(int4 rows, int4 columns);
+vartype *new_realmatrix_nodata(int4 rows, int4 columns);
+vartype *new_complexmatrix_nodata(int4 rows, int4 columns);
+realmatrix_data *new_realmatrix_data(int4 size);
+complexmatrix_data *new_complexmatrix_data(int4 size);
+void free_realmatrix_data(realmatrix_data *array);
+void free_complexmatrix_data(complexmatrix_data *array);
 vartype *new_matrix_alias(vartype *m);
 void free_vartype(vartype *v);
 void clean_vartype_pools();
+void get_vartype_stats(int4 *live, int4 *slabs);
 vartype *dup_vartype(const vartype *v);
+vartype *recycle_vartype(vartype *old, const vartype *v);
+vartype *recycle_real(vartype *old, phloat x);
+vartype *recycle_complex(vartype *old, phloat re, phloat im);
 int disentangle(vartype *v);
 int lookup_var(const char *name, int namelength);
+void rebuild_var_index();
 vartype *recall_var(const char *name, int namelength);
 void store_var(const char *name, int namelength, vartype *value);
 int purge_var(const char *name, int namelength);
@@ -39,4 +50,18 @@ int vars_exist(int real, int cpx, int matrix);
 int contains_no_strings(const vartype_realmatrix *rm);
 int matrix_copy(vartype *dst, const vartype *src);
 
+/* Matrix data arrays normally live in the heap, but they may also live in
+ * a part of the state file that the shell has mapped into memory (see
+ * shell_map_saved_state()). Use free_matrix_data() and realloc_matrix_data()
+ * instead of free() and realloc() on them, and call matrix_data_modified()
+ * before writing to an existing array in place (disentangle() does that).
+ * mapped_data_unmodified() returns true if data is mapped, and has not been
+ * written to since it was mapped.
+ */
+bool register_mapped_data(phloat *data, int4 nbytes);
+void free_matrix_data(phloat *data);
+phloat *realloc_matrix_data(phloat *data, int4 nbytes);
+void matrix_data_modified(const phloat *data);
+bool mapped_data_unmodified(const void *data, int4 nbytes);
+
 #endif
@@ -134,9 +134,13 @@ extern "C" double log2(double x);
  * Version 17: 1.4.65 iPhone "OFF enable" flag
  * Version 18: 1.4.79 Replaced BCD20 with Intel's Decimal Floating Point
  *                    Library v.2.1.
+ * Version 19: 1.5.13 "Fast binary matrix arithmetic" option
+ * Version 20: 1.5.13 Large matrices stored out of line, in page-aligned
+ *                    blocks at the end of the file
+ * Version 21: 1.5.13 Journal ID
  */
 #define FREE42_MAGIC 0x466b3432
-#define FREE42_VERSION 18
+#define FREE42_VERSION 21
 
 
 #endif
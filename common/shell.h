@@ -74,6 +74,9 @@ void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad);
  * active invocation of core_keydown() or core_keyup() will then return
  * immediately (with a return value of 1, to indicate that it would like to get
  * the CPU back as soon as possible).
+ * While running a program, the core calls this about every 10 milliseconds,
+ * not before every instruction; shells that learn about events on another
+ * thread can call core_event_pending() to get the CPU back sooner.
  */
 int shell_wants_cpu();
 
@@ -109,9 +112,45 @@ int4 shell_read_saved_state(void *buf, int4 bufsize);
  * The emulator core should only call this function from core_quit(). (Nothing
  * horrible will happen if you try to call this function during other contexts,
  * but you will always get an error then.)
+ * Shells should write the state to a new file, and only rename it over the
+ * old one once it has been written and synced successfully. That way, a
+ * failed or interrupted write can't destroy the only copy of the state, and
+ * the old file stays intact for any data that is still mapped from it (see
+ * shell_map_saved_state()).
  */
 bool shell_write_saved_state(const void *buf, int4 nbytes);
 
+/* shell_map_saved_state()
+ * shell_unmap_saved_state()
+ *
+ * Callbacks to map part of the saved state directly into memory, instead of
+ * reading it with shell_read_saved_state(). The core uses this for large
+ * matrices, which are stored at the end of the state file, each in its own
+ * block, starting at a multiple of 4096 bytes from the start of the file (see
+ * shell_saved_state_position()). The offset is relative to the current read
+ * position, which is not changed by this call. The mapping must be private
+ * (copy-on-write): the core will modify the memory, and those changes must not
+ * go to the file. The mapping must also remain valid after the state file is
+ * closed, and after it is replaced by a new one, so the shell should save the
+ * state to a new file and rename it over the old one, rather than overwriting
+ * the old one in place.
+ * Shells that can't or don't want to do this may simply return NULL; the core
+ * then reads the data using shell_read_saved_state() instead.
+ * The core calls shell_unmap_saved_state() when it no longer needs the memory;
+ * the addr and nbytes arguments are those of the shell_map_saved_state() call
+ * that returned it.
+ */
+void *shell_map_saved_state(int4 offset, int4 nbytes);
+void shell_unmap_saved_state(void *addr, int4 nbytes);
+
+/* shell_saved_state_position()
+ * Callback to find out how many bytes have been written to the state file so
+ * far, counting the shell's own data at the start of the file. The core uses
+ * this in core_quit() to align the blocks described above. Shells that don't
+ * implement shell_map_saved_state() may simply return 0.
+ */
+int4 shell_saved_state_position();
+
 /* shell_get_mem()
  * Callback to get the amount of free memory in bytes.
  */
@@ -18,6 +18,7 @@
 #ifndef ANDROID
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "shell_spool.h"
 #include "core_main.h"
@@ -96,10 +97,11 @@ typedef struct {
     int bytecount;
     char buf[255];
 
-    short prefix_table[4096];
-    short code_table[4096];
-    short hash_next[4096];
-    short hash_head[256];
+    /* The LZW string table. Since the alphabet is just { 0, 1 }, there is no
+     * need for hashing: child[code][pixel] is the code for the string 'code'
+     * followed by 'pixel', or -1 if that isn't in the table yet.
+     */
+    short child[4096][2];
 
     int maxcode;
     int clear_code;
@@ -107,19 +109,22 @@ typedef struct {
 
     int curr_code_size;
     int prefix;
-    int currbyte;
-    int bits_needed;
+    uint4 bitbuf;
+    int bitcount;
     int initial_clear;
-    int really_done;
 
     int width;
     int height;
 } gif_data;
 
-static gif_data *g;
+static gif_data *spool_gif;
 
+static void gif_put_code(gif_data *g, int code, file_writer writer);
+static void gif_emit(gif_data *g, int code, file_writer writer);
 
-int shell_start_gif(file_writer writer, int width, int provisional_height) {
+
+static void gif_start(gif_data *g, file_writer writer, int width,
+                      int provisional_height) {
     char buf[29];
     char *p = buf, c;
     int height = provisional_height;
@@ -181,179 +186,148 @@ int shell_start_gif(file_writer writer, int width, int provisional_height) {
 
     /* Initialize GIF encoder */
 
-    if (g == NULL) {
-        g = (gif_data *) malloc(sizeof(gif_data));
-        if (g == NULL)
-            return 0;
-    }
-
     g->codesize = 2;
     g->bytecount = 0;
     g->maxcode = 1 << g->codesize;
-    for (i = 0; i < g->maxcode; i++) {
-        g->prefix_table[i] = -1;
-        g->code_table[i] = i;
-        g->hash_next[i] = -1;
-    }
-    for (i = 0; i < 256; i++)
-        g->hash_head[i] = -1;
+    for (i = 0; i < g->maxcode; i++)
+        g->child[i][0] = g->child[i][1] = -1;
 
     g->clear_code = g->maxcode++;
     g->end_code = g->maxcode++;
 
     g->curr_code_size = g->codesize + 1;
     g->prefix = -1;
-    g->currbyte = 0;
-    g->bits_needed = 8;
+    g->bitbuf = 0;
+    g->bitcount = 0;
     g->initial_clear = 1;
-    g->really_done = 0;
 
     g->width = width;
     g->height = 0;
 
     c = g->codesize;
     writer(&c, 1);
+}
 
-    return 1;
+static void gif_put_code(gif_data *g, int code, file_writer writer) {
+    /* Codes are packed into bytes least significant bit first, and the
+     * bytes are written in blocks of 255.
+     */
+    g->bitbuf |= (uint4) code << g->bitcount;
+    g->bitcount += g->curr_code_size;
+    while (g->bitcount >= 8) {
+        g->buf[g->bytecount++] = (char) g->bitbuf;
+        g->bitbuf >>= 8;
+        g->bitcount -= 8;
+        if (g->bytecount == 255) {
+            char c = g->bytecount;
+            writer(&c, 1);
+            writer(g->buf, g->bytecount);
+            g->bytecount = 0;
+        }
+    }
 }
 
-void shell_spool_gif(const char *bits, int bytesperline,
-                     int x, int y, int width, int height,
-                     file_writer writer) {
+static void gif_emit(gif_data *g, int code, file_writer writer) {
+    if (g->initial_clear) {
+        gif_put_code(g, g->clear_code, writer);
+        g->initial_clear = 0;
+    }
+    gif_put_code(g, code, writer);
+    if (g->maxcode > (1 << g->curr_code_size)) {
+        g->curr_code_size++;
+    } else if (code == g->clear_code) {
+        /* Codes above end_code get their children cleared when they are
+         * reused, so only the roots need to be cleared here.
+         */
+        int i;
+        for (i = 0; i < 1 << g->codesize; i++)
+            g->child[i][0] = g->child[i][1] = -1;
+        g->maxcode = (1 << g->codesize) + 2;
+        g->curr_code_size = g->codesize + 1;
+    } else if (g->maxcode == 4096) {
+        /* The table is full; start over */
+        gif_emit(g, g->clear_code, writer);
+    }
+}
+
+static void gif_spool(gif_data *g, const char *bits, int bytesperline,
+                      int x, int y, int width, int height,
+                      file_writer writer) {
     int v, h;
     g->height += height;
 
-    /* Encode Image Data */
-
-    for (v = y; v < y + height || (v == y && height == 0); v++) {
-        int done = v == y && height == 0;
-        for (h = 0; h < g->width; h++) {
-            int new_code;
-            unsigned char hash_code;
-            int hash_index;
-            int pixel;
-
-            if (g->really_done) {
-                new_code = g->end_code;
-                goto emit;
-            } else if (done) {
-                new_code = g->prefix;
-                goto emit;
-            }
-
-            if (h < width)
-                pixel = ((bits[bytesperline * v + (h >> 3)]) >> (h & 7)) & 1;
-            else
-                pixel = 0;
+    /* Encode Image Data. The pixels are read a byte at a time; the part of
+     * each row beyond 'width', up to the width of the image, is blank.
+     */
 
-            /* Look for concat(prefix, pixel) in string table */
-            if (g->prefix == -1) {
-                g->prefix = pixel;
-                goto no_emit;
+    for (v = y; v < y + height; v++) {
+        const unsigned char *row = (const unsigned char *) bits
+                                                    + bytesperline * v;
+        for (h = 0; h < g->width; h += 8) {
+            int n = g->width - h;
+            int byte;
+            if (n > 8)
+                n = 8;
+            if (h >= width)
+                byte = 0;
+            else {
+                byte = row[h >> 3];
+                if (width - h < 8)
+                    byte &= (1 << (width - h)) - 1;
             }
-            
-            /* Compute hash code
-             * TODO: There's a lot of room for improvement here!
-             * I'm getting search percentages of over 30%; looking for
-             * something in single digits.
-             */
-            {
-                unsigned long x = (((long) g->prefix) << 20)
-                                        + (((long) pixel) << 12);
-                unsigned char b1, b2, b3;
-                x /= 997;
-                b1 = (unsigned char) (x >> 16);
-                b2 = (unsigned char) (x >> 8);
-                b3 = (unsigned char) x;
-                hash_code = b1 ^ b2 ^ b3;
-            }
-            hash_index = g->hash_head[hash_code];
-            while (hash_index != -1) {
-                if (g->prefix_table[hash_index] == g->prefix
-                         && g->code_table[hash_index] == pixel) {
-                    g->prefix = hash_index;
-                    goto no_emit;
-                }
-                hash_index = g->hash_next[hash_index];
-            }
-            
-            /* Not found: */
-            if (g->maxcode < 4096) {
-                g->prefix_table[g->maxcode] = g->prefix;
-                g->code_table[g->maxcode] = pixel;
-                g->hash_next[g->maxcode] = g->hash_head[hash_code];
-                g->hash_head[hash_code] = g->maxcode;
-                g->maxcode++;
-            }
-            new_code = g->prefix;
-            g->prefix = pixel;
-            
-            emit: {
-                int outcode = g->initial_clear ? g->clear_code
-                                    : g->really_done ? g->end_code : new_code;
-                int bits_available = g->curr_code_size;
-                while (bits_available != 0) {
-                    int bits_copied = g->bits_needed < bits_available ?
-                                g->bits_needed : bits_available;
-                    int bits = outcode >> (g->curr_code_size - bits_available);
-                    bits &= 255 >> (8 - bits_copied);
-                    g->currbyte |= bits << (8 - g->bits_needed);
-                    bits_available -= bits_copied;
-                    g->bits_needed -= bits_copied;
-                    if (g->bits_needed == 0 ||
-                                    (bits_available == 0 && g->really_done)) {
-                        g->buf[g->bytecount++] = g->currbyte;
-                        if (g->bytecount == 255) {
-                            char c = g->bytecount;
-                            writer(&c, 1);
-                            writer(g->buf, g->bytecount);
-                            g->bytecount = 0;
-                        }
-                        if (bits_available == 0 && g->really_done)
-                            goto data_done;
-                        g->currbyte = 0;
-                        g->bits_needed = 8;
-                    }
+            while (n-- > 0) {
+                int pixel = byte & 1;
+                int code;
+                byte >>= 1;
+
+                if (g->prefix == -1) {
+                    g->prefix = pixel;
+                    continue;
                 }
 
-                if (done) {
-                    done = 0;
-                    g->really_done = 1;
-                    goto emit;
+                /* Look for concat(prefix, pixel) in string table */
+                code = g->child[g->prefix][pixel];
+                if (code != -1) {
+                    g->prefix = code;
+                    continue;
                 }
-                if (g->initial_clear) {
-                    g->initial_clear = 0;
-                    goto emit;
-                } else {
-                    if (g->maxcode > (1 << g->curr_code_size)) {
-                        g->curr_code_size++;
-                    } else if (new_code == g->clear_code) {
-                        int i;
-                        g->maxcode = (1 << g->codesize) + 2;
-                        g->curr_code_size = g->codesize + 1;
-                        for (i = 0; i < 256; i++)
-                            g->hash_head[i] = -1;
-                    } else if (g->maxcode == 4096) {
-                        new_code = g->clear_code;
-                        goto emit;
-                    }
+
+                /* Not found: */
+                if (g->maxcode < 4096) {
+                    g->child[g->prefix][pixel] = g->maxcode;
+                    g->child[g->maxcode][0] = g->child[g->maxcode][1] = -1;
+                    g->maxcode++;
                 }
+                code = g->prefix;
+                g->prefix = pixel;
+                gif_emit(g, code, writer);
             }
-
-            no_emit:;
         }
     }
-
-    data_done:
-    ;
 }
 
-void shell_finish_gif(file_seeker seeker, file_writer writer) {
+static void gif_finish(gif_data *g, file_seeker seeker, file_writer writer) {
     char c;
 
     /* Flush the encoder and write any remaining data */
 
-    shell_spool_gif(NULL, 0, 0, 0, 0, 0, writer);
+    if (g->initial_clear) {
+        /* No pixels were ever encoded */
+        gif_put_code(g, g->clear_code, writer);
+        gif_put_code(g, g->clear_code, writer);
+    } else {
+        gif_put_code(g, g->prefix, writer);
+        gif_put_code(g, g->end_code, writer);
+    }
+    if (g->bitcount > 0) {
+        g->buf[g->bytecount++] = (char) g->bitbuf;
+        if (g->bytecount == 255) {
+            c = g->bytecount;
+            writer(&c, 1);
+            writer(g->buf, g->bytecount);
+            g->bytecount = 0;
+        }
+    }
 
     if (g->bytecount > 0) {
         c = g->bytecount;
@@ -386,10 +360,472 @@ void shell_finish_gif(file_seeker seeker, file_writer writer) {
     /* All done! */
 }
 
+int shell_start_gif(file_writer writer, int width, int provisional_height) {
+    if (spool_gif == NULL) {
+        spool_gif = (gif_data *) malloc(sizeof(gif_data));
+        if (spool_gif == NULL)
+            return 0;
+    }
+    gif_start(spool_gif, writer, width, provisional_height);
+    return 1;
+}
+
+void shell_spool_gif(const char *bits, int bytesperline,
+                     int x, int y, int width, int height,
+                     file_writer writer) {
+    gif_spool(spool_gif, bits, bytesperline, x, y, width, height, writer);
+}
+
+void shell_finish_gif(file_seeker seeker, file_writer writer) {
+    gif_finish(spool_gif, seeker, writer);
+}
+
+/* Streaming printer sinks */
+
+#define SINK_BUFSIZE 16384
+#define PNG_CHUNKSIZE 8192
+
+typedef struct {
+    uint4 bitbuf;
+    int bitcount;
+    int last;
+    int run;
+    uint4 adler_a;
+    uint4 adler_b;
+    int chunklen;
+    unsigned char chunk[PNG_CHUNKSIZE];
+} png_data;
+
+struct print_sink {
+    int format;
+    int width;
+    int height;
+    sink_writer writer;
+    sink_seeker seeker;
+    void *context;
+    void (*request_flush)(void *context);
+    int flush_requested;
+    int error;
+    unsigned char *row;
+    gif_data *gif;
+    png_data *png;
+    int buflen;
+    char buf[SINK_BUFSIZE];
+};
+
+/* The encoders write through file_writer and file_seeker callbacks, which
+ * carry no context, so while a sink is calling one, it is found here.
+ */
+static print_sink *curr_sink;
+
+int print_sink_flush(print_sink *s) {
+    s->flush_requested = 0;
+    if (s->buflen > 0 && !s->error)
+        if (!s->writer(s->context, s->buf, s->buflen))
+            s->error = 1;
+    s->buflen = 0;
+    return !s->error;
+}
+
+static void sink_put(print_sink *s, const char *text, int length) {
+    while (length > 0) {
+        int n = SINK_BUFSIZE - s->buflen;
+        if (n == 0) {
+            /* The shell hasn't gotten around to flushing the buffer; do it
+             * now, rather than let it grow.
+             */
+            print_sink_flush(s);
+            n = SINK_BUFSIZE;
+        }
+        if (n > length)
+            n = length;
+        memcpy(s->buf + s->buflen, text, n);
+        s->buflen += n;
+        text += n;
+        length -= n;
+    }
+    if (s->buflen >= SINK_BUFSIZE / 2 && !s->flush_requested
+            && s->request_flush != NULL) {
+        s->flush_requested = 1;
+        s->request_flush(s->context);
+    }
+}
+
+static void sink_writer_tramp(const char *text, int length) {
+    sink_put(curr_sink, text, length);
+}
+
+static void sink_newliner_tramp() {
+    sink_put(curr_sink, "\n", 1);
+}
+
+static void sink_seek(print_sink *s, int4 pos) {
+    print_sink_flush(s);
+    if (!s->error && !s->seeker(s->context, pos))
+        s->error = 1;
+}
+
+static void sink_seeker_tramp(int4 pos) {
+    sink_seek(curr_sink, pos);
+}
+
+static void sink_put_uint4(print_sink *s, uint4 n) {
+    char buf[4];
+    buf[0] = (char) (n >> 24);
+    buf[1] = (char) (n >> 16);
+    buf[2] = (char) (n >> 8);
+    buf[3] = (char) n;
+    sink_put(s, buf, 4);
+}
+
+/* Copies one row of a bitmap passed to print_sink_print() into s->row,
+ * in the printer's format (least significant bit is leftmost, 1 is black),
+ * with the part beyond 'width' blank. Like shell_spool_gif(), this ignores
+ * 'x'.
+ */
+static void sink_get_row(print_sink *s, const char *bits, int bytesperline,
+                         int v, int width) {
+    const unsigned char *src = (const unsigned char *) bits
+                                                    + bytesperline * v;
+    int nbytes = (s->width + 7) >> 3;
+    int h;
+    if (width > s->width)
+        width = s->width;
+    for (h = 0; h < nbytes; h++) {
+        int n = width - (h << 3);
+        if (n <= 0)
+            s->row[h] = 0;
+        else if (n < 8)
+            s->row[h] = src[h] & ((1 << n) - 1);
+        else
+            s->row[h] = src[h];
+    }
+}
+
+static uint4 crc_table[256];
+static int crc_table_built = 0;
+
+static uint4 png_crc(uint4 crc, const unsigned char *buf, int len) {
+    int i;
+    if (!crc_table_built) {
+        for (i = 0; i < 256; i++) {
+            uint4 c = i;
+            int k;
+            for (k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+        crc_table_built = 1;
+    }
+    crc = ~crc;
+    for (i = 0; i < len; i++)
+        crc = crc_table[(crc ^ buf[i]) & 255] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void png_put_chunk(print_sink *s, const char *type,
+                          const unsigned char *data, int len) {
+    uint4 crc = png_crc(0, (const unsigned char *) type, 4);
+    crc = png_crc(crc, data, len);
+    sink_put_uint4(s, len);
+    sink_put(s, type, 4);
+    sink_put(s, (const char *) data, len);
+    sink_put_uint4(s, crc);
+}
+
+static void png_put_bits(print_sink *s, uint4 value, int n) {
+    png_data *p = s->png;
+    p->bitbuf |= value << p->bitcount;
+    p->bitcount += n;
+    while (p->bitcount >= 8) {
+        p->chunk[p->chunklen++] = (unsigned char) p->bitbuf;
+        p->bitbuf >>= 8;
+        p->bitcount -= 8;
+        if (p->chunklen == PNG_CHUNKSIZE) {
+            png_put_chunk(s, "IDAT", p->chunk, p->chunklen);
+            p->chunklen = 0;
+        }
+    }
+}
+
+/* Writes a symbol using the fixed Huffman code of RFC 1951. Huffman codes
+ * are stored most significant bit first, so they are reversed here.
+ */
+static void png_put_symbol(print_sink *s, int sym) {
+    int code, len, i, rev = 0;
+    if (sym < 144) {
+        code = 0x30 + sym;
+        len = 8;
+    } else if (sym < 256) {
+        code = 0x190 + sym - 144;
+        len = 9;
+    } else if (sym < 280) {
+        code = sym - 256;
+        len = 7;
+    } else {
+        code = 0xc0 + sym - 280;
+        len = 8;
+    }
+    for (i = 0; i < len; i++) {
+        rev = (rev << 1) | (code & 1);
+        code >>= 1;
+    }
+    png_put_bits(s, rev, len);
+}
+
+static const short length_base[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const char length_extra[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static void png_put_run(print_sink *s) {
+    png_data *p = s->png;
+    if (p->run >= 3) {
+        /* A match of length 'run' at distance 1 */
+        int i = 28;
+        while (length_base[i] > p->run)
+            i--;
+        png_put_symbol(s, 257 + i);
+        png_put_bits(s, p->run - length_base[i], length_extra[i]);
+        png_put_bits(s, 0, 5);
+    } else {
+        while (p->run-- > 0)
+            png_put_symbol(s, p->last);
+    }
+    p->run = 0;
+}
+
+/* The only compression done is replacing runs of identical bytes with
+ * matches at distance 1; printouts consist mostly of blank space, so that
+ * is where nearly all the gain is.
+ */
+static void png_deflate(print_sink *s, const unsigned char *buf, int len) {
+    png_data *p = s->png;
+    int i;
+    for (i = 0; i < len; i++) {
+        int c = buf[i];
+        p->adler_a += c;
+        if (p->adler_a >= 65521)
+            p->adler_a -= 65521;
+        p->adler_b += p->adler_a;
+        if (p->adler_b >= 65521)
+            p->adler_b -= 65521;
+        if (c == p->last && p->run < 258) {
+            p->run++;
+            continue;
+        }
+        png_put_run(s);
+        png_put_symbol(s, c);
+        p->last = c;
+    }
+}
+
+static void png_start(print_sink *s) {
+    static const char signature[] = "\211PNG\r\n\032\n";
+    unsigned char ihdr[13];
+    png_data *p = s->png;
+
+    /* The height is written as 0 for now; print_sink_close() fills it in,
+     * and recalculates the CRC.
+     */
+    sink_put(s, signature, 8);
+    ihdr[0] = s->width >> 24;
+    ihdr[1] = s->width >> 16;
+    ihdr[2] = s->width >> 8;
+    ihdr[3] = s->width;
+    memset(ihdr + 4, 0, 4);
+    ihdr[8] = 1;    /* bit depth */
+    ihdr[9] = 0;    /* grayscale */
+    ihdr[10] = 0;   /* deflate */
+    ihdr[11] = 0;   /* adaptive filtering */
+    ihdr[12] = 0;   /* no interlace */
+    png_put_chunk(s, "IHDR", ihdr, 13);
+
+    p->bitbuf = 0;
+    p->bitcount = 0;
+    p->last = -1;
+    p->run = 0;
+    p->adler_a = 1;
+    p->adler_b = 0;
+    p->chunklen = 0;
+
+    /* zlib header, then the header of a single final block, using the
+     * fixed Huffman codes
+     */
+    p->chunk[p->chunklen++] = 0x78;
+    p->chunk[p->chunklen++] = 0x01;
+    png_put_bits(s, 1, 1);
+    png_put_bits(s, 1, 2);
+}
+
+static void png_spool(print_sink *s, const char *bits, int bytesperline,
+                      int y, int width, int height) {
+    int nbytes = (s->width + 7) >> 3;
+    int v, h;
+    for (v = y; v < y + height; v++) {
+        unsigned char filter = 0;
+        sink_get_row(s, bits, bytesperline, v, width);
+        /* PNG puts the leftmost pixel in the most significant bit, and
+         * in grayscale, 0 is black.
+         */
+        for (h = 0; h < nbytes; h++) {
+            int b = s->row[h], r = 0, i;
+            for (i = 0; i < 8; i++) {
+                r = (r << 1) | (b & 1);
+                b >>= 1;
+            }
+            s->row[h] = ~r;
+        }
+        png_deflate(s, &filter, 1);
+        png_deflate(s, s->row, nbytes);
+    }
+}
+
+static void png_finish(print_sink *s) {
+    png_data *p = s->png;
+    unsigned char buf[17];
+    uint4 adler;
+
+    png_put_run(s);
+    png_put_symbol(s, 256);
+    if (p->bitcount > 0)
+        png_put_bits(s, 0, 8 - p->bitcount);
+    adler = (p->adler_b << 16) | p->adler_a;
+    png_put_bits(s, (adler >> 24) & 255, 8);
+    png_put_bits(s, (adler >> 16) & 255, 8);
+    png_put_bits(s, (adler >> 8) & 255, 8);
+    png_put_bits(s, adler & 255, 8);
+    if (p->chunklen > 0)
+        png_put_chunk(s, "IDAT", p->chunk, p->chunklen);
+    png_put_chunk(s, "IEND", NULL, 0);
+
+    /* Fill in the height, and the IHDR CRC */
+    buf[0] = 'I';
+    buf[1] = 'H';
+    buf[2] = 'D';
+    buf[3] = 'R';
+    buf[4] = s->width >> 24;
+    buf[5] = s->width >> 16;
+    buf[6] = s->width >> 8;
+    buf[7] = s->width;
+    buf[8] = s->height >> 24;
+    buf[9] = s->height >> 16;
+    buf[10] = s->height >> 8;
+    buf[11] = s->height;
+    buf[12] = 1;
+    buf[13] = 0;
+    buf[14] = 0;
+    buf[15] = 0;
+    buf[16] = 0;
+    sink_seek(s, 20);
+    sink_put(s, (const char *) buf + 8, 4);
+    sink_seek(s, 29);
+    sink_put_uint4(s, png_crc(0, buf, 17));
+}
+
+print_sink *print_sink_open(int format, int width,
+                            sink_writer writer, sink_seeker seeker,
+                            void *context,
+                            void (*request_flush)(void *context)) {
+    print_sink *s;
+    if (format < PRINT_SINK_TEXT || format > PRINT_SINK_RAW
+            || writer == NULL || width <= 0 || width > 65535)
+        return NULL;
+    if ((format == PRINT_SINK_GIF || format == PRINT_SINK_PNG)
+            && seeker == NULL)
+        return NULL;
+    s = (print_sink *) malloc(sizeof(print_sink));
+    if (s == NULL)
+        return NULL;
+    s->format = format;
+    s->width = width;
+    s->height = 0;
+    s->writer = writer;
+    s->seeker = seeker;
+    s->context = context;
+    s->request_flush = request_flush;
+    s->flush_requested = 0;
+    s->error = 0;
+    s->row = (unsigned char *) malloc((width + 7) >> 3);
+    s->gif = NULL;
+    s->png = NULL;
+    s->buflen = 0;
+    if (format == PRINT_SINK_GIF)
+        s->gif = (gif_data *) malloc(sizeof(gif_data));
+    else if (format == PRINT_SINK_PNG)
+        s->png = (png_data *) malloc(sizeof(png_data));
+    if (s->row == NULL
+            || (format == PRINT_SINK_GIF && s->gif == NULL)
+            || (format == PRINT_SINK_PNG && s->png == NULL)) {
+        free(s->row);
+        free(s->gif);
+        free(s->png);
+        free(s);
+        return NULL;
+    }
+
+    curr_sink = s;
+    if (format == PRINT_SINK_GIF)
+        gif_start(s->gif, sink_writer_tramp, width, 0);
+    else if (format == PRINT_SINK_PNG)
+        png_start(s);
+    curr_sink = NULL;
+    return s;
+}
+
+void print_sink_print(print_sink *s, const char *text, int length,
+                      const char *bits, int bytesperline,
+                      int x, int y, int width, int height) {
+    int nbytes = (s->width + 7) >> 3;
+    int v;
+    curr_sink = s;
+    switch (s->format) {
+        case PRINT_SINK_TEXT:
+            shell_spool_txt(text, length,
+                            sink_writer_tramp, sink_newliner_tramp);
+            break;
+        case PRINT_SINK_GIF:
+            gif_spool(s->gif, bits, bytesperline, x, y, width, height,
+                      sink_writer_tramp);
+            break;
+        case PRINT_SINK_PNG:
+            png_spool(s, bits, bytesperline, y, width, height);
+            break;
+        case PRINT_SINK_RAW:
+            for (v = y; v < y + height; v++) {
+                sink_get_row(s, bits, bytesperline, v, width);
+                sink_put(s, (const char *) s->row, nbytes);
+            }
+            break;
+    }
+    s->height += height;
+    curr_sink = NULL;
+}
+
+int print_sink_close(print_sink *s) {
+    int ok;
+    curr_sink = s;
+    if (s->format == PRINT_SINK_GIF)
+        gif_finish(s->gif, sink_seeker_tramp, sink_writer_tramp);
+    else if (s->format == PRINT_SINK_PNG)
+        png_finish(s);
+    curr_sink = NULL;
+    ok = print_sink_flush(s);
+    free(s->row);
+    free(s->gif);
+    free(s->png);
+    free(s);
+    return ok;
+}
+
 void shell_spool_exit() {
-    if (g != NULL) {
-        free(g);
-        g = NULL;
+    if (spool_gif != NULL) {
+        free(spool_gif);
+        spool_gif = NULL;
     }
 }
 
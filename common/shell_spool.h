@@ -77,6 +77,64 @@ void shell_spool_gif(const char *bits, int bytesperline,
  */
 void shell_finish_gif(file_seeker seeker, file_writer writer);
 
+/* print_sink_open()
+ *
+ * Shell helper that streams printer output to a file, in one of the formats
+ * PRINT_SINK_TEXT (like shell_spool_txt()), PRINT_SINK_GIF, PRINT_SINK_PNG
+ * (1-bit grayscale), or PRINT_SINK_RAW (rows of (width + 7) / 8 bytes, with
+ * the leftmost pixel in the least significant bit and 1 meaning black, and
+ * no header). 'width' is the width of the image; the printer is 143 pixels
+ * wide.
+ * Output is collected in a buffer of fixed size, and passed to 'writer' in
+ * blocks, so memory use does not grow however much is printed. When the
+ * buffer is half full, 'request_flush' (which may be NULL) is called, once,
+ * so that the shell can call print_sink_flush() at a convenient moment,
+ * e.g. from its event loop, rather than having the emulator wait for the
+ * file system; if the buffer fills up anyway, it is flushed immediately.
+ * 'seeker' is required for GIF and PNG, which get their height filled in by
+ * print_sink_close(); until then, the file is incomplete. The writer and
+ * seeker should return 0 if an error occurred, and nonzero otherwise.
+ * Returns NULL if the arguments are invalid or memory allocation failed.
+ */
+#define PRINT_SINK_TEXT 0
+#define PRINT_SINK_GIF 1
+#define PRINT_SINK_PNG 2
+#define PRINT_SINK_RAW 3
+
+typedef struct print_sink print_sink;
+typedef int (*sink_writer)(void *context, const char *buf, int4 length);
+typedef int (*sink_seeker)(void *context, int4 pos);
+
+print_sink *print_sink_open(int format, int width,
+                            sink_writer writer, sink_seeker seeker,
+                            void *context,
+                            void (*request_flush)(void *context));
+
+/* print_sink_print()
+ *
+ * Sends one shell_print() call's worth of output to a sink; the parameters
+ * are the same as shell_print()'s.
+ */
+void print_sink_print(print_sink *sink, const char *text, int length,
+                      const char *bits, int bytesperline,
+                      int x, int y, int width, int height);
+
+/* print_sink_flush()
+ *
+ * Passes all buffered output to the sink's writer.
+ * Returns 1 on success; 0 if the writer or seeker has failed, now or
+ * earlier.
+ */
+int print_sink_flush(print_sink *sink);
+
+/* print_sink_close()
+ *
+ * Finishes the file, flushes it, and frees the sink. After this call, the
+ * caller should close the output file.
+ * Returns 1 on success; 0 if the writer or seeker has failed at any time.
+ */
+int print_sink_close(print_sink *sink);
+
 /* shell_spool_exit()
  *
  * Cleans up spooler's private data. Call this just before application exit.
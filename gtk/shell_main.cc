@@ -22,11 +22,13 @@
 #include <gdk/gdkx.h>
 #include <errno.h>
 #include <locale.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -116,8 +118,60 @@ static keymap_entry *keymap = NULL;
 static guint reminder_id = 0;
 static FILE *statefile = NULL;
 static char statefilename[FILENAMELEN];
+static char statetempname[FILENAMELEN];
+static char journalfilename[FILENAMELEN];
 static char printfilename[FILENAMELEN];
 
+/* Saving the state is done in two steps: first, the shell and core state are
+ * serialized into a memory buffer, the snapshot, on the main thread; then, a
+ * background thread writes the snapshot to statetempname, fsync()s it, and
+ * renames it over statefilename. While snapshot_active is set,
+ * shell_write_saved_state() appends to the snapshot instead of writing to
+ * statefile.
+ * Large matrices that are still mapped from the old state file, and that the
+ * core hasn't modified (see core_saved_state_unmodified()), are not copied
+ * into the snapshot. Instead, the snapshot gets a piece: a read-only mapping
+ * of the same bytes in the old file, which the saver thread writes out and
+ * unmaps. The old file is never written to, so the piece stays valid no
+ * matter what the core does to its own mapping after the snapshot is taken.
+ */
+typedef struct {
+    int4 bufpos;
+    char *map;
+    size_t skew;
+    int4 nbytes;
+} snapshot_piece;
+
+static bool snapshot_active = false;
+static bool snapshot_ok;
+static char *snapshot_buf = NULL;
+static int4 snapshot_buflen;
+static int4 snapshot_capacity;
+static int4 snapshot_size;
+static snapshot_piece *snapshot_pieces = NULL;
+static int snapshot_piece_count;
+static int snapshot_piece_capacity;
+static pthread_t saver_thread;
+static bool saver_running = false;
+static pthread_mutex_t saver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool saver_busy = false;
+static bool saver_failed = false;
+
+/* Mappings handed out by shell_map_saved_state(). Each one keeps its own
+ * descriptor for the file it came from, so that the same bytes can be mapped
+ * again when they are saved; see above.
+ */
+typedef struct {
+    char *addr;
+    int4 nbytes;
+    int fd;
+    off_t start;
+} mapping_struct;
+
+static mapping_struct *mappings = NULL;
+static int mapping_count = 0;
+static int mapping_capacity = 0;
+
 static int ann_updown = 0;
 static int ann_shift = 0;
 static int ann_print = 0;
@@ -133,6 +187,12 @@ static void read_key_map(const char *keymapfilename);
 static void init_shell_state(int4 version);
 static int read_shell_state(int4 *version);
 static int write_shell_state();
+static void begin_snapshot();
+static bool end_snapshot(bool ok);
+static bool snapshot_reference(const void *buf, int4 nbytes);
+static void free_snapshot();
+static void *saver(void *arg);
+static void wait_for_saver();
 static void int_term_handler(int sig);
 static void usr1_handler(int sig);
 static gboolean gt_signal_handler(GIOChannel *source, GIOCondition condition,
@@ -169,6 +229,7 @@ static gboolean timeout1(gpointer cd);
 static gboolean timeout2(gpointer cd);
 static gboolean timeout3(gpointer cd);
 static gboolean battery_checker(gpointer cd);
+static gboolean checkpoint_timer(gpointer cd);
 static void repaint_printout(int x, int y, int width, int height);
 static gboolean reminder(gpointer cd);
 static void txt_writer(const char *text, int length);
@@ -300,6 +361,8 @@ int main(int argc, char *argv[]) {
         snprintf(printfilename, FILENAMELEN, "%s/.free42print", home);
         snprintf(keymapfilename, FILENAMELEN, "%s/.free42keymap", home);
     }
+    snprintf(statetempname, FILENAMELEN, "%s.new", statefilename);
+    snprintf(journalfilename, FILENAMELEN, "%s.journal", statefilename);
 
     
     /****************************/
@@ -551,6 +614,21 @@ int main(int argc, char *argv[]) {
         fclose(statefile);
         statefile = NULL;
     }
+
+    /* If we didn't get to save the state the last time around, the journal
+     * has the changes made since the state file was written. If none of
+     * them apply to the state we just loaded, the journal is stale.
+     */
+    statefile = fopen(journalfilename, "r");
+    if (statefile != NULL) {
+        bool replayed = core_replay_journal();
+        if (statefile != NULL)
+            fclose(statefile);
+        statefile = NULL;
+        if (!replayed)
+            remove(journalfilename);
+    }
+    g_timeout_add(5000, checkpoint_timer, NULL);
     if (core_powercycle())
         enable_reminder();
 
@@ -901,19 +979,149 @@ static void quit() {
         state.printWindowHeight = y;
     }
 
-    statefile = fopen(statefilename, "w");
-    if (statefile != NULL) {
-        write_shell_state();
-    }
+    /* Get the windows out of the way while the state is being written; with
+     * a large state, that may take a while.
+     */
+    gtk_widget_hide(printwindow);
+    gtk_widget_hide(mainwindow);
+    gdk_display_flush(gdk_display_get_default());
+
+    begin_snapshot();
+    bool ok = write_shell_state();
     core_quit();
-    if (statefile != NULL)
-        fclose(statefile);
+    end_snapshot(ok);
+    wait_for_saver();
 
     shell_spool_exit();
 
     exit(0);
 }
 
+static void begin_snapshot() {
+    wait_for_saver();
+    snapshot_buf = NULL;
+    snapshot_buflen = 0;
+    snapshot_capacity = 0;
+    snapshot_size = 0;
+    snapshot_pieces = NULL;
+    snapshot_piece_count = 0;
+    snapshot_piece_capacity = 0;
+    snapshot_ok = true;
+    snapshot_active = true;
+}
+
+static bool end_snapshot(bool ok) {
+    snapshot_active = false;
+    if (!ok || !snapshot_ok) {
+        free_snapshot();
+        return false;
+    }
+    pthread_mutex_lock(&saver_mutex);
+    saver_busy = true;
+    pthread_mutex_unlock(&saver_mutex);
+    if (pthread_create(&saver_thread, NULL, saver, NULL) == 0)
+        saver_running = true;
+    else
+        saver(NULL);
+    return true;
+}
+
+static void *saver(void *arg) {
+    /* Once the new file is in place, the journal is obsolete. The main
+     * thread doesn't write checkpoints while this is going on, so we can't
+     * throw away any changes made after the snapshot was taken.
+     */
+    bool ok = false;
+    FILE *f = fopen(statetempname, "w");
+    if (f != NULL) {
+        int4 pos = 0;
+        ok = true;
+        for (int i = 0; ok && i < snapshot_piece_count; i++) {
+            snapshot_piece *p = snapshot_pieces + i;
+            ok = fwrite(snapshot_buf + pos, 1, p->bufpos - pos, f)
+                        == (size_t) (p->bufpos - pos)
+                    && fwrite(p->map + p->skew, 1, p->nbytes, f)
+                        == (size_t) p->nbytes;
+            pos = p->bufpos;
+        }
+        ok = ok
+                && fwrite(snapshot_buf + pos, 1, snapshot_buflen - pos, f)
+                        == (size_t) (snapshot_buflen - pos)
+                && fflush(f) == 0
+                && fsync(fileno(f)) == 0;
+        if (fclose(f) != 0)
+            ok = false;
+        if (ok)
+            ok = rename(statetempname, statefilename) == 0;
+        if (ok)
+            remove(journalfilename);
+        else
+            remove(statetempname);
+    }
+    free_snapshot();
+
+    pthread_mutex_lock(&saver_mutex);
+    saver_busy = false;
+    saver_failed = !ok;
+    pthread_mutex_unlock(&saver_mutex);
+    return NULL;
+}
+
+static bool snapshot_reference(const void *buf, int4 nbytes) {
+    mapping_struct *m = NULL;
+    for (int i = 0; i < mapping_count; i++)
+        if (mappings[i].addr <= (const char *) buf
+                && (const char *) buf + nbytes
+                        <= mappings[i].addr + mappings[i].nbytes) {
+            m = mappings + i;
+            break;
+        }
+    if (m == NULL || !core_saved_state_unmodified(buf, nbytes))
+        return false;
+    if (snapshot_piece_count == snapshot_piece_capacity) {
+        int newcapacity = snapshot_piece_capacity + 8;
+        snapshot_piece *newpieces = (snapshot_piece *)
+                realloc(snapshot_pieces, newcapacity * sizeof(snapshot_piece));
+        if (newpieces == NULL)
+            return false;
+        snapshot_pieces = newpieces;
+        snapshot_piece_capacity = newcapacity;
+    }
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t start = m->start + ((const char *) buf - m->addr);
+    off_t page = start - start % pagesize;
+    size_t skew = start - page;
+    void *map = mmap(NULL, nbytes + skew, PROT_READ, MAP_PRIVATE, m->fd, page);
+    if (map == MAP_FAILED)
+        return false;
+    snapshot_piece *p = snapshot_pieces + snapshot_piece_count++;
+    p->bufpos = snapshot_buflen;
+    p->map = (char *) map;
+    p->skew = skew;
+    p->nbytes = nbytes;
+    snapshot_size += nbytes;
+    return true;
+}
+
+static void free_snapshot() {
+    free(snapshot_buf);
+    snapshot_buf = NULL;
+    for (int i = 0; i < snapshot_piece_count; i++) {
+        snapshot_piece *p = snapshot_pieces + i;
+        munmap(p->map, p->nbytes + p->skew);
+    }
+    free(snapshot_pieces);
+    snapshot_pieces = NULL;
+    snapshot_piece_count = 0;
+}
+
+static void wait_for_saver() {
+    if (saver_running) {
+        pthread_join(saver_thread, NULL);
+        saver_running = false;
+    }
+}
+
 static void set_window_property(GtkWidget *window, const char *prop_name, char *props[], int num_props) {
     Display *display = GDK_DISPLAY();
     gtk_widget_realize(window);
@@ -1265,6 +1473,9 @@ static void preferencesCB() {
     static GtkWidget *printtogif;
     static GtkWidget *gifpath;
     static GtkWidget *gifheight;
+#ifdef BCD_MATH
+    static GtkWidget *fastmatrix;
+#endif
 
     if (dialog == NULL) {
         dialog = gtk_dialog_new_with_buttons(
@@ -1306,6 +1517,10 @@ static void preferencesCB() {
         gtk_table_attach(GTK_TABLE(table), label, 1, 2, 7, 8, (GtkAttachOptions) (GTK_EXPAND | GTK_FILL), (GtkAttachOptions) 0, 3, 3);
         gifheight = gtk_entry_new_with_max_length(5);
         gtk_table_attach(GTK_TABLE(table), gifheight, 2, 3, 7, 8, (GtkAttachOptions) (GTK_SHRINK), (GtkAttachOptions) 0, 3, 3);
+#ifdef BCD_MATH
+        fastmatrix = gtk_check_button_new_with_label("Fast binary matrix arithmetic (about 16 digits instead of 34)");
+        gtk_table_attach(GTK_TABLE(table), fastmatrix, 0, 4, 8, 9, (GtkAttachOptions) (GTK_EXPAND | GTK_FILL), (GtkAttachOptions) 0, 3, 3);
+#endif
 
         g_signal_connect(G_OBJECT(browse1), "clicked", G_CALLBACK(browse_file),
                 (gpointer) new browse_file_info("Select Text File Name",
@@ -1331,6 +1546,9 @@ static void preferencesCB() {
     char maxlen[6];
     snprintf(maxlen, 6, "%d", state.printerGifMaxLength);
         gtk_entry_set_text(GTK_ENTRY(gifheight), maxlen);
+#ifdef BCD_MATH
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(fastmatrix), core_settings.matrix_fastbinary);
+#endif
 
     gtk_window_set_role(GTK_WINDOW(dialog), "Free42 Dialog");
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
@@ -1339,6 +1557,9 @@ static void preferencesCB() {
         core_settings.auto_repeat = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(autorepeat));
         state.singleInstance = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(singleinstance));
         core_settings.raw_text = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(rawtext));
+#ifdef BCD_MATH
+        core_settings.matrix_fastbinary = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(fastmatrix));
+#endif
 
         state.printerToTxtFile = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(printtotext));
         char *old = strclone(state.printerTxtFileName);
@@ -1807,6 +2028,49 @@ static gboolean battery_checker(gpointer cd) {
     return TRUE;
 }
 
+static gboolean checkpoint_timer(gpointer cd) {
+    pthread_mutex_lock(&saver_mutex);
+    bool busy = saver_busy;
+    bool failed = saver_failed;
+    pthread_mutex_unlock(&saver_mutex);
+    if (busy)
+        return TRUE;
+
+    /* If the last attempt to write the state file failed, the checkpoints
+     * written since then are tagged with the state that didn't make it to
+     * disk, so they would never be replayed; keep trying to write the state
+     * file instead.
+     */
+    long journal_size = 0;
+    if (!failed) {
+        statefile = fopen(journalfilename, "a");
+        if (statefile == NULL)
+            return TRUE;
+        core_checkpoint();
+        if (statefile == NULL)
+            return TRUE;
+        journal_size = ftell(statefile);
+        fclose(statefile);
+        statefile = NULL;
+
+        /* Once the journal has grown bigger than the state file itself,
+         * replace both with a fresh state file. The journal is only removed
+         * after the new state file is in place, so a crash at any point
+         * leaves a consistent pair behind.
+         */
+        struct stat st;
+        if (journal_size < 65536 || (stat(statefilename, &st) == 0
+                                        && journal_size < st.st_size))
+            return TRUE;
+    }
+
+    begin_snapshot();
+    bool ok = write_shell_state();
+    ok = core_save_state() && ok;
+    end_snapshot(ok);
+    return TRUE;
+}
+
 static void repaint_printout(int x, int y, int width, int height) {
     GdkPixbuf *buf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE,
                                     8, width, height);
@@ -1986,13 +2250,35 @@ int4 shell_read_saved_state(void *buf, int4 bufsize) {
 }
 
 bool shell_write_saved_state(const void *buf, int4 nbytes) {
+    if (snapshot_active) {
+        if (!snapshot_ok)
+            return false;
+        if (snapshot_reference(buf, nbytes))
+            return true;
+        if (snapshot_buflen + nbytes > snapshot_capacity) {
+            int4 newcapacity = snapshot_capacity == 0 ? 65536
+                                                      : snapshot_capacity;
+            while (newcapacity < snapshot_buflen + nbytes)
+                newcapacity *= 2;
+            char *newbuf = (char *) realloc(snapshot_buf, newcapacity);
+            if (newbuf == NULL) {
+                snapshot_ok = false;
+                return false;
+            }
+            snapshot_buf = newbuf;
+            snapshot_capacity = newcapacity;
+        }
+        memcpy(snapshot_buf + snapshot_buflen, buf, nbytes);
+        snapshot_buflen += nbytes;
+        snapshot_size += nbytes;
+        return true;
+    }
     if (statefile == NULL)
         return false;
     else {
         int4 n = fwrite(buf, 1, nbytes, statefile);
         if (n != nbytes) {
             fclose(statefile);
-            remove(statefilename);
             statefile = NULL;
             return false;
         } else
@@ -2000,6 +2286,70 @@ bool shell_write_saved_state(const void *buf, int4 nbytes) {
     }
 }
 
+void *shell_map_saved_state(int4 offset, int4 nbytes) {
+    if (statefile == NULL)
+        return NULL;
+    long pos = ftell(statefile);
+    if (pos == -1)
+        return NULL;
+    // mmap() wants a page-aligned file offset, so map from the start of the
+    // page containing the data
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t start = pos + offset;
+    off_t page = start - start % pagesize;
+    size_t skew = start - page;
+    // Accessing a mapping beyond the end of the file raises SIGBUS, so make
+    // sure the file is long enough
+    struct stat st;
+    if (fstat(fileno(statefile), &st) != 0 || st.st_size < start + nbytes)
+        return NULL;
+    if (mapping_count == mapping_capacity) {
+        int newcapacity = mapping_capacity + 8;
+        mapping_struct *newmappings = (mapping_struct *)
+                realloc(mappings, newcapacity * sizeof(mapping_struct));
+        if (newmappings == NULL)
+            return NULL;
+        mappings = newmappings;
+        mapping_capacity = newcapacity;
+    }
+    int fd = dup(fileno(statefile));
+    if (fd == -1)
+        return NULL;
+    void *addr = mmap(NULL, nbytes + skew, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, page);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    mapping_struct *m = mappings + mapping_count++;
+    m->addr = (char *) addr + skew;
+    m->nbytes = nbytes;
+    m->fd = fd;
+    m->start = start;
+    return m->addr;
+}
+
+void shell_unmap_saved_state(void *addr, int4 nbytes) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t skew = (size_t) addr % pagesize;
+    munmap((char *) addr - skew, nbytes + skew);
+    for (int i = 0; i < mapping_count; i++)
+        if (mappings[i].addr == addr) {
+            close(mappings[i].fd);
+            mappings[i] = mappings[--mapping_count];
+            break;
+        }
+}
+
+int4 shell_saved_state_position() {
+    if (snapshot_active)
+        return snapshot_size;
+    if (statefile == NULL)
+        return 0;
+    long pos = ftell(statefile);
+    return pos == -1 ? 0 : (int4) pos;
+}
+
 uint4 shell_get_mem() { 
     FILE *meminfo = fopen("/proc/meminfo", "r");
     char line[1024];
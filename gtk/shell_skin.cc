@@ -83,6 +83,11 @@ static const SkinColor *skin_cmap;
 
 static GdkPixbuf *disp_image = NULL;
 
+/* The RGB pixels for every possible byte of the core's display bitmap, at
+ * the current display scale: 256 entries of 8 * display_scale.x pixels.
+ */
+static guchar *disp_lut = NULL;
+
 static char skin_label_buf[1024];
 static int skin_label_pos;
 
@@ -483,6 +488,22 @@ void skin_load(int *width, int *height) {
     guint32 p = (display_bg.r << 24)
                     | (display_bg.g << 16) | (display_bg.b << 8);
     gdk_pixbuf_fill(disp_image, p);
+
+    int run = display_scale.x * 3;
+    free(disp_lut);
+    disp_lut = (guchar *) malloc(256 * 8 * run);
+    if (disp_lut != NULL) {
+        guchar *q = disp_lut;
+        for (int b = 0; b < 256; b++)
+            for (int h = 0; h < 8; h++) {
+                SkinColor c = (b & (1 << h)) != 0 ? display_fg : display_bg;
+                for (int hh = 0; hh < display_scale.x; hh++) {
+                    *q++ = c.r;
+                    *q++ = c.g;
+                    *q++ = c.b;
+                }
+            }
+    }
 }
 
 int skin_init_image(int type, int ncolors, const SkinColor *colors,
@@ -725,23 +746,50 @@ void skin_display_blitter(const char *bits, int bytesperline, int x, int y,
     int sx = display_scale.x;
     int sy = display_scale.y;
 
-    for (int v = y; v < y + height; v++)
-        for (int h = x; h < x + width; h++) {
-            SkinColor c;
-            if ((bits[v * bytesperline + (h >> 3)] & (1 << (h & 7))) != 0)
-                c = display_fg;
-            else
-                c = display_bg;
-            for (int vv = v * sy; vv < (v + 1) * sy; vv++) {
-                guchar *p = pix + disp_bpl * vv;
-                for (int hh = h * sx; hh < (h + 1) * sx; hh++) {
-                    guchar *p2 = p + hh * 3;
-                    p2[0] = c.r;
-                    p2[1] = c.g;
-                    p2[2] = c.b;
-                }
+    if (disp_lut != NULL) {
+        /* Expand each row a byte at a time, using the lookup table, and then
+         * copy it to the other sy - 1 rows.
+         */
+        int run = sx * 3;
+        for (int v = y; v < y + height; v++) {
+            const unsigned char *src = (const unsigned char *) bits
+                                                    + v * bytesperline;
+            guchar *p = pix + disp_bpl * v * sy + x * run;
+            guchar *dst = p;
+            int h = x;
+            while (h < x + width) {
+                int bit = h & 7;
+                int n = 8 - bit;
+                if (n > x + width - h)
+                    n = x + width - h;
+                memcpy(dst, disp_lut + (src[h >> 3] * 8 + bit) * run,
+                       n * run);
+                dst += n * run;
+                h += n;
             }
+            for (int vv = 1; vv < sy; vv++)
+                memcpy(p + disp_bpl * vv, p, width * run);
         }
+    } else {
+        /* Only if the lookup table could not be allocated */
+        for (int v = y; v < y + height; v++)
+            for (int h = x; h < x + width; h++) {
+                SkinColor c;
+                if ((bits[v * bytesperline + (h >> 3)] & (1 << (h & 7))) != 0)
+                    c = display_fg;
+                else
+                    c = display_bg;
+                for (int vv = v * sy; vv < (v + 1) * sy; vv++) {
+                    guchar *p = pix + disp_bpl * vv;
+                    for (int hh = h * sx; hh < (h + 1) * sx; hh++) {
+                        guchar *p2 = p + hh * 3;
+                        p2[0] = c.r;
+                        p2[1] = c.g;
+                        p2[2] = c.b;
+                    }
+                }
+            }
+    }
     if (allow_paint && display_enabled)
         gdk_draw_pixbuf(calc_widget->window, NULL, disp_image,
                         x * sx, y * sy,
@@ -19,6 +19,7 @@
 #import <sys/stat.h>
 #import <sys/sysctl.h>
 #import <pthread.h>
+#import <unistd.h>
 
 #import <AudioToolbox/AudioServices.h>
 #import <CoreLocation/CoreLocation.h>
@@ -266,6 +267,7 @@ static CalcView *calcView = nil;
 - (void) touchesBegan2 {
     TRACE("touchesBegan2");
     we_want_cpu = 1;
+    core_event_pending();
     pthread_mutex_lock(&is_running_mutex);
     while (is_running)
         pthread_cond_wait(&is_running_cond, &is_running_mutex);
@@ -302,6 +304,7 @@ static CalcView *calcView = nil;
 - (void) touchesEnded2 {
     TRACE("touchesEnded2");
     we_want_cpu = 1;
+    core_event_pending();
     pthread_mutex_lock(&is_running_mutex);
     while (is_running)
         pthread_cond_wait(&is_running_cond, &is_running_mutex);
@@ -609,15 +612,20 @@ static void quit2(bool really_quit) {
     shell_spool_exit();
 
     mkdir("config", 0755);
-    statefile = fopen("config/state", "w");
+    statefile = fopen("config/state.new", "w");
     if (statefile != NULL)
         write_shell_state();
     if (really_quit)
         core_quit();
     else
         core_enter_background();
-    if (statefile != NULL)
-        fclose(statefile);
+    if (statefile != NULL) {
+        bool ok = fflush(statefile) == 0 && fsync(fileno(statefile)) == 0;
+        if (fclose(statefile) == 0 && ok)
+            rename("config/state.new", "config/state");
+        else
+            remove("config/state.new");
+    }
     if (really_quit)
         exit(0);
 }
@@ -823,7 +831,7 @@ bool shell_write_saved_state(const void *buf, int nbytes) {
         size_t n = fwrite(buf, 1, nbytes, statefile);
         if (n != nbytes) {
             fclose(statefile);
-            remove("config/state");
+            remove("config/state.new");
             statefile = NULL;
             return false;
         } else
@@ -831,6 +839,21 @@ bool shell_write_saved_state(const void *buf, int nbytes) {
     }
 }
 
+void *shell_map_saved_state(int4 offset, int4 nbytes) {
+    TRACE("shell_map_saved_state");
+    // Not supported; the core will read the data instead
+    return NULL;
+}
+
+void shell_unmap_saved_state(void *addr, int4 nbytes) {
+    TRACE("shell_unmap_saved_state");
+}
+
+int4 shell_saved_state_position() {
+    TRACE("shell_saved_state_position");
+    return 0;
+}
+
 unsigned int shell_get_mem() {
     TRACE("shell_get_mem");
     int mib[2];
@@ -19,6 +19,7 @@
 #import <sys/stat.h>
 #import <sys/time.h>
 #import <pthread.h>
+#import <unistd.h>
 #import "free42.h"
 #import "shell.h"
 #import "shell_skin.h"
@@ -49,6 +50,7 @@ static pthread_mutex_t is_running_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t is_running_cond = PTHREAD_COND_INITIALIZER;
 
 static char statefilename[FILENAMELEN];
+static char statetempname[FILENAMELEN];
 static char printfilename[FILENAMELEN];
 static FILE *statefile = NULL;
 static char export_file_name[FILENAMELEN];
@@ -341,12 +343,18 @@ static bool is_file(const char *name);
     state.printWindowY = (int) printWindow.frame.origin.y;
     state.printWindowHeight = (int) [[printWindow contentView] frame].size.height;
     state.printWindowKnown = 1;
-    statefile = fopen(statefilename, "w");
+    snprintf(statetempname, FILENAMELEN, "%s.new", statefilename);
+    statefile = fopen(statetempname, "w");
     if (statefile != NULL)
         write_shell_state();
     core_quit();
-    if (statefile != NULL)
-        fclose(statefile);
+    if (statefile != NULL) {
+        bool ok = fflush(statefile) == 0 && fsync(fileno(statefile)) == 0;
+        if (fclose(statefile) == 0 && ok)
+            rename(statetempname, statefilename);
+        else
+            remove(statetempname);
+    }
 }
 
 - (void)windowWillClose:(NSNotification *)notification {
@@ -599,6 +607,7 @@ static char version[32] = "";
 
 - (void) mouseDown2 {
     we_want_cpu = 1;
+    core_event_pending();
     pthread_mutex_lock(&is_running_mutex);
     while (is_running)
         pthread_cond_wait(&is_running_cond, &is_running_mutex);
@@ -613,6 +622,7 @@ static char version[32] = "";
 
 - (void) mouseUp2 {
     we_want_cpu = 1;
+    core_event_pending();
     pthread_mutex_lock(&is_running_mutex);
     while (is_running)
         pthread_cond_wait(&is_running_cond, &is_running_mutex);
@@ -1224,7 +1234,7 @@ bool shell_write_saved_state(const void *buf, int4 nbytes) {
         int4 n = fwrite(buf, 1, nbytes, statefile);
         if (n != nbytes) {
             fclose(statefile);
-            remove(statefilename);
+            remove(statetempname);
             statefile = NULL;
             return false;
         } else
@@ -1232,6 +1242,19 @@ bool shell_write_saved_state(const void *buf, int4 nbytes) {
     }
 }
 
+void *shell_map_saved_state(int4 offset, int4 nbytes) {
+    // Not supported; the core will read the data instead
+    return NULL;
+}
+
+void shell_unmap_saved_state(void *addr, int4 nbytes) {
+    // Nothing to do
+}
+
+int4 shell_saved_state_position() {
+    return 0;
+}
+
 int shell_write(const char *buf, int4 buflen) {
     int4 written;
     if (export_file == NULL)
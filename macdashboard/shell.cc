@@ -44,7 +44,6 @@ typedef struct {
 
 static int schedule_timeout3;
 static int we_want_cpu;
-static char *statefilename;
 static char *export_file_name;
 static FILE *statefile;
 static FILE *export_file;
@@ -221,7 +220,7 @@ bool shell_write_saved_state(const void *buf, int4 nbytes) {
 	int4 n = fwrite(buf, 1, nbytes, statefile);
 	if (n != nbytes) {
 	    fclose(statefile);
-	    remove(statefilename);
+	    remove("state.new");
 	    statefile = NULL;
 	    return false;
 	} else
@@ -229,6 +228,19 @@ bool shell_write_saved_state(const void *buf, int4 nbytes) {
     }
 }
 
+void *shell_map_saved_state(int4 offset, int4 nbytes) {
+    /* Not supported; the core will read the data instead */
+    return NULL;
+}
+
+void shell_unmap_saved_state(void *addr, int4 nbytes) {
+    /* Nothing to do */
+}
+
+int4 shell_saved_state_position() {
+    return 0;
+}
+
 uint4 shell_get_mem()
 {
     return 65536; /* 64k free memory, always */
@@ -503,11 +515,17 @@ static int write_shell_state() {
 void
 cleanup()
 {
-    statefile = fopen("state", "w");
+    statefile = fopen("state.new", "w");
 
     write_shell_state();
     core_quit();
-    fclose(statefile);
+    if (statefile != NULL) {
+	int ok = fflush(statefile) == 0 && fsync(fileno(statefile)) == 0;
+	if (fclose(statefile) == 0 && ok)
+	    rename("state.new", "state");
+	else
+	    remove("state.new");
+    }
 }
 
 void
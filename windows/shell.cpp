@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <direct.h>
+#include <io.h>
 #include <stdio.h>
 #include <shlobj.h>
 
@@ -126,6 +127,7 @@ static int printOutHeight;
 
 static char free42dirname[FILENAMELEN];
 static char statefilename[FILENAMELEN];
+static char statetempname[FILENAMELEN];
 static FILE *statefile = NULL;
 static char printfilename[FILENAMELEN];
 
@@ -1430,7 +1432,8 @@ static void Quit() {
         ;
     }
 
-    statefile = fopen(statefilename, "wb");
+    sprintf(statetempname, "%s.new", statefilename);
+    statefile = fopen(statetempname, "wb");
     if (statefile != NULL) {
         if (!placement_saved) {
             GetWindowPlacement(hMainWnd, &state.mainPlacement);
@@ -1443,8 +1446,15 @@ static void Quit() {
         write_shell_state();
     }
     core_quit();
-    if (statefile != NULL)
-        fclose(statefile);
+    if (statefile != NULL) {
+        bool ok = fflush(statefile) == 0 && _commit(_fileno(statefile)) == 0;
+        // rename() won't replace an existing file here, hence MoveFileEx()
+        if (fclose(statefile) == 0 && ok)
+            ok = MoveFileEx(statetempname, statefilename,
+                        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+        if (!ok)
+            remove(statetempname);
+    }
 
     if (print_txt != NULL)
         fclose(print_txt);
@@ -1847,7 +1857,7 @@ bool shell_write_saved_state(const void *buf, int4 nbytes) {
         int4 n = fwrite(buf, 1, nbytes, statefile);
         if (n != nbytes) {
             fclose(statefile);
-            remove(statefilename);
+            remove(statetempname);
             statefile = NULL;
             return false;
         } else
@@ -1855,6 +1865,19 @@ bool shell_write_saved_state(const void *buf, int4 nbytes) {
     }
 }
 
+void *shell_map_saved_state(int4 offset, int4 nbytes) {
+    // Not supported; the core will read the data instead
+    return NULL;
+}
+
+void shell_unmap_saved_state(void *addr, int4 nbytes) {
+    // Nothing to do
+}
+
+int4 shell_saved_state_position() {
+    return 0;
+}
+
 uint4 shell_get_mem() {
     MEMORYSTATUS memstat;
     GlobalMemoryStatus(&memstat);